@@ -0,0 +1,20 @@
+local PROJECT_NAME = 'Bench'
+
+project ( PROJECT_NAME )
+    kind 'ConsoleApp'
+    targetdir (ROOT_PATH_JOIN('bin/'..COMMON_PATH))
+    objdir (ROOT_PATH_JOIN('!build/obj/$(ProjectName)/'..COMMON_PATH))
+
+    -- Core's classes are not exported from its library, they are built in
+    includedirs { '../Core/hpp' }
+    files {
+        'src/**.cpp',
+        '../Core/hpp/**.hpp',
+        '../Core/src/**.cpp'
+    }
+    removefiles { '../Core/src/main.cpp' }
+
+    vpaths {
+        ["Header Files"] = { '../Core/hpp/**.hpp' },
+        ["Source Files"] = { 'src/**.cpp', '../Core/src/**.cpp' }
+    }
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include <socket.hpp>
+
+#include <Shared/path.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <memory>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Echo load generator. Connections each keep one message in flight against
+// an echo server in the same process, and the messages echoed per second
+// are reported for every worker count of the sweep. The worker count is
+// fixed once the first socket exists, so every count runs in a process of
+// its own:
+//   Bench [--engine epoll|uring|iocp] [--connections N] [--size N]
+//         [--seconds N] [workers...]
+
+namespace Socket = NSA::Core::Socket;
+
+namespace {
+	struct Options {
+		std::string engine;
+		std::uint32_t connections = 256;
+		std::uint32_t size = 64;
+		std::uint32_t seconds = 5;
+		std::vector<std::uint32_t> workers;
+		// Set in the processes the sweep starts
+		bool single = false;
+	};
+
+	constexpr std::uint32_t PORT = 23456;
+
+	bool ParseNumber(std::string_view text, std::uint32_t& value) noexcept {
+		auto end = text.data() + text.size();
+		auto [ptr, ec] = std::from_chars(text.data(), end, value);
+		return ec == std::errc() && ptr == end && value != 0;
+	}
+
+	bool ParseOptions(int argc, char** argv, Options& options) noexcept {
+		for (int i = 1; i < argc; i++) {
+			std::string_view arg = argv[i];
+			std::uint32_t value = 0;
+			if (arg == "--run") {
+				options.single = true;
+				continue;
+			}
+
+			if (arg.starts_with("--")) {
+				if (i + 1 >= argc)
+					return false;
+				std::string_view next = argv[++i];
+
+				if (arg == "--engine") {
+					options.engine = next;
+					continue;
+				}
+				if (!ParseNumber(next, value))
+					return false;
+
+				if (arg == "--connections")
+					options.connections = value;
+				else if (arg == "--size")
+					options.size = value;
+				else if (arg == "--seconds")
+					options.seconds = value;
+				else
+					return false;
+				continue;
+			}
+
+			if (!ParseNumber(arg, value))
+				return false;
+			options.workers.push_back(value);
+		}
+
+		if (options.workers.empty()) {
+			auto processors = std::max(1u, std::thread::hardware_concurrency());
+			for (std::uint32_t count = 1; count < processors; count *= 2)
+				options.workers.push_back(count);
+			options.workers.push_back(processors);
+		}
+		return !options.single || options.workers.size() == 1;
+	}
+
+	bool SetEngine(std::string_view name) noexcept {
+		if (name.empty())
+			return true;
+		if (name == "epoll")
+			return Socket::Socket::SetEngine(Socket::Socket::Engine::EPOLL);
+		if (name == "uring")
+			return Socket::Socket::SetEngine(Socket::Socket::Engine::IO_URING);
+		if (name == "iocp")
+			return Socket::Socket::SetEngine(Socket::Socket::Engine::IOCP);
+		return false;
+	}
+
+	// One worker count, the result printed as a row of the sweep
+	int Run(const Options& options) noexcept {
+		if (!SetEngine(options.engine)) {
+			std::println(stderr, "Engine {} is not available", options.engine);
+			return 1;
+		}
+
+		Socket::Socket::WorkerConfig config;
+		config.queues = options.workers.front();
+		if (!Socket::Socket::SetWorkerConfig(config)) {
+			std::println(stderr, "Failed to set {} workers", config.queues);
+			return 1;
+		}
+
+		Socket::ServerSocket server;
+		server.OnData = [&](Socket::ServerSocket::on_data_t& event) {
+			if (event.client)
+				server.Send(event.data, event.client);
+		};
+		if (!server.Create() || !server.Listen("127.0.0.1", PORT)) {
+			std::println(stderr, "Failed to listen on port {}", PORT);
+			return 1;
+		}
+
+		struct Connection {
+			Socket::ClientSocket socket;
+			std::uint64_t received = 0;
+			std::atomic<bool> connected = false;
+		};
+
+		const std::string message(options.size, 'x');
+		std::atomic<bool> running = true;
+		std::atomic<std::uint64_t> echoed = 0;
+
+		std::vector<std::unique_ptr<Connection>> connections;
+		connections.reserve(options.connections);
+		for (std::uint32_t i = 0; i < options.connections; i++) {
+			auto connection = connections.emplace_back(std::make_unique<Connection>()).get();
+			connection->socket.OnConnect = [&, connection](Socket::ClientSocket::on_connect_t&) {
+				connection->connected = true;
+				connection->socket.Send(message);
+			};
+			// Receives of a connection never overlap, the next message only
+			// goes out once the whole previous one is back
+			connection->socket.OnData = [&, connection](Socket::ClientSocket::on_data_t& event) {
+				auto before = connection->received / options.size;
+				connection->received += event.data.size();
+				auto done = connection->received / options.size - before;
+				if (done == 0)
+					return;
+
+				echoed.fetch_add(done, std::memory_order_relaxed);
+				if (running.load(std::memory_order_relaxed))
+					connection->socket.Send(message);
+			};
+
+			if (!connection->socket.Create() || !connection->socket.Connect("127.0.0.1", PORT)) {
+				std::println(stderr, "Failed to connect to port {}", PORT);
+				return 1;
+			}
+		}
+
+		// Measured once every connection is up
+		constexpr auto CONNECT_TIMEOUT = std::chrono::seconds(10);
+		auto deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+		for (auto& connection : connections) {
+			while (!connection->connected && std::chrono::steady_clock::now() < deadline)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (std::chrono::steady_clock::now() >= deadline) {
+			std::println(stderr, "Connections did not come up");
+			return 1;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		auto first = echoed.load();
+		std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+		auto last = echoed.load();
+		auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		running = false;
+
+		auto rate = static_cast<double>(last - first) / elapsed;
+		std::println(
+			"{:>7} {:>14.0f} {:>10.1f}",
+			config.queues,
+			rate,
+			// Both directions
+			rate * options.size * 2 / (1024 * 1024)
+		);
+
+		for (auto& connection : connections)
+			connection->socket.Close();
+		server.Close();
+		return 0;
+	}
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	if (!ParseOptions(argc, argv, options)) {
+		std::println(stderr, "Usage: {} [--engine epoll|uring|iocp] [--connections N] [--size N] [--seconds N] [workers...]", argv[0]);
+		return 1;
+	}
+	if (options.single)
+		return Run(options);
+
+	std::println(
+		"{} connections, {} byte messages, {}s per run",
+		options.connections,
+		options.size,
+		options.seconds
+	);
+	std::println("{:>7} {:>14} {:>10}", "workers", "messages/s", "MiB/s");
+
+	auto self = NSA::Shared::GetExecutablePath();
+	for (auto workers : options.workers) {
+		auto command = std::format(
+			"\"{}\" --run --connections {} --size {} --seconds {}",
+			self.string(),
+			options.connections,
+			options.size,
+			options.seconds
+		);
+		if (!options.engine.empty())
+			command += std::format(" --engine {}", options.engine);
+		command += std::format(" {}", workers);
+
+		// The run prints to the same output, after what is buffered here
+		std::fflush(stdout);
+		if (std::system(command.c_str()) != 0)
+			std::println(stderr, "Run with {} workers failed", workers);
+	}
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <socket.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The codec libraries stay out of the headers
+struct BrotliEncoderStateStruct;
+struct BrotliDecoderStateStruct;
+
+namespace NSA::Core::Socket::Compression {
+	enum class Role : std::uint8_t {
+		CLIENT = 0,
+		SERVER
+	};
+	// Ids on the wire, NONE when the peers settled on none
+	enum class Codec : std::uint8_t {
+		NONE = 0,
+		SNAPPY,
+		ZLIB,
+		BROTLI
+	};
+
+	// Largest payload in one frame, bigger sends are split. Frames that
+	// inflate to more fail the connection
+	constexpr std::size_t MAX_CHUNK = 64 * 1024;
+
+	struct Config {
+		// Codecs offered, most preferred first: snappy for links where
+		// latency counts, zlib or brotli where bandwidth does. The server
+		// picks the first of its own the client offers too
+		std::vector<Codec> codecs = { Codec::SNAPPY, Codec::ZLIB, Codec::BROTLI };
+
+		// zlib level 1-9 and brotli quality 0-11. Streams are flushed on
+		// every send, low ones keep up with the link
+		int zlibLevel = 6;
+		int brotliQuality = 5;
+		// log2 of the brotli window, 10-24. Memory per connection grows
+		// with it, zlib keeps to 32 KiB
+		int brotliWindow = 18;
+
+		// Sends smaller than this go out as they are
+		std::size_t minSize = 128;
+	};
+
+	struct Stats {
+		// Connections that settled on a codec, and those left uncompressed:
+		// no codec in common, or a peer that does not compress
+		std::uint64_t negotiated = 0;
+		std::uint64_t declined = 0;
+		// Payload handed to sends, and the bytes it went out as
+		std::uint64_t sent = 0;
+		std::uint64_t sentCompressed = 0;
+		// Bytes that arrived, and the payload they inflated to
+		std::uint64_t receivedCompressed = 0;
+		std::uint64_t received = 0;
+		// Nanoseconds spent in the codecs. Nothing in there waits, so it
+		// is CPU time of the threads that sent and received
+		std::uint64_t compressTime = 0;
+		std::uint64_t decompressTime = 0;
+
+		double SendRatio() const noexcept {
+			return sentCompressed == 0 ? 0.0 : static_cast<double>(sent) / sentCompressed;
+		}
+		double ReceiveRatio() const noexcept {
+			return receivedCompressed == 0 ? 0.0 : static_cast<double>(received) / receivedCompressed;
+		}
+	};
+
+	// Settings and counters of one side, shared by the sessions of every
+	// connection it serves
+	class Context {
+	public:
+		Context() noexcept = default;
+
+		Context(const Context&) = delete;
+		Context& operator=(const Context&) = delete;
+
+		bool Create(const Config& config) noexcept;
+		bool IsCreated() const noexcept { return m_created; }
+
+		const Config& GetConfig() const noexcept { return m_config; }
+		Stats GetStats() const noexcept;
+	private:
+		friend class Session;
+	private:
+		Config m_config;
+		bool m_created = false;
+
+		std::atomic<std::uint64_t> m_negotiated = 0;
+		std::atomic<std::uint64_t> m_declined = 0;
+		std::atomic<std::uint64_t> m_sent = 0;
+		std::atomic<std::uint64_t> m_sentCompressed = 0;
+		std::atomic<std::uint64_t> m_receivedCompressed = 0;
+		std::atomic<std::uint64_t> m_received = 0;
+		std::atomic<std::uint64_t> m_compressTime = 0;
+		std::atomic<std::uint64_t> m_decompressTime = 0;
+	};
+
+	// zlib streams, reset and reused across connections
+	struct Deflater;
+	struct Inflater;
+
+	// Compression state of one connection. The client opens with the codecs
+	// it offers and holds its sends until the server answered; the server
+	// holds its own until the offer arrived. A server whose client opens
+	// with anything else stays uncompressed, so peers that do not compress
+	// still get through. Payload then goes out in frames, each flushed so
+	// the peer can inflate it as soon as it is in
+	class Session {
+	public:
+		Session(std::shared_ptr<Context> context) noexcept;
+		~Session() noexcept;
+
+		Session(const Session&) = delete;
+		Session& operator=(const Session&) = delete;
+
+		// Starts over for a new connection; the client's offer is output
+		bool Start(Role role) noexcept;
+
+		// Bytes that arrived, their payload appended to `plain`. False once
+		// the stream is broken
+		bool Receive(const char* data, std::size_t length, std::string& plain) noexcept;
+		// Payload to send; held back until the codec is settled
+		bool Write(std::span<const std::string_view> buffers) noexcept;
+
+		// Output is taken by one thread at a time, so frames go out in the
+		// order they were made. BeginOutput is false while another thread
+		// is at it; that one picks up whatever is added meanwhile.
+		// TakeOutput is false once nothing is left, which ends the turn
+		bool BeginOutput() noexcept;
+		bool TakeOutput(IOCP::Buffer& out) noexcept;
+
+		bool IsNegotiated() const noexcept { return m_negotiated.load(std::memory_order_acquire); }
+		// Set once negotiated
+		Codec GetCodec() const noexcept { return m_codec; }
+		std::uint32_t GetError() const noexcept { return m_error; }
+	private:
+		// Takes the offer, or the answer to it, off the front of m_input
+		bool Negotiate() noexcept;
+		// Settles on `codec` and lets the sends held back meanwhile out
+		bool Settle(Codec codec) noexcept;
+		// Splits payload into frames and appends them to m_output
+		bool Frame(std::span<const std::string_view> buffers) noexcept;
+		bool Compress(std::string_view chunk) noexcept;
+		// Inflates the payload of one frame onto `plain`
+		bool Decompress(std::string_view payload, std::string& plain) noexcept;
+		bool Fail() noexcept;
+		void Reset() noexcept;
+	private:
+		std::shared_ptr<Context> m_context;
+
+		std::mutex m_mutex;
+		Role m_role = Role::CLIENT;
+		Codec m_codec = Codec::NONE;
+		std::atomic<bool> m_negotiated = false;
+		bool m_started = false;
+
+		// Received bytes short of a whole frame, or of the negotiation
+		std::string m_input;
+		// Payload sent before the codec was settled
+		std::string m_pending;
+		// Gathers payload spread over several buffers into one frame
+		std::string m_chunk;
+		IOCP::Buffer m_output;
+		bool m_outputBusy = false;
+
+		Deflater* m_deflater = nullptr;
+		Inflater* m_inflater = nullptr;
+		BrotliEncoderStateStruct* m_encoder = nullptr;
+		BrotliDecoderStateStruct* m_decoder = nullptr;
+
+		std::uint32_t m_error = 0;
+	};
+}
\ No newline at end of file
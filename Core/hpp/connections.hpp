@@ -0,0 +1,181 @@
+#pragma once
+
+#include <socket.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace NSA::Core::Socket {
+	// Connected ClientSockets kept open between uses, per host:port. A
+	// lease that finds an idle connection skips the handshake; above the
+	// per host cap leases wait for one to come back
+	class ConnectionPool {
+	public:
+		struct Config {
+			Socket::AddressFamily family = Socket::AddressFamily::IPV4;
+			// Connections open to one host:port at once, leased, idle and
+			// still connecting alike
+			std::uint32_t maxPerHost = 8;
+			// Idle connections kept per host:port, the rest are closed when
+			// they come back
+			std::uint32_t maxIdlePerHost = 8;
+			// Idle connections older than this are closed instead of leased,
+			// before the server drops them on its own
+			std::chrono::seconds idleTimeout = std::chrono::seconds(60);
+		};
+		struct Stats {
+			// Leased an idle connection
+			std::uint64_t hits = 0;
+			// Had to open a new one
+			std::uint64_t misses = 0;
+			// Waited at the per host cap
+			std::uint64_t waits = 0;
+			// Connections that failed to connect
+			std::uint64_t failures = 0;
+			// Idle connections found closed, expired or sent data
+			std::uint64_t evicted = 0;
+			// Time spent waiting at the cap, in total and the longest wait
+			std::chrono::microseconds waitTime{};
+			std::chrono::microseconds maxWaitTime{};
+		};
+
+		// `socket` is leased to the callee until handed back to Release,
+		// nullptr with `error` set when connecting failed
+		using Callback = std::function<void(ClientSocket* socket, std::uint32_t error)>;
+	public:
+		ConnectionPool() noexcept;
+		ConnectionPool(const Config& config) noexcept;
+		// Closes every connection, leased ones included. Not from a worker
+		~ConnectionPool() noexcept;
+
+		ConnectionPool(const ConnectionPool&) = delete;
+		ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+		// Calls `callback` with a connection to `host`:`port`, on the worker
+		// of that connection; healthy idle ones are handed over without a
+		// handshake. False when a new connection could not be started,
+		// failures after that arrive through `callback`.
+		// The pool keeps OnConnect and OnConnectFailed of its sockets, the
+		// other events are the lessee's to set
+		bool Acquire(std::string_view host, std::uint32_t port, Callback callback) noexcept;
+		// Hands a leased connection back, closing it unless `reusable`.
+		// The next lease of it replaces the events set on it
+		void Release(ClientSocket* socket, bool reusable = true) noexcept;
+
+		// Closes idle connections that expired or went bad, without waiting
+		// for a lease to come across them
+		void Prune() noexcept;
+
+		Stats GetStats() const noexcept;
+	private:
+		struct Host;
+
+		enum class State : std::uint8_t {
+			CONNECTING,
+			LEASED,
+			IDLE
+		};
+
+		// Bytes arriving while idle belong to no request; such a
+		// connection is closed as if the peer had
+		class Connection : public ClientSocket {
+		public:
+			Connection(ConnectionPool* pool, Host* host) noexcept
+				: pool(pool), host(host) {}
+
+			// Hands the connection to `callback` on its worker, once the
+			// completion running there, if any, has returned. The lessee
+			// replaces events that may be the ones running right now
+			bool Lease() noexcept;
+
+			ConnectionPool* pool;
+			Host* host;
+			State state = State::CONNECTING;
+			std::atomic<bool> idle = false;
+			// Who the connection is being opened or leased for
+			Callback callback;
+			std::chrono::steady_clock::time_point idleSince;
+		protected:
+			void OnIOCompleted(
+				IOCP::IOContext* ctx,
+				std::uint32_t bytesTransferred,
+				std::uint32_t error
+			) noexcept override;
+		};
+
+		struct Waiter {
+			Callback callback;
+			std::chrono::steady_clock::time_point since;
+		};
+		struct Host {
+			std::string host;
+			std::uint32_t port = 0;
+
+			std::vector<std::unique_ptr<Connection>> connections;
+			// Most recently used last, leased from the back
+			std::vector<Connection*> idle;
+			std::deque<Waiter> waiters;
+		};
+	private:
+		// Starts a connection for `callback`. On failure `callback` is left
+		// with the caller, with `error` set. `lock` is given up meanwhile
+		bool Open(
+			Host& host,
+			Callback& callback,
+			std::uint32_t& error,
+			std::unique_lock<std::mutex>& lock
+		) noexcept;
+		// Opens connections for waiters while there is room, then gives up
+		// `lock` to report the ones that failed
+		void Serve(Host& host, std::unique_lock<std::mutex>& lock) noexcept;
+		// Takes a connection that will not be leased again out of `host`,
+		// m_mutex held. CloseRetired closes it once the lock is given up
+		void Retire(Host& host, Connection* connection) noexcept;
+		// Closes what Retire took out, m_mutex not held: the completions
+		// cancelled by it reach the lessee, which may call Release
+		void CloseRetired() noexcept;
+		// Idle connection fit to lease, m_mutex held
+		bool IsHealthy(Connection* connection, std::chrono::steady_clock::time_point now) const noexcept;
+		void RecordWait(std::chrono::steady_clock::time_point since) noexcept;
+		// Destroys retired connections, off the workers only
+		void Reap() noexcept;
+
+		// Also where Lease ends up
+		void OnConnected(Connection* connection) noexcept;
+		void OnFailed(Connection* connection, std::uint32_t error) noexcept;
+
+		static std::string Key(std::string_view host, std::uint32_t port);
+	private:
+		Config m_config;
+
+		mutable std::mutex m_mutex;
+		std::unordered_map<std::string, Host> m_hosts;
+		// Retired connections whose completions may still be running; their
+		// destructors wait for them, which a worker cannot do
+		std::vector<std::unique_ptr<Connection>> m_retired;
+		// Those of them still to be closed, and the CloseRetired calls at it.
+		// Reap and the destructor leave them alone meanwhile
+		std::vector<Connection*> m_unclosed;
+		std::uint32_t m_closers = 0;
+		std::condition_variable m_closed;
+		bool m_closing = false;
+
+		std::atomic<std::uint64_t> m_hits = 0;
+		std::atomic<std::uint64_t> m_misses = 0;
+		std::atomic<std::uint64_t> m_waits = 0;
+		std::atomic<std::uint64_t> m_failures = 0;
+		std::atomic<std::uint64_t> m_evicted = 0;
+		std::atomic<std::uint64_t> m_waitTime = 0;
+		std::atomic<std::uint64_t> m_maxWaitTime = 0;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <socket.hpp>
+#include <pool.hpp>
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace NSA::Core::Socket::Coro {
+	// Coroutine that starts right away and runs to its end without anyone
+	// awaiting it. Its frame comes from the pool of the thread creating it
+	// and goes back to that of the thread it finishes on, normally a worker
+	class Task {
+	public:
+		struct promise_type {
+			Task get_return_object() noexcept { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept { std::terminate(); }
+
+			static void* operator new(std::size_t size) {
+				return Pool::Allocate(size);
+			}
+			static void operator delete(void* ptr, std::size_t size) noexcept {
+				Pool::Deallocate(ptr, size);
+			}
+		};
+	};
+
+	class Listener;
+
+	// Awaitable side of one connection, taking over the events of its
+	// socket. An awaiting coroutine resumes on the thread completing the
+	// operation, inside the event that completed it. One coroutine awaits
+	// a Stream at a time; its socket runs on a strand, so the events it
+	// resumes from never overlap
+	class Stream {
+	public:
+		// Resumes with 0 once connected, the error otherwise
+		class ConnectAwaiter {
+		public:
+			bool await_ready() noexcept;
+			bool await_suspend(std::coroutine_handle<> handle) noexcept;
+			std::uint32_t await_resume() noexcept;
+		private:
+			friend class Stream;
+			ConnectAwaiter(Stream* stream, std::string_view host, std::uint32_t port) noexcept
+				: m_stream(stream), m_host(host), m_port(port) {}
+
+			Stream* m_stream;
+			std::string_view m_host;
+			std::uint32_t m_port;
+		};
+		// Resumes with what arrived since the last Recv, empty once the
+		// connection is gone
+		class RecvAwaiter {
+		public:
+			bool await_ready() noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> handle) noexcept;
+			std::string await_resume() noexcept;
+		private:
+			friend class Stream;
+			RecvAwaiter(Stream* stream) noexcept : m_stream(stream) {}
+
+			Stream* m_stream;
+		};
+		// Queues the bytes and resumes right away, unless the connection
+		// is at its high watermark; then once it drained. False when the
+		// connection is gone
+		class SendAwaiter {
+		public:
+			bool await_ready() noexcept;
+			bool await_suspend(std::coroutine_handle<> handle) noexcept;
+			bool await_resume() noexcept { return m_sent; }
+		private:
+			friend class Stream;
+			SendAwaiter(Stream* stream, std::string_view data) noexcept
+				: m_stream(stream), m_data(data) {}
+
+			Stream* m_stream;
+			std::string_view m_data;
+			bool m_sent = false;
+		};
+	public:
+		// Client side, on a socket of its own
+		Stream() noexcept;
+		~Stream() noexcept;
+
+		Stream(const Stream&) = delete;
+		Stream& operator=(const Stream&) = delete;
+
+		// Numeric hosts connect right away, names are looked up first
+		ConnectAwaiter Connect(std::string_view host, std::uint32_t port) noexcept {
+			return { this, host, port };
+		}
+		RecvAwaiter Recv() noexcept { return { this }; }
+		// `data` has to stay valid until the Send resumes
+		SendAwaiter Send(std::string_view data) noexcept { return { this, data }; }
+		// Ends the connection, an awaited Recv resumes with nothing
+		void Close() noexcept;
+
+		ClientSocket* GetSocket() const noexcept { return m_socket; }
+	private:
+		friend class Listener;
+		// Server side, on a connection `server` accepted
+		Stream(ServerSocket* server, ClientSocket* client) noexcept;
+
+		enum class Wait : std::uint8_t {
+			NONE,
+			CONNECT,
+			RECV,
+			SEND
+		};
+
+		void OnConnected(std::uint32_t error) noexcept;
+		void OnData(std::string& data) noexcept;
+		void OnDisconnected() noexcept;
+		void OnBackpressure() noexcept;
+		void OnWritable() noexcept;
+
+		// Takes the coroutine waiting for `wait` out, to be resumed once
+		// the lock is let go of
+		std::coroutine_handle<> Wake(Wait wait) noexcept;
+		// Parks `handle` for `wait`, unless `ready` says it need not
+		template <typename Ready>
+		bool Park(std::coroutine_handle<> handle, Wait wait, Ready&& ready) noexcept;
+	private:
+		std::mutex m_mutex;
+		std::coroutine_handle<> m_waiter;
+		Wait m_wait = Wait::NONE;
+
+		std::string m_received;
+		std::uint32_t m_connectError = 0;
+		bool m_connectDone = false;
+		bool m_closed = false;
+		bool m_congested = false;
+
+		// Owner of the connection, nullptr on the client side
+		ServerSocket* m_server = nullptr;
+		ClientSocket* m_socket = nullptr;
+		// Last, so completions are through before the rest goes
+		std::unique_ptr<ClientSocket> m_ownSocket;
+	};
+
+	// Awaitable accepts, taking over the events of its server
+	class Listener {
+	public:
+		// Resumes with the next connection, nullptr once closed
+		class AcceptAwaiter {
+		public:
+			bool await_ready() noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> handle) noexcept;
+			std::shared_ptr<Stream> await_resume() noexcept;
+		private:
+			friend class Listener;
+			AcceptAwaiter(Listener* listener) noexcept : m_listener(listener) {}
+
+			Listener* m_listener;
+		};
+	public:
+		// Accepted connections run on a strand, set before Listen
+		Listener(ServerSocket& server) noexcept;
+		~Listener() noexcept;
+
+		Listener(const Listener&) = delete;
+		Listener& operator=(const Listener&) = delete;
+
+		AcceptAwaiter Accept() noexcept { return { this }; }
+		// Closes the server, an awaited Accept resumes with nullptr
+		void Close() noexcept;
+	private:
+		// Stream of `client` while it is connected
+		std::shared_ptr<Stream> Find(ClientSocket* client) noexcept;
+	private:
+		ServerSocket& m_server;
+
+		std::mutex m_mutex;
+		std::coroutine_handle<> m_waiter;
+		std::deque<std::shared_ptr<Stream>> m_accepted;
+		// A stream stays here until its connection is gone, so the events
+		// of the connection always find it
+		std::unordered_map<ClientSocket*, std::shared_ptr<Stream>> m_streams;
+		bool m_closed = false;
+	};
+}
\ No newline at end of file
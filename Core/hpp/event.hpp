@@ -17,9 +17,9 @@ namespace NSA::Core::Event {
         }
 
         void operator()(EventType event) const noexcept {
-            Call(event);
+            this->Call(event);
         }
-        void Call(EventType event) const noexcept {
+        void Call(EventType& event) const noexcept {
             if (m_listener) m_listener(event);
         }
 
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <socket.hpp>
+#include <event.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace NSA::Core::Socket {
+	// Passes the listening sockets of a running instance on to the one
+	// started to replace it, so a restart never refuses a connection or
+	// loses the accept backlog. Once the successor holds the listeners the
+	// old instance stops accepting and goes on to drain the connections it
+	// holds, then the successor starts accepting; connections arriving in
+	// between wait in the backlog.
+	// Windows duplicates the sockets with WSADuplicateSocket over a named
+	// pipe, Linux passes the descriptors with SCM_RIGHTS over a Unix socket
+	class Handoff {
+	public:
+		struct on_handed_off_t : public Event::event_t {
+			// Instance that took the listeners over
+			std::uint32_t pid;
+
+			constexpr on_handed_off_t(std::uint32_t pid) noexcept : pid(pid) {}
+		};
+	public:
+		Handoff() noexcept;
+		// Stops offering, unless the listeners are gone already
+		~Handoff() noexcept;
+
+		Handoff(const Handoff&) = delete;
+		Handoff& operator=(const Handoff&) = delete;
+
+		// Waits on a thread of its own for the next instance to ask for the
+		// listeners of `servers`. After handing them over the servers are
+		// detached and OnHandedOff fires on that thread. The servers have to
+		// outlive the Handoff
+		bool Offer(std::vector<ServerSocket*> servers) noexcept;
+
+		// Takes over the listeners instance `pid` offers, into `servers` in
+		// the order it offered its own. The servers must not have been
+		// created yet. False when nothing was taken over, the servers are
+		// then free to Create and Listen themselves; short of the old
+		// instance going away halfway through the exchange, or a server
+		// failing to adopt listeners already released to it
+		static bool Take(std::uint32_t pid, const std::vector<ServerSocket*>& servers) noexcept;
+
+		Event::Event<on_handed_off_t> OnHandedOff;
+	private:
+#if NSA_USE_WINDOWS
+		using Channel = HANDLE;
+#else
+		using Channel = int;
+#endif
+
+		void Run() noexcept;
+		// Hands the listeners to the successor on the other end of
+		// `channel`, true once it confirmed taking them over
+		bool Serve(Channel channel) noexcept;
+		// Detaches the servers, leaving the listeners to the successor
+		void Release() noexcept;
+
+		// Endpoint instance `pid` offers its listeners on
+		static std::string ChannelName(std::uint32_t pid);
+	private:
+		// Longest a successor may take for a step of the exchange
+		constexpr static auto EXCHANGE_TIMEOUT = std::chrono::seconds(5);
+
+		std::vector<ServerSocket*> m_servers;
+		std::thread m_thread;
+#if NSA_USE_WINDOWS
+		// Manual reset event ending Run
+		HANDLE m_stop = nullptr;
+#else
+		// Listening Unix socket, and the eventfd ending Run
+		int m_listener = -1;
+		int m_stop = -1;
+#endif
+	};
+}
\ No newline at end of file
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace NSA::Core::Socket::Pool {
+	// Leaves grown elements uninitialized, so resizing a recycled buffer
+	// does not zero-fill memory the next operation overwrites anyway
+	template <typename T>
+	struct DefaultInitAllocator : public std::allocator<T> {
+		template <typename U>
+		struct rebind {
+			using other = DefaultInitAllocator<U>;
+		};
+
+		using std::allocator<T>::allocator;
+
+		template <typename U>
+		void construct(U* ptr) noexcept(std::is_nothrow_default_constructible_v<U>) {
+			::new (static_cast<void*>(ptr)) U;
+		}
+		template <typename U, typename... Args>
+		void construct(U* ptr, Args&&... args) {
+			::new (static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+		}
+	};
+
+	struct Stats {
+		// Acquired from a thread's free list
+		std::uint64_t hits = 0;
+		// Had to go to the heap
+		std::uint64_t misses = 0;
+		// Handed back to a free list on release
+		std::uint64_t recycled = 0;
+	};
+
+	namespace Detail {
+		// Counts of one thread, on a line of their own so the hot path
+		// never shares it. Only the owner bumps them, GetStats reads them
+		struct alignas(64) Counters {
+			std::atomic<std::uint64_t> hits = 0;
+			std::atomic<std::uint64_t> misses = 0;
+			std::atomic<std::uint64_t> recycled = 0;
+
+			Counters* prev = nullptr;
+			Counters* next = nullptr;
+		};
+
+		// Counters of the threads alive, and what the exited ones left
+		inline std::mutex gs_countersMutex;
+		inline Counters* gs_counters = nullptr;
+		inline Counters gs_retired;
+
+		inline thread_local Counters* t_counters = nullptr;
+
+		struct CountersSlot {
+			Counters own;
+
+			CountersSlot() noexcept {
+				std::lock_guard<std::mutex> lock(gs_countersMutex);
+				own.next = gs_counters;
+				if (gs_counters)
+					gs_counters->prev = &own;
+				gs_counters = &own;
+			}
+			~CountersSlot() noexcept {
+				std::lock_guard<std::mutex> lock(gs_countersMutex);
+				if (own.prev)
+					own.prev->next = own.next;
+				else
+					gs_counters = own.next;
+				if (own.next)
+					own.next->prev = own.prev;
+
+				gs_retired.hits += own.hits.load(std::memory_order_relaxed);
+				gs_retired.misses += own.misses.load(std::memory_order_relaxed);
+				gs_retired.recycled += own.recycled.load(std::memory_order_relaxed);
+
+				// Whatever the thread still does on its way out
+				t_counters = &gs_retired;
+			}
+		};
+
+		inline Counters& LocalCounters() noexcept {
+			if (auto counters = t_counters)
+				return *counters;
+
+			thread_local CountersSlot slot;
+			t_counters = &slot.own;
+			return slot.own;
+		}
+
+		inline void Bump(std::atomic<std::uint64_t>& counter) noexcept {
+			counter.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	inline Stats GetStats() noexcept {
+		std::lock_guard<std::mutex> lock(Detail::gs_countersMutex);
+
+		auto sum = [](const Detail::Counters& counters, Stats& stats) noexcept {
+			stats.hits += counters.hits.load(std::memory_order_relaxed);
+			stats.misses += counters.misses.load(std::memory_order_relaxed);
+			stats.recycled += counters.recycled.load(std::memory_order_relaxed);
+		};
+
+		Stats stats;
+		sum(Detail::gs_retired, stats);
+		for (auto counters = Detail::gs_counters; counters; counters = counters->next)
+			sum(*counters, stats);
+		return stats;
+	}
+
+	// Per thread cache of released objects, linked through their `next`
+	// member. Objects go back to the list of whichever thread releases
+	// them, which for I/O contexts is the worker that completed them.
+	// A thread whose list is full hands all of it to a shared depot in one
+	// go, and one whose list ran dry takes a whole list from there, so
+	// objects released on one thread and acquired on another still come
+	// back around instead of going through the heap.
+	// T provides Reset() to return a released object to its initial state
+	// while keeping whatever storage it has grown. LIMIT caps the objects
+	// a thread keeps, lower for large ones
+	template <typename T, std::uint32_t LIMIT = 1024>
+	class FreeList {
+	public:
+		constexpr static std::uint32_t MAX_CACHED = LIMIT;
+		// Full lists the depot holds on to
+		constexpr static std::uint32_t MAX_DEPOT = 4;
+	public:
+		static T* Acquire() noexcept {
+			auto& cache = t_cache;
+			if (!cache.head && !cache.closed)
+				TakeFromDepot(cache);
+
+			auto& counters = Detail::LocalCounters();
+			if (auto obj = cache.head) {
+				cache.head = static_cast<T*>(obj->next);
+				cache.count--;
+				obj->next = nullptr;
+
+				Detail::Bump(counters.hits);
+				return obj;
+			}
+
+			Detail::Bump(counters.misses);
+			return new T;
+		}
+
+		static void Recycle(T* obj) noexcept {
+			auto& cache = t_cache;
+			if (cache.count >= MAX_CACHED && !cache.closed)
+				GiveToDepot(cache);
+
+			if (cache.closed || cache.count >= MAX_CACHED) {
+				delete obj;
+				return;
+			}
+
+			// Registers the cleanup of this thread's list
+			(void)&t_reaper;
+
+			obj->Reset();
+			obj->next = cache.head;
+			cache.head = obj;
+			cache.count++;
+
+			Detail::Bump(Detail::LocalCounters().recycled);
+		}
+	private:
+		// Trivially destructible, so it stays usable while other thread
+		// locals are torn down
+		struct Cache {
+			T* head = nullptr;
+			std::uint32_t count = 0;
+			bool closed = false;
+		};
+		// Lists handed over whole, head and length. Never torn down, what
+		// is left in it at exit stays reachable
+		struct Depot {
+			std::mutex mutex;
+			T* heads[MAX_DEPOT] = {};
+			std::uint32_t counts[MAX_DEPOT] = {};
+			// Read without the lock to skip it when there is nothing to do
+			std::atomic<std::uint32_t> size = 0;
+		};
+
+		static Depot& GetDepot() noexcept {
+			static Depot* depot = new Depot;
+			return *depot;
+		}
+
+		static void TakeFromDepot(Cache& cache) noexcept {
+			auto& depot = GetDepot();
+			if (depot.size.load(std::memory_order_relaxed) == 0)
+				return;
+
+			std::lock_guard<std::mutex> lock(depot.mutex);
+			auto size = depot.size.load(std::memory_order_relaxed);
+			if (size == 0)
+				return;
+
+			size--;
+			cache.head = std::exchange(depot.heads[size], nullptr);
+			cache.count = depot.counts[size];
+			depot.size.store(size, std::memory_order_relaxed);
+
+			// A thread that only acquires still has to give the list back
+			(void)&t_reaper;
+		}
+
+		static bool GiveToDepot(Cache& cache) noexcept {
+			auto& depot = GetDepot();
+			if (depot.size.load(std::memory_order_relaxed) == MAX_DEPOT)
+				return false;
+
+			std::lock_guard<std::mutex> lock(depot.mutex);
+			auto size = depot.size.load(std::memory_order_relaxed);
+			if (size == MAX_DEPOT)
+				return false;
+
+			depot.heads[size] = std::exchange(cache.head, nullptr);
+			depot.counts[size] = std::exchange(cache.count, 0);
+			depot.size.store(size + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		struct Reaper {
+			~Reaper() noexcept {
+				auto& cache = t_cache;
+				// Kept for the threads still running
+				if (cache.head)
+					GiveToDepot(cache);
+
+				while (auto obj = cache.head) {
+					cache.head = static_cast<T*>(obj->next);
+					delete obj;
+				}
+				cache.count = 0;
+				cache.closed = true;
+			}
+		};
+	private:
+		static inline thread_local Cache t_cache;
+		static inline thread_local Reaper t_reaper;
+	};
+
+	namespace Detail {
+		// Storage handed out by Allocate, from the free list of its size
+		template <std::size_t SIZE>
+		struct Block {
+			Block* next = nullptr;
+			alignas(std::max_align_t) unsigned char storage[SIZE];
+
+			void Reset() noexcept {}
+		};
+
+		template <std::size_t SIZE>
+		void* AcquireBlock() noexcept {
+			return FreeList<Block<SIZE>>::Acquire()->storage;
+		}
+
+		template <std::size_t SIZE>
+		void RecycleBlock(void* ptr) noexcept {
+			auto block = reinterpret_cast<Block<SIZE>*>(
+				static_cast<unsigned char*>(ptr) - offsetof(Block<SIZE>, storage)
+			);
+			FreeList<Block<SIZE>>::Recycle(block);
+		}
+	}
+
+	// Largest size Allocate serves from the free lists
+	constexpr std::size_t MAX_BLOCK_SIZE = 4096;
+
+	// Raw storage from the same per thread lists, in a few size classes,
+	// for objects only sized at run time such as coroutine frames. Larger
+	// ones go to the heap. Deallocate takes the size Allocate was given
+	inline void* Allocate(std::size_t size) {
+		if (size <= 256)
+			return Detail::AcquireBlock<256>();
+		if (size <= 512)
+			return Detail::AcquireBlock<512>();
+		if (size <= 1024)
+			return Detail::AcquireBlock<1024>();
+		if (size <= 2048)
+			return Detail::AcquireBlock<2048>();
+		if (size <= MAX_BLOCK_SIZE)
+			return Detail::AcquireBlock<MAX_BLOCK_SIZE>();
+
+		Detail::Bump(Detail::LocalCounters().misses);
+		return ::operator new(size);
+	}
+
+	inline void Deallocate(void* ptr, std::size_t size) noexcept {
+		if (size <= 256)
+			Detail::RecycleBlock<256>(ptr);
+		else if (size <= 512)
+			Detail::RecycleBlock<512>(ptr);
+		else if (size <= 1024)
+			Detail::RecycleBlock<1024>(ptr);
+		else if (size <= 2048)
+			Detail::RecycleBlock<2048>(ptr);
+		else if (size <= MAX_BLOCK_SIZE)
+			Detail::RecycleBlock<MAX_BLOCK_SIZE>(ptr);
+		else
+			::operator delete(ptr, size);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <socket.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace NSA::Core::Socket::DNS {
+	struct Config {
+		// How long an answer is reused. getaddrinfo does not report the
+		// record TTLs, so these are the only bound on staleness
+		std::chrono::seconds positiveTtl = std::chrono::seconds(30);
+		// Failed lookups are answered from the cache for this long, so a
+		// dead name is not hammered by every reconnect
+		std::chrono::seconds negativeTtl = std::chrono::seconds(5);
+		// Lookups running at once, each blocking one resolver thread
+		std::uint32_t threads = 2;
+		// Names kept; the ones closest to expiring go first
+		std::size_t maxEntries = 4096;
+	};
+
+	struct Stats {
+		// Answered from the cache, failures included
+		std::uint64_t hits = 0;
+		// Hits on a cached failure
+		std::uint64_t negativeHits = 0;
+		// Started a lookup
+		std::uint64_t misses = 0;
+		// Waited for a lookup of the same name already running
+		std::uint64_t joined = 0;
+	};
+
+	struct Answer {
+		// 0, or the error the lookup failed with
+		std::uint32_t error = 0;
+		// Port 0, whoever connects fills it in
+		std::vector<IOCP::Address> addresses;
+	};
+
+	// Name lookups off the I/O path. Lookups run on a few resolver threads
+	// of their own and are shared through one cache by every socket; names
+	// looked up while a lookup of them is running wait for that one
+	class Resolver {
+	public:
+		using Callback = std::function<void(const Answer&)>;
+		// Identifies a Resolve call for Cancel, 0 when nothing is pending
+		using Ticket = std::uint64_t;
+	public:
+		// Only possible before the first lookup
+		static bool SetConfig(const Config& config) noexcept;
+		static const Config& GetConfig() noexcept { return gs_config; }
+
+		// The cached answer, std::nullopt when `host` has to be looked up
+		static std::optional<Answer> Lookup(
+			std::string_view host,
+			Socket::AddressFamily family
+		) noexcept;
+
+		// Calls `callback` with the answer from a resolver thread, or right
+		// away when it is cached; 0 when the lookup could not be started
+		static Ticket Resolve(
+			std::string_view host,
+			Socket::AddressFamily family,
+			Callback callback
+		) noexcept;
+
+		// Drops the callback of a lookup still running, false when it
+		// already ran. Waits for it when it is running right now
+		static bool Cancel(Ticket ticket) noexcept;
+
+		static Stats GetStats() noexcept;
+	private:
+		struct Waiter {
+			Ticket ticket;
+			Callback callback;
+		};
+		struct Entry {
+			std::string host;
+			Socket::AddressFamily family;
+
+			Answer answer;
+			std::chrono::steady_clock::time_point expires;
+			// Lookup still running, `waiters` get the answer once it is in
+			bool pending = true;
+			std::vector<Waiter> waiters;
+		};
+		// Joins the resolver threads when the process exits
+		struct Threads {
+			std::vector<std::thread> threads;
+			~Threads() noexcept;
+		};
+	private:
+		static void ResolverThread() noexcept;
+		static Answer Query(const std::string& host, Socket::AddressFamily family) noexcept;
+		static std::string Key(std::string_view host, Socket::AddressFamily family);
+		// Makes room for one more entry, gs_mutex held
+		static void Evict(std::chrono::steady_clock::time_point now) noexcept;
+	private:
+		static Config gs_config;
+
+		static std::mutex gs_mutex;
+		static std::condition_variable gs_wake;
+		// Cancel waits on this for callbacks that are running
+		static std::condition_variable gs_dispatched;
+		static std::unordered_map<std::string, Entry> gs_cache;
+		// Keys waiting for a resolver thread
+		static std::deque<std::string> gs_queue;
+		// Tickets whose callback is running
+		static std::vector<Ticket> gs_dispatching;
+		static Ticket gs_nextTicket;
+		static bool gs_stopping;
+
+		static std::atomic<std::uint64_t> gs_hits;
+		static std::atomic<std::uint64_t> gs_negativeHits;
+		static std::atomic<std::uint64_t> gs_misses;
+		static std::atomic<std::uint64_t> gs_joined;
+
+		// Last, so the threads are gone before the state they use
+		static Threads gs_threads;
+	};
+}
\ No newline at end of file
@@ -1,45 +1,270 @@
 #pragma once
 
-#include <WinSock2.h>
-#include <mswsock.h>
+#include <Shared/os.hpp>
+
+#if NSA_USE_WINDOWS
+#	include <WinSock2.h>
+#	include <mswsock.h>
+#else
+#	include <sys/socket.h>
+#	include <sys/uio.h>
+#	include <sys/epoll.h>
+#	include <netinet/in.h>
+#	include <netdb.h>
+
+#	include <uring.hpp>
+
+#	ifndef INVALID_SOCKET
+#		define INVALID_SOCKET (-1)
+#	endif
+#	ifndef SOCKET_ERROR
+#		define SOCKET_ERROR (-1)
+#	endif
+#endif
 
 #include <string>
+#include <functional>
+#include <filesystem>
 #include <optional>
 #include <vector>
+#include <deque>
+#include <memory>
 #include <string_view>
+#include <span>
 #include <cstdint>
+#include <chrono>
 #include <thread>
 #include <atomic>
 #include <mutex>
 
 #include <event.hpp>
+#include <pool.hpp>
 
 namespace NSA::Core::Socket {
 	class Socket;
 
+	namespace Timer {
+		class Wheel;
+	}
+	namespace TLS {
+		class Context;
+		class Session;
+	}
+	namespace Compression {
+		class Context;
+		class Session;
+	}
+
 	namespace IOCP {
 		enum class IOOperation : std::uint8_t {
 			NONE = 0,
 			ACCEPT,
 			RECV,
 			SEND,
-			CONNECT
+			CONNECT,
+			SEND_FILE,
+			RECV_FROM,
+			SEND_TO,
+			// Runs a task handed to Socket::Execute
+			TASK
+		};
+
+#if NSA_USE_WINDOWS
+		using FileHandle = HANDLE;
+		inline const FileHandle INVALID_FILE = INVALID_HANDLE_VALUE;
+#else
+		using FileHandle = int;
+		inline const FileHandle INVALID_FILE = -1;
+#endif
+
+		using Buffer = std::vector<char, Pool::DefaultInitAllocator<char>>;
+		// Bytes shared between the caller and in-flight operations
+		using BufferRef = std::shared_ptr<Buffer>;
+
+		// Socket address in the form the socket calls take it
+		struct Address {
+			sockaddr_storage storage{};
+#if NSA_USE_WINDOWS
+			int length = 0;
+#else
+			socklen_t length = 0;
+#endif
+
+			const sockaddr* Get() const noexcept { return reinterpret_cast<const sockaddr*>(&storage); }
+			sockaddr* Get() noexcept { return reinterpret_cast<sockaddr*>(&storage); }
+
+			int Family() const noexcept { return storage.ss_family; }
+			std::uint32_t GetPort() const noexcept;
+			void SetPort(std::uint32_t port) noexcept;
+
+			// Numeric IPv4 or IPv6 host, no name lookup
+			static std::optional<Address> Parse(std::string_view host, std::uint32_t port) noexcept;
+			// Numeric host and port; IPv4 peers of a dual-stack socket come
+			// out in their IPv4 form
+			std::optional<std::pair<std::string, std::uint32_t>> Format() const noexcept;
+
+			friend bool operator==(const Address& lhs, const Address& rhs) noexcept;
+		};
+
+		struct Datagram {
+			std::span<const char> data;
+			Address peer;
 		};
 
 		struct IOContext {
 			IOContext() noexcept;
+			~IOContext() noexcept;
+
+			// Back to the freshly constructed state, keeping the buffer's
+			// storage for the next operation
+			void Reset() noexcept;
+
+			// Bytes the operation transfers, from `segments` when there are any
+			std::size_t Size() const noexcept;
+			// Takes over the result of a completion of `from`, its `length`
+			// received bytes copied out of wherever the engine put them
+			void CopyResult(const IOContext& from, std::uint32_t length) noexcept;
+			// Lays `buffers` out back to back in `buffer`
+			void Gather(std::span<const std::string_view> buffers) noexcept;
+			// Sends `buffers` in place, without copying them into `buffer`
+			void Attach(std::span<const BufferRef> buffers) noexcept;
+			// Sends `length` bytes of `file` from `offset`, up to the end of
+			// the file when `length` is 0. The file has to stay open until the
+			// send completes
+			bool SetFile(FileHandle file, std::uint64_t offset, std::uint64_t length) noexcept;
+			// Same as SetFile, on a file opened here and closed with the context
+			bool OpenFile(const std::filesystem::path& path, std::uint64_t offset, std::uint64_t length) noexcept;
+#if NSA_USE_LINUX
+			constexpr static std::size_t MAX_SEGMENTS = 1024;
 
-			OVERLAPPED overlapped; 
+			// The part of `segments` not sent yet, as a message for sendmsg
+			msghdr* PendingMessage() noexcept;
+#endif
+
+			// Received bytes, wherever the engine put them
+			char* Data() noexcept {
+#if NSA_USE_LINUX
+				if (selected)
+					return selected;
+#endif
+				return buffer.data();
+			}
+
+#if NSA_USE_WINDOWS
+			OVERLAPPED overlapped;
 			WSABUF wsabuf;
-			std::vector<char> buffer;
+			std::vector<WSABUF> wsabufs;
+#endif
+			Buffer buffer;
+			// Caller buffers a gathered send goes out from instead of `buffer`
+			std::vector<BufferRef> segments;
 			IOOperation operation = IOOperation::NONE;
 			Socket* owner = nullptr;
+			// Socket whose descriptor the operation runs on; it keeps the
+			// context alive until the operation completes
+			Socket* target = nullptr;
+			// The operation stays posted after this completion
+			bool multishot = false;
+			// Bytes a SEND accounts for in the outbound queue of its target
+			std::size_t queued = 0;
+			// Bytes already handed to the kernel by partial sends, datagrams
+			// for SEND_TO
+			std::size_t offset = 0;
+
+			// Part of a file a SEND_FILE transmits
+			FileHandle file = INVALID_FILE;
+			std::uint64_t fileOffset = 0;
+			std::uint64_t fileLength = 0;
+			// `file` was opened by OpenFile
+			bool ownsFile = false;
+
+			// Datagrams a SEND_TO sends or a RECV_FROM took in, their bytes
+			// in `buffer`
+			std::vector<Datagram> datagrams;
+			// Peer of an ACCEPT, or the one a CONNECT goes to
+			Address address;
+			// Error of a completion handed to a worker by Post
+			std::optional<std::uint32_t> posted;
+			// Position of a RECV among those posted on its target, 0 when it
+			// needs no ordering
+			std::uint64_t sequence = 0;
+			// Result of a completion waiting for its turn, behind earlier
+			// receives or on the strand of its target
+			std::uint32_t deferredBytes = 0;
+			std::uint32_t deferredError = 0;
+			// Links into the strand queue of the target
+			IOContext* strandNext = nullptr;
+			// Copy of a multishot completion that waited on the strand,
+			// released once it ran
+			bool detached = false;
+
+			// Wheel a PostAfter context is armed on, null once it expired.
+			// Links into its slot there, by the tick it is due at
+			Timer::Wheel* timerWheel = nullptr;
+			std::uint64_t timerDue = 0;
+			std::uint16_t timerSlot = 0;
+			IOContext* timerPrev = nullptr;
+			IOContext* timerNext = nullptr;
+
+			// Links into the target's list of posted contexts
+			IOContext* prev = nullptr;
+			IOContext* next = nullptr;
+			// Deletes the context as the type it was created with
+			void (*destroy)(IOContext* ctx) noexcept = nullptr;
+			// Copies a completion of the context, `length` bytes received, to
+			// a new one of the same type on the same target
+			IOContext* (*detach)(IOContext* ctx, std::uint32_t length) noexcept = nullptr;
+			// Left to the worker by a socket destroyed on it while the
+			// operation was still out, released once it reports back
+			bool orphaned = false;
+#if NSA_USE_LINUX
+			// Descriptor produced by a completed ACCEPT
+			int socket = INVALID_SOCKET;
+			// Kernel provided buffer holding the received bytes (io_uring)
+			char* selected = nullptr;
+			// Gathered send state handed to sendmsg
+			std::vector<iovec> iovecs;
+			msghdr message{};
+
+			// Batch handed to recvmmsg/sendmmsg, one message per receive slot
+			// or per run of datagrams sent together
+			std::vector<mmsghdr> messages;
+			std::vector<char> control;
+			// Runs of equally sized datagrams to one peer go out as a single
+			// segmented send (UDP GSO)
+			bool segment = false;
+#endif
+		};
+
+		// Received bytes handed out without copying them. `data` points into
+		// the receive buffer and is only valid during the event; Retain()
+		// keeps the bytes around for longer, after which `data` points into
+		// the retained buffer
+		struct DataView {
+			std::span<const char> data;
+
+			DataView(IOContext* ctx, std::size_t length) noexcept
+				: data(ctx->Data(), length), m_ctx(ctx) {}
+			// Bytes that are not in a receive buffer, decrypted ones for
+			// instance; retained from the start
+			DataView(BufferRef retained) noexcept
+				: data(retained->data(), retained->size()), m_ctx(nullptr),
+				m_retained(std::move(retained)) {}
+
+			BufferRef Retain() noexcept;
+		private:
+			IOContext* m_ctx;
+			BufferRef m_retained;
 		};
 	}
 
 	class Socket {
 	public:
+#if NSA_USE_WINDOWS
 		using SockType = SOCKET;
+#else
+		using SockType = int;
+#endif
 
 		enum class AddressFamily : std::uint8_t {
 			IPV4 = AF_INET,
@@ -51,6 +276,41 @@ namespace NSA::Core::Socket {
 			UDP = SOCK_DGRAM,
 			RAW = SOCK_RAW
 		};
+		enum class Engine : std::uint8_t {
+			IOCP = 0,
+			EPOLL,
+			IO_URING
+		};
+		// How sockets are spread over the completion queues
+		enum class Placement : std::uint8_t {
+			// In creation order
+			ROUND_ROBIN = 0,
+			// Onto the queue with the fewest open sockets
+			LEAST_LOADED,
+			// Onto the queue of the worker creating the socket, so accepted
+			// and follow-up connections stay next to their parent
+			CALLER
+		};
+		struct WorkerConfig {
+			// Completion queues, each drained by one worker; 0 means one per
+			// logical processor
+			std::uint32_t queues = 0;
+			Placement placement = Placement::ROUND_ROBIN;
+			// Pin worker N to logical processor N
+			bool pinned = true;
+		};
+		// Outbound queue every connection keeps in front of its descriptor
+		struct SendQueueConfig {
+			// Sends posted on the descriptor at once; later ones wait and go
+			// out merged into one vectored send
+			std::uint32_t maxInflight = 4;
+			// Largest send waiting writes are merged into
+			std::size_t maxCoalesced = 256 * 1024;
+			// Unsent bytes at which OnBackpressure fires, and down to which
+			// they have to drain before OnWritable follows
+			std::size_t highWatermark = 1024 * 1024;
+			std::size_t lowWatermark = 256 * 1024;
+		};
 	public:
 		Socket() noexcept;
 
@@ -62,25 +322,86 @@ namespace NSA::Core::Socket {
 
 		virtual ~Socket() noexcept;
 
+		// `queue` puts the socket on that completion queue instead of the
+		// one the placement policy picks
 		bool Create(
 			AddressFamily family = AddressFamily::IPV4,
-			SocketType type = SocketType::TCP
+			SocketType type = SocketType::TCP,
+			std::optional<std::uint32_t> queue = std::nullopt
+		) noexcept;
+
+		// Takes over a descriptor opened elsewhere, one received from another
+		// process for instance, in place of Create. Left with the caller
+		// when it fails
+		bool Attach(
+			SockType socket,
+			std::optional<std::uint32_t> queue = std::nullopt
 		) noexcept;
 
-		bool Close() noexcept;
+		virtual bool Close() noexcept;
+		// Closes the descriptor of this process only. The connection or
+		// listener behind it stays up for the processes it was duplicated
+		// into, where Close would shut it down for them as well
+		virtual bool Detach() noexcept;
 		bool IsOpen() const noexcept;
 
 		SockType GetSocket() const noexcept;
-		std::string_view GetHost() const noexcept { return m_host; }
+		AddressFamily GetFamily() const noexcept { return m_family; }
+		// Peer of a connection, the bound address of a listening or datagram
+		// socket
+		const IOCP::Address& GetAddress() const noexcept { return m_address; }
+		// Numeric form of the address, only formatted once asked for
+		std::string_view GetHost() const noexcept;
 		std::uint32_t GetPort() const noexcept { return m_port; }
 
 		static std::uint64_t GetShutdownKey() noexcept { return gs_shutdownKey; }
 
+		// Picks the completion engine; only possible before the first socket
+		// exists. IO_URING falls back to EPOLL when the kernel lacks support
+		static bool SetEngine(Engine engine) noexcept;
+		static Engine GetEngine() noexcept { return gs_engine; }
+
+		// Same restriction as SetEngine
+		static bool SetWorkerConfig(const WorkerConfig& config) noexcept;
+		static const WorkerConfig& GetWorkerConfig() noexcept { return gs_workerConfig; }
+
+		// Same restriction as SetEngine
+		static bool SetSendQueueConfig(const SendQueueConfig& config) noexcept;
+		static const SendQueueConfig& GetSendQueueConfig() noexcept { return gs_sendQueueConfig; }
+
+		// Bytes handed to Send on this descriptor that have not gone out yet
+		std::size_t GetUnsentBytes() const noexcept {
+			return m_unsentBytes.load(std::memory_order_relaxed);
+		}
+
+		// Runs the completions of this socket and the tasks handed to Execute
+		// one at a time and in order, so handlers keep per-connection state
+		// without a lock. Whichever worker finds the strand idle runs what
+		// queued up on it. Only switched while nothing completes, before
+		// connecting or from OnConnect
+		void UseStrand(bool enabled = true) noexcept;
+		bool IsStranded() const noexcept { return m_stranded.load(std::memory_order_relaxed); }
+		// Runs `task` on the worker of this socket's queue, after the
+		// completions queued on its strand. False while it has no queue
+		bool Execute(std::function<void()> task) noexcept;
+
+		// Queue the socket's completions are delivered on, std::nullopt
+		// until it is associated with one
+		std::optional<std::uint32_t> GetQueue() const noexcept;
+		// True on the worker threads completions are delivered on
+		static bool IsWorkerThread() noexcept;
+
+		// Recycling of I/O contexts and their buffers across all workers
+		static Pool::Stats GetPoolStats() noexcept { return Pool::GetStats(); }
+
+		// Peer of a connected descriptor
 		static std::optional<std::pair<
 			std::string, std::uint32_t
 		>> GetSocketAddress(
 			SockType sock
 		) noexcept;
+		// Address a descriptor is bound to
+		static std::optional<IOCP::Address> GetLocalAddress(SockType sock) noexcept;
 
 		friend void swap(Socket& lhs, Socket& rhs) noexcept;
 	protected:
@@ -90,30 +411,305 @@ namespace NSA::Core::Socket {
 			std::uint32_t error
 		) noexcept = 0;
 
+		bool AssociateIOCP(std::optional<std::uint32_t> queue = std::nullopt) noexcept;
+		// Takes `address` over as the one GetHost and GetPort report
+		void SetAddress(const IOCP::Address& address) noexcept;
+		// Lets an IPv6 descriptor take IPv4 peers as well (IPV6_V6ONLY off)
+		static void EnableDualStack(SockType sock, AddressFamily family) noexcept;
+		// Number of worker queues, one per worker once they are running
+		static std::uint32_t GetQueueCount() noexcept;
+
+		// Accepts and receives are armed once and keep completing
+		static bool IsMultishot() noexcept { return gs_engine == Engine::IO_URING; }
+
+		// Creates a context owned by this socket for an operation on the
+		// descriptor of `target`, which holds on to it until Release()
+		template <typename T>
+		T* Track(Socket* target) noexcept;
+		static void Release(IOCP::IOContext* ctx) noexcept;
+
+		// Posts the SEND in `ctx` on the descriptor of its target
+		static bool PostSend(IOCP::IOContext* ctx) noexcept;
+		// Posts the RECV in `ctx` on the descriptor of its target. Its data
+		// reaches the owner after that of the receives posted before it,
+		// whichever worker completes them
+		static bool PostRecv(IOCP::IOContext* ctx) noexcept;
+		// Hands the SEND in `ctx` to the outbound queue of its target, which
+		// posts it right away while fewer than maxInflight sends are out
+		static bool QueueSend(IOCP::IOContext* ctx) noexcept;
+		// Accounts for a completed SEND and posts what queued up behind it
+		static void CompleteSend(IOCP::IOContext* ctx, bool failed) noexcept;
+		// Hands `ctx` to its owner on the worker of its target's queue, as
+		// if the operation had completed with `error`
+		static bool Post(IOCP::IOContext* ctx, std::uint32_t error) noexcept;
+		// Same, once `delay` has passed, from the timer wheel of that worker
+		static bool PostAfter(
+			IOCP::IOContext* ctx,
+			std::uint32_t error,
+			std::chrono::milliseconds delay
+		) noexcept;
+		// Takes back what PostAfter still holds for `target`; the contexts
+		// stay with their target
+		static void CancelDelayed(Socket* target) noexcept;
+
+		// Trades descriptors with `other`. Neither may have operations
+		// pending, and both have to be on the same queue
+		bool SwapDescriptor(Socket* other) noexcept;
+
+		// The unsent bytes of `target` reached the high watermark through a
+		// send of this socket, or drained back down to the low one
+		virtual void OnSendBacklog(
+			[[maybe_unused]] Socket* target,
+			[[maybe_unused]] std::size_t unsent,
+			[[maybe_unused]] bool congested
+		) noexcept {}
+
+		// Blocks until every operation on this descriptor has reported back.
+		// Returns right away on the descriptor's own worker, whose
+		// completions are queued behind the one running
+		void WaitForPending() noexcept;
+		// True once every operation on this descriptor has reported back
+		bool IsDrained() const noexcept { return m_inflight == 0; }
+
+#if NSA_USE_WINDOWS
 		static void* GetWinsockFunctionPtr(SockType sock, GUID guid) noexcept;
+		static LPFN_TRANSMITFILE GetTransmitFilePtr(SockType sock) noexcept;
 
-		bool AssociateIOCP() const noexcept;
+		// Posts the next piece of a SEND_FILE larger than one TransmitFile
+		// takes, or the next datagram of a SEND_TO; false once everything
+		// is through or the send failed
+		static bool ContinueTransmit(
+			IOCP::IOContext* ctx,
+			std::uint32_t bytesTransferred,
+			std::uint32_t& error
+		) noexcept;
+#else
+		// Queues `ctx` on the descriptor of `target` and completes it once the
+		// descriptor is ready. Completions are delivered to `ctx->owner`.
+		static bool Submit(Socket* target, IOCP::IOContext* ctx) noexcept;
+
+		// Logical processor worker `index` is pinned to, -1 if unknown
+		static int GetWorkerCpu(std::uint32_t index) noexcept;
+#endif
 	private:
+		static void Startup() noexcept;
+		static void Cleanup() noexcept;
+
+		// Hands out the PostAfter contexts of worker `index` that are due,
+		// and returns how long the worker may sleep, -1 for no limit
+		static int RunTimers(std::uint32_t index) noexcept;
+		// Cuts the wait of worker `index` short
+		static void WakeWorker(std::uint32_t index) noexcept;
+
+		static bool PinWorker(std::uint32_t index) noexcept;
+		static void OnWorkerStart(std::uint32_t index) noexcept;
+		std::uint32_t PickQueue(std::optional<std::uint32_t> requested) noexcept;
+		void ReleaseQueue() noexcept;
+
+		// Hands the completion of `ctx` to its owner. A numbered RECV waits
+		// for those posted before it, and lets through the ones it held up
+		static void Complete(
+			IOCP::IOContext* ctx,
+			std::uint32_t bytesTransferred,
+			std::uint32_t error
+		) noexcept;
+		// Same, past the ordering of receives: through the strand of the
+		// target when it has one
+		static void Deliver(
+			IOCP::IOContext* ctx,
+			std::uint32_t bytesTransferred,
+			std::uint32_t error
+		) noexcept;
+		static void Run(
+			IOCP::IOContext* ctx,
+			std::uint32_t bytesTransferred,
+			std::uint32_t error
+		) noexcept;
+		// Runs what queued up on the strand until it is empty
+		void RunStrand() noexcept;
+
+		// Counts an operation on this descriptor as reported back, waking
+		// WaitForPending with the last one
+		void ReleaseInflight() noexcept;
+
+		// `shutdown` off leaves the socket up for other holders of it
+		bool CloseInternal(bool notifyPending, bool shutdown = true) noexcept;
+		// Drops the sends that never made it out of the outbound queue
+		void DropQueuedSends() noexcept;
+
+#if NSA_USE_WINDOWS
 		static DWORD WINAPI IOCPWorkerThread(LPVOID param) noexcept;
+#else
+		static void EpollWorkerThread(std::uint32_t index) noexcept;
+
+		void OnReady(std::uint32_t events) noexcept;
+		// Delivers what Post handed to worker `index`
+		static void RunPosted(std::uint32_t index) noexcept;
+		void Drain(std::deque<IOCP::IOContext*>& queue) noexcept;
+		bool TryComplete(
+			IOCP::IOContext* ctx,
+			std::uint32_t& bytesTransferred,
+			std::uint32_t& error
+		) noexcept;
+
+		static void Dispatch(
+			IOCP::IOContext* ctx,
+			std::uint32_t bytesTransferred,
+			std::uint32_t error
+		) noexcept;
+
+		static void UringWorkerThread(std::uint32_t index) noexcept;
+
+		bool SubmitRing(IOCP::IOContext* ctx) noexcept;
+		// Lets the write queued behind the completed one go
+		void SubmitNextWrite() noexcept;
+		static void OnRingCompletion(
+			IOUring::Ring& ring,
+			const io_uring_cqe& cqe
+		) noexcept;
+#endif
 	protected:
 		constexpr static std::uint32_t MAX_PENDING_RECVS = 4;
+#if NSA_USE_WINDOWS
 		static std::vector<HANDLE> gs_workers;
+#else
+		static std::vector<std::thread> gs_workers;
+#endif
 
 		SockType m_socket;
-		std::string m_host;
+		AddressFamily m_family = AddressFamily::UNSPECIFIED;
+		IOCP::Address m_address;
+		mutable std::mutex m_hostMutex;
+		mutable std::string m_host;
 		std::uint32_t m_port;
-		static std::mutex gs_bufferMutex;
 	private:
-		static HANDLE gs_globalIOCP;
+
+		constexpr static std::uint32_t NO_QUEUE = UINT32_MAX;
+#if NSA_USE_WINDOWS
+		// One completion port per worker
+		static std::vector<HANDLE> gs_ports;
+#else
+		// One epoll instance or ring per worker
+		static std::vector<int> gs_epolls;
+		static int gs_wakeEvent;
+		static std::vector<std::unique_ptr<IOUring::Ring>> gs_rings;
+
+		// Completions handed to an epoll worker by Post, and the eventfd
+		// waking it up for them
+		struct PostQueue {
+			std::mutex mutex;
+			std::deque<IOCP::IOContext*> contexts;
+			int event = INVALID_SOCKET;
+		};
+		static std::vector<std::unique_ptr<PostQueue>> gs_postQueues;
+
+		// Operations waiting for the descriptor to become readable/writable
+		std::mutex m_ioMutex;
+		std::deque<IOCP::IOContext*> m_pendingReads;
+		std::deque<IOCP::IOContext*> m_pendingWrites;
+#endif
+		std::atomic<std::uint32_t> m_inflight = 0;
+		// Bumped whenever a socket's last operation reported back.
+		// WaitForPending sleeps on it rather than on the socket, which may
+		// be gone by the time the waker gets to notify
+		static std::atomic<std::uint32_t> gs_drained;
+		std::uint32_t m_queue = NO_QUEUE;
+		// Queue of the last descriptor, where what is still due after Close
+		// comes back on
+		std::uint32_t m_lastQueue = NO_QUEUE;
+
+		// Contexts of the operations posted on this descriptor, linked
+		// through the contexts themselves. Only contended by operations on
+		// the same connection
+		std::mutex m_ctxMutex;
+		IOCP::IOContext* m_postedCtx = nullptr;
+
+		// Receives are numbered as they are posted, under m_ioMutex with
+		// epoll whose queue keeps them in that order. Completions ahead of
+		// the next one due wait in m_heldRecvs
+		std::mutex m_recvMutex;
+		std::uint64_t m_recvPosted = 0;
+		std::uint64_t m_recvDelivered = 0;
+		std::vector<IOCP::IOContext*> m_heldRecvs;
+
+		// Task handed to Execute
+		struct TaskContext : public IOCP::IOContext {
+			std::function<void()> task;
+
+			void Reset() noexcept {
+				task = nullptr;
+				IOContext::Reset();
+			}
+		};
+
+		// Completions waiting on the strand, newest first. nullptr while it
+		// is idle, ending in a marker while a thread runs it
+		std::atomic<bool> m_stranded = false;
+		std::atomic<IOCP::IOContext*> m_strandQueue = nullptr;
+
+		// Sends waiting for one of the in-flight ones to complete
+		std::mutex m_sendMutex;
+		std::deque<IOCP::IOContext*> m_queuedSends;
+		std::uint32_t m_sendsInflight = 0;
+		std::atomic<std::size_t> m_unsentBytes = 0;
+		// Socket told about the high watermark, nullptr below it
+		Socket* m_congestedBy = nullptr;
+
+		static WorkerConfig gs_workerConfig;
+		static SendQueueConfig gs_sendQueueConfig;
+		// Open sockets per queue
+		static std::vector<std::atomic<std::uint32_t>> gs_queueLoad;
+		static std::atomic<std::uint32_t> gs_nextQueue;
+		static Engine gs_engine;
 		static std::mutex gs_globalMutex;
 		static std::atomic<std::uint32_t> gs_socketCount;
 		static std::atomic<bool> gs_workersRunning;
 		static const std::uint64_t gs_shutdownKey;
+
+		// One per queue, driven by its worker
+		static std::vector<std::unique_ptr<Timer::Wheel>> gs_wheels;
 	};
 
+	template <typename T>
+	T* Socket::Track(Socket* target) noexcept {
+		auto ctx = Pool::FreeList<T>::Acquire();
+		ctx->owner = this;
+		ctx->target = target;
+		ctx->destroy = [](IOCP::IOContext* ctx) noexcept {
+			Pool::FreeList<T>::Recycle(static_cast<T*>(ctx));
+		};
+		ctx->detach = [](IOCP::IOContext* ctx, std::uint32_t length) noexcept -> IOCP::IOContext* {
+			auto copy = ctx->owner->Track<T>(ctx->target);
+			copy->CopyResult(*static_cast<T*>(ctx), length);
+			return copy;
+		};
+
+		std::lock_guard<std::mutex> lock(target->m_ctxMutex);
+		ctx->next = target->m_postedCtx;
+		if (ctx->next)
+			ctx->next->prev = ctx;
+		target->m_postedCtx = ctx;
+		return ctx;
+	}
+
 	class ClientSocket : public Socket {
 	public:
-		struct ClientContext : public IOCP::IOContext {};
+		struct ClientContext : public IOCP::IOContext {
+			// A CONNECT waiting for the resolver, which fills `candidates`
+			bool resolving = false;
+			// Addresses a CONNECT tries in order
+			std::vector<IOCP::Address> candidates;
+			// Attempt of a connection race the timer lets the next one
+			// start after, 0 for anything but the timer
+			std::uint64_t race = 0;
+
+			void Reset() noexcept {
+				IOCP::IOContext::Reset();
+				resolving = false;
+				candidates.clear();
+				race = 0;
+			}
+		};
 	public:
 		struct on_connect_t : public Event::event_t {
 			std::string_view host;
@@ -122,40 +718,280 @@ namespace NSA::Core::Socket {
 			constexpr on_connect_t(std::string_view host, std::uint32_t port)
 				noexcept : host(host), port(port) {}
 		};
+		struct on_connect_failed_t : public Event::event_t {
+			std::uint32_t error;
+
+			constexpr on_connect_failed_t(std::uint32_t error) noexcept
+				: error(error) {}
+		};
 		struct on_data_t : public Event::event_t {
 			std::string data;
-			constexpr on_data_t(std::string data) noexcept : data(data) {}
+			constexpr on_data_t(std::string data) noexcept : data(std::move(data)) {}
 			constexpr on_data_t(const char* data) noexcept : data(data) {}
 			constexpr on_data_t(const char* data, std::size_t length) noexcept
 				: data(data, length) {}
 		};
+		struct on_data_view_t : public Event::event_t, public IOCP::DataView {
+			on_data_view_t(IOCP::IOContext* ctx, std::size_t length) noexcept
+				: DataView(ctx, length) {}
+			on_data_view_t(IOCP::BufferRef retained) noexcept
+				: DataView(std::move(retained)) {}
+		};
+		struct on_backpressure_t : public Event::event_t {
+			std::size_t unsent;
+
+			constexpr on_backpressure_t(std::size_t unsent) noexcept
+				: unsent(unsent) {}
+		};
+		struct on_writable_t : public Event::event_t {
+			std::size_t unsent;
+
+			constexpr on_writable_t(std::size_t unsent) noexcept
+				: unsent(unsent) {}
+		};
+		struct on_file_sent_t : public Event::event_t {
+			std::uint64_t bytes;
+			std::uint32_t error;
+
+			constexpr on_file_sent_t(std::uint64_t bytes, std::uint32_t error) noexcept
+				: bytes(bytes), error(error) {}
+		};
+		struct on_disconnect_t : public Event::event_t {
+			std::uint32_t error;
+
+			constexpr on_disconnect_t(std::uint32_t error) noexcept
+				: error(error) {}
+		};
+		struct on_secure_t : public Event::event_t {
+			// Negotiated through ALPN, empty when none was
+			std::string_view protocol;
+			bool resumed;
+
+			constexpr on_secure_t(std::string_view protocol, bool resumed) noexcept
+				: protocol(protocol), resumed(resumed) {}
+		};
 	public:
 		ClientSocket() noexcept;
-		ClientSocket(Socket::SockType&& socket) noexcept;
+		ClientSocket(
+			Socket::SockType&& socket,
+			std::optional<std::uint32_t> queue = std::nullopt
+		) noexcept;
+		~ClientSocket() noexcept override;
+
+		// Ends a connection race still running along with the connection
+		bool Close() noexcept override;
 
+		// Numeric hosts and cached names are connected to right away, false
+		// when that fails. Other names are looked up on a resolver thread
+		// first, a failure then arrives through OnConnectFailed
 		bool Connect(const std::string_view& host, std::uint32_t port) noexcept;
 		bool Send(const std::string_view& data) noexcept;
+		// Copies the pieces back to back and sends them with one call
+		bool Send(std::span<const std::string_view> buffers) noexcept;
+		// Sends the buffers in place as one vectored write; they are kept
+		// alive until the send completes
+		bool Send(std::span<const IOCP::BufferRef> buffers) noexcept;
+		// Sends part of a file straight from the file system cache, `length`
+		// 0 meaning up to the end of the file. OnFileSent reports back
+		bool SendFile(
+			const std::filesystem::path& path,
+			std::uint64_t offset = 0,
+			std::uint64_t length = 0
+		) noexcept;
+		// Same, on a file the caller keeps open until OnFileSent
+		bool SendFile(
+			IOCP::FileHandle file,
+			std::uint64_t offset = 0,
+			std::uint64_t length = 0
+		) noexcept;
+
+		// Speaks TLS on the connections made from then on, through
+		// `context` of the client role. `serverName` goes out as SNI and is
+		// what the certificate is checked against, the host given to
+		// Connect when empty. Only before connecting
+		bool UseTLS(std::shared_ptr<TLS::Context> context, std::string_view serverName = {}) noexcept;
+		// TLS state of the connection, nullptr without TLS
+		TLS::Session* GetTLS() const noexcept { return m_tls.get(); }
+		// Compresses the connections made from then on, with the codec
+		// settled with the server through `context`. The server has to
+		// compress too. Underneath OnData and Send, on top of TLS. Only
+		// before connecting; SendFile is refused from then on
+		bool UseCompression(std::shared_ptr<Compression::Context> context) noexcept;
+		// Compression state of the connection, nullptr without it
+		Compression::Session* GetCompression() const noexcept { return m_compression.get(); }
 
 		Event::Event<on_connect_t> OnConnect;
+		// The name did not resolve, or none of its addresses took the
+		// connection
+		Event::Event<on_connect_failed_t> OnConnectFailed;
 		Event::Event<on_data_t> OnData;
+		// Same bytes as OnData, without the copy into a string
+		Event::Event<on_data_view_t> OnDataView;
+		// Unsent bytes reached the high watermark, hold further sends back
+		// until OnWritable
+		Event::Event<on_backpressure_t> OnBackpressure;
+		// Unsent bytes drained back down to the low watermark
+		Event::Event<on_writable_t> OnWritable;
+		// A SendFile finished, `error` is set when the connection broke
+		Event::Event<on_file_sent_t> OnFileSent;
+		// Nothing more is received: the peer closed the connection (error
+		// 0), it broke, or it was closed here. Once per connection
+		Event::Event<on_disconnect_t> OnDisconnect;
+		// The TLS handshake is through. Sends made before it went out
+		// right behind it
+		Event::Event<on_secure_t> OnSecure;
 	protected:
 		void OnIOCompleted(
 			IOCP::IOContext* ctx,
 			std::uint32_t bytesTransferred,
 			std::uint32_t error
 		) noexcept override;
+		void OnSendBacklog(
+			Socket* target,
+			std::size_t unsent,
+			bool congested
+		) noexcept override;
 	private:
+#if NSA_USE_WINDOWS
 		static LPFN_CONNECTEX GetConnectExPtr(SockType sock) noexcept;
+#endif
 
 		bool Recv() noexcept;
+		// Hands what a receive got to OnData and OnDataView, through TLS
+		// and decompression first when the connection uses them; false once
+		// either ended
+		bool Receive(IOCP::IOContext* ctx, std::uint32_t length) noexcept;
+		// Queues the records TLS has waiting to go out
+		bool FlushTLS() noexcept;
+		// Queues a file send, behind the plaintext TLS still has waiting
+		bool QueueFile(ClientContext* ctx) noexcept;
+		// Hands the frames compression has waiting to TLS, or queues them
+		bool FlushCompression() noexcept;
+		// What TLS or compression ended the connection with
+		std::uint32_t GetStageError() const noexcept;
+		// Files are sent by the kernel, which leaves TLS and compression out
+		bool CanSendFile() const noexcept;
+		// Closes the connection after its receive side ended, and reports
+		// the first time it does
+		void Disconnect(std::uint32_t error) noexcept;
+		// Starts the CONNECT in `ctx` on the descriptor of its target, to
+		// the first of its candidates that takes it
+		bool ConnectTo(ClientContext* ctx, std::uint32_t& error) noexcept;
+
+		// Races connections to `candidates` (RFC 8305): the families take
+		// turns, each attempt gets ATTEMPT_DELAY before the next one joins
+		// in, and the first through is kept
+		void StartRace(std::vector<IOCP::Address> candidates) noexcept;
+		// Starts attempts until one is under way or none is left
+		void StartAttempt() noexcept;
+		// Settles the attempt `ctx` was on; true when it won and its
+		// descriptor is now this socket's
+		bool FinishAttempt(ClientContext* ctx, std::uint32_t error) noexcept;
+
+		// Hands accepted connections their peer address
+		friend class ServerSocket;
 	private:
-		std::vector<std::unique_ptr<ClientContext>> m_postedCtx;
+		// Descriptor of one raced connection. Its CONNECT is owned, and
+		// completed, by the client
+		class Attempt : public Socket {
+		public:
+			using Socket::WaitForPending;
+			using Socket::IsDrained;
+
+			// Race it ran in, and whether it reported back to it. Under
+			// m_raceMutex
+			std::uint64_t race = 0;
+			bool settled = false;
+		protected:
+			void OnIOCompleted(
+				[[maybe_unused]] IOCP::IOContext* ctx,
+				[[maybe_unused]] std::uint32_t bytesTransferred,
+				[[maybe_unused]] std::uint32_t error
+			) noexcept override {}
+		};
+
+		// Connection Attempt Delay, RFC 8305 section 5
+		constexpr static auto ATTEMPT_DELAY = std::chrono::milliseconds(250);
+
+		// Lookup the connection waits for, 0 when none is running
+		std::atomic<std::uint64_t> m_resolveTicket = 0;
+
+		std::mutex m_raceMutex;
+		// Addresses in the order they are tried, and the next one up
+		std::vector<IOCP::Address> m_raceCandidates;
+		std::size_t m_nextCandidate = 0;
+		// Descriptors raced so far, kept until their completions drained
+		// and the next race starts
+		std::vector<std::unique_ptr<Attempt>> m_attempts;
+		std::uint32_t m_attemptsRunning = 0;
+		// Bumped by every race, attempts of earlier ones only lose
+		std::uint64_t m_race = 0;
+		// Bumped by every attempt, so only the latest one's timer counts
+		std::uint64_t m_raceGeneration = 0;
+		bool m_raceSettled = false;
+		std::uint32_t m_raceError = 0;
+
+		// OnDisconnect went out for this connection. Only touched by the
+		// receives, which complete one after the other
+		bool m_disconnected = false;
+
+		// TLS of the connection and the name it goes to; accepted
+		// connections get theirs from the server
+		std::unique_ptr<TLS::Session> m_tls;
+		std::string m_serverName;
+		// Host given to Connect, the name TLS goes by without m_serverName
+		std::string m_connectHost;
+		std::unique_ptr<Compression::Session> m_compression;
 	};
 
 	class ServerSocket : public Socket {
 	public:
 		struct ServerContext : public IOCP::IOContext {
-			ClientSocket* client;
+			ClientSocket* client = nullptr;
+			// Timer of an accept that failed for a reason that passes, posts
+			// accepts on its listener again once it fires
+			bool backoff = false;
+
+			void Reset() noexcept {
+				IOCP::IOContext::Reset();
+				client = nullptr;
+				backoff = false;
+			}
+			void CopyResult(const ServerContext& from, std::uint32_t length) noexcept {
+				IOCP::IOContext::CopyResult(from, length);
+				client = from.client;
+			}
+		};
+		// How a sharded server spreads connections over its listeners
+		enum class Steering : std::uint8_t {
+			// The kernel's hash of the connection's addresses and ports
+			HASH = 0,
+			// Onto the listener whose worker runs on the processor that took
+			// the connection in (SO_INCOMING_CPU)
+			INCOMING_CPU,
+			// Same through a BPF program that picks the listener by processor,
+			// for kernels whose SO_INCOMING_CPU does not steer reuseport groups
+			BPF
+		};
+		struct AcceptConfig {
+			// Bounds of the accepts kept posted. The pool grows while
+			// connections arrive faster than it is replenished; once they slow
+			// down, completed accepts are not replaced until it is back down
+			// to the arrival rate. 0 for minPending means one per worker
+			std::uint32_t minPending = 0;
+			std::uint32_t maxPending = 256;
+			// Bytes of the first request received along with the accept and
+			// handed to OnData right after OnConnect. On Windows the accept
+			// waits for them, a client that never sends holds on to it
+			std::uint32_t firstPayload = 0;
+			// Linux only: one listener per worker bound with SO_REUSEPORT, so
+			// the kernel spreads connections over them and every connection
+			// stays on the worker whose listener accepted it
+			bool reusePort = false;
+			Steering steering = Steering::HASH;
+			// Accepted connections run on a strand (UseStrand). OnConnect and
+			// the first payload come with the accept, ahead of it
+			bool strand = false;
 		};
 	public:
 		struct on_listening_t : public Event::event_t {
@@ -180,30 +1016,315 @@ namespace NSA::Core::Socket {
 			on_data_t(const char* data, std::size_t length, ClientSocket* client) noexcept
 				: data(data, length), client(client) {}
 			on_data_t(std::string data, ClientSocket* client) noexcept
-				: data(data), client(client) {}
+				: data(std::move(data)), client(client) {}
+		};
+		struct on_data_view_t : public Event::event_t, public IOCP::DataView {
+			ClientSocket* client;
+
+			on_data_view_t(IOCP::IOContext* ctx, std::size_t length, ClientSocket* client) noexcept
+				: DataView(ctx, length), client(client) {}
+			on_data_view_t(IOCP::BufferRef retained, ClientSocket* client) noexcept
+				: DataView(std::move(retained)), client(client) {}
+		};
+		struct on_backpressure_t : public Event::event_t {
+			std::size_t unsent;
+			ClientSocket* client;
+
+			on_backpressure_t(std::size_t unsent, ClientSocket* client) noexcept
+				: unsent(unsent), client(client) {}
+		};
+		struct on_writable_t : public Event::event_t {
+			std::size_t unsent;
+			ClientSocket* client;
+
+			on_writable_t(std::size_t unsent, ClientSocket* client) noexcept
+				: unsent(unsent), client(client) {}
+		};
+		struct on_file_sent_t : public Event::event_t {
+			std::uint64_t bytes;
+			std::uint32_t error;
+			ClientSocket* client;
+
+			on_file_sent_t(std::uint64_t bytes, std::uint32_t error, ClientSocket* client) noexcept
+				: bytes(bytes), error(error), client(client) {}
+		};
+		struct on_disconnect_t : public Event::event_t {
+			std::uint32_t error;
+			ClientSocket* client;
+
+			on_disconnect_t(std::uint32_t error, ClientSocket* client) noexcept
+				: error(error), client(client) {}
+		};
+		struct on_secure_t : public Event::event_t {
+			// Negotiated through ALPN, empty when none was
+			std::string_view protocol;
+			bool resumed;
+			ClientSocket* client;
+
+			on_secure_t(std::string_view protocol, bool resumed, ClientSocket* client) noexcept
+				: protocol(protocol), resumed(resumed), client(client) {}
 		};
 
 	public:
+		~ServerSocket() noexcept override;
+
+		// Closes every listener
+		bool Close() noexcept override;
+		// Stops accepting on every listener, without shutting them down for
+		// the process they were handed over to. Accepted clients stay
+		bool Detach() noexcept override;
+
+		// `host` has to be of the socket's family. IPv6 listeners take IPv4
+		// connections as well, "::" listens on every address of both
 		bool Listen(const std::string_view& host, std::uint32_t port) noexcept;
+		// Accepts on descriptors already bound and listening, in place of
+		// Create and Listen. More than one make a sharded server, listener N
+		// on queue N. The descriptors are the server's from then on, closed
+		// again when it fails
+		bool Adopt(std::span<const SockType> listeners) noexcept;
+		// Descriptors of the listeners, in the order Adopt takes them
+		std::vector<SockType> GetListenSockets() const noexcept;
+		// Accepted clients still connected
+		std::size_t GetConnectionCount() const noexcept;
+
+		// Only before Listen
+		bool SetAcceptConfig(const AcceptConfig& config) noexcept;
+		const AcceptConfig& GetAcceptConfig() const noexcept { return m_acceptConfig; }
+		// Accepts posted right now
+		std::uint32_t GetPendingAccepts() const noexcept { return m_pendingAccepts; }
+		// Accepted connections speak TLS, through `context` of the server
+		// role. Only before Listen
+		bool UseTLS(std::shared_ptr<TLS::Context> context) noexcept;
+		// Accepted connections compress with the codec settled through
+		// `context`; clients that do not ask for it stay uncompressed.
+		// Only before Listen
+		bool UseCompression(std::shared_ptr<Compression::Context> context) noexcept;
+
 		bool Send(const std::string_view& data, ClientSocket* sock) noexcept;
+		// Copies the pieces back to back and sends them with one call
+		bool Send(std::span<const std::string_view> buffers, ClientSocket* sock) noexcept;
+		// Sends the buffers in place as one vectored write; they are kept
+		// alive until the send completes
+		bool Send(std::span<const IOCP::BufferRef> buffers, ClientSocket* sock) noexcept;
+		// Sends part of a file straight from the file system cache, `length`
+		// 0 meaning up to the end of the file. OnFileSent reports back
+		bool SendFile(
+			const std::filesystem::path& path,
+			ClientSocket* sock,
+			std::uint64_t offset = 0,
+			std::uint64_t length = 0
+		) noexcept;
+		// Same, on a file the caller keeps open until OnFileSent
+		bool SendFile(
+			IOCP::FileHandle file,
+			ClientSocket* sock,
+			std::uint64_t offset = 0,
+			std::uint64_t length = 0
+		) noexcept;
 
 		Event::Event<on_listening_t> OnListening;
 		Event::Event<on_connect_t> OnConnect;
 		Event::Event<on_data_t> OnData;
+		// Same bytes as OnData, without the copy into a string
+		Event::Event<on_data_view_t> OnDataView;
+		// Unsent bytes of a client reached the high watermark, hold further
+		// sends to it back until OnWritable
+		Event::Event<on_backpressure_t> OnBackpressure;
+		// Unsent bytes of a client drained back down to the low watermark
+		Event::Event<on_writable_t> OnWritable;
+		// A SendFile to a client finished, `error` is set when the
+		// connection broke
+		Event::Event<on_file_sent_t> OnFileSent;
+		// Nothing more is received from a client: it closed the connection
+		// (error 0), the connection broke, or it was closed here
+		Event::Event<on_disconnect_t> OnDisconnect;
+		// The TLS handshake of a client is through
+		Event::Event<on_secure_t> OnSecure;
 	protected:
 		void OnIOCompleted(
 			IOCP::IOContext* ctx,
 			std::uint32_t bytesTransferred,
 			std::uint32_t error
 		) noexcept override;
+		void OnSendBacklog(
+			Socket* target,
+			std::size_t unsent,
+			bool congested
+		) noexcept override;
 	private:
+#if NSA_USE_WINDOWS
 		static LPFN_ACCEPTEX GetAcceptExPtr(SockType sock) noexcept;
+		static LPFN_GETACCEPTEXSOCKADDRS GetAcceptExSockaddrsPtr(SockType sock) noexcept;
+#endif
 
-		bool Accept() noexcept;
+		bool Accept(Socket* listener) noexcept;
+		// Posts accepts on `listener` until as many are pending as the
+		// arrival rate asks for; `accepted` when called for a consumed accept
+		void ReplenishAccepts(std::size_t listener, bool accepted) noexcept;
+		// Posts the first accepts on `listener`, or the ones it lost
+		void ResumeAccepts(std::size_t listener) noexcept;
+		// Gives up the accept on `listener` that just failed, and resumes
+		// accepting on it after ACCEPT_BACKOFF unless it already waits
+		void BackOffAccept(std::size_t listener) noexcept;
 		bool Recv(ClientSocket* sock) noexcept;
+		// Hands what a receive from the client in `ctx` got to OnData and
+		// OnDataView, through TLS and decompression first; false once
+		// either ended
+		bool Receive(ServerContext* ctx, std::uint32_t length) noexcept;
+		// Queues the records TLS has waiting to go out to `client`
+		bool FlushTLS(ClientSocket* client) noexcept;
+		// Queues a file send to `client`, behind the plaintext TLS still
+		// has waiting for it
+		bool QueueFile(ServerContext* ctx, ClientSocket* client) noexcept;
+		// Hands the frames compression has waiting for `client` to TLS, or
+		// queues them
+		bool FlushCompression(ClientSocket* client) noexcept;
+		// Closes `client` after its receive side ended, and reports the
+		// first time it does
+		void Disconnect(ClientSocket* client, std::uint32_t error) noexcept;
+
+		// Socket options, bind and listen of one listener
+		bool OpenListener(Socket* listener, const IOCP::Address& address) noexcept;
+		// Posts the first accepts on every listener
+		void StartAccepting() noexcept;
 	private:
-		std::atomic<std::uint32_t> m_pendingAccepts;
+		// Listener added by SO_REUSEPORT sharding. Its operations are owned,
+		// and their completions handled, by the server
+		class Shard : public Socket {
+		public:
+			using Socket::WaitForPending;
+		protected:
+			void OnIOCompleted(
+				[[maybe_unused]] IOCP::IOContext* ctx,
+				[[maybe_unused]] std::uint32_t bytesTransferred,
+				[[maybe_unused]] std::uint32_t error
+			) noexcept override {}
+		};
+
+		// Period over which the connection arrival rate is measured
+		constexpr static auto ACCEPT_WINDOW = std::chrono::milliseconds(100);
+		// Pause after an accept failed while out of descriptors or memory,
+		// which the next one would run into right away
+		constexpr static auto ACCEPT_BACKOFF = std::chrono::milliseconds(50);
+#if NSA_USE_WINDOWS
+		// Room AcceptEx wants for each of the local and remote address
+		constexpr static DWORD ACCEPT_ADDRESS_LENGTH = sizeof(sockaddr_storage) + 16;
+#else
+		// Seconds TCP_DEFER_ACCEPT holds a connection back waiting for data
+		constexpr static int FIRST_PAYLOAD_TIMEOUT = 1;
+#endif
+
+		AcceptConfig m_acceptConfig;
+		// Given to every accepted connection, nullptr without TLS
+		std::shared_ptr<TLS::Context> m_tlsContext;
+		// Same, nullptr without compression
+		std::shared_ptr<Compression::Context> m_compressionContext;
+		// Stopped accepting through Detach
+		std::atomic<bool> m_detached = false;
+		// Listening sockets in the order of their queues, only this one
+		// unless sharded
+		std::vector<Socket*> m_listeners;
+		std::vector<std::unique_ptr<Shard>> m_shards;
+
+		std::mutex m_acceptMutex;
+		std::atomic<std::uint32_t> m_pendingAccepts = 0;
+		// Accepts pending on each listener
+		std::vector<std::uint32_t> m_listenerAccepts;
+		// Listeners waiting out ACCEPT_BACKOFF, one timer each
+		std::vector<bool> m_listenerBackoff;
+		// Accepts the arrival rate asks for, 0 before Listen
+		std::uint32_t m_acceptTarget = 0;
+		// Connections accepted in the current window
+		std::uint32_t m_windowAccepts = 0;
+		std::chrono::steady_clock::time_point m_windowStart;
+		mutable std::mutex m_clientsMutex;
 		std::vector<std::unique_ptr<ClientSocket>> m_clients;
-		std::vector<std::unique_ptr<ServerContext>> m_postedCtx;
+	};
+
+	class DatagramSocket : public Socket {
+	public:
+		struct DatagramContext : public IOCP::IOContext {};
+		struct DatagramConfig {
+			// Datagrams one receive takes in at most
+			std::uint32_t recvBatch = 16;
+			// Longer datagrams are cut off at this size
+			std::uint32_t maxDatagramSize = 2048;
+			// Linux only: UDP GRO and GSO. The kernel hands trains of datagrams
+			// from one peer over in one receive slot, which grows every slot to
+			// 64 KiB, and splits runs of equally sized datagrams sent to one
+			// peer itself
+			bool offload = true;
+		};
+	public:
+		struct on_datagrams_t : public Event::event_t {
+			// Only valid during the event, the bytes point into the receive
+			// buffer
+			std::span<const IOCP::Datagram> datagrams;
+
+			on_datagrams_t(std::span<const IOCP::Datagram> datagrams) noexcept
+				: datagrams(datagrams) {}
+		};
+		struct on_backpressure_t : public Event::event_t {
+			std::size_t unsent;
+
+			constexpr on_backpressure_t(std::size_t unsent) noexcept
+				: unsent(unsent) {}
+		};
+		struct on_writable_t : public Event::event_t {
+			std::size_t unsent;
+
+			constexpr on_writable_t(std::size_t unsent) noexcept
+				: unsent(unsent) {}
+		};
+	public:
+		~DatagramSocket() noexcept override;
+
+		bool Create(
+			AddressFamily family = AddressFamily::IPV4,
+			std::optional<std::uint32_t> queue = std::nullopt
+		) noexcept;
+
+		// Binds the socket and starts receiving
+		bool Bind(const std::string_view& host, std::uint32_t port) noexcept;
+
+		// Only before Bind
+		bool SetDatagramConfig(const DatagramConfig& config) noexcept;
+		const DatagramConfig& GetDatagramConfig() const noexcept { return m_config; }
+
+		bool Send(const std::string_view& data, const IOCP::Address& peer) noexcept;
+		// Copies the datagrams back to back and sends them with as few calls
+		// as possible. Datagrams the network refuses are skipped
+		bool Send(std::span<const IOCP::Datagram> datagrams) noexcept;
+
+		// One event per receive, carrying every datagram it took in
+		Event::Event<on_datagrams_t> OnDatagrams;
+		// Unsent bytes reached the high watermark, hold further sends back
+		// until OnWritable
+		Event::Event<on_backpressure_t> OnBackpressure;
+		// Unsent bytes drained back down to the low watermark
+		Event::Event<on_writable_t> OnWritable;
+	protected:
+		void OnIOCompleted(
+			IOCP::IOContext* ctx,
+			std::uint32_t bytesTransferred,
+			std::uint32_t error
+		) noexcept override;
+		void OnSendBacklog(
+			Socket* target,
+			std::size_t unsent,
+			bool congested
+		) noexcept override;
+	private:
+		// Posts `ctx` again once its datagrams were handed out, a fresh
+		// context when there is none
+		bool Recv(DatagramContext* ctx = nullptr) noexcept;
+	private:
+#if NSA_USE_LINUX
+		// Room for the largest train of datagrams GRO coalesces
+		constexpr static std::uint32_t OFFLOAD_SLOT_SIZE = 64 * 1024;
+#endif
+
+		DatagramConfig m_config;
+		bool m_bound = false;
 	};
 }
\ No newline at end of file
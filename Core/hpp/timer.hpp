@@ -0,0 +1,143 @@
+#pragma once
+
+#include <socket.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+
+namespace NSA::Core::Socket::Timer {
+	// Hierarchical timing wheel of one worker (Varghese & Lauck). Timers are
+	// the I/O contexts themselves, linked into their slot through their
+	// timer members, so arming one allocates nothing. Level N holds timers
+	// due within the current span of level N + 1; each is moved one level
+	// down whenever the level below wraps, and expires from level 0 at its
+	// tick. Arming, cancelling and expiring are O(1)
+	class Wheel {
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		constexpr static std::uint32_t SLOT_BITS = 6;
+		constexpr static std::uint32_t SLOTS = 1 << SLOT_BITS;
+		// With 1 ms ticks four levels reach ~4.6 hours ahead, later timers
+		// wait in an overflow list until the top level wraps
+		constexpr static std::uint32_t LEVELS = 4;
+		constexpr static auto TICK = std::chrono::milliseconds(1);
+		constexpr static std::uint64_t NEVER = std::numeric_limits<std::uint64_t>::max();
+	public:
+		Wheel() noexcept;
+		Wheel(const Wheel&) = delete;
+		Wheel& operator=(const Wheel&) = delete;
+
+		// Arms `ctx` to expire once `delay` has passed. True when it comes
+		// due before the worker would wake up on its own
+		bool Insert(IOCP::IOContext* ctx, Clock::duration delay) noexcept;
+		// Disarms `ctx`, false when it already expired
+		bool Remove(IOCP::IOContext* ctx) noexcept;
+
+		// Catches up with the clock and returns the expired contexts, linked
+		// through `timerNext`. `claim` sees each of them before the wheel
+		// lets go of them, while Remove still waits
+		template <typename Func>
+		IOCP::IOContext* Advance(Func&& claim) noexcept;
+
+		// Milliseconds until the next timer needs looking at, -1 when none
+		// is armed. Taken as the time the worker is about to sleep for
+		int Sleep() noexcept;
+
+		std::size_t Size() const noexcept;
+	private:
+		std::uint64_t Now() const noexcept;
+
+		// Files `ctx` under its due tick relative to m_now
+		void Link(IOCP::IOContext* ctx) noexcept;
+		void Unlink(IOCP::IOContext* ctx) noexcept;
+		// Takes every context out of a slot, as a list through `timerNext`
+		IOCP::IOContext* Take(std::uint32_t slot) noexcept;
+
+		// First tick past m_now with anything to expire or move down
+		std::uint64_t NextEvent() const noexcept;
+		// Moves the slots wrapping at `tick` down a level, then expires what
+		// is due at it
+		template <typename Func>
+		void Expire(std::uint64_t tick, IOCP::IOContext*& head, IOCP::IOContext*& tail, Func& claim) noexcept;
+	private:
+		// Slot index of the overflow list, past the levels
+		constexpr static std::uint32_t OVERFLOW_SLOT = LEVELS * SLOTS;
+
+		mutable std::mutex m_mutex;
+		Clock::time_point m_epoch;
+		// Ticks since m_epoch the wheel has caught up to
+		std::uint64_t m_now = 0;
+		// Tick the worker sleeps until, so arming an earlier one wakes it
+		std::uint64_t m_sleepUntil = NEVER;
+		std::size_t m_count = 0;
+
+		std::array<IOCP::IOContext*, OVERFLOW_SLOT + 1> m_slots{};
+		// Non-empty slots per level
+		std::array<std::uint64_t, LEVELS> m_occupied{};
+	};
+
+	template <typename Func>
+	IOCP::IOContext* Wheel::Advance(Func&& claim) noexcept {
+		IOCP::IOContext* head = nullptr;
+		IOCP::IOContext* tail = nullptr;
+
+		auto now = Now();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		while (m_count != 0) {
+			auto next = NextEvent();
+			if (next > now)
+				break;
+
+			// Nothing happens on the ticks in between
+			m_now = next;
+			Expire(next, head, tail, claim);
+		}
+		m_now = std::max(m_now, now);
+		return head;
+	}
+
+	template <typename Func>
+	void Wheel::Expire(
+		std::uint64_t tick,
+		IOCP::IOContext*& head,
+		IOCP::IOContext*& tail,
+		Func& claim
+	) noexcept {
+		constexpr auto SPAN_BITS = SLOT_BITS * LEVELS;
+		if ((tick & ((std::uint64_t(1) << SPAN_BITS) - 1)) == 0) {
+			for (auto ctx = Take(OVERFLOW_SLOT); ctx;)
+				Link(std::exchange(ctx, ctx->timerNext));
+		}
+
+		// Top down, what moves lands in the lower slots wrapping right now
+		for (auto level = LEVELS; level-- > 1;) {
+			auto shift = SLOT_BITS * level;
+			if ((tick & ((std::uint64_t(1) << shift) - 1)) != 0)
+				continue;
+
+			auto slot = level * SLOTS + ((tick >> shift) & (SLOTS - 1));
+			for (auto ctx = Take(slot); ctx;)
+				Link(std::exchange(ctx, ctx->timerNext));
+		}
+
+		for (auto ctx = Take(tick & (SLOTS - 1)); ctx;) {
+			auto expired = std::exchange(ctx, ctx->timerNext);
+			expired->timerWheel = nullptr;
+			expired->timerNext = nullptr;
+			m_count--;
+			claim(expired);
+
+			if (tail)
+				tail->timerNext = expired;
+			else
+				head = expired;
+			tail = expired;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <socket.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// OpenSSL stays out of the headers
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+struct bio_st;
+
+namespace NSA::Core::Socket::TLS {
+	enum class Role : std::uint8_t {
+		CLIENT = 0,
+		SERVER
+	};
+	enum class Version : std::uint8_t {
+		TLS1_2 = 0,
+		TLS1_3
+	};
+
+	struct Config {
+		// PEM files: the certificate chain, leaf first, and its private key.
+		// Required on the server, a client certificate otherwise
+		std::string certificateFile;
+		std::string privateKeyFile;
+		// PEM bundle peers are verified against, the system store when empty
+		std::string caFile;
+		// Client: check the server's certificate and its name
+		bool verifyPeer = true;
+		// Server: turn away clients without a certificate caFile vouches
+		// for. The authorities in caFile are named to clients to pick theirs
+		bool requireClientCertificate = false;
+
+		Version minVersion = Version::TLS1_2;
+		// OpenSSL cipher strings, for TLS 1.2 and for TLS 1.3. Empty keeps
+		// OpenSSL's defaults
+		std::string ciphers;
+		std::string ciphersuites;
+		// Protocols offered through ALPN, most preferred first. The server
+		// picks the first of its own the client offers too
+		std::vector<std::string> alpn;
+
+		// Sessions kept for resumption: by the server for session ids, by
+		// the client for the servers it connects to
+		std::size_t sessionCacheSize = 20 * 1024;
+		// Stateless resumption through session tickets, on top of the cache
+		bool tickets = true;
+
+		// Linux: once the handshake is through, the keys for sending go to
+		// the kernel (kTLS), which encrypts sends and SendFile in place of
+		// OpenSSL. AES-GCM and ChaCha20-Poly1305 only. Connections stay with
+		// OpenSSL where the kernel lacks the tls module
+		bool kernelOffload = false;
+	};
+
+	struct Stats {
+		// Completed handshakes, and those that resumed a session
+		std::uint64_t handshakes = 0;
+		std::uint64_t resumed = 0;
+		// Handshakes that failed
+		std::uint64_t failed = 0;
+		// Connections whose sends the kernel encrypts
+		std::uint64_t offloaded = 0;
+		// Sessions in the cache right now
+		std::uint64_t cached = 0;
+
+		double ResumptionRate() const noexcept {
+			return handshakes == 0 ? 0.0 : static_cast<double>(resumed) / handshakes;
+		}
+	};
+
+	// Certificates, settings and the session cache of one side. The sessions
+	// of every connection it serves share it, whichever worker they run on
+	class Context {
+	public:
+		Context() noexcept = default;
+		~Context() noexcept;
+
+		Context(const Context&) = delete;
+		Context& operator=(const Context&) = delete;
+
+		bool Create(const Config& config, Role role) noexcept;
+		bool IsCreated() const noexcept { return m_ctx != nullptr; }
+
+		Role GetRole() const noexcept { return m_role; }
+		const Config& GetConfig() const noexcept { return m_config; }
+		Stats GetStats() const noexcept;
+	private:
+		friend class Session;
+
+		// Client side: keeps the last session a server handed out, for the
+		// next connection to it
+		void StoreSession(const std::string& peer, ssl_session_st* session) noexcept;
+
+		static int OnNewSession(ssl_st* ssl, ssl_session_st* session) noexcept;
+		// Picks the traffic secret kTLS needs out of the key log
+		static void OnKeyLog(const ssl_st* ssl, const char* line) noexcept;
+		static int OnSelectProtocol(
+			ssl_st* ssl,
+			const unsigned char** out,
+			unsigned char* outLength,
+			const unsigned char* in,
+			unsigned int inLength,
+			void* arg
+		) noexcept;
+	private:
+		ssl_ctx_st* m_ctx = nullptr;
+		Role m_role = Role::CLIENT;
+		Config m_config;
+		// ALPN list in its wire format
+		std::string m_protocols;
+
+		mutable std::mutex m_sessionMutex;
+		std::unordered_map<std::string, ssl_session_st*> m_sessions;
+
+		std::atomic<std::uint64_t> m_handshakes = 0;
+		std::atomic<std::uint64_t> m_resumed = 0;
+		std::atomic<std::uint64_t> m_failed = 0;
+		std::atomic<std::uint64_t> m_offloaded = 0;
+	};
+
+	// TLS state of one connection, driven through memory BIOs: received
+	// records are fed in as they complete, and the records it produces are
+	// taken out and queued as regular sends. Nothing in it waits on the
+	// network, so a worker never blocks on it
+	class Session {
+	public:
+		Session(std::shared_ptr<Context> context) noexcept;
+		~Session() noexcept;
+
+		Session(const Session&) = delete;
+		Session& operator=(const Session&) = delete;
+
+		// Starts over for a new connection to or from `peer` ("host:port"),
+		// clients resuming the last session they had with it. `serverName`
+		// is sent as SNI and checked against the certificate; an address is
+		// checked against its IP entries instead. Clients that verify the
+		// peer fail to start without one
+		bool Start(std::string_view serverName, std::string_view peer) noexcept;
+
+		// Records that arrived, their plaintext appended to `plain`. False
+		// once the session ended: closed by the peer, or failed
+		bool Receive(const char* data, std::size_t length, std::string& plain) noexcept;
+		// Plaintext to send; held back until the handshake is through
+		bool Write(std::span<const std::string_view> buffers) noexcept;
+
+		// Output is taken by one thread at a time, so records go out in the
+		// order they were made. BeginOutput is false while another thread
+		// is at it; that one picks up whatever is added meanwhile.
+		// TakeOutput is false once nothing is left, which ends the turn
+		bool BeginOutput() noexcept;
+		bool TakeOutput(IOCP::Buffer& out, IOCP::IOContext*& queued) noexcept;
+		// A send of its own, such as a file, behind the plaintext written
+		// so far; only once the kernel encrypts. TakeOutput hands it back
+		// in its place, `queued` set and `out` left empty
+		bool Queue(IOCP::IOContext* ctx) noexcept;
+
+		// Hands sending over to the kernel once the records made before the
+		// switch are out: nothing taken is still unsent on `socket`, and
+		// nothing is left to take. True when output is waiting since, the
+		// sends held back meanwhile; in the clear once the kernel has them
+		bool Offload(Socket::SockType socket, std::size_t unsent) noexcept;
+		bool IsOffloaded() const noexcept { return m_offloaded.load(std::memory_order_acquire); }
+
+		bool IsSecured() const noexcept { return m_secured.load(std::memory_order_acquire); }
+		// Set once the handshake is through
+		std::string_view GetProtocol() const noexcept { return m_protocol; }
+		bool IsResumed() const noexcept { return m_resumed; }
+		// 0 when the peer closed the session, the error it failed with
+		// otherwise
+		std::uint32_t GetError() const noexcept { return m_error; }
+	private:
+		friend class Context;
+
+		// Runs the handshake as far as the records in hand allow
+		bool Handshake() noexcept;
+		// Ends the session on a failed call, false for it
+		bool Fail() noexcept;
+		// Keys and sequence for the kernel, taken right after the handshake.
+		// TLS 1.3 moves on to fresh keys first, so nothing OpenSSL sent
+		// counts against them
+		bool PrepareOffload() noexcept;
+		void Reset() noexcept;
+	private:
+		std::shared_ptr<Context> m_context;
+
+		std::mutex m_mutex;
+		ssl_st* m_ssl = nullptr;
+		// Records received, and those waiting to go out. Owned by m_ssl
+		bio_st* m_input = nullptr;
+		bio_st* m_output = nullptr;
+		// Plaintext written before the handshake was through
+		std::string m_pending;
+		std::string m_peer;
+		bool m_outputBusy = false;
+		bool m_ended = false;
+
+		enum class OffloadState : std::uint8_t {
+			NONE = 0,
+			// Waiting for the records ahead of the switch to go out; sends
+			// are held back in m_pending
+			PENDING,
+			// The kernel encrypts, output is the plaintext in m_plain.
+			// OpenSSL only decrypts
+			ACTIVE
+		};
+		OffloadState m_offload = OffloadState::NONE;
+		// Traffic secret this side sends with, from the key log (TLS 1.3)
+		std::vector<unsigned char> m_secret;
+		// crypto_info handed to setsockopt(TLS_TX)
+		std::vector<unsigned char> m_kernelInfo;
+		IOCP::Buffer m_plain;
+		// Sends queued behind m_plain, each at the length it had then
+		std::deque<std::pair<std::size_t, IOCP::IOContext*>> m_queued;
+		std::atomic<bool> m_offloaded = false;
+
+		std::atomic<bool> m_secured = false;
+		std::string m_protocol;
+		bool m_resumed = false;
+		std::uint32_t m_error = 0;
+	};
+}
\ No newline at end of file
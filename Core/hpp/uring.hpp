@@ -0,0 +1,167 @@
+#pragma once
+
+#include <Shared/os.hpp>
+
+#if NSA_USE_LINUX
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+namespace NSA::Core::Socket::IOUring {
+	// Thin io_uring wrapper driven through the raw syscalls. Any thread may
+	// submit; only the thread that calls Wait() reaps completions.
+	class Ring {
+	public:
+		constexpr static std::uint16_t BUFFER_GROUP = 0;
+		constexpr static std::uint32_t MAX_COMPLETIONS = 16;
+	public:
+		Ring() noexcept = default;
+		Ring(const Ring&) = delete;
+		Ring& operator=(const Ring&) = delete;
+
+		~Ring() noexcept;
+
+		bool Create(
+			std::uint32_t entries,
+			std::uint32_t bufferCount,
+			std::uint32_t bufferSize
+		) noexcept;
+		void Destroy() noexcept;
+
+		bool IsOpen() const noexcept { return m_fd != -1; }
+
+		// Fills the next SQE through `prepare` and hands it to the kernel. When
+		// called from the reaping thread the SQE rides along with the next
+		// Wait() unless `flush` asks for it to be issued right away
+		template <typename Func>
+		bool Submit(Func&& prepare, bool flush = false) noexcept;
+
+		// Blocks until at least one completion is ready or `timeout`
+		// milliseconds passed (-1 for no limit), then hands every ready CQE
+		// to `handler` in batches of MAX_COMPLETIONS
+		template <typename Func>
+		bool Wait(Func&& handler, int timeout = -1) noexcept;
+
+		// Provided buffers picked by the kernel for IOSQE_BUFFER_SELECT reads
+		char* GetBuffer(std::uint16_t id) noexcept;
+		void ReturnBuffer(std::uint16_t id) noexcept;
+	private:
+		io_uring_sqe* NextSqe() noexcept;
+		bool Flush() noexcept;
+		int Enter(
+			std::uint32_t toSubmit,
+			std::uint32_t minComplete,
+			std::uint32_t flags,
+			int timeout = -1
+		) noexcept;
+	private:
+		static thread_local Ring* t_reaping;
+
+		int m_fd = -1;
+
+		void* m_ringPtr = nullptr;
+		std::size_t m_ringSize = 0;
+		void* m_cqRingPtr = nullptr;
+		std::size_t m_cqRingSize = 0;
+
+		std::uint32_t* m_sqHead = nullptr;
+		std::uint32_t* m_sqTail = nullptr;
+		std::uint32_t* m_sqArray = nullptr;
+		std::uint32_t m_sqMask = 0;
+		std::uint32_t m_sqEntries = 0;
+		io_uring_sqe* m_sqes = nullptr;
+		std::size_t m_sqesSize = 0;
+
+		std::uint32_t* m_cqHead = nullptr;
+		std::uint32_t* m_cqTail = nullptr;
+		std::uint32_t m_cqMask = 0;
+		io_uring_cqe* m_cqes = nullptr;
+
+		io_uring_buf_ring* m_bufferRing = nullptr;
+		std::size_t m_bufferRingSize = 0;
+		std::unique_ptr<char[]> m_buffers;
+		std::uint32_t m_bufferSize = 0;
+		std::uint16_t m_bufferMask = 0;
+		std::uint16_t m_bufferTail = 0;
+
+		std::mutex m_submitMutex;
+		std::uint32_t m_unsubmitted = 0;
+	};
+
+	template <typename Func>
+	bool Ring::Submit(Func&& prepare, bool flush) noexcept {
+		std::lock_guard<std::mutex> lock(m_submitMutex);
+
+		auto sqe = NextSqe();
+		if (!sqe)
+			return false;
+
+		std::memset(sqe, 0, sizeof(*sqe));
+		prepare(sqe);
+
+		auto tail = std::atomic_ref(*m_sqTail).load(std::memory_order_relaxed);
+		m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+		std::atomic_ref(*m_sqTail).store(tail + 1, std::memory_order_release);
+		m_unsubmitted++;
+
+		if (t_reaping == this && !flush)
+			return true;
+
+		return Flush();
+	}
+
+	template <typename Func>
+	bool Ring::Wait(Func&& handler, int timeout) noexcept {
+		t_reaping = this;
+
+		std::uint32_t toSubmit = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_submitMutex);
+			std::swap(toSubmit, m_unsubmitted);
+		}
+
+		auto submitted = Enter(toSubmit, 1, IORING_ENTER_GETEVENTS, timeout);
+		if (submitted < 0) {
+			{
+				std::lock_guard<std::mutex> lock(m_submitMutex);
+				m_unsubmitted += toSubmit;
+			}
+			if (
+				submitted != -EINTR &&
+				submitted != -EAGAIN &&
+				submitted != -EBUSY &&
+				submitted != -ETIME
+			)
+				return false;
+		} else if (static_cast<std::uint32_t>(submitted) < toSubmit) {
+			std::lock_guard<std::mutex> lock(m_submitMutex);
+			m_unsubmitted += toSubmit - static_cast<std::uint32_t>(submitted);
+		}
+
+		io_uring_cqe completions[MAX_COMPLETIONS];
+		while (true) {
+			auto head = std::atomic_ref(*m_cqHead).load(std::memory_order_relaxed);
+			auto tail = std::atomic_ref(*m_cqTail).load(std::memory_order_acquire);
+
+			std::uint32_t count = 0;
+			for (; head != tail && count < MAX_COMPLETIONS; head++, count++)
+				completions[count] = m_cqes[head & m_cqMask];
+
+			// Release the slots before dispatching, handlers may take a while
+			std::atomic_ref(*m_cqHead).store(head, std::memory_order_release);
+
+			for (std::uint32_t i = 0; i < count; i++)
+				handler(completions[i]);
+
+			if (count < MAX_COMPLETIONS)
+				break;
+		}
+		return true;
+	}
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,549 @@
+#include <compression.hpp>
+
+#include <snappy.h>
+#include <zlib.h>
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+
+#include <algorithm>
+#include <chrono>
+#include <print>
+#include <utility>
+
+#if NSA_USE_LINUX
+#	include <cerrno>
+#endif
+
+namespace NSA::Core::Socket::Compression {
+	struct Deflater {
+		Deflater* next = nullptr;
+		z_stream stream{};
+		// -1 until the stream is set up
+		int level = -1;
+
+		~Deflater() noexcept {
+			if (level >= 0)
+				deflateEnd(&stream);
+		}
+		void Reset() noexcept {
+			if (level >= 0)
+				deflateReset(&stream);
+		}
+	};
+
+	struct Inflater {
+		Inflater* next = nullptr;
+		z_stream stream{};
+		bool ready = false;
+
+		~Inflater() noexcept {
+			if (ready)
+				inflateEnd(&stream);
+		}
+		void Reset() noexcept {
+			if (ready)
+				inflateReset(&stream);
+		}
+	};
+
+	namespace {
+#if NSA_USE_WINDOWS
+		constexpr std::uint32_t STREAM_FAILED = WSAECONNABORTED;
+#else
+		constexpr std::uint32_t STREAM_FAILED = ECONNABORTED;
+#endif
+
+		// Opens the offer and the answer, ahead of the version
+		constexpr std::string_view MAGIC = "NSAZ";
+		constexpr std::uint8_t VERSION = 1;
+		// Magic, version and the codec count, or the codec answered
+		constexpr std::size_t NEGOTIATION_SIZE = MAGIC.size() + 2;
+		constexpr std::size_t MAX_CODECS = 8;
+
+		// Frames open with the payload length, big endian, its top bit set
+		// when the payload is compressed
+		constexpr std::size_t FRAME_HEADER = 4;
+		constexpr std::uint32_t COMPRESSED = 0x80000000u;
+		// A full chunk that did not shrink, with room to spare
+		constexpr std::size_t MAX_FRAME = 2 * MAX_CHUNK;
+
+		// zlib streams take a few hundred KiB each
+		constexpr std::uint32_t MAX_POOLED = 32;
+		using DeflaterPool = Pool::FreeList<Deflater, MAX_POOLED>;
+		using InflaterPool = Pool::FreeList<Inflater, MAX_POOLED>;
+
+		Deflater* AcquireDeflater(int level) noexcept {
+			auto deflater = DeflaterPool::Acquire();
+			if (deflater->level == level)
+				return deflater;
+
+			// Raw deflate, the frames carry the lengths
+			auto ok = deflater->level < 0
+				? deflateInit2(&deflater->stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK
+				: deflateParams(&deflater->stream, level, Z_DEFAULT_STRATEGY) == Z_OK;
+			if (!ok) {
+				delete deflater;
+				return nullptr;
+			}
+
+			deflater->level = level;
+			return deflater;
+		}
+
+		Inflater* AcquireInflater() noexcept {
+			auto inflater = InflaterPool::Acquire();
+			if (inflater->ready)
+				return inflater;
+
+			if (inflateInit2(&inflater->stream, -MAX_WBITS) != Z_OK) {
+				delete inflater;
+				return nullptr;
+			}
+
+			inflater->ready = true;
+			return inflater;
+		}
+
+		std::uint64_t Elapsed(std::chrono::steady_clock::time_point since) noexcept {
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - since
+			).count());
+		}
+	}
+
+#pragma region Context
+
+	bool Context::Create(const Config& config) noexcept {
+		if (m_created || config.codecs.size() > MAX_CODECS)
+			return false;
+
+		for (auto it = config.codecs.begin(); it != config.codecs.end(); ++it) {
+			if (*it == Codec::NONE || *it > Codec::BROTLI)
+				return false;
+			if (std::find(config.codecs.begin(), it, *it) != it)
+				return false;
+		}
+
+		if (config.zlibLevel < 1 || config.zlibLevel > 9)
+			return false;
+		if (config.brotliQuality < BROTLI_MIN_QUALITY || config.brotliQuality > BROTLI_MAX_QUALITY)
+			return false;
+		if (config.brotliWindow < BROTLI_MIN_WINDOW_BITS || config.brotliWindow > BROTLI_MAX_WINDOW_BITS)
+			return false;
+
+		m_config = config;
+		m_created = true;
+		return true;
+	}
+
+	Stats Context::GetStats() const noexcept {
+		Stats stats;
+		stats.negotiated = m_negotiated.load(std::memory_order_relaxed);
+		stats.declined = m_declined.load(std::memory_order_relaxed);
+		stats.sent = m_sent.load(std::memory_order_relaxed);
+		stats.sentCompressed = m_sentCompressed.load(std::memory_order_relaxed);
+		stats.receivedCompressed = m_receivedCompressed.load(std::memory_order_relaxed);
+		stats.received = m_received.load(std::memory_order_relaxed);
+		stats.compressTime = m_compressTime.load(std::memory_order_relaxed);
+		stats.decompressTime = m_decompressTime.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+#pragma endregion
+
+#pragma region Session
+
+	Session::Session(std::shared_ptr<Context> context) noexcept
+		: m_context(std::move(context)) {}
+
+	Session::~Session() noexcept {
+		this->Reset();
+	}
+
+	void Session::Reset() noexcept {
+		// zlib streams go back to the pool; brotli has no way to reset its
+		// state, it starts from scratch
+		if (m_deflater)
+			DeflaterPool::Recycle(std::exchange(m_deflater, nullptr));
+		if (m_inflater)
+			InflaterPool::Recycle(std::exchange(m_inflater, nullptr));
+		if (m_encoder)
+			BrotliEncoderDestroyInstance(std::exchange(m_encoder, nullptr));
+		if (m_decoder)
+			BrotliDecoderDestroyInstance(std::exchange(m_decoder, nullptr));
+
+		m_input.clear();
+		m_pending.clear();
+		m_chunk.clear();
+		m_output.clear();
+		m_outputBusy = false;
+
+		m_codec = Codec::NONE;
+		m_negotiated.store(false, std::memory_order_release);
+		m_started = false;
+		m_error = 0;
+	}
+
+	bool Session::Fail() noexcept {
+#ifdef ATS_DEBUG
+		std::println(stderr, "Compression stream failed, codec {}", static_cast<int>(m_codec));
+#endif
+		m_error = STREAM_FAILED;
+		return false;
+	}
+
+	bool Session::Start(Role role) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		this->Reset();
+
+		if (!m_context || !m_context->IsCreated())
+			return this->Fail();
+
+		m_role = role;
+		m_started = true;
+		if (role == Role::SERVER)
+			return true;
+
+		auto& codecs = m_context->m_config.codecs;
+		m_output.insert(m_output.end(), MAGIC.begin(), MAGIC.end());
+		m_output.push_back(static_cast<char>(VERSION));
+		m_output.push_back(static_cast<char>(codecs.size()));
+		for (auto codec : codecs)
+			m_output.push_back(static_cast<char>(codec));
+		return true;
+	}
+
+	bool Session::Negotiate() noexcept {
+		// A peer that does not compress shows with the first byte that
+		// differs
+		auto known = std::min(m_input.size(), MAGIC.size());
+		if (std::string_view(m_input).substr(0, known) != MAGIC.substr(0, known)) {
+			if (m_role == Role::CLIENT)
+				return this->Fail();
+			// Whatever it sent is payload
+			return this->Settle(Codec::NONE);
+		}
+
+		if (m_input.size() < NEGOTIATION_SIZE)
+			return true;
+
+		auto version = static_cast<std::uint8_t>(m_input[MAGIC.size()]);
+		auto value = static_cast<std::uint8_t>(m_input[MAGIC.size() + 1]);
+		auto& codecs = m_context->m_config.codecs;
+
+		if (m_role == Role::CLIENT) {
+			auto codec = static_cast<Codec>(value);
+			if (version != VERSION)
+				return this->Fail();
+			if (codec != Codec::NONE && std::ranges::find(codecs, codec) == codecs.end())
+				return this->Fail();
+
+			m_input.erase(0, NEGOTIATION_SIZE);
+			return this->Settle(codec);
+		}
+
+		if (value > MAX_CODECS)
+			return this->Fail();
+		if (m_input.size() < NEGOTIATION_SIZE + value)
+			return true;
+
+		// The first of our own the client offers too; none across versions
+		auto offered = std::string_view(m_input).substr(NEGOTIATION_SIZE, value);
+		auto codec = Codec::NONE;
+		if (version == VERSION) {
+			for (auto own : codecs) {
+				if (offered.find(static_cast<char>(own)) != std::string_view::npos) {
+					codec = own;
+					break;
+				}
+			}
+		}
+		m_input.erase(0, NEGOTIATION_SIZE + value);
+
+		m_output.insert(m_output.end(), MAGIC.begin(), MAGIC.end());
+		m_output.push_back(static_cast<char>(VERSION));
+		m_output.push_back(static_cast<char>(codec));
+		return this->Settle(codec);
+	}
+
+	bool Session::Settle(Codec codec) noexcept {
+		auto& config = m_context->m_config;
+		if (codec == Codec::ZLIB) {
+			m_deflater = AcquireDeflater(config.zlibLevel);
+			m_inflater = AcquireInflater();
+			if (!m_deflater || !m_inflater)
+				return this->Fail();
+		} else if (codec == Codec::BROTLI) {
+			m_encoder = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+			m_decoder = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+			if (!m_encoder || !m_decoder)
+				return this->Fail();
+
+			BrotliEncoderSetParameter(m_encoder, BROTLI_PARAM_QUALITY, static_cast<std::uint32_t>(config.brotliQuality));
+			BrotliEncoderSetParameter(m_encoder, BROTLI_PARAM_LGWIN, static_cast<std::uint32_t>(config.brotliWindow));
+		}
+
+		m_codec = codec;
+		m_negotiated.store(true, std::memory_order_release);
+		(codec == Codec::NONE ? m_context->m_declined : m_context->m_negotiated)
+			.fetch_add(1, std::memory_order_relaxed);
+
+		auto pending = std::exchange(m_pending, {});
+		if (pending.empty())
+			return true;
+
+		std::string_view view(pending);
+		return this->Frame(std::span<const std::string_view>(&view, 1));
+	}
+
+	bool Session::Receive(const char* data, std::size_t length, std::string& plain) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_started || m_error != 0)
+			return false;
+
+		// Taken in place unless something short of a frame came before
+		std::string_view input(data, length);
+		std::string held;
+		if (!m_input.empty() || !m_negotiated.load(std::memory_order_relaxed)) {
+			m_input.append(data, length);
+			if (!m_negotiated.load(std::memory_order_relaxed)) {
+				if (!this->Negotiate())
+					return false;
+				if (!m_negotiated.load(std::memory_order_relaxed))
+					return true;
+			}
+
+			held = std::exchange(m_input, {});
+			input = held;
+		}
+
+		if (m_codec == Codec::NONE) {
+			plain.append(input);
+			return true;
+		}
+
+		while (input.size() >= FRAME_HEADER) {
+			auto bytes = reinterpret_cast<const unsigned char*>(input.data());
+			auto header = (static_cast<std::uint32_t>(bytes[0]) << 24)
+				| (static_cast<std::uint32_t>(bytes[1]) << 16)
+				| (static_cast<std::uint32_t>(bytes[2]) << 8)
+				| static_cast<std::uint32_t>(bytes[3]);
+
+			auto size = static_cast<std::size_t>(header & ~COMPRESSED);
+			if (size > MAX_FRAME || ((header & COMPRESSED) == 0 && size > MAX_CHUNK))
+				return this->Fail();
+			if (input.size() - FRAME_HEADER < size)
+				break;
+
+			auto payload = input.substr(FRAME_HEADER, size);
+			auto before = plain.size();
+			if ((header & COMPRESSED) == 0)
+				plain.append(payload);
+			else if (!this->Decompress(payload, plain))
+				return false;
+
+			m_context->m_receivedCompressed.fetch_add(FRAME_HEADER + size, std::memory_order_relaxed);
+			m_context->m_received.fetch_add(plain.size() - before, std::memory_order_relaxed);
+			input.remove_prefix(FRAME_HEADER + size);
+		}
+
+		m_input.assign(input);
+		return true;
+	}
+
+	bool Session::Decompress(std::string_view payload, std::string& plain) noexcept {
+		auto begin = std::chrono::steady_clock::now();
+
+		// One byte over a chunk tells a frame that inflates to more
+		auto start = plain.size();
+		auto room = MAX_CHUNK + 1;
+		bool ok = false;
+		plain.resize_and_overwrite(start + room, [&](char* data, std::size_t) noexcept {
+			auto out = data + start;
+			std::size_t produced = 0;
+			switch (m_codec) {
+				case Codec::SNAPPY: {
+					ok = snappy::GetUncompressedLength(payload.data(), payload.size(), &produced)
+						&& produced <= MAX_CHUNK
+						&& snappy::RawUncompress(payload.data(), payload.size(), out);
+					break;
+				} case Codec::ZLIB: {
+					auto& stream = m_inflater->stream;
+					stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload.data()));
+					stream.avail_in = static_cast<uInt>(payload.size());
+					stream.next_out = reinterpret_cast<Bytef*>(out);
+					stream.avail_out = static_cast<uInt>(room);
+
+					auto result = inflate(&stream, Z_SYNC_FLUSH);
+					produced = room - stream.avail_out;
+					ok = (result == Z_OK || result == Z_BUF_ERROR) && stream.avail_in == 0 && produced <= MAX_CHUNK;
+					break;
+				} case Codec::BROTLI: {
+					auto nextIn = reinterpret_cast<const std::uint8_t*>(payload.data());
+					auto availIn = payload.size();
+					auto nextOut = reinterpret_cast<std::uint8_t*>(out);
+					auto availOut = room;
+
+					auto result = BrotliDecoderDecompressStream(m_decoder, &availIn, &nextIn, &availOut, &nextOut, nullptr);
+					produced = room - availOut;
+					ok = result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT && availIn == 0 && produced <= MAX_CHUNK;
+					break;
+				} default:
+					break;
+			}
+			return start + (ok ? produced : 0);
+		});
+
+		m_context->m_decompressTime.fetch_add(Elapsed(begin), std::memory_order_relaxed);
+		if (!ok)
+			return this->Fail();
+		return true;
+	}
+
+	bool Session::Write(std::span<const std::string_view> buffers) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_started || m_error != 0)
+			return false;
+
+		if (!m_negotiated.load(std::memory_order_relaxed)) {
+			for (auto& buffer : buffers)
+				m_pending += buffer;
+			return true;
+		}
+		return this->Frame(buffers);
+	}
+
+	bool Session::Frame(std::span<const std::string_view> buffers) noexcept {
+		if (m_codec == Codec::NONE) {
+			for (auto& buffer : buffers)
+				m_output.insert(m_output.end(), buffer.begin(), buffer.end());
+			return true;
+		}
+
+		for (std::size_t i = 0; i < buffers.size(); i++) {
+			auto buffer = buffers[i];
+			while (!buffer.empty()) {
+				// Compressed in place, unless it has to be joined with the
+				// buffers behind it
+				if (m_chunk.empty() && (buffer.size() >= MAX_CHUNK || i + 1 == buffers.size())) {
+					auto chunk = buffer.substr(0, MAX_CHUNK);
+					if (!this->Compress(chunk))
+						return false;
+					buffer.remove_prefix(chunk.size());
+					continue;
+				}
+
+				auto take = std::min(MAX_CHUNK - m_chunk.size(), buffer.size());
+				m_chunk += buffer.substr(0, take);
+				buffer.remove_prefix(take);
+				if (m_chunk.size() == MAX_CHUNK) {
+					if (!this->Compress(m_chunk))
+						return false;
+					m_chunk.clear();
+				}
+			}
+		}
+
+		if (m_chunk.empty())
+			return true;
+
+		auto ok = this->Compress(m_chunk);
+		m_chunk.clear();
+		return ok;
+	}
+
+	bool Session::Compress(std::string_view chunk) noexcept {
+		auto& config = m_context->m_config;
+		auto start = m_output.size();
+		auto out = start + FRAME_HEADER;
+
+		// Small ones gain nothing, and stay out of the streams
+		auto compressed = chunk.size() >= config.minSize;
+		if (compressed) {
+			auto begin = std::chrono::steady_clock::now();
+			switch (m_codec) {
+				case Codec::SNAPPY: {
+					m_output.resize(out + snappy::MaxCompressedLength(chunk.size()));
+
+					std::size_t length = 0;
+					snappy::RawCompress(chunk.data(), chunk.size(), m_output.data() + out, &length);
+					out += length;
+					// Frames stand on their own, one that did not shrink
+					// goes out as it is
+					compressed = length < chunk.size();
+					break;
+				} case Codec::ZLIB: {
+					auto& stream = m_deflater->stream;
+					stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data()));
+					stream.avail_in = static_cast<uInt>(chunk.size());
+
+					// The flush leaves all of it in the frame, ending on a
+					// byte boundary
+					do {
+						m_output.resize(out + deflateBound(&stream, stream.avail_in) + 16);
+						stream.next_out = reinterpret_cast<Bytef*>(m_output.data() + out);
+						stream.avail_out = static_cast<uInt>(m_output.size() - out);
+
+						auto result = deflate(&stream, Z_SYNC_FLUSH);
+						out = m_output.size() - stream.avail_out;
+						if (result != Z_OK && result != Z_BUF_ERROR)
+							return this->Fail();
+					} while (stream.avail_out == 0);
+					break;
+				} case Codec::BROTLI: {
+					auto nextIn = reinterpret_cast<const std::uint8_t*>(chunk.data());
+					auto availIn = chunk.size();
+					do {
+						m_output.resize(out + BrotliEncoderMaxCompressedSize(availIn) + 16);
+						auto nextOut = reinterpret_cast<std::uint8_t*>(m_output.data() + out);
+						auto availOut = m_output.size() - out;
+
+						if (!BrotliEncoderCompressStream(m_encoder, BROTLI_OPERATION_FLUSH, &availIn, &nextIn, &availOut, &nextOut, nullptr))
+							return this->Fail();
+						out = m_output.size() - availOut;
+					} while (availIn != 0 || BrotliEncoderHasMoreOutput(m_encoder));
+					break;
+				} default:
+					break;
+			}
+			m_context->m_compressTime.fetch_add(Elapsed(begin), std::memory_order_relaxed);
+		}
+
+		if (!compressed) {
+			out = start + FRAME_HEADER;
+			m_output.resize(out);
+			m_output.insert(m_output.end(), chunk.begin(), chunk.end());
+			out += chunk.size();
+		}
+		m_output.resize(out);
+
+		auto header = static_cast<std::uint32_t>(out - start - FRAME_HEADER) | (compressed ? COMPRESSED : 0);
+		m_output[start] = static_cast<char>(header >> 24);
+		m_output[start + 1] = static_cast<char>(header >> 16);
+		m_output[start + 2] = static_cast<char>(header >> 8);
+		m_output[start + 3] = static_cast<char>(header);
+
+		m_context->m_sent.fetch_add(chunk.size(), std::memory_order_relaxed);
+		m_context->m_sentCompressed.fetch_add(out - start, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool Session::BeginOutput() noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return !std::exchange(m_outputBusy, true);
+	}
+
+	bool Session::TakeOutput(IOCP::Buffer& out) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_output.empty()) {
+			m_outputBusy = false;
+			return false;
+		}
+
+		out.swap(m_output);
+		m_output.clear();
+		return true;
+	}
+
+#pragma endregion
+}
\ No newline at end of file
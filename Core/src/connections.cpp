@@ -0,0 +1,407 @@
+#include <connections.hpp>
+
+#include <Shared/utils.hpp>
+
+#include <algorithm>
+#include <print>
+#include <utility>
+
+#if NSA_USE_LINUX
+#	include <cerrno>
+#endif
+
+namespace NSA::Core::Socket {
+	namespace {
+#if NSA_USE_WINDOWS
+		constexpr std::uint32_t CANCELLED = ERROR_OPERATION_ABORTED;
+#else
+		constexpr std::uint32_t CANCELLED = ECANCELED;
+#endif
+
+		std::uint32_t LastError() noexcept {
+#if NSA_USE_WINDOWS
+			return static_cast<std::uint32_t>(WSAGetLastError());
+#else
+			return static_cast<std::uint32_t>(errno);
+#endif
+		}
+	}
+
+	ConnectionPool::ConnectionPool() noexcept {}
+
+	ConnectionPool::ConnectionPool(const Config& config) noexcept : m_config(config) {}
+
+	ConnectionPool::~ConnectionPool() noexcept {
+		std::vector<std::unique_ptr<Connection>> connections;
+		std::vector<Callback> waiting;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_closing = true;
+			// Destroying the connections closes them as well
+			m_unclosed.clear();
+			m_closed.wait(lock, [this] { return m_closers == 0; });
+
+			for (auto& [key, host] : m_hosts) {
+				for (auto& connection : host.connections) {
+					// Still connecting or on the way to a lessee
+					if (connection->callback)
+						waiting.push_back(std::exchange(connection->callback, nullptr));
+					connections.push_back(std::move(connection));
+				}
+				host.connections.clear();
+				host.idle.clear();
+
+				for (auto& waiter : host.waiters)
+					waiting.push_back(std::move(waiter.callback));
+				host.waiters.clear();
+			}
+
+			for (auto& connection : m_retired)
+				connections.push_back(std::move(connection));
+			m_retired.clear();
+		}
+
+		for (auto& callback : waiting)
+			callback(nullptr, CANCELLED);
+
+		// Completions still running take m_mutex, so the pool has to be
+		// intact until the connections are gone
+		connections.clear();
+	}
+
+	bool ConnectionPool::Acquire(
+		std::string_view host,
+		std::uint32_t port,
+		Callback callback
+	) noexcept {
+		this->Reap();
+
+		auto key = Key(host, port);
+		auto now = std::chrono::steady_clock::now();
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_closing)
+			return false;
+
+		auto it = m_hosts.find(key);
+		if (it == m_hosts.end()) {
+			it = m_hosts.emplace(std::move(key), Host{}).first;
+			it->second.host = host;
+			it->second.port = port;
+		}
+		auto& entry = it->second;
+
+		while (!entry.idle.empty()) {
+			auto connection = entry.idle.back();
+			entry.idle.pop_back();
+
+			if (!this->IsHealthy(connection, now)) {
+				m_evicted.fetch_add(1, std::memory_order_relaxed);
+				this->Retire(entry, connection);
+				continue;
+			}
+
+			connection->state = State::LEASED;
+			connection->idle = false;
+			connection->callback = std::move(callback);
+			if (!connection->Lease()) {
+				// Closed since the health check
+				callback = std::move(connection->callback);
+				m_evicted.fetch_add(1, std::memory_order_relaxed);
+				this->Retire(entry, connection);
+				continue;
+			}
+
+			m_hits.fetch_add(1, std::memory_order_relaxed);
+			lock.unlock();
+
+			this->CloseRetired();
+			return true;
+		}
+
+		if (entry.connections.size() >= m_config.maxPerHost) {
+			m_waits.fetch_add(1, std::memory_order_relaxed);
+			entry.waiters.push_back({ std::move(callback), now });
+			lock.unlock();
+
+			this->CloseRetired();
+			return true;
+		}
+
+		std::uint32_t error = 0;
+		bool started = this->Open(entry, callback, error, lock);
+		lock.unlock();
+
+		this->CloseRetired();
+		return started;
+	}
+
+	void ConnectionPool::Release(ClientSocket* socket, bool reusable) noexcept {
+		auto connection = static_cast<Connection*>(socket);
+		auto& host = *connection->host;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_closing || connection->state != State::LEASED)
+			return;
+
+		if (!reusable || !connection->IsOpen()) {
+			this->Retire(host, connection);
+		} else if (!host.waiters.empty()) {
+			// Straight to whoever waits, the connection never goes idle
+			connection->callback = std::move(host.waiters.front().callback);
+			if (connection->Lease()) {
+				this->RecordWait(host.waiters.front().since);
+				host.waiters.pop_front();
+				m_hits.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			host.waiters.front().callback = std::move(connection->callback);
+			this->Retire(host, connection);
+		} else if (host.idle.size() >= m_config.maxIdlePerHost) {
+			this->Retire(host, connection);
+		} else {
+			connection->state = State::IDLE;
+			connection->idleSince = std::chrono::steady_clock::now();
+			connection->idle = true;
+			host.idle.push_back(connection);
+			return;
+		}
+
+		// A connection less, room for one that waits
+		this->Serve(host, lock);
+		this->CloseRetired();
+		this->Reap();
+	}
+
+	void ConnectionPool::Prune() noexcept {
+		auto now = std::chrono::steady_clock::now();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto& [key, host] : m_hosts) {
+				auto idle = host.idle;
+				for (auto connection : idle) {
+					if (this->IsHealthy(connection, now))
+						continue;
+
+					m_evicted.fetch_add(1, std::memory_order_relaxed);
+					this->Retire(host, connection);
+				}
+			}
+		}
+		this->CloseRetired();
+		this->Reap();
+	}
+
+	ConnectionPool::Stats ConnectionPool::GetStats() const noexcept {
+		return {
+			m_hits.load(std::memory_order_relaxed),
+			m_misses.load(std::memory_order_relaxed),
+			m_waits.load(std::memory_order_relaxed),
+			m_failures.load(std::memory_order_relaxed),
+			m_evicted.load(std::memory_order_relaxed),
+			std::chrono::microseconds(m_waitTime.load(std::memory_order_relaxed)),
+			std::chrono::microseconds(m_maxWaitTime.load(std::memory_order_relaxed))
+		};
+	}
+
+	bool ConnectionPool::Open(
+		Host& host,
+		Callback& callback,
+		std::uint32_t& error,
+		std::unique_lock<std::mutex>& lock
+	) noexcept {
+		auto connection = host.connections.emplace_back(new Connection(this, &host)).get();
+		connection->callback = std::move(callback);
+		connection->OnConnect = [this, connection](ClientSocket::on_connect_t&) {
+			this->OnConnected(connection);
+		};
+		connection->OnConnectFailed = [this, connection](ClientSocket::on_connect_failed_t& e) {
+			this->OnFailed(connection, e.error);
+		};
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+
+		auto name = host.host;
+		auto port = host.port;
+		lock.unlock();
+
+		// The handshake may be through before Connect returns
+		bool started = connection->Create(m_config.family) && connection->Connect(name, port);
+		if (!started)
+			error = LastError();
+
+		lock.lock();
+		if (started)
+			return true;
+
+#ifdef ATS_DEBUG
+		std::println(
+			stderr,
+			"Opening a pooled connection to {}:{} failed: {}",
+			name,
+			port,
+			Shared::Utils::GetLastWSAErrorString(error)
+		);
+#endif
+		m_failures.fetch_add(1, std::memory_order_relaxed);
+		callback = std::move(connection->callback);
+		if (!m_closing)
+			this->Retire(host, connection);
+		return false;
+	}
+
+	void ConnectionPool::Serve(Host& host, std::unique_lock<std::mutex>& lock) noexcept {
+		std::vector<std::pair<Callback, std::uint32_t>> failed;
+		while (
+			!m_closing &&
+			!host.waiters.empty() &&
+			host.connections.size() < m_config.maxPerHost
+		) {
+			auto waiter = std::move(host.waiters.front());
+			host.waiters.pop_front();
+			this->RecordWait(waiter.since);
+
+			std::uint32_t error = 0;
+			if (!this->Open(host, waiter.callback, error, lock))
+				failed.emplace_back(std::move(waiter.callback), error);
+		}
+		lock.unlock();
+
+		for (auto& [callback, error] : failed)
+			callback(nullptr, error);
+	}
+
+	void ConnectionPool::Retire(Host& host, Connection* connection) noexcept {
+		std::erase(host.idle, connection);
+		connection->idle = false;
+
+		auto it = std::ranges::find(host.connections, connection, &std::unique_ptr<Connection>::get);
+		if (it == host.connections.end())
+			return;
+
+		m_retired.push_back(std::move(*it));
+		m_unclosed.push_back(connection);
+		host.connections.erase(it);
+	}
+
+	void ConnectionPool::CloseRetired() noexcept {
+		std::vector<Connection*> closing;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_unclosed.empty())
+				return;
+
+			closing.swap(m_unclosed);
+			m_closers++;
+		}
+
+		for (auto connection : closing)
+			connection->Close();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_closers == 0)
+			m_closed.notify_all();
+	}
+
+	bool ConnectionPool::IsHealthy(
+		Connection* connection,
+		std::chrono::steady_clock::time_point now
+	) const noexcept {
+		// Closed by the peer, or by bytes that arrived while idle
+		if (!connection->IsOpen())
+			return false;
+
+		return now - connection->idleSince < m_config.idleTimeout;
+	}
+
+	void ConnectionPool::RecordWait(std::chrono::steady_clock::time_point since) noexcept {
+		auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - since
+		).count();
+
+		m_waitTime.fetch_add(waited, std::memory_order_relaxed);
+
+		auto longest = m_maxWaitTime.load(std::memory_order_relaxed);
+		while (
+			static_cast<std::uint64_t>(waited) > longest &&
+			!m_maxWaitTime.compare_exchange_weak(longest, waited, std::memory_order_relaxed)
+		) {}
+	}
+
+	void ConnectionPool::Reap() noexcept {
+		if (Socket::IsWorkerThread())
+			return;
+
+		std::vector<std::unique_ptr<Connection>> retired;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			// Some are still to be closed, left for the next time
+			if (m_unclosed.empty() && m_closers == 0)
+				retired.swap(m_retired);
+		}
+		// Destructors wait for completions still running, which may be
+		// waiting for m_mutex
+	}
+
+	void ConnectionPool::OnConnected(Connection* connection) noexcept {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		// Cancelled by the destructor
+		if (m_closing)
+			return;
+
+		auto callback = std::exchange(connection->callback, nullptr);
+		connection->state = State::LEASED;
+		lock.unlock();
+
+		callback(connection, 0);
+	}
+
+	void ConnectionPool::OnFailed(Connection* connection, std::uint32_t error) noexcept {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_closing)
+			return;
+
+		auto callback = std::exchange(connection->callback, nullptr);
+		m_failures.fetch_add(1, std::memory_order_relaxed);
+
+		auto& host = *connection->host;
+		this->Retire(host, connection);
+		this->Serve(host, lock);
+		this->CloseRetired();
+
+		callback(nullptr, error);
+	}
+
+	std::string ConnectionPool::Key(std::string_view host, std::uint32_t port) {
+		return std::string(host) + ':' + std::to_string(port);
+	}
+
+	bool ConnectionPool::Connection::Lease() noexcept {
+		auto ctx = Track<ClientContext>(this);
+		if (Socket::Post(ctx, 0))
+			return true;
+
+		Socket::Release(ctx);
+		return false;
+	}
+
+	void ConnectionPool::Connection::OnIOCompleted(
+		IOCP::IOContext* ctx,
+		std::uint32_t bytesTransferred,
+		std::uint32_t error
+	) noexcept {
+		// Posted by Lease, the only context without an operation
+		if (ctx && ctx->operation == IOCP::IOOperation::NONE) {
+			Socket::Release(ctx);
+			pool->OnConnected(this);
+			return;
+		}
+
+		// Nobody asked for these, the connection is out of step with its
+		// peer. Handled like the peer closing it
+		if (ctx && ctx->operation == IOCP::IOOperation::RECV && idle)
+			bytesTransferred = 0;
+
+		ClientSocket::OnIOCompleted(ctx, bytesTransferred, error);
+	}
+}
\ No newline at end of file
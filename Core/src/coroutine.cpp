@@ -0,0 +1,306 @@
+#include <coroutine.hpp>
+
+#include <utility>
+
+#if NSA_USE_LINUX
+#	include <cerrno>
+#endif
+
+namespace NSA::Core::Socket::Coro {
+#pragma region Stream
+
+	Stream::Stream() noexcept : m_ownSocket(new ClientSocket) {
+		m_socket = m_ownSocket.get();
+		m_socket->UseStrand();
+
+		m_socket->OnConnect = [this](ClientSocket::on_connect_t&) {
+			this->OnConnected(0);
+		};
+		m_socket->OnConnectFailed = [this](ClientSocket::on_connect_failed_t& e) {
+			this->OnConnected(e.error);
+		};
+		m_socket->OnData = [this](ClientSocket::on_data_t& e) {
+			this->OnData(e.data);
+		};
+		m_socket->OnDisconnect = [this](ClientSocket::on_disconnect_t&) {
+			this->OnDisconnected();
+		};
+		m_socket->OnBackpressure = [this](ClientSocket::on_backpressure_t&) {
+			this->OnBackpressure();
+		};
+		m_socket->OnWritable = [this](ClientSocket::on_writable_t&) {
+			this->OnWritable();
+		};
+	}
+
+	Stream::Stream(ServerSocket* server, ClientSocket* client) noexcept
+		: m_server(server), m_socket(client) {
+		m_connectDone = true;
+	}
+
+	Stream::~Stream() noexcept {
+		// Its events call back into this object until it is closed
+		if (m_ownSocket)
+			m_ownSocket->Close();
+	}
+
+	void Stream::Close() noexcept {
+		m_socket->Close();
+
+		std::coroutine_handle<> waiter;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+			waiter = this->Wake(m_wait);
+		}
+		if (waiter)
+			waiter.resume();
+	}
+
+	void Stream::OnConnected(std::uint32_t error) noexcept {
+		std::coroutine_handle<> waiter;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_connectDone = true;
+			m_connectError = error;
+			waiter = this->Wake(Wait::CONNECT);
+		}
+		if (waiter)
+			waiter.resume();
+	}
+
+	void Stream::OnData(std::string& data) noexcept {
+		std::coroutine_handle<> waiter;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			// Taken over as it is, unless earlier bytes are still waiting
+			if (m_received.empty())
+				m_received.swap(data);
+			else
+				m_received += data;
+			waiter = this->Wake(Wait::RECV);
+		}
+		if (waiter)
+			waiter.resume();
+	}
+
+	void Stream::OnDisconnected() noexcept {
+		std::coroutine_handle<> waiter;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+			waiter = this->Wake(m_wait);
+		}
+		if (waiter)
+			waiter.resume();
+	}
+
+	void Stream::OnBackpressure() noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_congested = true;
+	}
+
+	void Stream::OnWritable() noexcept {
+		std::coroutine_handle<> waiter;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_congested = false;
+			waiter = this->Wake(Wait::SEND);
+		}
+		if (waiter)
+			waiter.resume();
+	}
+
+	std::coroutine_handle<> Stream::Wake(Wait wait) noexcept {
+		if (wait == Wait::NONE || m_wait != wait)
+			return {};
+
+		m_wait = Wait::NONE;
+		return std::exchange(m_waiter, {});
+	}
+
+	template <typename Ready>
+	bool Stream::Park(std::coroutine_handle<> handle, Wait wait, Ready&& ready) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// Completed in the meantime, the coroutine goes straight on
+		if (ready())
+			return false;
+
+		m_waiter = handle;
+		m_wait = wait;
+		return true;
+	}
+
+	bool Stream::ConnectAwaiter::await_ready() noexcept {
+		auto stream = m_stream;
+		{
+			std::lock_guard<std::mutex> lock(stream->m_mutex);
+			stream->m_connectDone = false;
+			stream->m_connectError = 0;
+			stream->m_closed = false;
+			stream->m_received.clear();
+		}
+
+		auto socket = stream->m_socket;
+		if ((socket->IsOpen() || socket->Create()) && socket->Connect(m_host, m_port))
+			return false;
+
+		std::lock_guard<std::mutex> lock(stream->m_mutex);
+		stream->m_connectDone = true;
+#if NSA_USE_WINDOWS
+		stream->m_connectError = static_cast<std::uint32_t>(WSAGetLastError());
+#else
+		stream->m_connectError = static_cast<std::uint32_t>(errno);
+#endif
+		return true;
+	}
+
+	bool Stream::ConnectAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept {
+		auto stream = m_stream;
+		return stream->Park(handle, Wait::CONNECT, [stream] {
+			return stream->m_connectDone;
+		});
+	}
+
+	std::uint32_t Stream::ConnectAwaiter::await_resume() noexcept {
+		std::lock_guard<std::mutex> lock(m_stream->m_mutex);
+		return m_stream->m_connectError;
+	}
+
+	bool Stream::RecvAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept {
+		auto stream = m_stream;
+		return stream->Park(handle, Wait::RECV, [stream] {
+			return !stream->m_received.empty() || stream->m_closed;
+		});
+	}
+
+	std::string Stream::RecvAwaiter::await_resume() noexcept {
+		std::lock_guard<std::mutex> lock(m_stream->m_mutex);
+		return std::exchange(m_stream->m_received, {});
+	}
+
+	bool Stream::SendAwaiter::await_ready() noexcept {
+		auto stream = m_stream;
+		{
+			std::lock_guard<std::mutex> lock(stream->m_mutex);
+			if (stream->m_closed)
+				return true;
+		}
+
+		// Outside the lock, the send may report backpressure right away
+		m_sent = stream->m_server
+			? stream->m_server->Send(m_data, stream->m_socket)
+			: stream->m_socket->Send(m_data);
+		if (!m_sent)
+			return true;
+
+		std::lock_guard<std::mutex> lock(stream->m_mutex);
+		return !stream->m_congested;
+	}
+
+	bool Stream::SendAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept {
+		auto stream = m_stream;
+		return stream->Park(handle, Wait::SEND, [stream] {
+			return !stream->m_congested || stream->m_closed;
+		});
+	}
+
+#pragma endregion
+
+#pragma region Listener
+
+	Listener::Listener(ServerSocket& server) noexcept : m_server(server) {
+		auto config = m_server.GetAcceptConfig();
+		config.strand = true;
+		m_server.SetAcceptConfig(config);
+
+		m_server.OnConnect = [this](ServerSocket::on_connect_t& e) {
+			std::shared_ptr<Stream> stream(new Stream(&m_server, e.client));
+
+			std::coroutine_handle<> waiter;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_streams[e.client] = stream;
+				m_accepted.push_back(std::move(stream));
+				waiter = std::exchange(m_waiter, {});
+			}
+			if (waiter)
+				waiter.resume();
+		};
+		m_server.OnData = [this](ServerSocket::on_data_t& e) {
+			if (auto stream = this->Find(e.client))
+				stream->OnData(e.data);
+		};
+		m_server.OnDisconnect = [this](ServerSocket::on_disconnect_t& e) {
+			std::shared_ptr<Stream> stream;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto it = m_streams.find(e.client);
+				if (it == m_streams.end())
+					return;
+
+				stream = std::move(it->second);
+				m_streams.erase(it);
+			}
+			stream->OnDisconnected();
+		};
+		m_server.OnBackpressure = [this](ServerSocket::on_backpressure_t& e) {
+			if (auto stream = this->Find(e.client))
+				stream->OnBackpressure();
+		};
+		m_server.OnWritable = [this](ServerSocket::on_writable_t& e) {
+			if (auto stream = this->Find(e.client))
+				stream->OnWritable();
+		};
+	}
+
+	Listener::~Listener() noexcept {
+		m_server.OnConnect = nullptr;
+		m_server.OnData = nullptr;
+		m_server.OnDisconnect = nullptr;
+		m_server.OnBackpressure = nullptr;
+		m_server.OnWritable = nullptr;
+	}
+
+	void Listener::Close() noexcept {
+		m_server.Close();
+
+		std::coroutine_handle<> waiter;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+			waiter = std::exchange(m_waiter, {});
+		}
+		if (waiter)
+			waiter.resume();
+	}
+
+	std::shared_ptr<Stream> Listener::Find(ClientSocket* client) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_streams.find(client);
+		return it == m_streams.end() ? nullptr : it->second;
+	}
+
+	bool Listener::AcceptAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept {
+		auto listener = m_listener;
+		std::lock_guard<std::mutex> lock(listener->m_mutex);
+		if (!listener->m_accepted.empty() || listener->m_closed)
+			return false;
+
+		listener->m_waiter = handle;
+		return true;
+	}
+
+	std::shared_ptr<Stream> Listener::AcceptAwaiter::await_resume() noexcept {
+		auto listener = m_listener;
+		std::lock_guard<std::mutex> lock(listener->m_mutex);
+		if (listener->m_accepted.empty())
+			return nullptr;
+
+		auto stream = std::move(listener->m_accepted.front());
+		listener->m_accepted.pop_front();
+		return stream;
+	}
+
+#pragma endregion
+}
\ No newline at end of file
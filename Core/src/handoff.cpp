@@ -0,0 +1,550 @@
+#include <handoff.hpp>
+
+#include <Shared/utils.hpp>
+
+#include <print>
+#include <span>
+#include <utility>
+
+#if NSA_USE_LINUX
+#	include <sys/eventfd.h>
+#	include <sys/un.h>
+#	include <poll.h>
+#	include <unistd.h>
+#	include <cerrno>
+#	include <cstddef>
+#	include <cstring>
+#endif
+
+namespace NSA::Core::Socket {
+	namespace {
+#if NSA_USE_WINDOWS
+		// Reads or writes all of `length` bytes on an overlapped pipe. Gives
+		// up after `timeout` milliseconds or once `stop` is signalled
+		bool Transfer(
+			HANDLE pipe,
+			void* data,
+			DWORD length,
+			bool write,
+			HANDLE stop,
+			DWORD timeout
+		) noexcept {
+			OVERLAPPED overlapped{};
+			overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+			if (!overlapped.hEvent)
+				return false;
+
+			auto bytes = static_cast<char*>(data);
+			bool done = true;
+			while (length != 0) {
+				ResetEvent(overlapped.hEvent);
+				auto started = write
+					? WriteFile(pipe, bytes, length, nullptr, &overlapped)
+					: ReadFile(pipe, bytes, length, nullptr, &overlapped);
+				if (!started && GetLastError() != ERROR_IO_PENDING) {
+					done = false;
+					break;
+				}
+
+				DWORD transferred = 0;
+				HANDLE events[] = { overlapped.hEvent, stop };
+				if (WaitForMultipleObjects(stop ? 2 : 1, events, FALSE, timeout) != WAIT_OBJECT_0) {
+					CancelIoEx(pipe, &overlapped);
+					GetOverlappedResult(pipe, &overlapped, &transferred, TRUE);
+					done = false;
+					break;
+				}
+
+				if (!GetOverlappedResult(pipe, &overlapped, &transferred, FALSE) || transferred == 0) {
+					done = false;
+					break;
+				}
+				bytes += transferred;
+				length -= transferred;
+			}
+
+			CloseHandle(overlapped.hEvent);
+			return done;
+		}
+#else
+		// Most descriptors one SCM_RIGHTS message carries (SCM_MAX_FD)
+		constexpr std::size_t MAX_DESCRIPTORS = 253;
+
+		// Abstract socket address, gone with the socket instead of lingering
+		// in the file system
+		socklen_t ChannelAddress(const std::string& name, sockaddr_un& address) noexcept {
+			address = {};
+			address.sun_family = AF_UNIX;
+			auto length = std::min(name.size(), sizeof(address.sun_path) - 1);
+			memcpy(address.sun_path + 1, name.data(), length);
+			return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + length);
+		}
+
+		// The other end is process `pid`, running as the same user
+		bool IsPeer(int channel, std::uint32_t pid) noexcept {
+			ucred peer{};
+			socklen_t length = sizeof(peer);
+			if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &peer, &length) == -1)
+				return false;
+
+			return static_cast<std::uint32_t>(peer.pid) == pid && peer.uid == getuid();
+		}
+
+		// One message of the descriptor count, the descriptors riding along
+		bool SendDescriptors(int channel, std::span<const int> descriptors) noexcept {
+			if (descriptors.size() > MAX_DESCRIPTORS)
+				return false;
+
+			auto count = static_cast<std::uint32_t>(descriptors.size());
+			iovec iov{ &count, sizeof(count) };
+
+			std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_DESCRIPTORS));
+			msghdr message{};
+			message.msg_iov = &iov;
+			message.msg_iovlen = 1;
+			if (count != 0) {
+				message.msg_control = control.data();
+				message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+				auto header = CMSG_FIRSTHDR(&message);
+				header->cmsg_level = SOL_SOCKET;
+				header->cmsg_type = SCM_RIGHTS;
+				header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+				memcpy(CMSG_DATA(header), descriptors.data(), sizeof(int) * count);
+			}
+
+			return sendmsg(channel, &message, MSG_NOSIGNAL) == sizeof(count);
+		}
+
+		bool ReceiveDescriptors(int channel, std::vector<int>& descriptors) noexcept {
+			std::uint32_t count = 0;
+			iovec iov{ &count, sizeof(count) };
+
+			std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_DESCRIPTORS));
+			msghdr message{};
+			message.msg_iov = &iov;
+			message.msg_iovlen = 1;
+			message.msg_control = control.data();
+			message.msg_controllen = control.size();
+
+			auto received = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+
+			// Whatever arrived is ours to close, even in a bad message
+			for (auto header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+				if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+					continue;
+
+				auto first = descriptors.size();
+				descriptors.resize(first + (header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+				memcpy(
+					descriptors.data() + first,
+					CMSG_DATA(header),
+					(descriptors.size() - first) * sizeof(int)
+				);
+			}
+
+			return received == sizeof(count)
+				&& !(message.msg_flags & MSG_CTRUNC)
+				&& descriptors.size() == count;
+		}
+#endif
+	}
+
+	Handoff::Handoff() noexcept {
+#if NSA_USE_WINDOWS
+		m_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+#else
+		m_stop = eventfd(0, EFD_CLOEXEC);
+#endif
+	}
+
+	Handoff::~Handoff() noexcept {
+#if NSA_USE_WINDOWS
+		if (m_stop)
+			SetEvent(m_stop);
+#else
+		if (m_stop != -1)
+			eventfd_write(m_stop, 1);
+#endif
+
+		if (m_thread.joinable())
+			m_thread.join();
+
+#if NSA_USE_WINDOWS
+		if (m_stop)
+			CloseHandle(m_stop);
+#else
+		if (m_listener != -1)
+			close(m_listener);
+		if (m_stop != -1)
+			close(m_stop);
+#endif
+	}
+
+	bool Handoff::Offer(std::vector<ServerSocket*> servers) noexcept {
+		if (m_thread.joinable() || servers.empty())
+			return false;
+
+#if NSA_USE_WINDOWS
+		if (!m_stop)
+			return false;
+#else
+		if (m_stop == -1)
+			return false;
+
+		// Taken already means another Handoff of this process offers
+		sockaddr_un address;
+		auto length = ChannelAddress(Handoff::ChannelName(getpid()), address);
+
+		m_listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (
+			m_listener == -1 ||
+			bind(m_listener, reinterpret_cast<sockaddr*>(&address), length) == -1 ||
+			listen(m_listener, 1) == -1
+		) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"Handoff channel failed: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			if (m_listener != -1)
+				close(m_listener);
+			m_listener = -1;
+			return false;
+		}
+#endif
+
+		m_servers = std::move(servers);
+		m_thread = std::thread(&Handoff::Run, this);
+		return true;
+	}
+
+#if NSA_USE_WINDOWS
+	void Handoff::Run() noexcept {
+		auto name = R"(\\.\pipe\)" + Handoff::ChannelName(GetCurrentProcessId());
+
+		OVERLAPPED overlapped{};
+		overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		if (!overlapped.hEvent)
+			return;
+
+		while (WaitForSingleObject(m_stop, 0) != WAIT_OBJECT_0) {
+			auto pipe = CreateNamedPipeA(
+				name.c_str(),
+				PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+				PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+				1,
+				4096,
+				4096,
+				0,
+				nullptr
+			);
+			if (pipe == INVALID_HANDLE_VALUE) {
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"CreateNamedPipeA failed: {}",
+					Shared::Utils::GetLastErrorString()
+				);
+#endif
+				break;
+			}
+
+			ResetEvent(overlapped.hEvent);
+			bool connected = ConnectNamedPipe(pipe, &overlapped) != FALSE;
+			if (!connected) {
+				auto error = GetLastError();
+				if (error == ERROR_PIPE_CONNECTED) {
+					connected = true;
+				} else if (error == ERROR_IO_PENDING) {
+					DWORD unused = 0;
+					HANDLE events[] = { overlapped.hEvent, m_stop };
+					if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0) {
+						connected = GetOverlappedResult(pipe, &overlapped, &unused, FALSE) != FALSE;
+					} else {
+						CancelIoEx(pipe, &overlapped);
+						GetOverlappedResult(pipe, &overlapped, &unused, TRUE);
+					}
+				}
+			}
+
+			bool handedOff = connected && this->Serve(pipe);
+			if (connected)
+				DisconnectNamedPipe(pipe);
+			CloseHandle(pipe);
+
+			if (handedOff)
+				break;
+		}
+
+		CloseHandle(overlapped.hEvent);
+	}
+#else
+	void Handoff::Run() noexcept {
+		while (true) {
+			pollfd events[] = {
+				{ m_listener, POLLIN, 0 },
+				{ m_stop, POLLIN, 0 }
+			};
+			if (poll(events, 2, -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			if (events[1].revents != 0)
+				break;
+
+			auto channel = accept4(m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (channel == -1)
+				continue;
+
+			timeval timeout{ static_cast<time_t>(EXCHANGE_TIMEOUT.count()), 0 };
+			setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(channel, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+			bool handedOff = this->Serve(channel);
+			close(channel);
+
+			if (handedOff)
+				break;
+		}
+
+		// Nothing left to offer
+		close(m_listener);
+		m_listener = -1;
+	}
+#endif
+
+	bool Handoff::Serve(Channel channel) noexcept {
+		// The successor introduces itself first, which takes write access
+		// to the channel, and has to be the process on the other end
+		std::uint32_t pid = 0;
+		std::uint8_t ready = 0;
+		std::uint8_t released = 1;
+		auto count = static_cast<std::uint32_t>(m_servers.size());
+
+#if NSA_USE_WINDOWS
+		auto timeout = static_cast<DWORD>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(EXCHANGE_TIMEOUT).count()
+		);
+
+		ULONG client = 0;
+		if (
+			!Transfer(channel, &pid, sizeof(pid), false, m_stop, timeout) ||
+			!GetNamedPipeClientProcessId(channel, &client) ||
+			client != pid
+		)
+			return false;
+
+		if (!Transfer(channel, &count, sizeof(count), true, m_stop, timeout))
+			return false;
+
+		for (auto server : m_servers) {
+			auto sockets = server->GetListenSockets();
+			auto listeners = static_cast<std::uint32_t>(sockets.size());
+			if (!Transfer(channel, &listeners, sizeof(listeners), true, m_stop, timeout))
+				return false;
+
+			// Usable by that process only
+			for (auto socket : sockets) {
+				WSAPROTOCOL_INFOW info{};
+				if (WSADuplicateSocketW(socket, pid, &info) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"WSADuplicateSocketW failed: {}",
+						Shared::Utils::GetLastWSAErrorString()
+					);
+#endif
+					return false;
+				}
+
+				if (!Transfer(channel, &info, sizeof(info), true, m_stop, timeout))
+					return false;
+			}
+		}
+
+		if (!Transfer(channel, &ready, sizeof(ready), false, m_stop, timeout) || ready != 1)
+			return false;
+
+		this->Release();
+		Transfer(channel, &released, sizeof(released), true, m_stop, timeout);
+#else
+		if (recv(channel, &pid, sizeof(pid), 0) != sizeof(pid) || !IsPeer(channel, pid))
+			return false;
+
+		if (send(channel, &count, sizeof(count), MSG_NOSIGNAL) != sizeof(count))
+			return false;
+
+		for (auto server : m_servers) {
+			if (!SendDescriptors(channel, server->GetListenSockets()))
+				return false;
+		}
+
+		if (recv(channel, &ready, sizeof(ready), 0) != sizeof(ready) || ready != 1)
+			return false;
+
+		this->Release();
+		send(channel, &released, sizeof(released), MSG_NOSIGNAL);
+#endif
+
+		OnHandedOff({ pid });
+		return true;
+	}
+
+	void Handoff::Release() noexcept {
+		// Connections arriving from now on wait in the backlog for the
+		// successor, the listeners themselves never go away
+		for (auto server : m_servers)
+			server->Detach();
+	}
+
+	bool Handoff::Take(std::uint32_t pid, const std::vector<ServerSocket*>& servers) noexcept {
+		if (servers.empty())
+			return false;
+
+		std::vector<std::vector<Socket::SockType>> listeners(servers.size());
+		std::uint32_t count = 0;
+		bool received = false;
+
+#if NSA_USE_WINDOWS
+		auto timeout = static_cast<DWORD>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(EXCHANGE_TIMEOUT).count()
+		);
+		auto name = R"(\\.\pipe\)" + Handoff::ChannelName(pid);
+
+		auto open = [&]() {
+			return CreateFileA(
+				name.c_str(),
+				GENERIC_READ | GENERIC_WRITE,
+				0,
+				nullptr,
+				OPEN_EXISTING,
+				FILE_FLAG_OVERLAPPED,
+				nullptr
+			);
+		};
+		auto channel = open();
+		if (channel == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipeA(name.c_str(), timeout))
+			channel = open();
+		if (channel == INVALID_HANDLE_VALUE)
+			return false;
+
+		auto self = static_cast<std::uint32_t>(GetCurrentProcessId());
+		ULONG server = 0;
+		received =
+			GetNamedPipeServerProcessId(channel, &server) &&
+			server == pid &&
+			Transfer(channel, &self, sizeof(self), true, nullptr, timeout) &&
+			Transfer(channel, &count, sizeof(count), false, nullptr, timeout) &&
+			count == servers.size();
+
+		for (std::size_t i = 0; received && i < servers.size(); i++) {
+			std::uint32_t sockets = 0;
+			received = Transfer(channel, &sockets, sizeof(sockets), false, nullptr, timeout);
+
+			for (std::uint32_t j = 0; received && j < sockets; j++) {
+				WSAPROTOCOL_INFOW info{};
+				received = Transfer(channel, &info, sizeof(info), false, nullptr, timeout);
+				if (!received)
+					break;
+
+				auto socket = WSASocketW(
+					FROM_PROTOCOL_INFO,
+					FROM_PROTOCOL_INFO,
+					FROM_PROTOCOL_INFO,
+					&info,
+					0,
+					WSA_FLAG_OVERLAPPED
+				);
+				received = socket != INVALID_SOCKET;
+				if (received)
+					listeners[i].push_back(socket);
+			}
+		}
+
+		// Ready to take over, then released by the old instance
+		auto release = [&] {
+			std::uint8_t ready = 1, released = 0;
+			return
+				Transfer(channel, &ready, sizeof(ready), true, nullptr, timeout) &&
+				Transfer(channel, &released, sizeof(released), false, nullptr, timeout) &&
+				released == 1;
+		};
+#else
+		sockaddr_un address;
+		auto length = ChannelAddress(Handoff::ChannelName(pid), address);
+
+		auto channel = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (channel == -1)
+			return false;
+
+		timeval timeout{ static_cast<time_t>(EXCHANGE_TIMEOUT.count()), 0 };
+		setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(channel, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		// Anyone may bind an abstract name, so the owner is checked as well
+		auto self = static_cast<std::uint32_t>(getpid());
+		received =
+			connect(channel, reinterpret_cast<sockaddr*>(&address), length) != -1 &&
+			IsPeer(channel, pid) &&
+			send(channel, &self, sizeof(self), MSG_NOSIGNAL) == sizeof(self) &&
+			recv(channel, &count, sizeof(count), 0) == sizeof(count) &&
+			count == servers.size();
+
+		for (std::size_t i = 0; received && i < servers.size(); i++)
+			received = ReceiveDescriptors(channel, listeners[i]);
+
+		auto release = [&] {
+			std::uint8_t ready = 1, released = 0;
+			return
+				send(channel, &ready, sizeof(ready), MSG_NOSIGNAL) == sizeof(ready) &&
+				recv(channel, &released, sizeof(released), 0) == sizeof(released) &&
+				released == 1;
+		};
+#endif
+
+		// The old instance stops accepting before any accept is armed here,
+		// so no connection is handed to a waiter about to go away. Those
+		// arriving in between wait in the backlog
+		bool released = received && release();
+
+		// Adopt owns the descriptors it is given, whatever it returns. Past
+		// the release a failure leaves the listeners to nobody
+		std::size_t adopted = 0;
+		if (released) {
+			while (adopted < servers.size() && servers[adopted]->Adopt(listeners[adopted]))
+				adopted++;
+		}
+
+		bool taken = adopted == servers.size();
+		if (!taken) {
+			for (std::size_t i = 0; i < adopted; i++)
+				servers[i]->Detach();
+
+			auto first = released ? adopted + 1 : 0;
+			for (auto i = first; i < servers.size(); i++) {
+				for (auto socket : listeners[i]) {
+#if NSA_USE_WINDOWS
+					closesocket(socket);
+#else
+					close(socket);
+#endif
+				}
+			}
+		}
+
+#if NSA_USE_WINDOWS
+		CloseHandle(channel);
+#else
+		close(channel);
+#endif
+		return taken;
+	}
+
+	std::string Handoff::ChannelName(std::uint32_t pid) {
+		return "NSA-handoff-" + std::to_string(pid);
+	}
+}
\ No newline at end of file
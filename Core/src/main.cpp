@@ -1,8 +1,11 @@
 #include <main.hpp>
 #include <socket.hpp>
+#include <handoff.hpp>
 #include <event.hpp>
 
 #include <WS2tcpip.h>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <print>
 #include <string>
@@ -55,20 +58,36 @@ CORE_API void EntryPoint() {
         sock.OnListening = [](Socket::ServerSocket::on_listening_t& event) {
             std::println("Server listening on {}:{}", event.host, event.port);
 		};
-        sock.Create();
-        sock.Listen("127.0.0.1", 12345);
-    }
-    /*
-    if (it != procs.end()) {
-        // Found another process with the same name
 
-    } else {
+        // Another instance is running, this one replaces it without the
+        // listener ever going away
+        bool taken = it != procs.end() && Socket::Handoff::Take(it->GetPID(), { &sock });
+        if (!taken) {
+            sock.Create();
+            sock.Listen("127.0.0.1", 12345);
+        }
+
+        std::atomic<bool> handedOff = false;
+        Socket::Handoff handoff;
+        handoff.OnHandedOff = [&](Socket::Handoff::on_handed_off_t& event) {
+            std::println("Listener handed over to {}, draining", event.pid);
+            handedOff = true;
+        };
+        handoff.Offer({ &sock });
+
+        while (!handedOff)
+            Sleep(1000);
 
+        // Gone once the clients are, or the slow ones are cut off
+        constexpr auto DRAIN_TIMEOUT = std::chrono::seconds(30);
+        auto deadline = std::chrono::steady_clock::now() + DRAIN_TIMEOUT;
+        while (sock.GetConnectionCount() != 0 && std::chrono::steady_clock::now() < deadline)
+            Sleep(100);
+        return;
     }
-    */
 
 	while (true) {
 		Sleep(1000);
         ;
 	}
-}
\ No newline at end of file
+}
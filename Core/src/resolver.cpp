@@ -0,0 +1,325 @@
+#include <resolver.hpp>
+
+#include <Shared/utils.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <print>
+#include <system_error>
+#include <utility>
+
+#if NSA_USE_WINDOWS
+#	include <WS2tcpip.h>
+#else
+#	include <cerrno>
+#	include <cstring>
+#endif
+
+namespace NSA::Core::Socket::DNS {
+	Config Resolver::gs_config = {};
+	std::mutex Resolver::gs_mutex;
+	std::condition_variable Resolver::gs_wake;
+	std::condition_variable Resolver::gs_dispatched;
+	std::unordered_map<std::string, Resolver::Entry> Resolver::gs_cache = {};
+	std::deque<std::string> Resolver::gs_queue = {};
+	std::vector<Resolver::Ticket> Resolver::gs_dispatching = {};
+	Resolver::Ticket Resolver::gs_nextTicket = 1;
+	bool Resolver::gs_stopping = false;
+	std::atomic<std::uint64_t> Resolver::gs_hits = 0;
+	std::atomic<std::uint64_t> Resolver::gs_negativeHits = 0;
+	std::atomic<std::uint64_t> Resolver::gs_misses = 0;
+	std::atomic<std::uint64_t> Resolver::gs_joined = 0;
+	Resolver::Threads Resolver::gs_threads = {};
+
+	Resolver::Threads::~Threads() noexcept {
+		{
+			std::lock_guard<std::mutex> lock(gs_mutex);
+			gs_stopping = true;
+		}
+		gs_wake.notify_all();
+
+		for (auto& thread : threads) {
+			if (thread.joinable())
+				thread.join();
+		}
+	}
+
+	bool Resolver::SetConfig(const Config& config) noexcept {
+		if (config.threads == 0 || config.maxEntries == 0)
+			return false;
+
+		std::lock_guard<std::mutex> lock(gs_mutex);
+		if (!gs_threads.threads.empty())
+			return false;
+
+		gs_config = config;
+		return true;
+	}
+
+	std::optional<Answer> Resolver::Lookup(
+		std::string_view host,
+		Socket::AddressFamily family
+	) noexcept {
+		auto key = Key(host, family);
+
+		std::lock_guard<std::mutex> lock(gs_mutex);
+		auto it = gs_cache.find(key);
+		if (it == gs_cache.end() || it->second.pending)
+			return std::nullopt;
+
+		if (it->second.expires <= std::chrono::steady_clock::now())
+			return std::nullopt;
+
+		gs_hits.fetch_add(1, std::memory_order_relaxed);
+		if (it->second.answer.error != 0)
+			gs_negativeHits.fetch_add(1, std::memory_order_relaxed);
+		return it->second.answer;
+	}
+
+	Resolver::Ticket Resolver::Resolve(
+		std::string_view host,
+		Socket::AddressFamily family,
+		Callback callback
+	) noexcept {
+		auto key = Key(host, family);
+		auto now = std::chrono::steady_clock::now();
+
+		std::unique_lock<std::mutex> lock(gs_mutex);
+		if (gs_stopping)
+			return 0;
+
+		auto ticket = gs_nextTicket++;
+
+		auto it = gs_cache.find(key);
+		if (it != gs_cache.end()) {
+			auto& entry = it->second;
+			if (entry.pending) {
+				gs_joined.fetch_add(1, std::memory_order_relaxed);
+				entry.waiters.push_back({ ticket, std::move(callback) });
+				return ticket;
+			}
+
+			if (entry.expires > now) {
+				gs_hits.fetch_add(1, std::memory_order_relaxed);
+				if (entry.answer.error != 0)
+					gs_negativeHits.fetch_add(1, std::memory_order_relaxed);
+
+				auto answer = entry.answer;
+				lock.unlock();
+
+				callback(answer);
+				return ticket;
+			}
+
+			// Expired, looked up again in place
+			entry.pending = true;
+		} else {
+			if (gs_cache.size() >= gs_config.maxEntries)
+				Evict(now);
+
+			it = gs_cache.emplace(std::move(key), Entry{}).first;
+			it->second.host = host;
+			it->second.family = family;
+		}
+
+		gs_misses.fetch_add(1, std::memory_order_relaxed);
+		it->second.waiters.push_back({ ticket, std::move(callback) });
+		gs_queue.push_back(it->first);
+
+		// Threads are started as lookups first need them
+		if (gs_threads.threads.size() < gs_config.threads) {
+			try {
+				gs_threads.threads.emplace_back(Resolver::ResolverThread);
+			} catch ([[maybe_unused]] const std::system_error& e) {
+#ifdef ATS_DEBUG
+				std::println(stderr, "Starting a resolver thread failed: {}", e.what());
+#endif
+				// The lookup waits for one of the running threads
+				if (gs_threads.threads.empty()) {
+					gs_queue.pop_back();
+					gs_cache.erase(it);
+					return 0;
+				}
+			}
+		}
+
+		lock.unlock();
+		gs_wake.notify_one();
+		return ticket;
+	}
+
+	bool Resolver::Cancel(Ticket ticket) noexcept {
+		if (ticket == 0)
+			return false;
+
+		std::unique_lock<std::mutex> lock(gs_mutex);
+		for (auto& [key, entry] : gs_cache) {
+			if (!entry.pending)
+				continue;
+
+			auto waiter = std::ranges::find(entry.waiters, ticket, &Waiter::ticket);
+			if (waiter != entry.waiters.end()) {
+				entry.waiters.erase(waiter);
+				return true;
+			}
+		}
+
+		// Whoever cancels goes on to free what the callback touches
+		gs_dispatched.wait(lock, [ticket] {
+			return std::ranges::find(gs_dispatching, ticket) == gs_dispatching.end();
+		});
+		return false;
+	}
+
+	Stats Resolver::GetStats() noexcept {
+		return {
+			gs_hits.load(std::memory_order_relaxed),
+			gs_negativeHits.load(std::memory_order_relaxed),
+			gs_misses.load(std::memory_order_relaxed),
+			gs_joined.load(std::memory_order_relaxed)
+		};
+	}
+
+	void Resolver::ResolverThread() noexcept {
+		std::unique_lock<std::mutex> lock(gs_mutex);
+		while (true) {
+			gs_wake.wait(lock, [] { return gs_stopping || !gs_queue.empty(); });
+			if (gs_stopping)
+				break;
+
+			auto key = std::move(gs_queue.front());
+			gs_queue.pop_front();
+
+			auto& pending = gs_cache.at(key);
+			auto host = pending.host;
+			auto family = pending.family;
+			lock.unlock();
+
+			auto answer = Resolver::Query(host, family);
+			auto ttl = answer.error == 0 ? gs_config.positiveTtl : gs_config.negativeTtl;
+
+			lock.lock();
+			// Pending entries are never evicted, so it is still there
+			auto& entry = gs_cache.at(key);
+			entry.answer = std::move(answer);
+			entry.expires = std::chrono::steady_clock::now() + ttl;
+			entry.pending = false;
+
+			auto waiters = std::move(entry.waiters);
+			entry.waiters.clear();
+			for (auto& waiter : waiters)
+				gs_dispatching.push_back(waiter.ticket);
+
+			auto result = entry.answer;
+			lock.unlock();
+
+			for (auto& waiter : waiters) {
+				waiter.callback(result);
+
+				{
+					std::lock_guard<std::mutex> guard(gs_mutex);
+					std::erase(gs_dispatching, waiter.ticket);
+				}
+				gs_dispatched.notify_all();
+			}
+
+			lock.lock();
+		}
+	}
+
+	Answer Resolver::Query(const std::string& host, Socket::AddressFamily family) noexcept {
+		addrinfo hints{};
+		hints.ai_family = std::to_underlying(family);
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		// A dual-stack socket reaches IPv4 hosts through mapped addresses
+		if (family == Socket::AddressFamily::IPV6)
+			hints.ai_flags = AI_V4MAPPED | AI_ALL;
+
+		Answer answer;
+
+		addrinfo* result = nullptr;
+		auto ret = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+		if (ret != 0) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"getaddrinfo failed for {}: {}",
+				host,
+#if NSA_USE_WINDOWS
+				Shared::Utils::GetLastErrorString(ret)
+#else
+				gai_strerror(ret)
+#endif
+			);
+#endif
+
+#if NSA_USE_WINDOWS
+			answer.error = static_cast<std::uint32_t>(ret);
+#else
+			// In the errno range the completions report errors in
+			switch (ret) {
+				case EAI_SYSTEM:
+					answer.error = static_cast<std::uint32_t>(errno);
+					break;
+				case EAI_AGAIN:
+					answer.error = EAGAIN;
+					break;
+				case EAI_MEMORY:
+					answer.error = ENOMEM;
+					break;
+				default:
+					answer.error = EHOSTUNREACH;
+					break;
+			}
+#endif
+			return answer;
+		}
+
+		for (auto ai = result; ai; ai = ai->ai_next) {
+			if (ai->ai_addrlen > sizeof(sockaddr_storage))
+				continue;
+
+			IOCP::Address address;
+			memcpy(&address.storage, ai->ai_addr, ai->ai_addrlen);
+			address.length = static_cast<decltype(address.length)>(ai->ai_addrlen);
+
+			// Listed once per socket type on some systems
+			if (std::ranges::find(answer.addresses, address) == answer.addresses.end())
+				answer.addresses.push_back(address);
+		}
+		freeaddrinfo(result);
+
+		if (answer.addresses.empty())
+			answer.error = EHOSTUNREACH;
+		return answer;
+	}
+
+	std::string Resolver::Key(std::string_view host, Socket::AddressFamily family) {
+		// Names are case insensitive
+		std::string key(host.size(), '\0');
+		std::ranges::transform(host, key.begin(), [](unsigned char c) {
+			return static_cast<char>(std::tolower(c));
+		});
+		return key + '/' + std::to_string(std::to_underlying(family));
+	}
+
+	void Resolver::Evict(std::chrono::steady_clock::time_point now) noexcept {
+		std::erase_if(gs_cache, [now](const auto& item) {
+			return !item.second.pending && item.second.expires <= now;
+		});
+		if (gs_cache.size() < gs_config.maxEntries)
+			return;
+
+		auto oldest = gs_cache.end();
+		for (auto it = gs_cache.begin(); it != gs_cache.end(); ++it) {
+			if (it->second.pending)
+				continue;
+
+			if (oldest == gs_cache.end() || it->second.expires < oldest->second.expires)
+				oldest = it;
+		}
+		if (oldest != gs_cache.end())
+			gs_cache.erase(oldest);
+	}
+}
\ No newline at end of file
@@ -1,25 +1,64 @@
 #include <socket.hpp>
+#include <resolver.hpp>
+#include <timer.hpp>
+#include <tls.hpp>
+#include <compression.hpp>
 
 #include <Shared/os.hpp>
 #include <Shared/utils.hpp>
 
 #include <algorithm>
+#include <utility>
 #include <thread>
 #include <print>
 #include <cassert>
-#include <WS2tcpip.h>
 
-#pragma comment(lib, "ws2_32.lib")
+#if NSA_USE_WINDOWS
+#	include <WS2tcpip.h>
+
+#	pragma comment(lib, "ws2_32.lib")
+#else
+#	include <sys/eventfd.h>
+#	include <sys/sendfile.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <csignal>
+#	include <sched.h>
+#	include <pthread.h>
+#	include <arpa/inet.h>
+#	include <netinet/tcp.h>
+#	include <netinet/udp.h>
+#	include <linux/filter.h>
+#	include <poll.h>
+#	include <unistd.h>
+#	include <cerrno>
+#	include <cstring>
+#endif
 
 namespace NSA::Core::Socket {
 #pragma region Static member initialization
-	HANDLE Socket::gs_globalIOCP = INVALID_HANDLE_VALUE;
+#if NSA_USE_WINDOWS
+	std::vector<HANDLE> Socket::gs_ports = {};
 	std::vector<HANDLE> Socket::gs_workers = {};
+	Socket::Engine Socket::gs_engine = Socket::Engine::IOCP;
+#else
+	std::vector<int> Socket::gs_epolls = {};
+	int Socket::gs_wakeEvent = INVALID_SOCKET;
+	std::vector<std::thread> Socket::gs_workers = {};
+	std::vector<std::unique_ptr<IOUring::Ring>> Socket::gs_rings = {};
+	std::vector<std::unique_ptr<Socket::PostQueue>> Socket::gs_postQueues = {};
+	Socket::Engine Socket::gs_engine = Socket::Engine::EPOLL;
+#endif
+	std::atomic<std::uint32_t> Socket::gs_drained = 0;
+	Socket::WorkerConfig Socket::gs_workerConfig = {};
+	Socket::SendQueueConfig Socket::gs_sendQueueConfig = {};
+	std::vector<std::atomic<std::uint32_t>> Socket::gs_queueLoad = {};
+	std::atomic<std::uint32_t> Socket::gs_nextQueue = 0;
 	std::mutex Socket::gs_globalMutex;
-	std::mutex Socket::gs_bufferMutex;
 	std::atomic<std::uint32_t> Socket::gs_socketCount = 0;
 	std::atomic<bool> Socket::gs_workersRunning = false;
-	const auto Socket::gs_shutdownKey = Shared::Utils::RandomInRange<std::uint64_t>
+	std::vector<std::unique_ptr<Timer::Wheel>> Socket::gs_wheels = {};
+	const std::uint64_t Socket::gs_shutdownKey = Shared::Utils::RandomInRange<std::uint64_t>
 	(
 		0x1000000000000000,
 		0xFFFFFFFFFFFFFFFE
@@ -28,555 +67,4555 @@ namespace NSA::Core::Socket {
 
 	namespace IOCP {
 		constexpr auto DEFAULT_BUFFER_SIZE = 8 * 1024;
+		// Larger buffers are not kept around once their context is recycled
+		constexpr auto MAX_RECYCLED_BUFFER_SIZE = 64 * 1024;
+#if NSA_USE_WINDOWS
+		// Most bytes one TransmitFile call takes
+		constexpr std::uint64_t MAX_TRANSMIT_SIZE = 0x7FFFFFFE;
+#endif
 
 		IOContext::IOContext() noexcept {
+#if NSA_USE_WINDOWS
 			memset(&overlapped, 0, sizeof(overlapped));
 
 			buffer.resize(DEFAULT_BUFFER_SIZE);
 			wsabuf.buf = buffer.data();
 			wsabuf.len = static_cast<ULONG>(buffer.size());
+#endif
 		}
-	}
 
-	DWORD WINAPI Socket::IOCPWorkerThread(LPVOID param) noexcept {
-		auto sock = reinterpret_cast<Socket*>(param);
+		IOContext::~IOContext() noexcept {
+			if (ownsFile) {
+#if NSA_USE_WINDOWS
+				CloseHandle(file);
+#else
+				close(file);
+#endif
+			}
+		}
 
-		auto threadId = GetCurrentThreadId();
-		constexpr auto MAX_EVENTS = 16;
+		void IOContext::Reset() noexcept {
+			if (buffer.capacity() > MAX_RECYCLED_BUFFER_SIZE)
+				Buffer().swap(buffer);
 
-		while (true) {
-			if (!Socket::gs_workersRunning)
-				break;
+			if (ownsFile) {
+#if NSA_USE_WINDOWS
+				CloseHandle(file);
+#else
+				close(file);
+#endif
+			}
+			file = INVALID_FILE;
+			fileOffset = 0;
+			fileLength = 0;
+			ownsFile = false;
 
-			OVERLAPPED_ENTRY entries[MAX_EVENTS];
-			ULONG count;
+			operation = IOOperation::NONE;
+			owner = nullptr;
+			target = nullptr;
+			multishot = false;
+			queued = 0;
+			offset = 0;
+			prev = nullptr;
+			next = nullptr;
+			destroy = nullptr;
+			detach = nullptr;
+			segments.clear();
+			datagrams.clear();
+			address = {};
+			posted.reset();
+			sequence = 0;
+			deferredBytes = 0;
+			deferredError = 0;
+			strandNext = nullptr;
+			detached = false;
+			timerWheel = nullptr;
+			timerDue = 0;
+			timerSlot = 0;
+			timerPrev = nullptr;
+			timerNext = nullptr;
+			orphaned = false;
+#if NSA_USE_WINDOWS
+			memset(&overlapped, 0, sizeof(overlapped));
+			wsabufs.clear();
 
-			if (!GetQueuedCompletionStatusEx(
-				Socket::gs_globalIOCP,
-				entries,
-				ARRAYSIZE(entries),
-				&count,
-				INFINITE,
-				false
-			)) {
-				std::println(
-					stderr,
-					"{} -> GetQueuedCompletionStatusEx failed: {}",
-					threadId,
-					Shared::Utils::GetLastErrorString()
-				);
-				continue;
-			}
-			for (ULONG i = 0; i < count; i++) {
-				std::lock_guard<std::mutex> lock(Socket::gs_bufferMutex);
+			buffer.resize(DEFAULT_BUFFER_SIZE);
+			wsabuf.buf = buffer.data();
+			wsabuf.len = static_cast<ULONG>(buffer.size());
+#else
+			buffer.clear();
+			iovecs.clear();
+			messages.clear();
+			control.clear();
+			segment = false;
+			socket = INVALID_SOCKET;
+			selected = nullptr;
+#endif
+		}
 
-				auto& entry = entries[i];
+		void IOContext::CopyResult(const IOContext& from, std::uint32_t length) noexcept {
+			operation = from.operation;
+			multishot = from.multishot;
+			address = from.address;
+#if NSA_USE_LINUX
+			socket = from.socket;
+			auto data = from.selected ? from.selected : from.buffer.data();
+#else
+			auto data = from.buffer.data();
+#endif
+			buffer.assign(data, data + length);
+		}
 
-				auto ctx = reinterpret_cast<IOCP::IOContext*>(entry.lpOverlapped);
-				if (!ctx)
-					continue;
+		std::size_t IOContext::Size() const noexcept {
+			if (operation == IOOperation::SEND_FILE)
+				return static_cast<std::size_t>(fileLength);
 
-				ctx->buffer.resize(entry.dwNumberOfBytesTransferred);
-				
-				ctx->owner->OnIOCompleted(
-					ctx,
-					entry.dwNumberOfBytesTransferred,
-					Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(entry.Internal))
-				);
+			if (segments.empty())
+				return buffer.size();
+
+			std::size_t size = 0;
+			for (auto& segment : segments)
+				size += segment->size();
+			return size;
+		}
+
+		void IOContext::Gather(std::span<const std::string_view> buffers) noexcept {
+			std::size_t size = 0;
+			for (auto& data : buffers)
+				size += data.size();
+
+			buffer.resize(size);
+			auto out = buffer.data();
+			for (auto& data : buffers)
+				out = std::ranges::copy(data, out).out;
+		}
+
+		void IOContext::Attach(std::span<const BufferRef> buffers) noexcept {
+			for (auto& data : buffers) {
+				if (data && !data->empty())
+					segments.push_back(data);
 			}
 		}
-		return 0;
-	}
 
-#pragma region Socket details
+		bool IOContext::SetFile(FileHandle file, std::uint64_t offset, std::uint64_t length) noexcept {
+			if (file == INVALID_FILE)
+				return false;
 
-	Socket::Socket() noexcept
-		: m_socket(INVALID_SOCKET), m_host(""), m_port(0)
-	{
-		std::lock_guard<std::mutex> lock(gs_globalMutex);
-		if (gs_socketCount == 0) {
-			static WSAData ms_wsaData;
-			if (WSAStartup(MAKEWORD(2, 2), &ms_wsaData)) {
+#if NSA_USE_WINDOWS
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file, &size)) {
+#ifdef ATS_DEBUG
 				std::println(
 					stderr,
-					"WSAStartup failed: {}",
-					Shared::Utils::GetLastWSAErrorString()
+					"GetFileSizeEx failed: {}",
+					Shared::Utils::GetLastErrorString()
 				);
-				return;
+#endif
+				return false;
+			}
+			auto fileSize = static_cast<std::uint64_t>(size.QuadPart);
+#else
+			struct stat info;
+			if (fstat(file, &info) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"fstat failed: {}",
+					Shared::Utils::GetLastErrorString()
+				);
+#endif
+				return false;
 			}
-			Socket::gs_globalIOCP = CreateIoCompletionPort(
-				INVALID_HANDLE_VALUE,
+			auto fileSize = static_cast<std::uint64_t>(info.st_size);
+#endif
+
+			if (offset > fileSize)
+				return false;
+			if (length == 0)
+				length = fileSize - offset;
+			else if (length > fileSize - offset)
+				return false;
+
+			this->file = file;
+			fileOffset = offset;
+			fileLength = length;
+			return true;
+		}
+
+		bool IOContext::OpenFile(const std::filesystem::path& path, std::uint64_t offset, std::uint64_t length) noexcept {
+#if NSA_USE_WINDOWS
+			auto opened = CreateFileW(
+				path.c_str(),
+				GENERIC_READ,
+				FILE_SHARE_READ,
 				nullptr,
-				reinterpret_cast<ULONG_PTR>(this),
-				0
+				OPEN_EXISTING,
+				FILE_FLAG_SEQUENTIAL_SCAN,
+				nullptr
 			);
-			if (!gs_globalIOCP) {
+#else
+			auto opened = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+			if (opened == INVALID_FILE) {
 #ifdef ATS_DEBUG
 				std::println(
 					stderr,
-					"CreateIOCompletionPort error: {}",
+					"Opening {} failed: {}",
+					path.string(),
 					Shared::Utils::GetLastErrorString()
 				);
 #endif
-				return;
+				return false;
 			}
-			SYSTEM_INFO sysInfo;
-			GetSystemInfo(&sysInfo);
-			auto threadCount = sysInfo.dwNumberOfProcessors;
 
-			for (DWORD i = 0; i < threadCount * 2; i++) {
-				HANDLE thread = CreateThread(
-					nullptr,
-					0,
-					Socket::IOCPWorkerThread,
-					this,
-					CREATE_SUSPENDED,
-					nullptr
-				);
+			// Closed by Reset() from here on, even if the range is rejected
+			file = opened;
+			ownsFile = true;
+			return SetFile(opened, offset, length);
+		}
 
-				if (thread) {
-					Socket::gs_workers.push_back(thread);
+#if NSA_USE_LINUX
+		msghdr* IOContext::PendingMessage() noexcept {
+			iovecs.clear();
+
+			// Skip whatever a previous partial send already got out
+			auto skip = offset;
+			for (auto& segment : segments) {
+				if (skip >= segment->size()) {
+					skip -= segment->size();
+					continue;
 				}
+
+				iovecs.push_back({ segment->data() + skip, segment->size() - skip });
+				skip = 0;
+
+				if (iovecs.size() == MAX_SEGMENTS)
+					break;
 			}
+
+			message = {};
+			message.msg_iov = iovecs.data();
+			message.msg_iovlen = iovecs.size();
+			return &message;
 		}
-		
-		gs_socketCount++;
-	}
+#endif
 
-	bool Socket::Create(AddressFamily family, SocketType type) noexcept {
-		if (m_socket != INVALID_SOCKET)
-			return false;
+		BufferRef DataView::Retain() noexcept {
+			if (m_retained)
+				return m_retained;
 
-		IPPROTO protocol;
-		switch (type) {
-			case SocketType::TCP:
-				protocol = IPPROTO::IPPROTO_TCP;
-				break;
-			case SocketType::UDP:
-				protocol = IPPROTO::IPPROTO_UDP;
-				break;
-			default:
-				protocol = IPPROTO::IPPROTO_RAW;
+			if (data.data() == m_ctx->buffer.data()) {
+				// Take the receive buffer over, its storage does not move
+				m_retained = std::make_shared<Buffer>(std::move(m_ctx->buffer));
+			} else {
+				// Kernel provided buffers go back to the ring after the event
+				m_retained = std::make_shared<Buffer>(data.begin(), data.end());
+				data = { m_retained->data(), m_retained->size() };
+			}
+			return m_retained;
 		}
 
-		m_socket = WSASocketW(
-			std::to_underlying(family),
-			std::to_underlying(type),
-			protocol,
-			nullptr,
-			0,
-			WSA_FLAG_OVERLAPPED
-		);
+		std::optional<Address> Address::Parse(std::string_view host, std::uint32_t port) noexcept {
+			// inet_pton wants a terminated string
+			std::string name(host);
+			Address address;
 
-		if (m_socket == INVALID_SOCKET) {
-#ifdef ATS_DEBUG
-			std::println(
-				stderr,
-				"WSASocketW error: {}",
-				Shared::Utils::GetLastWSAErrorString()
-			);
-#endif
-			return false;
+			auto ipv4 = reinterpret_cast<sockaddr_in*>(&address.storage);
+			if (inet_pton(AF_INET, name.c_str(), &ipv4->sin_addr) == 1) {
+				ipv4->sin_family = AF_INET;
+				ipv4->sin_port = htons(static_cast<std::uint16_t>(port));
+				address.length = sizeof(sockaddr_in);
+				return address;
+			}
+
+			auto ipv6 = reinterpret_cast<sockaddr_in6*>(&address.storage);
+			if (inet_pton(AF_INET6, name.c_str(), &ipv6->sin6_addr) == 1) {
+				ipv6->sin6_family = AF_INET6;
+				ipv6->sin6_port = htons(static_cast<std::uint16_t>(port));
+				address.length = sizeof(sockaddr_in6);
+				return address;
+			}
+			return std::nullopt;
 		}
 
-		if (!SetFileCompletionNotificationModes(
-			reinterpret_cast<HANDLE>(m_socket),
-			FILE_SKIP_COMPLETION_PORT_ON_SUCCESS
-		)) {
-#ifdef ATS_DEBUG
-			std::println(
-				stderr,
-				"SetFileCompletionNotificationModes error: {}",
-				Shared::Utils::GetLastErrorString()
-			);
-#endif
-			return false;
+		std::uint32_t Address::GetPort() const noexcept {
+			std::uint16_t port = storage.ss_family == AF_INET6
+				? reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_port
+				: reinterpret_cast<const sockaddr_in*>(&storage)->sin_port;
+			return ntohs(port);
 		}
 
-		bool res = AssociateIOCP();
-		Socket::gs_workersRunning = true;
-		std::ranges::for_each(Socket::gs_workers, ResumeThread);
+		void Address::SetPort(std::uint32_t port) noexcept {
+			auto value = htons(static_cast<std::uint16_t>(port));
+			if (storage.ss_family == AF_INET6)
+				reinterpret_cast<sockaddr_in6*>(&storage)->sin6_port = value;
+			else
+				reinterpret_cast<sockaddr_in*>(&storage)->sin_port = value;
+		}
 
-		return res;
-	}
+		std::optional<std::pair<std::string, std::uint32_t>> Address::Format() const noexcept {
+			auto raw = Get();
+			auto rawLength = length;
 
-	bool Socket::AssociateIOCP() const noexcept {
-		return CreateIoCompletionPort(
-			reinterpret_cast<HANDLE>(m_socket),
-			Socket::gs_globalIOCP,
-			reinterpret_cast<ULONG_PTR>(this),
-			0
-		) != nullptr;
-	}
+			// IPv4 peers of a dual-stack socket come in as ::ffff:a.b.c.d
+			sockaddr_in unmapped{};
+			auto ipv6 = reinterpret_cast<const sockaddr_in6*>(&storage);
+			if (storage.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr)) {
+				unmapped.sin_family = AF_INET;
+				unmapped.sin_port = ipv6->sin6_port;
+				memcpy(&unmapped.sin_addr, &ipv6->sin6_addr.s6_addr[12], sizeof(unmapped.sin_addr));
 
-	Socket::Socket(SockType&& socket) noexcept : m_host(""), m_port(0) {
-		std::swap(m_socket, socket);
-	}
+				raw = reinterpret_cast<const sockaddr*>(&unmapped);
+				rawLength = sizeof(unmapped);
+			}
 
-	Socket::Socket(Socket&& socket) noexcept : m_host(""), m_port(0) {
-		std::swap(m_socket, socket.m_socket);
+			char host[NI_MAXHOST];
+			if (getnameinfo(
+				raw,
+				rawLength,
+				host,
+				sizeof(host),
+				nullptr,
+				0,
+				NI_NUMERICHOST
+			) != 0)
+				return std::nullopt;
+
+			return std::pair{ std::string(host), GetPort() };
+		}
+
+		bool operator==(const Address& lhs, const Address& rhs) noexcept {
+			return lhs.length == rhs.length && memcmp(&lhs.storage, &rhs.storage, lhs.length) == 0;
+		}
 	}
 
-	Socket::~Socket() noexcept {
-		Close();
+#if NSA_USE_LINUX
+	namespace IOUring {
+		constexpr std::uint32_t RING_ENTRIES = 4096;
+		// Provided receive buffers per ring, shared by every socket on it
+		constexpr std::uint32_t RING_BUFFER_COUNT = 512;
 	}
+#endif
 
-	bool Socket::Close() noexcept {
-		std::lock_guard<std::mutex> lock(Socket::gs_globalMutex);
-		Socket::gs_socketCount--;
+	namespace {
+		// Queue drained by the current thread, empty off the workers
+		thread_local std::optional<std::uint32_t> t_queue = std::nullopt;
 
-		if (Socket::gs_socketCount == 0) {
-			assert(Socket::gs_globalIOCP != INVALID_HANDLE_VALUE && "globalIOCP invalid");
+		// Batches of datagrams laid out in slots of their buffer
+		constexpr bool IsDatagramOperation(IOCP::IOOperation operation) noexcept {
+			return operation == IOCP::IOOperation::RECV_FROM
+				|| operation == IOCP::IOOperation::SEND_TO;
+		}
 
-			// wake up threads
-			for (std::size_t i = 0; i < Socket::gs_workers.size(); i++) {
-				PostQueuedCompletionStatus(gs_globalIOCP, 0, gs_shutdownKey, nullptr);
+		// Compression and encryption copy what they send anyway, shared
+		// buffers go to them as views
+		std::vector<std::string_view> ToViews(std::span<const IOCP::BufferRef> buffers) noexcept {
+			std::vector<std::string_view> views;
+			views.reserve(buffers.size());
+			for (auto& buffer : buffers) {
+				if (buffer)
+					views.emplace_back(buffer->data(), buffer->size());
 			}
+			return views;
+		}
+	}
 
-			Socket::gs_workersRunning = false;
-			for (auto& thread : Socket::gs_workers) {
-				if (thread) {
-					WaitForSingleObject(thread, INFINITE);
-					CloseHandle(thread);
-				}
-			}
-			Socket::gs_workers.clear();
+#pragma region Worker queues
 
-			CloseHandle(Socket::gs_globalIOCP);
-			Socket::gs_globalIOCP = INVALID_HANDLE_VALUE;
-		}
+	std::uint32_t Socket::GetQueueCount() noexcept {
+		if (gs_workerConfig.queues != 0)
+			return gs_workerConfig.queues;
 
-		if (m_socket == INVALID_SOCKET)
-			return true;
+#if NSA_USE_WINDOWS
+		return std::max<DWORD>(1, GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+#else
+		// Only the processors we are allowed to run on
+		cpu_set_t allowed;
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == SOCKET_ERROR)
+			return std::max(1u, std::thread::hardware_concurrency());
+
+		return std::max(1, CPU_COUNT(&allowed));
+#endif
+	}
 
+	bool Socket::PinWorker(std::uint32_t index) noexcept {
 #if NSA_USE_WINDOWS
-		if (shutdown(m_socket, SD_BOTH) == SOCKET_ERROR)
+		auto total = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+		if (total == 0)
 			return false;
 
-		if (closesocket(m_socket) == SOCKET_ERROR)
-			return false;
+		// Machines past 64 processors split them into groups
+		index %= total;
+		auto groups = GetActiveProcessorGroupCount();
+		for (WORD group = 0; group < groups; group++) {
+			auto count = GetActiveProcessorCount(group);
+			if (index >= count) {
+				index -= count;
+				continue;
+			}
+
+			GROUP_AFFINITY affinity{};
+			affinity.Group = group;
+			affinity.Mask = static_cast<KAFFINITY>(1) << index;
+			return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+		}
+		return false;
 #else
-		if (shutdown(m_socket, SHUT_RDWR) == -1)
+		auto cpu = Socket::GetWorkerCpu(index);
+		if (cpu == -1)
 			return false;
 
-		if (close(m_socket) == -1)
-			return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
 #endif
-		m_socket = INVALID_SOCKET;
-		if (Socket::gs_socketCount == 0) {
-			if (WSACleanup() == SOCKET_ERROR) {
-				std::println(stderr, "WSACleanup failed: {}", Shared::Utils::GetLastErrorString());
-				return false;
-			}
-		}
-		return true;
 	}
-	
-	Socket::SockType Socket::GetSocket() const noexcept { return m_socket; }
 
-	bool Socket::IsOpen() const noexcept { return m_socket != INVALID_SOCKET; }
+#if NSA_USE_LINUX
+	int Socket::GetWorkerCpu(std::uint32_t index) noexcept {
+		// The process' mask, a pinned worker only sees its own processor
+		cpu_set_t allowed;
+		if (sched_getaffinity(getpid(), sizeof(allowed), &allowed) == SOCKET_ERROR)
+			return -1;
 
-	std::optional<std::pair<std::string, std::uint32_t>> Socket::GetSocketAddress(
-		SockType sock
-	) noexcept {
-		sockaddr_in peerAddr;
-		int addrLen = sizeof(peerAddr);
+		auto count = static_cast<std::uint32_t>(CPU_COUNT(&allowed));
+		if (count == 0)
+			return -1;
 
-		if (getpeername(
-			sock,
-			reinterpret_cast<sockaddr*>(&peerAddr),
-			&addrLen
-		) == SOCKET_ERROR) {
-#ifdef ATS_DEBUG
-			auto wsaErr = WSAGetLastError();
-			std::println(
-				stderr,
-				"getpeername failed: {} ({})",
-				Shared::Utils::GetLastWSAErrorString(wsaErr),
-				wsaErr
-			);
-#endif
-			return std::nullopt;
+		// N-th processor out of the ones we are allowed to run on
+		index %= count;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed) && index-- == 0)
+				return cpu;
 		}
+		return -1;
+	}
+#endif
 
-		char host[NI_MAXHOST];
-		char service[NI_MAXSERV];
+	void Socket::OnWorkerStart(std::uint32_t index) noexcept {
+		t_queue = index;
 
-		if (getnameinfo(
-			reinterpret_cast<sockaddr*>(&peerAddr),
-			addrLen,
-			host,
-			sizeof(host),
-			service,
-			sizeof(service),
-			NI_NUMERICHOST | NI_NUMERICSERV
-		) == SOCKET_ERROR) {
+		if (gs_workerConfig.pinned && !Socket::PinWorker(index)) {
 #ifdef ATS_DEBUG
 			std::println(
 				stderr,
-				"getnameinfo failed: {}",
-				Shared::Utils::GetLastWSAErrorString()
+				"Pinning worker {} failed: {}",
+				index,
+				Shared::Utils::GetLastErrorString()
 			);
 #endif
-			return std::nullopt;
 		}
+	}
 
-		auto port = Shared::Utils::StringToInt<std::uint32_t>(service);
-		if (!port.has_value()) {
-#ifdef ATS_DEBUG
-			std::println(stderr, "Port is not a valid number");
-#endif
-			return std::nullopt;
+	std::uint32_t Socket::PickQueue(std::optional<std::uint32_t> requested) noexcept {
+		auto count = static_cast<std::uint32_t>(gs_queueLoad.size());
+		assert(count != 0 && "no completion queues");
+
+		std::uint32_t queue = 0;
+		if (requested.has_value()) {
+			queue = requested.value() % count;
+		} else switch (gs_workerConfig.placement) {
+			case Placement::LEAST_LOADED: {
+				for (std::uint32_t i = 1; i < count; i++) {
+					if (gs_queueLoad[i] < gs_queueLoad[queue])
+						queue = i;
+				}
+				break;
+			} case Placement::CALLER: {
+				if (t_queue.has_value()) {
+					queue = t_queue.value();
+					break;
+				}
+				[[fallthrough]];
+			} default: {
+				queue = gs_nextQueue++ % count;
+				break;
+			}
 		}
 
-		return std::pair{ host, port.value() };
+		gs_queueLoad[queue]++;
+		m_queue = queue;
+		m_lastQueue = queue;
+		return queue;
 	}
 
-	void swap(Socket& lhs, Socket& rhs) noexcept {
+	void Socket::ReleaseQueue() noexcept {
+		if (m_queue == NO_QUEUE)
+			return;
+
+		gs_queueLoad[m_queue]--;
+		m_queue = NO_QUEUE;
+	}
+
+	std::optional<std::uint32_t> Socket::GetQueue() const noexcept {
+		if (m_queue == NO_QUEUE)
+			return std::nullopt;
+
+		return m_queue;
+	}
+
+	bool Socket::IsWorkerThread() noexcept {
+		return t_queue.has_value();
+	}
+
+	bool Socket::PostAfter(
+		IOCP::IOContext* ctx,
+		std::uint32_t error,
+		std::chrono::milliseconds delay
+	) noexcept {
+		auto queue = ctx->target->m_queue;
+		if (queue == NO_QUEUE || queue >= gs_wheels.size())
+			return false;
+
+		ctx->posted = error;
+		// A worker arming its own timer looks at the wheel before it sleeps
+		if (gs_wheels[queue]->Insert(ctx, delay) && t_queue != queue)
+			Socket::WakeWorker(queue);
+		return true;
+	}
+
+	void Socket::CancelDelayed(Socket* target) noexcept {
+		auto queue = target->m_queue;
+		if (queue == NO_QUEUE || queue >= gs_wheels.size())
+			return;
+
+		// PostAfter only ever arms the wheel of the target's own worker
+		std::lock_guard<std::mutex> lock(target->m_ctxMutex);
+		for (auto ctx = target->m_postedCtx; ctx; ctx = ctx->next)
+			gs_wheels[queue]->Remove(ctx);
+	}
+
+	int Socket::RunTimers(std::uint32_t index) noexcept {
+		auto& wheel = *gs_wheels[index];
+		auto expired = wheel.Advance([](IOCP::IOContext* ctx) noexcept {
+			// Off the wheel, so CancelDelayed misses it; waited for instead
+			ctx->target->m_inflight++;
+		});
+
+		while (expired) {
+			auto ctx = std::exchange(expired, expired->timerNext);
+			ctx->timerNext = nullptr;
+
+			if (ctx->orphaned) {
+				ctx->destroy(ctx);
+				continue;
+			}
+
+			auto target = ctx->target;
+			auto error = *std::exchange(ctx->posted, std::nullopt);
+#if NSA_USE_WINDOWS
+			Socket::Complete(ctx, 0, error);
+#else
+			Socket::Dispatch(ctx, 0, error);
+#endif
+			target->ReleaseInflight();
+		}
+		return wheel.Sleep();
+	}
+
+	void Socket::WaitForPending() noexcept {
+		// On its own worker they are queued behind the completion running,
+		// ~Socket leaves them to the worker instead
+		if (t_queue.has_value() && t_queue == m_lastQueue)
+			return;
+
+		while (true) {
+			auto drained = gs_drained.load();
+			if (m_inflight == 0)
+				return;
+
+			gs_drained.wait(drained);
+		}
+	}
+
+	void Socket::ReleaseInflight() noexcept {
+		// Nothing of this socket is touched past the last one
+		if (m_inflight.fetch_sub(1) != 1)
+			return;
+
+		gs_drained++;
+		gs_drained.notify_all();
+	}
+
+	bool Socket::SetWorkerConfig(const WorkerConfig& config) noexcept {
+		std::lock_guard<std::mutex> lock(gs_globalMutex);
+
+		// The queues are laid out when the first socket starts the engine
+		if (gs_socketCount != 0)
+			return false;
+
+		gs_workerConfig = config;
+		return true;
+	}
+
+#pragma endregion
+
+#if NSA_USE_WINDOWS
+#pragma region IOCP engine
+
+	DWORD WINAPI Socket::IOCPWorkerThread(LPVOID param) noexcept {
+		auto index = static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(param));
+		Socket::OnWorkerStart(index);
+
+		auto threadId = GetCurrentThreadId();
+		constexpr auto MAX_EVENTS = 16;
+
+		while (true) {
+			if (!Socket::gs_workersRunning)
+				break;
+
+			auto timeout = Socket::RunTimers(index);
+
+			OVERLAPPED_ENTRY entries[MAX_EVENTS];
+			ULONG count;
+
+			if (!GetQueuedCompletionStatusEx(
+				Socket::gs_ports[index],
+				entries,
+				ARRAYSIZE(entries),
+				&count,
+				timeout < 0 ? INFINITE : static_cast<DWORD>(timeout),
+				false
+			)) {
+				// The next timer is due
+				if (GetLastError() == WAIT_TIMEOUT)
+					continue;
+
+				std::println(
+					stderr,
+					"{} -> GetQueuedCompletionStatusEx failed: {}",
+					threadId,
+					Shared::Utils::GetLastErrorString()
+				);
+				continue;
+			}
+			for (ULONG i = 0; i < count; i++) {
+				auto& entry = entries[i];
+
+				auto ctx = reinterpret_cast<IOCP::IOContext*>(entry.lpOverlapped);
+				if (!ctx)
+					continue;
+
+				// Its socket is gone, nothing is left to report to
+				if (ctx->orphaned) {
+					ctx->destroy(ctx);
+					continue;
+				}
+
+				// The owner may release the context, the target outlives it
+				auto target = ctx->target;
+				auto bytesTransferred = static_cast<std::uint32_t>(entry.dwNumberOfBytesTransferred);
+				auto error = Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(entry.Internal));
+
+				if (ctx->posted.has_value()) {
+					// Handed over by Post, nothing went through the system
+					error = *std::exchange(ctx->posted, std::nullopt);
+				} else if (ctx->operation == IOCP::IOOperation::SEND_FILE || ctx->operation == IOCP::IOOperation::SEND_TO) {
+					// The next piece is counted on its own
+					if (Socket::ContinueTransmit(ctx, bytesTransferred, error)) {
+						target->ReleaseInflight();
+						continue;
+					}
+				} else if (ctx->segments.empty() && !IsDatagramOperation(ctx->operation)) {
+					// Gathered sends have no buffer of their own
+					ctx->buffer.resize(bytesTransferred);
+				}
+
+				Socket::Complete(ctx, bytesTransferred, error);
+				target->ReleaseInflight();
+			}
+		}
+		return 0;
+	}
+
+	void Socket::Startup() noexcept {
+		std::lock_guard<std::mutex> lock(gs_globalMutex);
+		if (gs_socketCount == 0) {
+			static WSAData ms_wsaData;
+			if (WSAStartup(MAKEWORD(2, 2), &ms_wsaData)) {
+				std::println(
+					stderr,
+					"WSAStartup failed: {}",
+					Shared::Utils::GetLastWSAErrorString()
+				);
+				return;
+			}
+			auto queueCount = Socket::GetQueueCount();
+
+			// A port per worker, so a socket's completions stay on one thread
+			for (std::uint32_t i = 0; i < queueCount; i++) {
+				HANDLE port = CreateIoCompletionPort(
+					INVALID_HANDLE_VALUE,
+					nullptr,
+					0,
+					1
+				);
+				if (!port) {
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"CreateIOCompletionPort error: {}",
+						Shared::Utils::GetLastErrorString()
+					);
+#endif
+					break;
+				}
+
+				HANDLE thread = CreateThread(
+					nullptr,
+					0,
+					Socket::IOCPWorkerThread,
+					reinterpret_cast<LPVOID>(static_cast<std::uintptr_t>(i)),
+					CREATE_SUSPENDED,
+					nullptr
+				);
+				if (!thread) {
+					CloseHandle(port);
+					break;
+				}
+
+				Socket::gs_ports.push_back(port);
+				Socket::gs_workers.push_back(thread);
+			}
+
+			if (Socket::gs_ports.empty())
+				return;
+
+			Socket::gs_queueLoad = std::vector<std::atomic<std::uint32_t>>(Socket::gs_ports.size());
+			for (std::size_t i = 0; i < Socket::gs_ports.size(); i++)
+				Socket::gs_wheels.emplace_back(new Timer::Wheel);
+		}
+
+		gs_socketCount++;
+	}
+
+	void Socket::Cleanup() noexcept {
+		std::lock_guard<std::mutex> lock(Socket::gs_globalMutex);
+		if (Socket::gs_socketCount == 0 || --Socket::gs_socketCount != 0)
+			return;
+
+		assert(!Socket::gs_ports.empty() && "completion ports missing");
+
+		// wake up threads, including the ones that were never resumed
+		Socket::gs_workersRunning = false;
+		std::ranges::for_each(Socket::gs_workers, ResumeThread);
+		for (auto port : Socket::gs_ports) {
+			PostQueuedCompletionStatus(port, 0, gs_shutdownKey, nullptr);
+		}
+
+		for (auto& thread : Socket::gs_workers) {
+			if (thread) {
+				WaitForSingleObject(thread, INFINITE);
+				CloseHandle(thread);
+			}
+		}
+		Socket::gs_workers.clear();
+
+		std::ranges::for_each(Socket::gs_ports, CloseHandle);
+		Socket::gs_ports.clear();
+		Socket::gs_queueLoad.clear();
+		Socket::gs_wheels.clear();
+
+		if (WSACleanup() == SOCKET_ERROR) {
+			std::println(stderr, "WSACleanup failed: {}", Shared::Utils::GetLastErrorString());
+		}
+	}
+
+	bool Socket::AssociateIOCP(std::optional<std::uint32_t> queue) noexcept {
+		return CreateIoCompletionPort(
+			reinterpret_cast<HANDLE>(m_socket),
+			Socket::gs_ports[PickQueue(queue)],
+			reinterpret_cast<ULONG_PTR>(this),
+			0
+		) != nullptr;
+	}
+
+	bool Socket::Post(IOCP::IOContext* ctx, std::uint32_t error) noexcept {
+		auto target = ctx->target;
+		auto queue = target->m_queue;
+		if (queue == NO_QUEUE)
+			return false;
+
+		ctx->posted = error;
+		// Waited for like any other operation on the socket
+		target->m_inflight++;
+
+		if (!PostQueuedCompletionStatus(
+			Socket::gs_ports[queue],
+			0,
+			reinterpret_cast<ULONG_PTR>(target),
+			&ctx->overlapped
+		)) {
+			ctx->posted.reset();
+			target->ReleaseInflight();
+			return false;
+		}
+		return true;
+	}
+
+	void Socket::WakeWorker(std::uint32_t index) noexcept {
+		// No context, the worker only goes round its loop once more
+		PostQueuedCompletionStatus(Socket::gs_ports[index], 0, 0, nullptr);
+	}
+
+#pragma endregion
+#else
+#pragma region Epoll engine
+
+	namespace {
+		// Queue the current thread is draining, so operations submitted from
+		// inside a completion handler are picked up by the running loop
+		// instead of recursing into it
+		thread_local std::deque<IOCP::IOContext*>* t_drainingQueue = nullptr;
+		// Sockets destroyed on this epoll worker while it goes through a
+		// batch, whose readiness may still be further down in it
+		thread_local std::vector<Socket*> t_destroyed;
+
+		constexpr bool IsReadOperation(IOCP::IOOperation operation) noexcept {
+			return operation == IOCP::IOOperation::RECV
+				|| operation == IOCP::IOOperation::ACCEPT
+				|| operation == IOCP::IOOperation::RECV_FROM;
+		}
+
+		constexpr bool IsWriteOperation(IOCP::IOOperation operation) noexcept {
+			return operation == IOCP::IOOperation::SEND
+				|| operation == IOCP::IOOperation::SEND_FILE
+				|| operation == IOCP::IOOperation::SEND_TO;
+		}
+
+		// Most datagrams and bytes the kernel takes in one segmented send
+		constexpr std::size_t MAX_GSO_SEGMENTS = 64;
+		constexpr std::size_t MAX_GSO_SIZE = 65507;
+		constexpr std::size_t GRO_CONTROL_SIZE = CMSG_SPACE(sizeof(int));
+		constexpr std::size_t GSO_CONTROL_SIZE = CMSG_SPACE(sizeof(std::uint16_t));
+
+		// Datagrams from `first` on that go out as one send: a run to the
+		// same peer laid out back to back, all as large as the first one
+		// except for the last
+		std::size_t SegmentRun(IOCP::IOContext* ctx, std::size_t first) noexcept {
+			auto& datagrams = ctx->datagrams;
+			auto size = datagrams[first].data.size();
+			if (!ctx->segment || size == 0)
+				return 1;
+
+			auto total = size;
+			std::size_t count = 1;
+			while (first + count < datagrams.size() && count < MAX_GSO_SEGMENTS) {
+				auto& previous = datagrams[first + count - 1];
+				auto& next = datagrams[first + count];
+				if (next.data.empty() || next.data.size() > size || total + next.data.size() > MAX_GSO_SIZE)
+					break;
+				if (next.peer != datagrams[first].peer || next.data.data() != previous.data.data() + previous.data.size())
+					break;
+
+				total += next.data.size();
+				count++;
+
+				if (next.data.size() < size)
+					break;
+			}
+			return count;
+		}
+
+		// Lays the datagrams not sent yet out as messages for sendmmsg
+		unsigned int PrepareSend(IOCP::IOContext* ctx) noexcept {
+			ctx->messages.clear();
+			ctx->iovecs.clear();
+			ctx->control.resize(IOCP::IOContext::MAX_SEGMENTS * GSO_CONTROL_SIZE);
+
+			auto& datagrams = ctx->datagrams;
+			auto next = ctx->offset;
+			while (next < datagrams.size() && ctx->messages.size() < IOCP::IOContext::MAX_SEGMENTS) {
+				auto run = SegmentRun(ctx, next);
+				auto& first = datagrams[next];
+				auto& last = datagrams[next + run - 1];
+
+				ctx->iovecs.push_back({
+					const_cast<char*>(first.data.data()),
+					static_cast<std::size_t>(last.data.data() + last.data.size() - first.data.data())
+				});
+
+				mmsghdr message{};
+				message.msg_hdr.msg_name = const_cast<sockaddr*>(first.peer.Get());
+				message.msg_hdr.msg_namelen = first.peer.length;
+				if (run > 1) {
+					// The kernel cuts the run back into datagrams of this size
+					message.msg_hdr.msg_control = ctx->control.data() + ctx->messages.size() * GSO_CONTROL_SIZE;
+					message.msg_hdr.msg_controllen = GSO_CONTROL_SIZE;
+
+					auto header = CMSG_FIRSTHDR(&message.msg_hdr);
+					header->cmsg_level = SOL_UDP;
+					header->cmsg_type = UDP_SEGMENT;
+					header->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+
+					auto segmentSize = static_cast<std::uint16_t>(first.data.size());
+					memcpy(CMSG_DATA(header), &segmentSize, sizeof(segmentSize));
+				}
+				ctx->messages.push_back(message);
+				next += run;
+			}
+
+			// Only now that `iovecs` stopped growing
+			for (std::size_t i = 0; i < ctx->messages.size(); i++) {
+				ctx->messages[i].msg_hdr.msg_iov = &ctx->iovecs[i];
+				ctx->messages[i].msg_hdr.msg_iovlen = 1;
+			}
+			return static_cast<unsigned int>(ctx->messages.size());
+		}
+
+		// Moves past the datagrams of the first `sent` messages
+		void AdvanceSend(IOCP::IOContext* ctx, std::size_t sent) noexcept {
+			while (sent-- > 0)
+				ctx->offset += SegmentRun(ctx, ctx->offset);
+		}
+
+		// Points one message per receive slot at its part of the buffer;
+		// the slots were laid out by sizing `messages` and `buffer`
+		unsigned int PrepareReceive(IOCP::IOContext* ctx) noexcept {
+			auto slots = ctx->messages.size();
+			auto slotSize = ctx->buffer.size() / slots;
+			ctx->datagrams.resize(slots);
+			ctx->iovecs.resize(slots);
+			ctx->control.resize(slots * GRO_CONTROL_SIZE);
+
+			for (std::size_t i = 0; i < slots; i++) {
+				ctx->iovecs[i] = { ctx->buffer.data() + i * slotSize, slotSize };
+
+				auto& header = ctx->messages[i].msg_hdr;
+				header = {};
+				header.msg_name = ctx->datagrams[i].peer.Get();
+				header.msg_namelen = sizeof(sockaddr_storage);
+				header.msg_iov = &ctx->iovecs[i];
+				header.msg_iovlen = 1;
+				header.msg_control = ctx->control.data() + i * GRO_CONTROL_SIZE;
+				header.msg_controllen = GRO_CONTROL_SIZE;
+			}
+			return static_cast<unsigned int>(slots);
+		}
+
+		// Hands the first `received` slots out as datagrams, cutting the
+		// trains GRO coalesced back into the datagrams they arrived as
+		void FinishReceive(IOCP::IOContext* ctx, std::size_t received) noexcept {
+			auto segmentSize = [ctx](std::size_t slot) noexcept -> std::size_t {
+				auto& header = ctx->messages[slot].msg_hdr;
+				for (auto cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+					if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+						continue;
+
+					int size = 0;
+					memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+					return size > 0 ? static_cast<std::size_t>(size) : 0;
+				}
+				return 0;
+			};
+			auto length = [ctx](std::size_t slot) noexcept {
+				// Cut off datagrams report their full length
+				return std::min<std::size_t>(ctx->messages[slot].msg_len, ctx->iovecs[slot].iov_len);
+			};
+
+			std::size_t total = 0;
+			for (std::size_t i = 0; i < received; i++) {
+				auto size = segmentSize(i);
+				total += size == 0 ? 1 : std::max<std::size_t>(1, (length(i) + size - 1) / size);
+			}
+			if (total > ctx->datagrams.size())
+				ctx->datagrams.resize(total);
+
+			// Back to front, every slot only moves further back
+			auto out = total;
+			for (auto i = received; i-- > 0;) {
+				auto peer = ctx->datagrams[i].peer;
+				peer.length = ctx->messages[i].msg_hdr.msg_namelen;
+
+				auto data = static_cast<const char*>(ctx->iovecs[i].iov_base);
+				auto bytes = length(i);
+				auto size = segmentSize(i);
+				if (size == 0 || size > bytes)
+					size = std::max<std::size_t>(bytes, 1);
+
+				auto count = std::max<std::size_t>(1, (bytes + size - 1) / size);
+				out -= count;
+				for (std::size_t k = 0; k < count; k++) {
+					auto start = k * size;
+					ctx->datagrams[out + k] = {
+						{ data + start, std::min(size, bytes - start) },
+						peer
+					};
+				}
+			}
+			ctx->datagrams.resize(total);
+		}
+
+		// sendfile has no MSG_NOSIGNAL, so SIGPIPE is blocked around it and a
+		// signal raised by a reset connection is taken back off the thread
+		ssize_t SendFileNoSignal(int sock, int file, off_t* position, std::size_t count) noexcept {
+			sigset_t pipe;
+			sigset_t previous;
+			sigemptyset(&pipe);
+			sigaddset(&pipe, SIGPIPE);
+			pthread_sigmask(SIG_BLOCK, &pipe, &previous);
+
+			auto sent = sendfile(sock, file, position, count);
+			auto err = errno;
+
+			if (sent == SOCKET_ERROR && err == EPIPE && !sigismember(&previous, SIGPIPE)) {
+				timespec poll{};
+				sigtimedwait(&pipe, nullptr, &poll);
+			}
+
+			pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+			errno = err;
+			return sent;
+		}
+	}
+
+	void Socket::EpollWorkerThread(std::uint32_t index) noexcept {
+		Socket::OnWorkerStart(index);
+
+		auto threadId = gettid();
+		constexpr auto MAX_EVENTS = 16;
+
+		while (true) {
+			if (!Socket::gs_workersRunning)
+				break;
+
+			epoll_event events[MAX_EVENTS];
+
+			auto count = epoll_wait(
+				Socket::gs_epolls[index],
+				events,
+				MAX_EVENTS,
+				Socket::RunTimers(index)
+			);
+			if (count == SOCKET_ERROR) {
+				if (errno == EINTR)
+					continue;
+
+				std::println(
+					stderr,
+					"{} -> epoll_wait failed: {}",
+					threadId,
+					Shared::Utils::GetLastErrorString()
+				);
+				if (errno == EBADF)
+					break;
+
+				continue;
+			}
+			t_destroyed.clear();
+
+			// Posted contexts go last: the barrier Close posts comes back
+			// behind any readiness already reported for the descriptor
+			bool posted = false;
+			for (int i = 0; i < count; i++) {
+				// The wake and post events are registered without an owner
+				auto sock = static_cast<Socket*>(events[i].data.ptr);
+				if (!sock) {
+					posted = true;
+					continue;
+				}
+
+				if (std::ranges::find(t_destroyed, sock) != t_destroyed.end())
+					continue;
+
+				sock->OnReady(events[i].events);
+			}
+
+			if (posted)
+				Socket::RunPosted(index);
+		}
+	}
+
+	void Socket::UringWorkerThread(std::uint32_t index) noexcept {
+		Socket::OnWorkerStart(index);
+
+		auto threadId = gettid();
+		auto& ring = *Socket::gs_rings[index];
+
+		while (true) {
+			if (!Socket::gs_workersRunning)
+				break;
+
+			if (!ring.Wait([&ring](const io_uring_cqe& cqe) {
+				Socket::OnRingCompletion(ring, cqe);
+			}, Socket::RunTimers(index))) {
+				std::println(
+					stderr,
+					"{} -> io_uring_enter failed: {}",
+					threadId,
+					Shared::Utils::GetLastErrorString()
+				);
+				break;
+			}
+		}
+	}
+
+	void Socket::Startup() noexcept {
+		std::lock_guard<std::mutex> lock(gs_globalMutex);
+		if (gs_socketCount == 0 && gs_engine == Engine::IO_URING) {
+			auto queueCount = Socket::GetQueueCount();
+
+			// One ring per worker; the worker is the only thread reaping it
+			for (std::uint32_t i = 0; i < queueCount; i++) {
+				auto& ring = Socket::gs_rings.emplace_back(new IOUring::Ring);
+				if (!ring->Create(
+					IOUring::RING_ENTRIES,
+					IOUring::RING_BUFFER_COUNT,
+					IOCP::DEFAULT_BUFFER_SIZE
+				)) {
+					Socket::gs_rings.clear();
+					break;
+				}
+			}
+
+			if (Socket::gs_rings.empty()) {
+#ifdef ATS_DEBUG
+				std::println(stderr, "io_uring unavailable, falling back to epoll");
+#endif
+				Socket::gs_engine = Engine::EPOLL;
+			} else {
+				Socket::gs_queueLoad = std::vector<std::atomic<std::uint32_t>>(Socket::gs_rings.size());
+				for (std::size_t i = 0; i < Socket::gs_rings.size(); i++)
+					Socket::gs_wheels.emplace_back(new Timer::Wheel);
+
+				Socket::gs_workersRunning = true;
+				for (std::uint32_t i = 0; i < Socket::gs_rings.size(); i++) {
+					Socket::gs_workers.emplace_back(Socket::UringWorkerThread, i);
+				}
+			}
+		}
+		if (gs_socketCount == 0 && gs_engine == Engine::EPOLL) {
+			Socket::gs_wakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (gs_wakeEvent == INVALID_SOCKET) {
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"eventfd error: {}",
+					Shared::Utils::GetLastErrorString()
+				);
+#endif
+				return;
+			}
+
+			// Level triggered, so a single write wakes every worker on shutdown
+			epoll_event wake{};
+			wake.events = EPOLLIN;
+			wake.data.ptr = nullptr;
+
+			// An epoll instance per worker, so a socket's completions stay on one thread
+			auto queueCount = Socket::GetQueueCount();
+			for (std::uint32_t i = 0; i < queueCount; i++) {
+				auto epoll = epoll_create1(EPOLL_CLOEXEC);
+				if (epoll == INVALID_SOCKET) {
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"epoll_create1 error: {}",
+						Shared::Utils::GetLastErrorString()
+					);
+#endif
+					break;
+				}
+
+				auto& posted = Socket::gs_postQueues.emplace_back(new PostQueue);
+				posted->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				if (posted->event == INVALID_SOCKET) {
+					Socket::gs_postQueues.pop_back();
+					close(epoll);
+					break;
+				}
+
+				epoll_ctl(epoll, EPOLL_CTL_ADD, gs_wakeEvent, &wake);
+				epoll_ctl(epoll, EPOLL_CTL_ADD, posted->event, &wake);
+				Socket::gs_epolls.push_back(epoll);
+			}
+
+			if (Socket::gs_epolls.empty()) {
+				close(gs_wakeEvent);
+				gs_wakeEvent = INVALID_SOCKET;
+				return;
+			}
+
+			Socket::gs_queueLoad = std::vector<std::atomic<std::uint32_t>>(Socket::gs_epolls.size());
+			for (std::size_t i = 0; i < Socket::gs_epolls.size(); i++)
+				Socket::gs_wheels.emplace_back(new Timer::Wheel);
+
+			Socket::gs_workersRunning = true;
+			for (std::uint32_t i = 0; i < Socket::gs_epolls.size(); i++) {
+				Socket::gs_workers.emplace_back(Socket::EpollWorkerThread, i);
+			}
+		}
+
+		gs_socketCount++;
+	}
+
+	void Socket::Cleanup() noexcept {
+		std::lock_guard<std::mutex> lock(Socket::gs_globalMutex);
+		if (Socket::gs_socketCount == 0 || --Socket::gs_socketCount != 0)
+			return;
+
+		// wake up threads
+		Socket::gs_workersRunning = false;
+		if (gs_engine == Engine::IO_URING) {
+			for (auto& ring : Socket::gs_rings) {
+				ring->Submit([](io_uring_sqe* sqe) {
+					sqe->opcode = IORING_OP_NOP;
+					sqe->user_data = 0;
+				}, true);
+			}
+		} else {
+			assert(!Socket::gs_epolls.empty() && "epoll instances missing");
+
+			std::uint64_t value = 1;
+			if (write(gs_wakeEvent, &value, sizeof(value)) == SOCKET_ERROR) {
+				std::println(stderr, "eventfd write failed: {}", Shared::Utils::GetLastErrorString());
+			}
+		}
+
+		for (auto& thread : Socket::gs_workers) {
+			// The last socket may be released by a completion handler
+			if (thread.get_id() == std::this_thread::get_id())
+				thread.detach();
+			else if (thread.joinable())
+				thread.join();
+		}
+		Socket::gs_workers.clear();
+		Socket::gs_queueLoad.clear();
+		Socket::gs_wheels.clear();
+
+		if (gs_engine == Engine::IO_URING) {
+			Socket::gs_rings.clear();
+			return;
+		}
+
+		std::ranges::for_each(Socket::gs_epolls, close);
+		Socket::gs_epolls.clear();
+		for (auto& posted : Socket::gs_postQueues)
+			close(posted->event);
+		Socket::gs_postQueues.clear();
+		close(Socket::gs_wakeEvent);
+		Socket::gs_wakeEvent = INVALID_SOCKET;
+	}
+
+	bool Socket::AssociateIOCP(std::optional<std::uint32_t> requested) noexcept {
+		auto queue = PickQueue(requested);
+
+		// Every operation on this descriptor goes through the same ring
+		if (gs_engine == Engine::IO_URING)
+			return true;
+
+		epoll_event event{};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = this;
+
+		return epoll_ctl(
+			Socket::gs_epolls[queue],
+			EPOLL_CTL_ADD,
+			m_socket,
+			&event
+		) != SOCKET_ERROR;
+	}
+
+	bool Socket::Post(IOCP::IOContext* ctx, std::uint32_t error) noexcept {
+		auto target = ctx->target;
+		auto queue = target->m_queue;
+		if (queue == NO_QUEUE)
+			return false;
+
+		ctx->posted = error;
+		// Waited for like any other operation on the descriptor
+		target->m_inflight++;
+
+		if (gs_engine == Engine::IO_URING) {
+			// A no-op completes on the worker's ring with the context attached
+			if (gs_rings[queue]->Submit([ctx](io_uring_sqe* sqe) {
+				sqe->opcode = IORING_OP_NOP;
+				sqe->user_data = reinterpret_cast<std::uint64_t>(ctx);
+			}))
+				return true;
+
+			ctx->posted.reset();
+			target->ReleaseInflight();
+			return false;
+		}
+
+		auto& posted = *gs_postQueues[queue];
+		{
+			std::lock_guard<std::mutex> lock(posted.mutex);
+			posted.contexts.push_back(ctx);
+		}
+
+		// Only fails when the counter would overflow, which is still a wake up
+		std::uint64_t value = 1;
+		if (write(posted.event, &value, sizeof(value)) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+			std::println(stderr, "eventfd write failed: {}", Shared::Utils::GetLastErrorString());
+#endif
+		}
+		return true;
+	}
+
+	void Socket::WakeWorker(std::uint32_t index) noexcept {
+		if (gs_engine == Engine::IO_URING) {
+			gs_rings[index]->Submit([](io_uring_sqe* sqe) {
+				sqe->opcode = IORING_OP_NOP;
+				sqe->user_data = 0;
+			}, true);
+			return;
+		}
+
+		// Taken for a Post with nothing in the queue
+		std::uint64_t value = 1;
+		if (write(gs_postQueues[index]->event, &value, sizeof(value)) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+			std::println(stderr, "eventfd write failed: {}", Shared::Utils::GetLastErrorString());
+#endif
+		}
+	}
+
+	void Socket::RunPosted(std::uint32_t index) noexcept {
+		auto& posted = *gs_postQueues[index];
+
+		// Reset before taking the contexts, a Post in between wakes us again
+		std::uint64_t value = 0;
+		if (read(posted.event, &value, sizeof(value)) == SOCKET_ERROR && errno != EAGAIN)
+			return;
+
+		std::deque<IOCP::IOContext*> contexts;
+		{
+			std::lock_guard<std::mutex> lock(posted.mutex);
+			contexts.swap(posted.contexts);
+		}
+
+		for (auto ctx : contexts) {
+			if (ctx->orphaned) {
+				ctx->destroy(ctx);
+				continue;
+			}
+
+			auto target = ctx->target;
+			Socket::Dispatch(ctx, 0, *std::exchange(ctx->posted, std::nullopt));
+			target->ReleaseInflight();
+		}
+	}
+
+	bool Socket::Submit(Socket* target, IOCP::IOContext* ctx) noexcept {
+		if (!target || !ctx)
+			return false;
+
+		if (gs_engine == Engine::IO_URING)
+			return target->SubmitRing(ctx);
+
+		auto& queue = IsReadOperation(ctx->operation)
+			? target->m_pendingReads
+			: target->m_pendingWrites;
+
+		{
+			std::lock_guard<std::mutex> lock(target->m_ioMutex);
+			if (target->m_socket == INVALID_SOCKET)
+				return false;
+
+			// The queue completes reads in the order they were pushed
+			if (ctx->operation == IOCP::IOOperation::RECV)
+				ctx->sequence = ++target->m_recvPosted;
+
+			queue.push_back(ctx);
+			target->m_inflight++;
+
+			// Queued behind an operation that is still waiting for readiness,
+			// or the queue is already being drained further up this thread
+			if (queue.size() > 1 || t_drainingQueue == &queue)
+				return true;
+		}
+
+		// Mirror FILE_SKIP_COMPLETION_PORT_ON_SUCCESS: complete right away if
+		// the descriptor is already ready. Pinned like OnReady does, Drain
+		// goes back to the queue after the last completion
+		target->m_inflight++;
+		target->Drain(queue);
+		target->ReleaseInflight();
+		return true;
+	}
+
+	void Socket::OnReady(std::uint32_t events) noexcept {
+		// Drain goes back to the queues after its last completion, which may
+		// be what WaitForPending on another thread is waiting for
+		m_inflight++;
+
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			Drain(m_pendingReads);
+
+		if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			Drain(m_pendingWrites);
+
+		ReleaseInflight();
+	}
+
+	void Socket::Drain(std::deque<IOCP::IOContext*>& queue) noexcept {
+		auto previousQueue = t_drainingQueue;
+		t_drainingQueue = &queue;
+
+		// Edge triggered: keep going until the kernel reports EAGAIN
+		while (true) {
+			IOCP::IOContext* ctx = nullptr;
+			std::uint32_t bytesTransferred = 0;
+			std::uint32_t error = 0;
+
+			{
+				std::lock_guard<std::mutex> lock(m_ioMutex);
+				if (queue.empty())
+					break;
+
+				ctx = queue.front();
+				if (!TryComplete(ctx, bytesTransferred, error))
+					break;
+
+				queue.pop_front();
+			}
+
+			Socket::Dispatch(ctx, bytesTransferred, error);
+			ReleaseInflight();
+		}
+
+		t_drainingQueue = previousQueue;
+	}
+
+	bool Socket::TryComplete(
+		IOCP::IOContext* ctx,
+		std::uint32_t& bytesTransferred,
+		std::uint32_t& error
+	) noexcept {
+		switch (ctx->operation) {
+			case IOCP::IOOperation::ACCEPT: {
+				while (true) {
+					ctx->address.length = sizeof(ctx->address.storage);
+					auto sock = accept4(
+						m_socket,
+						ctx->address.Get(),
+						&ctx->address.length,
+						SOCK_NONBLOCK | SOCK_CLOEXEC
+					);
+					if (sock != INVALID_SOCKET) {
+						ctx->socket = sock;
+						return true;
+					}
+
+					switch (errno) {
+						case EAGAIN:
+							return false;
+						case EINTR:
+						case ECONNABORTED:
+						case EPROTO:
+							// The peer gave up before we got to it
+							continue;
+						default:
+							error = errno;
+							return true;
+					}
+				}
+			} case IOCP::IOOperation::RECV: {
+				while (true) {
+					auto received = recv(
+						m_socket,
+						ctx->buffer.data(),
+						ctx->buffer.size(),
+						0
+					);
+					if (received != SOCKET_ERROR) {
+						bytesTransferred = static_cast<std::uint32_t>(received);
+						return true;
+					}
+
+					if (errno == EINTR)
+						continue;
+					if (errno == EAGAIN)
+						return false;
+
+					error = errno;
+					return true;
+				}
+			} case IOCP::IOOperation::SEND: {
+				auto size = ctx->Size();
+				while (ctx->offset < size) {
+					ssize_t sent;
+					if (ctx->segments.empty()) {
+						sent = send(
+							m_socket,
+							ctx->buffer.data() + ctx->offset,
+							ctx->buffer.size() - ctx->offset,
+							MSG_NOSIGNAL
+						);
+					} else {
+						sent = sendmsg(m_socket, ctx->PendingMessage(), MSG_NOSIGNAL);
+					}
+					if (sent == SOCKET_ERROR) {
+						if (errno == EINTR)
+							continue;
+						if (errno == EAGAIN)
+							return false;
+
+						error = errno;
+						break;
+					}
+					ctx->offset += static_cast<std::size_t>(sent);
+				}
+				bytesTransferred = static_cast<std::uint32_t>(ctx->offset);
+				return true;
+			} case IOCP::IOOperation::SEND_FILE: {
+				while (ctx->offset < ctx->fileLength) {
+					auto position = static_cast<off_t>(ctx->fileOffset + ctx->offset);
+					auto sent = SendFileNoSignal(
+						m_socket,
+						ctx->file,
+						&position,
+						static_cast<std::size_t>(ctx->fileLength - ctx->offset)
+					);
+					if (sent == SOCKET_ERROR) {
+						if (errno == EINTR)
+							continue;
+						if (errno == EAGAIN)
+							return false;
+
+						error = errno;
+						break;
+					}
+					// The file got shorter since the send was queued
+					if (sent == 0) {
+						error = EIO;
+						break;
+					}
+					ctx->offset += static_cast<std::size_t>(sent);
+				}
+				// The full count is in `offset`, files may go past 4 GiB
+				bytesTransferred = static_cast<std::uint32_t>(std::min<std::uint64_t>(ctx->offset, UINT32_MAX));
+				return true;
+			} case IOCP::IOOperation::RECV_FROM: {
+				while (true) {
+					auto received = recvmmsg(
+						m_socket,
+						ctx->messages.data(),
+						PrepareReceive(ctx),
+						0,
+						nullptr
+					);
+					if (received != SOCKET_ERROR) {
+						FinishReceive(ctx, static_cast<std::size_t>(received));
+						bytesTransferred = static_cast<std::uint32_t>(ctx->datagrams.size());
+						return true;
+					}
+
+					if (errno == EINTR)
+						continue;
+					if (errno == EAGAIN)
+						return false;
+
+					ctx->datagrams.clear();
+					error = errno;
+					return true;
+				}
+			} case IOCP::IOOperation::SEND_TO: {
+				while (ctx->offset < ctx->datagrams.size()) {
+					auto sent = sendmmsg(
+						m_socket,
+						ctx->messages.data(),
+						PrepareSend(ctx),
+						MSG_NOSIGNAL
+					);
+					if (sent == SOCKET_ERROR) {
+						if (errno == EINTR)
+							continue;
+						if (errno == EAGAIN)
+							return false;
+
+						// The route or device takes no segmented sends
+						if (ctx->segment && (errno == EIO || errno == EINVAL)) {
+							ctx->segment = false;
+							continue;
+						}
+
+						// Skip what the network refused, the rest may still go out
+						error = errno;
+						sent = 1;
+					}
+					AdvanceSend(ctx, static_cast<std::size_t>(sent));
+				}
+				// Datagrams rather than bytes
+				bytesTransferred = static_cast<std::uint32_t>(ctx->offset);
+				return true;
+			} case IOCP::IOOperation::CONNECT: {
+				int result = 0;
+				socklen_t resultLength = sizeof(result);
+
+				if (getsockopt(
+					m_socket,
+					SOL_SOCKET,
+					SO_ERROR,
+					&result,
+					&resultLength
+				) == SOCKET_ERROR) {
+					result = errno;
+				}
+				if (result != 0) {
+					error = static_cast<std::uint32_t>(result);
+					return true;
+				}
+
+				sockaddr_storage peerAddr;
+				socklen_t addrLen = sizeof(peerAddr);
+
+				if (getpeername(
+					m_socket,
+					reinterpret_cast<sockaddr*>(&peerAddr),
+					&addrLen
+				) == SOCKET_ERROR) {
+					// Handshake still in flight
+					if (errno == ENOTCONN)
+						return false;
+
+					error = errno;
+				}
+				return true;
+			} default: {
+				error = EINVAL;
+				return true;
+			}
+		}
+	}
+
+	void Socket::Dispatch(
+		IOCP::IOContext* ctx,
+		std::uint32_t bytesTransferred,
+		std::uint32_t error
+	) noexcept {
+		// Provided buffers, gathered sends and files have no buffer of their
+		// own, datagrams keep theirs laid out in slots
+		if (
+			!ctx->selected
+			&& ctx->segments.empty()
+			&& ctx->operation != IOCP::IOOperation::SEND_FILE
+			&& !IsDatagramOperation(ctx->operation)
+		)
+			ctx->buffer.resize(bytesTransferred);
+
+		Socket::Complete(ctx, bytesTransferred, error);
+	}
+
+	bool Socket::SubmitRing(IOCP::IOContext* ctx) noexcept {
+		std::lock_guard<std::mutex> lock(m_ioMutex);
+		if (m_socket == INVALID_SOCKET)
+			return false;
+
+		ctx->target = this;
+
+		if (IsWriteOperation(ctx->operation)) {
+			// One send in flight per descriptor keeps the stream in order,
+			// the rest wait for it to complete
+			if (m_pendingWrites.empty() || m_pendingWrites.front() != ctx) {
+				m_pendingWrites.push_back(ctx);
+				if (m_pendingWrites.size() > 1) {
+					m_inflight++;
+					return true;
+				}
+			}
+		}
+
+		// Resubmissions of a request that never reported back are already
+		// counted. The rest is counted up front, another worker may reap the
+		// completion before Submit even returns
+		bool counted = !(ctx->operation == IOCP::IOOperation::SEND && ctx->offset != 0);
+		if (counted)
+			m_inflight++;
+
+		auto fd = m_socket;
+		auto submitted = gs_rings[m_queue]->Submit([ctx, fd](io_uring_sqe* sqe) {
+			sqe->fd = fd;
+			sqe->user_data = reinterpret_cast<std::uint64_t>(ctx);
+
+			switch (ctx->operation) {
+				case IOCP::IOOperation::ACCEPT: {
+					sqe->opcode = IORING_OP_ACCEPT;
+					sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+					sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+					break;
+				} case IOCP::IOOperation::RECV: {
+					// The kernel picks a provided buffer once data arrives
+					sqe->opcode = IORING_OP_RECV;
+					sqe->flags = IOSQE_BUFFER_SELECT;
+					sqe->buf_group = IOUring::Ring::BUFFER_GROUP;
+					sqe->ioprio = IORING_RECV_MULTISHOT;
+					break;
+				} case IOCP::IOOperation::SEND: {
+					if (ctx->segments.empty()) {
+						sqe->opcode = IORING_OP_SEND;
+						sqe->addr = reinterpret_cast<std::uint64_t>(ctx->buffer.data() + ctx->offset);
+						sqe->len = static_cast<std::uint32_t>(ctx->buffer.size() - ctx->offset);
+					} else {
+						// The message lives in the context until the send completes
+						sqe->opcode = IORING_OP_SENDMSG;
+						sqe->addr = reinterpret_cast<std::uint64_t>(ctx->PendingMessage());
+						sqe->len = 1;
+					}
+					sqe->msg_flags = MSG_NOSIGNAL;
+					break;
+				} case IOCP::IOOperation::CONNECT: {
+					// Wait for the non-blocking connect to settle
+					sqe->opcode = IORING_OP_POLL_ADD;
+					sqe->poll32_events = POLLOUT;
+					break;
+				} case IOCP::IOOperation::SEND_FILE:
+				case IOCP::IOOperation::SEND_TO: {
+					// No sendfile or sendmmsg opcode; wait for room and send it
+					// from here
+					sqe->opcode = IORING_OP_POLL_ADD;
+					sqe->poll32_events = POLLOUT;
+					break;
+				} case IOCP::IOOperation::RECV_FROM: {
+					// Same for recvmmsg, once datagrams are there
+					sqe->opcode = IORING_OP_POLL_ADD;
+					sqe->poll32_events = POLLIN;
+					break;
+				} default: {
+					sqe->opcode = IORING_OP_NOP;
+					break;
+				}
+			}
+		});
+		if (!submitted) {
+			if (counted)
+				ReleaseInflight();
+			if (IsWriteOperation(ctx->operation))
+				m_pendingWrites.pop_front();
+			return false;
+		}
+		return true;
+	}
+
+	void Socket::SubmitNextWrite() noexcept {
+		IOCP::IOContext* next = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_ioMutex);
+			if (!m_pendingWrites.empty())
+				m_pendingWrites.pop_front();
+			if (!m_pendingWrites.empty())
+				next = m_pendingWrites.front();
+		}
+		if (next && SubmitRing(next))
+			ReleaseInflight();
+	}
+
+	void Socket::OnRingCompletion(
+		IOUring::Ring& ring,
+		const io_uring_cqe& cqe
+	) noexcept {
+		auto ctx = reinterpret_cast<IOCP::IOContext*>(cqe.user_data);
+
+		// Wake ups and cancellations carry no context
+		if (!ctx)
+			return;
+
+		// Its socket is gone, only the provided buffer is still of use
+		if (ctx->orphaned) {
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+				ring.ReturnBuffer(static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				ctx->destroy(ctx);
+			return;
+		}
+
+		// Handed over by Post, the no-op itself has nothing to report
+		if (ctx->posted.has_value()) {
+			auto target = ctx->target;
+			Socket::Dispatch(ctx, 0, *std::exchange(ctx->posted, std::nullopt));
+			target->ReleaseInflight();
+			return;
+		}
+
+		auto target = ctx->target;
+		bool more = cqe.flags & IORING_CQE_F_MORE;
+
+		// Only healthy accepts and receives keep going
+		bool healthy = false;
+		std::uint32_t bytesTransferred = 0;
+		std::uint32_t error = 0;
+
+		std::optional<std::uint16_t> bufferId;
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			bufferId = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			ctx->selected = ring.GetBuffer(*bufferId);
+		}
+
+		switch (ctx->operation) {
+			case IOCP::IOOperation::ACCEPT: {
+				if (cqe.res >= 0) {
+					ctx->socket = cqe.res;
+					healthy = true;
+
+					// A multishot accept has nowhere to put each peer address
+					ctx->address.length = sizeof(ctx->address.storage);
+					if (getpeername(ctx->socket, ctx->address.Get(), &ctx->address.length) == SOCKET_ERROR)
+						ctx->address = {};
+				} else {
+					error = static_cast<std::uint32_t>(-cqe.res);
+				}
+				break;
+			} case IOCP::IOOperation::RECV: {
+				if (cqe.res == -ENOBUFS && !more) {
+					// The buffer ring ran dry before anything was read
+					if (target->SubmitRing(ctx)) {
+						target->ReleaseInflight();
+						return;
+					}
+				}
+
+				if (cqe.res >= 0) {
+					bytesTransferred = static_cast<std::uint32_t>(cqe.res);
+					// End of stream finishes the receive for good
+					healthy = cqe.res > 0;
+				} else {
+					error = static_cast<std::uint32_t>(-cqe.res);
+				}
+				break;
+			} case IOCP::IOOperation::SEND: {
+				if (cqe.res < 0) {
+					error = static_cast<std::uint32_t>(-cqe.res);
+				} else {
+					ctx->offset += static_cast<std::size_t>(cqe.res);
+
+					// Short write, push the rest out before reporting back
+					if (cqe.res > 0 && ctx->offset < ctx->Size() && target->SubmitRing(ctx))
+						return;
+
+					bytesTransferred = static_cast<std::uint32_t>(ctx->offset);
+				}
+
+				target->SubmitNextWrite();
+				break;
+			} case IOCP::IOOperation::SEND_FILE:
+			case IOCP::IOOperation::SEND_TO: {
+				if (cqe.res < 0) {
+					error = static_cast<std::uint32_t>(-cqe.res);
+				} else if (!target->TryComplete(ctx, bytesTransferred, error)) {
+					// The socket buffer filled up again, wait for more room
+					if (target->SubmitRing(ctx)) {
+						target->ReleaseInflight();
+						return;
+					}
+					error = ECANCELED;
+				}
+
+				target->SubmitNextWrite();
+				break;
+			} case IOCP::IOOperation::CONNECT: {
+				if (cqe.res < 0) {
+					error = static_cast<std::uint32_t>(-cqe.res);
+				} else if (!target->TryComplete(ctx, bytesTransferred, error)) {
+					// Spurious wake up, keep waiting for the handshake
+					if (target->SubmitRing(ctx)) {
+						target->ReleaseInflight();
+						return;
+					}
+					error = ECANCELED;
+				}
+				break;
+			} case IOCP::IOOperation::RECV_FROM: {
+				if (cqe.res < 0) {
+					error = static_cast<std::uint32_t>(-cqe.res);
+				} else if (!target->TryComplete(ctx, bytesTransferred, error)) {
+					// Nothing left to take in after all, wait for more
+					if (target->SubmitRing(ctx)) {
+						target->ReleaseInflight();
+						return;
+					}
+					error = ECANCELED;
+				}
+				break;
+			} default: {
+				break;
+			}
+		}
+
+		// Multishot requests may also end on their own, e.g. on CQ overflow;
+		// re-arm them while the socket is healthy
+		bool rearm = !more && healthy && target->SubmitRing(ctx);
+		ctx->multishot = more || rearm;
+
+		bool keep = ctx->multishot;
+		Socket::Dispatch(ctx, bytesTransferred, error);
+
+		if (keep)
+			ctx->selected = nullptr;
+		if (bufferId)
+			ring.ReturnBuffer(*bufferId);
+		if (!more)
+			target->ReleaseInflight();
+	}
+
+#pragma endregion
+#endif
+
+#pragma region Socket details
+
+	bool Socket::SetEngine(Engine engine) noexcept {
+		std::lock_guard<std::mutex> lock(gs_globalMutex);
+
+		// The workers of the running engine would be left behind
+		if (gs_socketCount != 0)
+			return false;
+
+#if NSA_USE_WINDOWS
+		if (engine != Engine::IOCP)
+			return false;
+#else
+		if (engine == Engine::IOCP)
+			return false;
+#endif
+		gs_engine = engine;
+		return true;
+	}
+
+	bool Socket::SetSendQueueConfig(const SendQueueConfig& config) noexcept {
+		std::lock_guard<std::mutex> lock(gs_globalMutex);
+
+		// Read without locking on every send
+		if (gs_socketCount != 0)
+			return false;
+
+		if (config.maxInflight == 0 || config.lowWatermark > config.highWatermark)
+			return false;
+
+		gs_sendQueueConfig = config;
+		return true;
+	}
+
+	Socket::Socket() noexcept
+		: m_socket(INVALID_SOCKET), m_host(""), m_port(0)
+	{
+		Socket::Startup();
+	}
+
+	bool Socket::Create(
+		AddressFamily family,
+		SocketType type,
+		std::optional<std::uint32_t> queue
+	) noexcept {
+		if (m_socket != INVALID_SOCKET)
+			return false;
+
+		int protocol;
+		switch (type) {
+			case SocketType::TCP:
+				protocol = IPPROTO_TCP;
+				break;
+			case SocketType::UDP:
+				protocol = IPPROTO_UDP;
+				break;
+			default:
+				protocol = IPPROTO_RAW;
+		}
+
+#if NSA_USE_WINDOWS
+		m_socket = WSASocketW(
+			std::to_underlying(family),
+			std::to_underlying(type),
+			protocol,
+			nullptr,
+			0,
+			WSA_FLAG_OVERLAPPED
+		);
+
+		if (m_socket == INVALID_SOCKET) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"WSASocketW error: {}",
+				Shared::Utils::GetLastWSAErrorString()
+			);
+#endif
+			return false;
+		}
+
+		if (!SetFileCompletionNotificationModes(
+			reinterpret_cast<HANDLE>(m_socket),
+			FILE_SKIP_COMPLETION_PORT_ON_SUCCESS
+		)) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"SetFileCompletionNotificationModes error: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			return false;
+		}
+
+		m_family = family;
+		Socket::EnableDualStack(m_socket, family);
+
+		bool res = AssociateIOCP(queue);
+		Socket::gs_workersRunning = true;
+		std::ranges::for_each(Socket::gs_workers, ResumeThread);
+
+		return res;
+#else
+		m_socket = socket(
+			std::to_underlying(family),
+			std::to_underlying(type) | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			protocol
+		);
+
+		if (m_socket == INVALID_SOCKET) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"socket error: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			return false;
+		}
+
+		m_family = family;
+		Socket::EnableDualStack(m_socket, family);
+
+		return AssociateIOCP(queue);
+#endif
+	}
+
+	bool Socket::Attach(SockType socket, std::optional<std::uint32_t> queue) noexcept {
+		if (m_socket != INVALID_SOCKET || socket == INVALID_SOCKET)
+			return false;
+
+		auto local = Socket::GetLocalAddress(socket);
+		if (!local.has_value())
+			return false;
+
+#if NSA_USE_WINDOWS
+		if (!SetFileCompletionNotificationModes(
+			reinterpret_cast<HANDLE>(socket),
+			FILE_SKIP_COMPLETION_PORT_ON_SUCCESS
+		)) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"SetFileCompletionNotificationModes error: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			return false;
+		}
+#else
+		// Whoever created it decided its flags, the workers never block
+		auto flags = fcntl(socket, F_GETFL);
+		if (flags == -1 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"fcntl error: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			return false;
+		}
+		fcntl(socket, F_SETFD, FD_CLOEXEC);
+#endif
+
+		m_socket = socket;
+		if (!AssociateIOCP(queue)) {
+			m_socket = INVALID_SOCKET;
+			ReleaseQueue();
+			return false;
+		}
+		m_family = static_cast<AddressFamily>(local->Family());
+
+#if NSA_USE_WINDOWS
+		Socket::gs_workersRunning = true;
+		std::ranges::for_each(Socket::gs_workers, ResumeThread);
+#endif
+		return true;
+	}
+
+	Socket::Socket(SockType&& socket) noexcept : m_host(""), m_port(0) {
+		std::swap(m_socket, socket);
+	}
+
+	Socket::Socket(Socket&& socket) noexcept : m_host(""), m_port(0) {
+		std::swap(m_socket, socket.m_socket);
+		std::swap(m_queue, socket.m_queue);
+		std::swap(m_lastQueue, socket.m_lastQueue);
+		std::swap(m_family, socket.m_family);
+		std::swap(m_address, socket.m_address);
+	}
+
+	Socket::~Socket() noexcept {
+		// The derived part is gone, so pending operations must not call back
+		CloseInternal(false);
+		this->WaitForPending();
+
+		// Destroyed on its own worker, with completions still queued there.
+		// Their contexts go to the worker, which releases them as they come
+		// in; held receives and armed timers are not out anywhere
+		bool orphan = m_inflight != 0;
+#if NSA_USE_LINUX
+		if (orphan && gs_engine == Engine::EPOLL)
+			t_destroyed.push_back(this);
+#endif
+
+		while (m_postedCtx) {
+			auto ctx = m_postedCtx;
+			m_postedCtx = ctx->next;
+
+			// PostAfter only ever arms the wheel of the target's own worker
+			bool armed = m_lastQueue < gs_wheels.size() && gs_wheels[m_lastQueue]->Remove(ctx);
+			if (orphan && !armed && std::ranges::find(m_heldRecvs, ctx) == m_heldRecvs.end()) {
+				ctx->orphaned = true;
+				continue;
+			}
+			ctx->destroy(ctx);
+		}
+
+		Socket::Cleanup();
+	}
+
+	bool Socket::Close() noexcept {
+		return CloseInternal(true);
+	}
+
+	bool Socket::Detach() noexcept {
+		return CloseInternal(true, false);
+	}
+
+	bool Socket::CloseInternal(bool notifyPending, bool shutdown) noexcept {
+		DropQueuedSends();
+
+#if NSA_USE_WINDOWS
+		// Aborted operations are reported through the completion port
+		(void)notifyPending;
+
+		if (m_socket == INVALID_SOCKET)
+			return true;
+
+		// Closing a shared socket leaves its operations running
+		CancelIoEx(reinterpret_cast<HANDLE>(m_socket), nullptr);
+
+		// Listening or never connected sockets have nothing to shut down
+		if (shutdown)
+			::shutdown(m_socket, SD_BOTH);
+
+		if (closesocket(m_socket) == SOCKET_ERROR)
+			return false;
+
+		m_socket = INVALID_SOCKET;
+		ReleaseQueue();
+#else
+		std::deque<IOCP::IOContext*> cancelled;
+		{
+			std::lock_guard<std::mutex> lock(m_ioMutex);
+			if (m_socket == INVALID_SOCKET)
+				return true;
+
+			if (gs_engine == Engine::IO_URING) {
+				// Operations owned by the kernel complete with -ECANCELED
+				auto fd = m_socket;
+				gs_rings[m_queue]->Submit([fd](io_uring_sqe* sqe) {
+					sqe->opcode = IORING_OP_ASYNC_CANCEL;
+					sqe->fd = fd;
+					sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+					sqe->user_data = 0;
+				}, true);
+
+				// Sends queued behind the one in flight never reached the kernel
+				if (!m_pendingWrites.empty()) {
+					cancelled.assign(m_pendingWrites.begin() + 1, m_pendingWrites.end());
+					m_pendingWrites.resize(1);
+				}
+			} else {
+				cancelled.swap(m_pendingReads);
+				cancelled.insert(cancelled.end(), m_pendingWrites.begin(), m_pendingWrites.end());
+				m_pendingWrites.clear();
+			}
+
+			// Listening or never connected sockets have nothing to shut down.
+			// Shared ones outlive the close, as does their epoll registration
+			// with the open file, so it has to go explicitly
+			if (shutdown)
+				::shutdown(m_socket, SHUT_RDWR);
+			else if (gs_engine == Engine::EPOLL)
+				epoll_ctl(gs_epolls[m_queue], EPOLL_CTL_DEL, m_socket, nullptr);
+
+			// The descriptor is released even if close reports an error
+			close(m_socket);
+			m_socket = INVALID_SOCKET;
+
+			// Its readiness may already be on the way through the worker,
+			// which is done with it once this comes back
+			if (gs_engine == Engine::EPOLL) {
+				auto barrier = Track<TaskContext>(this);
+				barrier->operation = IOCP::IOOperation::TASK;
+				if (!Socket::Post(barrier, 0))
+					Socket::Release(barrier);
+			}
+			ReleaseQueue();
+		}
+
+		// Report aborted operations the way the completion port does
+		for (auto ctx : cancelled) {
+			if (notifyPending)
+				Socket::Dispatch(ctx, 0, ECANCELED);
+			ReleaseInflight();
+		}
+#endif
+		return true;
+	}
+
+	Socket::SockType Socket::GetSocket() const noexcept { return m_socket; }
+
+	bool Socket::IsOpen() const noexcept { return m_socket != INVALID_SOCKET; }
+
+	void Socket::Release(IOCP::IOContext* ctx) noexcept {
+		auto target = ctx->target;
+		{
+			std::lock_guard<std::mutex> lock(target->m_ctxMutex);
+			if (ctx->prev)
+				ctx->prev->next = ctx->next;
+			else
+				target->m_postedCtx = ctx->next;
+
+			if (ctx->next)
+				ctx->next->prev = ctx->prev;
+		}
+		ctx->destroy(ctx);
+	}
+
+	void Socket::Complete(
+		IOCP::IOContext* ctx,
+		std::uint32_t bytesTransferred,
+		std::uint32_t error
+	) noexcept {
+		if (ctx->sequence == 0) {
+			Socket::Deliver(ctx, bytesTransferred, error);
+			return;
+		}
+
+		// The owner may release the context, the target outlives it
+		auto target = ctx->target;
+		{
+			std::lock_guard<std::mutex> lock(target->m_recvMutex);
+			// An earlier receive is still out, or being handed over
+			if (ctx->sequence != target->m_recvDelivered + 1) {
+				ctx->deferredBytes = bytesTransferred;
+				ctx->deferredError = error;
+				target->m_heldRecvs.push_back(ctx);
+				return;
+			}
+		}
+
+		while (ctx) {
+			Socket::Deliver(ctx, bytesTransferred, error);
+
+			std::lock_guard<std::mutex> lock(target->m_recvMutex);
+			auto next = ++target->m_recvDelivered + 1;
+			auto held = std::ranges::find(target->m_heldRecvs, next, &IOCP::IOContext::sequence);
+			if (held == target->m_heldRecvs.end())
+				break;
+
+			ctx = *held;
+			bytesTransferred = ctx->deferredBytes;
+			error = ctx->deferredError;
+			target->m_heldRecvs.erase(held);
+		}
+	}
+
+	namespace {
+		// Ends the strand queue while a thread is running it
+		IOCP::IOContext* const STRAND_RUNNING = reinterpret_cast<IOCP::IOContext*>(std::uintptr_t(1));
+	}
+
+	void Socket::Deliver(
+		IOCP::IOContext* ctx,
+		std::uint32_t bytesTransferred,
+		std::uint32_t error
+	) noexcept {
+		auto target = ctx->target;
+		if (!target->IsStranded()) {
+			Socket::Run(ctx, bytesTransferred, error);
+			return;
+		}
+
+		// The thread finding the strand idle runs it, anyone else queues up
+		auto head = target->m_strandQueue.load(std::memory_order_relaxed);
+		while (true) {
+			if (head == nullptr) {
+				if (!target->m_strandQueue.compare_exchange_weak(
+					head,
+					STRAND_RUNNING,
+					std::memory_order_acquire,
+					std::memory_order_relaxed
+				))
+					continue;
+
+				Socket::Run(ctx, bytesTransferred, error);
+				target->RunStrand();
+				return;
+			}
+
+			// Multishot contexts come back with the next completion, and ring
+			// buffers go back once this returns, so neither can wait as is
+			if (ctx->multishot && !ctx->detached) {
+				ctx = ctx->detach(ctx, bytesTransferred);
+				ctx->detached = true;
+			}
+#if NSA_USE_LINUX
+			else if (ctx->selected) {
+				ctx->buffer.assign(ctx->selected, ctx->selected + bytesTransferred);
+				ctx->selected = nullptr;
+			}
+#endif
+
+			ctx->deferredBytes = bytesTransferred;
+			ctx->deferredError = error;
+			ctx->strandNext = head;
+			if (target->m_strandQueue.compare_exchange_weak(
+				head,
+				ctx,
+				std::memory_order_release,
+				std::memory_order_relaxed
+			))
+				return;
+		}
+	}
+
+	void Socket::Run(
+		IOCP::IOContext* ctx,
+		std::uint32_t bytesTransferred,
+		std::uint32_t error
+	) noexcept {
+		if (ctx->operation != IOCP::IOOperation::TASK) {
+			// Copies stay multishot so the handler leaves the operation be
+			auto detached = ctx->detached;
+			ctx->owner->OnIOCompleted(ctx, bytesTransferred, error);
+			if (detached)
+				Socket::Release(ctx);
+			return;
+		}
+
+		auto task = static_cast<TaskContext*>(ctx);
+		if (task->task)
+			task->task();
+		Socket::Release(ctx);
+	}
+
+	void Socket::RunStrand() noexcept {
+		while (true) {
+			auto batch = m_strandQueue.exchange(STRAND_RUNNING, std::memory_order_acquire);
+			if (batch == STRAND_RUNNING) {
+				// Nothing came in since the last batch, unless the marker moved
+				auto expected = STRAND_RUNNING;
+				if (m_strandQueue.compare_exchange_strong(
+					expected,
+					nullptr,
+					std::memory_order_release,
+					std::memory_order_relaxed
+				))
+					return;
+
+				continue;
+			}
+
+			// Queued newest first
+			IOCP::IOContext* ordered = nullptr;
+			while (batch != STRAND_RUNNING) {
+				auto next = std::exchange(batch->strandNext, ordered);
+				ordered = std::exchange(batch, next);
+			}
+
+			while (ordered) {
+				auto ctx = std::exchange(ordered, ordered->strandNext);
+				ctx->strandNext = nullptr;
+				Socket::Run(ctx, ctx->deferredBytes, ctx->deferredError);
+			}
+		}
+	}
+
+	void Socket::UseStrand(bool enabled) noexcept {
+		m_stranded.store(enabled, std::memory_order_relaxed);
+	}
+
+	bool Socket::Execute(std::function<void()> task) noexcept {
+		auto ctx = Track<TaskContext>(this);
+		ctx->operation = IOCP::IOOperation::TASK;
+		ctx->task = std::move(task);
+
+		if (!Socket::Post(ctx, 0)) {
+			Socket::Release(ctx);
+			return false;
+		}
+		return true;
+	}
+
+	bool Socket::PostSend(IOCP::IOContext* ctx) noexcept {
+#if NSA_USE_WINDOWS
+		if (ctx->operation == IOCP::IOOperation::SEND_TO) {
+			// A WSASendTo per datagram; the ones done right away report no
+			// completion, so the loop moves straight on to the next
+			while (ctx->offset < ctx->datagrams.size()) {
+				auto& datagram = ctx->datagrams[ctx->offset];
+				ctx->wsabuf.buf = const_cast<char*>(datagram.data.data());
+				ctx->wsabuf.len = static_cast<ULONG>(datagram.data.size());
+
+				// Counted until the port reports back. Done right away or
+				// failed, it reports nothing
+				ctx->target->m_inflight++;
+
+				DWORD bytesSent = 0;
+				if (WSASendTo(
+					ctx->target->GetSocket(),
+					&ctx->wsabuf,
+					1,
+					&bytesSent,
+					0,
+					datagram.peer.Get(),
+					datagram.peer.length,
+					&ctx->overlapped,
+					nullptr
+				) == SOCKET_ERROR) {
+					auto err = WSAGetLastError();
+					if (err == WSA_IO_PENDING)
+						return true;
+
+					ctx->target->ReleaseInflight();
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"WSASendTo failed: {}",
+						Shared::Utils::GetLastWSAErrorString(err)
+					);
+#endif
+					// Skip what the network refused, unless the socket is gone
+					if (err == WSAENOTSOCK || err == WSAENETDOWN || err == WSAEWOULDBLOCK)
+						return false;
+				} else {
+					ctx->target->ReleaseInflight();
+				}
+
+				ctx->offset++;
+				memset(&ctx->overlapped, 0, sizeof(ctx->overlapped));
+			}
+
+			// Datagrams rather than bytes
+			Socket::Complete(ctx, static_cast<std::uint32_t>(ctx->offset), 0);
+			return true;
+		}
+
+		if (ctx->operation == IOCP::IOOperation::SEND_FILE) {
+			auto TransmitFile = Socket::GetTransmitFilePtr(ctx->target->GetSocket());
+			if (!TransmitFile) {
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"GetTransmitFilePtr failed: {}",
+					Shared::Utils::GetLastErrorString()
+				);
+#endif
+				return false;
+			}
+
+			// The file position travels in the OVERLAPPED
+			auto position = ctx->fileOffset + ctx->offset;
+			ctx->overlapped.Offset = static_cast<DWORD>(position);
+			ctx->overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+
+			ctx->target->m_inflight++;
+			if (!TransmitFile(
+				ctx->target->GetSocket(),
+				ctx->file,
+				static_cast<DWORD>(std::min(ctx->fileLength - ctx->offset, IOCP::MAX_TRANSMIT_SIZE)),
+				0,
+				&ctx->overlapped,
+				nullptr,
+				0
+			)) {
+				auto err = WSAGetLastError();
+				if (err != WSA_IO_PENDING) {
+					ctx->target->ReleaseInflight();
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"TransmitFile failed: {}",
+						Shared::Utils::GetLastWSAErrorString(err)
+					);
+#endif
+					return false;
+				}
+			} else {
+				ctx->target->ReleaseInflight();
+
+				auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
+				auto error = Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal));
+
+				if (!Socket::ContinueTransmit(ctx, bytesTransferred, error))
+					Socket::Complete(ctx, bytesTransferred, error);
+			}
+			return true;
+		}
+
+		WSABUF* buffers = &ctx->wsabuf;
+		DWORD count = 1;
+
+		if (ctx->segments.empty()) {
+			ctx->wsabuf.buf = ctx->buffer.data();
+			ctx->wsabuf.len = static_cast<ULONG>(ctx->buffer.size());
+		} else {
+			ctx->wsabufs.clear();
+			for (auto& segment : ctx->segments) {
+				ctx->wsabufs.push_back({
+					static_cast<ULONG>(segment->size()),
+					segment->data()
+				});
+			}
+			buffers = ctx->wsabufs.data();
+			count = static_cast<DWORD>(ctx->wsabufs.size());
+		}
+
+		ctx->target->m_inflight++;
+
+		DWORD bytesSent = 0;
+		if (WSASend(
+			ctx->target->GetSocket(),
+			buffers,
+			count,
+			&bytesSent,
+			0,
+			&ctx->overlapped,
+			nullptr
+		) == SOCKET_ERROR) {
+			auto err = WSAGetLastError();
+			if (err != WSA_IO_PENDING) {
+				ctx->target->ReleaseInflight();
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"WSASend failed: {}",
+					Shared::Utils::GetLastWSAErrorString(err)
+				);
+#endif
+				return false;
+			}
+		} else {
+			ctx->target->ReleaseInflight();
+
+			auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
+			if (ctx->segments.empty())
+				ctx->buffer.resize(bytesTransferred);
+
+			Socket::Complete(
+				ctx,
+				bytesTransferred,
+				Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal))
+			);
+		}
+		return true;
+#else
+		return Socket::Submit(ctx->target, ctx);
+#endif
+	}
+
+	bool Socket::PostRecv(IOCP::IOContext* ctx) noexcept {
+#if NSA_USE_WINDOWS
+		auto target = ctx->target;
+		ctx->wsabuf.buf = ctx->buffer.data();
+		ctx->wsabuf.len = static_cast<ULONG>(ctx->buffer.size());
+
+		// Receives are filled in the order they are posted in, which the
+		// numbering has to match
+		std::unique_lock<std::mutex> lock(target->m_recvMutex);
+		ctx->sequence = ++target->m_recvPosted;
+
+		target->m_inflight++;
+
+		DWORD flags = 0;
+		DWORD bytesReceived = 0;
+		if (WSARecv(
+			target->GetSocket(),
+			&ctx->wsabuf,
+			1,
+			&bytesReceived,
+			&flags,
+			&ctx->overlapped,
+			nullptr
+		) == SOCKET_ERROR) {
+			auto err = WSAGetLastError();
+			if (err != WSA_IO_PENDING) {
+				// Nothing will complete under this number
+				target->m_recvPosted--;
+				target->ReleaseInflight();
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"WSARecv failed: {}",
+					Shared::Utils::GetLastWSAErrorString(err)
+				);
+#endif
+				return false;
+			}
+		} else {
+			lock.unlock();
+			target->ReleaseInflight();
+
+			auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
+			ctx->buffer.resize(bytesTransferred);
+
+			Socket::Complete(
+				ctx,
+				bytesTransferred,
+				Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal))
+			);
+		}
+		return true;
+#else
+		return Socket::Submit(ctx->target, ctx);
+#endif
+	}
+
+	bool Socket::QueueSend(IOCP::IOContext* ctx) noexcept {
+		auto target = ctx->target;
+		auto& config = gs_sendQueueConfig;
+		ctx->queued = ctx->Size();
+
+		bool post = false;
+		Socket* congested = nullptr;
+		std::size_t unsent = 0;
+		{
+			std::lock_guard<std::mutex> lock(target->m_sendMutex);
+			unsent = target->m_unsentBytes.fetch_add(ctx->queued, std::memory_order_relaxed) + ctx->queued;
+			if (!target->m_congestedBy && unsent >= config.highWatermark)
+				target->m_congestedBy = congested = ctx->owner;
+
+			// Nothing may overtake the sends already waiting
+			if (target->m_queuedSends.empty() && target->m_sendsInflight < config.maxInflight) {
+				target->m_sendsInflight++;
+				post = true;
+			} else {
+				target->m_queuedSends.push_back(ctx);
+			}
+		}
+
+		// Raised on the sending thread, a strand has its worker take it in
+		// turn instead. Without a queue there is nothing it could overlap
+		if (congested && !(target->IsStranded() && target->Execute([congested, target, unsent] {
+			congested->OnSendBacklog(target, unsent, true);
+		})))
+			congested->OnSendBacklog(target, unsent, true);
+
+		if (post && !Socket::PostSend(ctx)) {
+			Socket::CompleteSend(ctx, true);
+			Socket::Release(ctx);
+			return false;
+		}
+		return true;
+	}
+
+	void Socket::CompleteSend(IOCP::IOContext* ctx, bool failed) noexcept {
+		auto target = ctx->target;
+		auto& config = gs_sendQueueConfig;
+
+		IOCP::IOContext* next = nullptr;
+		Socket* writable = nullptr;
+		std::size_t unsent = 0;
+		{
+			std::lock_guard<std::mutex> lock(target->m_sendMutex);
+			target->m_sendsInflight--;
+			unsent = target->m_unsentBytes.fetch_sub(ctx->queued, std::memory_order_relaxed) - ctx->queued;
+
+			if (target->m_congestedBy && unsent <= config.lowWatermark)
+				writable = std::exchange(target->m_congestedBy, nullptr);
+
+			auto& queue = target->m_queuedSends;
+			if (!failed && !queue.empty() && target->m_sendsInflight < config.maxInflight) {
+				next = queue.front();
+				queue.pop_front();
+
+				// Merge the writes behind it into one send; only the ones of the
+				// same owner, the completion is reported to a single socket
+				while (!queue.empty()) {
+					auto waiting = queue.front();
+					if (waiting->owner != next->owner || next->queued + waiting->queued > config.maxCoalesced)
+						break;
+					// Files and datagram batches go out on their own
+					if (next->operation != IOCP::IOOperation::SEND || waiting->operation != IOCP::IOOperation::SEND)
+						break;
+
+					queue.pop_front();
+					if (next->segments.empty() && waiting->segments.empty()) {
+						// Small copied writes stay one contiguous buffer
+						next->buffer.insert(next->buffer.end(), waiting->buffer.begin(), waiting->buffer.end());
+					} else {
+						if (next->segments.empty() && !next->buffer.empty())
+							next->segments.push_back(std::make_shared<IOCP::Buffer>(std::move(next->buffer)));
+
+						if (waiting->segments.empty())
+							next->segments.push_back(std::make_shared<IOCP::Buffer>(std::move(waiting->buffer)));
+						else
+							next->segments.insert(next->segments.end(), waiting->segments.begin(), waiting->segments.end());
+					}
+					next->queued += waiting->queued;
+
+					Socket::Release(waiting);
+				}
+				target->m_sendsInflight++;
+			}
+		}
+
+		if (writable)
+			writable->OnSendBacklog(target, unsent, false);
+
+		// Whatever waits behind a failed send would fail as well
+		if (failed) {
+			target->DropQueuedSends();
+			return;
+		}
+
+		if (next && !Socket::PostSend(next)) {
+			Socket::CompleteSend(next, true);
+			Socket::Release(next);
+		}
+	}
+
+	void Socket::DropQueuedSends() noexcept {
+		std::deque<IOCP::IOContext*> dropped;
+		{
+			std::lock_guard<std::mutex> lock(m_sendMutex);
+			dropped.swap(m_queuedSends);
+			for (auto ctx : dropped)
+				m_unsentBytes.fetch_sub(ctx->queued, std::memory_order_relaxed);
+		}
+
+		for (auto ctx : dropped)
+			Socket::Release(ctx);
+	}
+
+	std::optional<std::pair<std::string, std::uint32_t>> Socket::GetSocketAddress(
+		SockType sock
+	) noexcept {
+		IOCP::Address peer;
+		peer.length = sizeof(peer.storage);
+
+		if (getpeername(sock, peer.Get(), &peer.length) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+#if NSA_USE_WINDOWS
+			auto wsaErr = WSAGetLastError();
+#else
+			auto wsaErr = errno;
+#endif
+			std::println(
+				stderr,
+				"getpeername failed: {} ({})",
+				Shared::Utils::GetLastWSAErrorString(wsaErr),
+				wsaErr
+			);
+#endif
+			return std::nullopt;
+		}
+
+		auto formatted = peer.Format();
+		if (!formatted.has_value()) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"getnameinfo failed: {}",
+				Shared::Utils::GetLastWSAErrorString()
+			);
+#endif
+			return std::nullopt;
+		}
+		return formatted;
+	}
+
+	std::optional<IOCP::Address> Socket::GetLocalAddress(SockType sock) noexcept {
+		IOCP::Address local;
+		local.length = sizeof(local.storage);
+
+		if (getsockname(sock, local.Get(), &local.length) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"getsockname failed: {}",
+				Shared::Utils::GetLastWSAErrorString()
+			);
+#endif
+			return std::nullopt;
+		}
+		return local;
+	}
+
+	std::string_view Socket::GetHost() const noexcept {
+		std::lock_guard<std::mutex> lock(m_hostMutex);
+		// Formatted on first use, most accepted peers are never asked for it
+		if (m_host.empty() && m_address.length != 0) {
+			if (auto formatted = m_address.Format())
+				m_host = std::move(formatted->first);
+		}
+		return m_host;
+	}
+
+	void Socket::SetAddress(const IOCP::Address& address) noexcept {
+		std::lock_guard<std::mutex> lock(m_hostMutex);
+		m_address = address;
+		m_host.clear();
+		m_port = address.GetPort();
+
+		if (m_family == AddressFamily::UNSPECIFIED)
+			m_family = static_cast<AddressFamily>(address.Family());
+	}
+
+	void Socket::EnableDualStack(SockType sock, AddressFamily family) noexcept {
+		if (family != AddressFamily::IPV6)
+			return;
+
+		// Windows defaults to IPv6 only, most Linux systems do not
+		int v6Only = 0;
+		if (setsockopt(
+			sock,
+			IPPROTO_IPV6,
+			IPV6_V6ONLY,
+			reinterpret_cast<const char*>(&v6Only),
+			sizeof(v6Only)
+		) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"IPV6_V6ONLY failed: {}",
+				Shared::Utils::GetLastWSAErrorString()
+			);
+#endif
+		}
+	}
+
+	bool Socket::SwapDescriptor(Socket* other) noexcept {
+		assert(m_queue == other->m_queue && "descriptors on different queues");
+		std::swap(m_socket, other->m_socket);
+
+#if NSA_USE_LINUX
+		// Readiness is reported to whoever registered the descriptor
+		if (gs_engine == Engine::EPOLL) {
+			for (auto sock : { this, other }) {
+				if (sock->m_socket == INVALID_SOCKET)
+					continue;
+
+				epoll_event event{};
+				event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+				event.data.ptr = sock;
+
+				if (epoll_ctl(
+					Socket::gs_epolls[sock->m_queue],
+					EPOLL_CTL_MOD,
+					sock->m_socket,
+					&event
+				) == SOCKET_ERROR)
+					return false;
+			}
+		}
+#endif
+		return true;
+	}
+
+	void swap(Socket& lhs, Socket& rhs) noexcept {
 		std::swap(lhs.m_socket, rhs.m_socket);
+		std::swap(lhs.m_queue, rhs.m_queue);
+		std::swap(lhs.m_lastQueue, rhs.m_lastQueue);
+		std::swap(lhs.m_family, rhs.m_family);
+		std::swap(lhs.m_address, rhs.m_address);
+	}
+
+#if NSA_USE_WINDOWS
+	void* Socket::GetWinsockFunctionPtr(SockType sock, GUID guid) noexcept {
+		void* func = nullptr;
+
+		DWORD bytes = 0;
+		if (WSAIoctl(
+			sock,
+			SIO_GET_EXTENSION_FUNCTION_POINTER,
+			&guid,
+			sizeof(guid),
+			&func,
+			sizeof(func),
+			&bytes,
+			nullptr,
+			nullptr
+		) == SOCKET_ERROR)
+			return nullptr;
+
+		return func;
+	}
+
+	LPFN_TRANSMITFILE Socket::GetTransmitFilePtr(SockType sock) noexcept {
+		static auto func = reinterpret_cast<LPFN_TRANSMITFILE>(
+			GetWinsockFunctionPtr(sock, WSAID_TRANSMITFILE)
+		);
+		return func;
+	}
+
+	bool Socket::ContinueTransmit(
+		IOCP::IOContext* ctx,
+		std::uint32_t bytesTransferred,
+		std::uint32_t& error
+	) noexcept {
+		if (ctx->operation == IOCP::IOOperation::SEND_TO) {
+			// A datagram the network refused does not hold back the rest
+			if (error == ERROR_OPERATION_ABORTED || ++ctx->offset >= ctx->datagrams.size())
+				return false;
+
+			error = 0;
+		} else {
+			if (error != 0)
+				return false;
+
+			ctx->offset += bytesTransferred;
+			if (ctx->offset >= ctx->fileLength)
+				return false;
+
+			// The file got shorter since the send was queued
+			if (bytesTransferred == 0) {
+				error = ERROR_HANDLE_EOF;
+				return false;
+			}
+		}
+
+		memset(&ctx->overlapped, 0, sizeof(ctx->overlapped));
+		if (Socket::PostSend(ctx))
+			return true;
+
+		error = WSAGetLastError();
+		return false;
+	}
+
+	LPFN_CONNECTEX ClientSocket::GetConnectExPtr(SockType sock) noexcept {
+		static auto func = reinterpret_cast<LPFN_CONNECTEX>(
+			GetWinsockFunctionPtr(sock, WSAID_CONNECTEX)
+		);
+		return func;
+	}
+	LPFN_ACCEPTEX ServerSocket::GetAcceptExPtr(SockType sock) noexcept {
+		static auto func = reinterpret_cast<LPFN_ACCEPTEX>(
+			GetWinsockFunctionPtr(sock, WSAID_ACCEPTEX)
+		);
+		return func;
+	}
+	LPFN_GETACCEPTEXSOCKADDRS ServerSocket::GetAcceptExSockaddrsPtr(SockType sock) noexcept {
+		static auto func = reinterpret_cast<LPFN_GETACCEPTEXSOCKADDRS>(
+			GetWinsockFunctionPtr(sock, WSAID_GETACCEPTEXSOCKADDRS)
+		);
+		return func;
+	}
+#endif
+
+#pragma endregion
+
+#pragma region Client Socket
+
+	namespace {
+		// Mapped addresses of a dual-stack socket count as IPv4
+		bool IsIPv4(const IOCP::Address& address) noexcept {
+			if (address.Family() == AF_INET)
+				return true;
+
+			auto ipv6 = reinterpret_cast<const sockaddr_in6*>(&address.storage);
+			return IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr);
+		}
+	}
+
+	ClientSocket::ClientSocket() noexcept : Socket() {}
+
+	ClientSocket::ClientSocket(
+		Socket::SockType&& socket,
+		std::optional<std::uint32_t> queue
+	) noexcept : Socket() {
+		m_socket = socket;
+		AssociateIOCP(queue);
+	}
+
+	ClientSocket::~ClientSocket() noexcept {
+		// Keeps a lookup still running from handing its answer over, and
+		// race timers from firing
+		DNS::Resolver::Cancel(m_resolveTicket);
+		Socket::CancelDelayed(this);
+
+		// Completions still in flight call back into this object
+		this->Close();
+		this->WaitForPending();
+		for (auto& attempt : m_attempts)
+			attempt->WaitForPending();
+	}
+
+	bool ClientSocket::Close() noexcept {
+		// Attempts still connecting lose to nothing, and the next race
+		// does not take them for its own
+		std::vector<Attempt*> attempts;
+		{
+			std::lock_guard<std::mutex> lock(m_raceMutex);
+			m_race++;
+			m_raceSettled = true;
+			for (auto& attempt : m_attempts)
+				attempts.push_back(attempt.get());
+		}
+		for (auto attempt : attempts)
+			attempt->Close();
+
+		return Socket::Close();
+	}
+
+	bool ClientSocket::Connect(const std::string_view& host, std::uint32_t port) noexcept {
+		if (m_socket == INVALID_SOCKET)
+			return false;
+
+		m_connectHost = host;
+
+		auto ctx = Track<ClientContext>(this);
+		ctx->operation = IOCP::IOOperation::CONNECT;
+
+		auto address = IOCP::Address::Parse(host, port);
+		if (address.has_value() && address->Family() == std::to_underlying(m_family)) {
+			ctx->candidates.push_back(*address);
+		} else if (auto answer = DNS::Resolver::Lookup(host, m_family)) {
+			ctx->candidates = std::move(answer->addresses);
+		} else {
+			// The CONNECT completion picks it up once the answer is in
+			ctx->resolving = true;
+
+			auto ticket = DNS::Resolver::Resolve(host, m_family, [ctx, port](const DNS::Answer& answer) {
+				ctx->candidates = answer.addresses;
+				for (auto& candidate : ctx->candidates)
+					candidate.SetPort(port);
+
+				// Closed in the meantime
+				if (!Socket::Post(ctx, answer.error))
+					Socket::Release(ctx);
+			});
+			if (ticket == 0) {
+				Socket::Release(ctx);
+				return false;
+			}
+
+			m_resolveTicket = ticket;
+			return true;
+		}
+
+		for (auto& candidate : ctx->candidates)
+			candidate.SetPort(port);
+
+		if (ctx->candidates.size() > 1) {
+			this->StartRace(std::move(ctx->candidates));
+			Socket::Release(ctx);
+			return true;
+		}
+
+		std::uint32_t error = 0;
+		if (!this->ConnectTo(ctx, error)) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"Connect failed: {}",
+				Shared::Utils::GetLastWSAErrorString(error)
+			);
+#endif
+			Socket::Release(ctx);
+			return false;
+		}
+		return true;
+	}
+
+	bool ClientSocket::ConnectTo(ClientContext* ctx, std::uint32_t& error) noexcept {
+		auto target = ctx->target;
+		auto sock = target->GetSocket();
+
+#if NSA_USE_WINDOWS
+		error = WSAEHOSTUNREACH;
+		if (ctx->candidates.empty())
+			return false;
+
+		auto ConnectEx = ClientSocket::GetConnectExPtr(sock);
+		if (!ConnectEx) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"GetConnectExPtr failed: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			error = WSAGetLastError();
+			return false;
+		}
+
+		// ConnectEx only takes bound sockets; every candidate is of the
+		// socket's family
+		IOCP::Address local;
+		local.storage.ss_family = std::to_underlying(m_family);
+		local.length = m_family == AddressFamily::IPV6
+			? sizeof(sockaddr_in6)
+			: sizeof(sockaddr_in);
+
+		if (bind(sock, local.Get(), local.length) == SOCKET_ERROR) {
+			// Bound by an earlier attempt
+			if (WSAGetLastError() != WSAEINVAL) {
+				error = WSAGetLastError();
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"bind failed: {}",
+					Shared::Utils::GetLastErrorString(error)
+				);
+#endif
+				return false;
+			}
+		}
+
+		for (auto& candidate : ctx->candidates) {
+			ctx->address = candidate;
+			memset(&ctx->overlapped, 0, sizeof(ctx->overlapped));
+
+			ctx->target->m_inflight++;
+
+			// Silence the C6387 warning
+			DWORD bytesSent = 0;
+			if (!ConnectEx(
+				sock,
+				ctx->address.Get(),
+				ctx->address.length,
+				nullptr,
+				0,
+				&bytesSent,
+				&ctx->overlapped
+			)) {
+				auto err = WSAGetLastError();
+				if (err != WSA_IO_PENDING) {
+					ctx->target->ReleaseInflight();
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"ConnectEx failed: {}",
+						Shared::Utils::GetLastErrorString(err)
+					);
+#endif
+					error = err;
+					continue;
+				}
+			} else {
+				// Connected already, the port reports nothing
+				ctx->target->ReleaseInflight();
+				Socket::Complete(ctx, 0, 0);
+			}
+			return true;
+		}
+		return false;
+#else
+		error = EHOSTUNREACH;
+		for (auto& candidate : ctx->candidates) {
+			ctx->address = candidate;
+
+			if (connect(
+				sock,
+				ctx->address.Get(),
+				ctx->address.length
+			) == SOCKET_ERROR && errno != EINPROGRESS) {
+#ifdef ATS_DEBUG
+				std::println(
+					stderr,
+					"connect failed: {}",
+					Shared::Utils::GetLastErrorString()
+				);
+#endif
+				error = errno;
+				continue;
+			}
+
+			// Completes once the handshake finishes and the socket turns writable
+			if (!Socket::Submit(target, ctx)) {
+				error = EBADF;
+				return false;
+			}
+			return true;
+		}
+		return false;
+#endif
+	}
+
+	void ClientSocket::StartRace(std::vector<IOCP::Address> candidates) noexcept {
+		// The families take turns, IPv6 first (RFC 8305 section 4)
+		std::vector<IOCP::Address> ipv6;
+		std::vector<IOCP::Address> ipv4;
+		for (auto& candidate : candidates)
+			(IsIPv4(candidate) ? ipv4 : ipv6).push_back(candidate);
+
+		candidates.clear();
+		for (std::size_t i = 0; i < std::max(ipv6.size(), ipv4.size()); i++) {
+			if (i < ipv6.size())
+				candidates.push_back(ipv6[i]);
+			if (i < ipv4.size())
+				candidates.push_back(ipv4[i]);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_raceMutex);
+			// Nothing reports back to the attempts of earlier races anymore
+			std::erase_if(m_attempts, [](const std::unique_ptr<Attempt>& attempt) noexcept {
+				return attempt->settled && attempt->IsDrained();
+			});
+
+			m_raceCandidates = std::move(candidates);
+			m_nextCandidate = 0;
+			m_race++;
+			m_attemptsRunning = 0;
+			m_raceSettled = false;
+			m_raceError = 0;
+		}
+		this->StartAttempt();
+	}
+
+	void ClientSocket::StartAttempt() noexcept {
+		std::unique_lock<std::mutex> lock(m_raceMutex);
+		while (!m_raceSettled && m_nextCandidate < m_raceCandidates.size()) {
+			auto address = m_raceCandidates[m_nextCandidate++];
+			auto generation = ++m_raceGeneration;
+			bool more = m_nextCandidate < m_raceCandidates.size();
+
+			auto attempt = m_attempts.emplace_back(new Attempt).get();
+			attempt->race = m_race;
+			m_attemptsRunning++;
+			// The connect may complete right away, back into FinishAttempt
+			lock.unlock();
+
+			std::uint32_t error = 0;
+			if (attempt->Create(m_family, SocketType::TCP, this->GetQueue())) {
+				auto ctx = Track<ClientContext>(attempt);
+				ctx->operation = IOCP::IOOperation::CONNECT;
+				ctx->candidates.push_back(address);
+
+				if (this->ConnectTo(ctx, error)) {
+					if (!more)
+						return;
+
+					// The next address joins in unless this one is through first
+					auto timer = Track<ClientContext>(this);
+					timer->operation = IOCP::IOOperation::CONNECT;
+					timer->race = generation;
+					if (!Socket::PostAfter(timer, 0, ATTEMPT_DELAY))
+						Socket::Release(timer);
+					return;
+				}
+				Socket::Release(ctx);
+			} else {
+#if NSA_USE_WINDOWS
+				error = WSAGetLastError();
+#else
+				error = errno;
+#endif
+			}
+			attempt->Close();
+
+			lock.lock();
+			attempt->settled = true;
+			if (attempt->race != m_race)
+				return;
+
+			m_attemptsRunning--;
+			m_raceError = error;
+		}
+
+		// Every address failed
+		bool failed = !m_raceSettled && m_attemptsRunning == 0;
+		if (failed)
+			m_raceSettled = true;
+
+		auto error = m_raceError;
+		lock.unlock();
+
+		if (failed) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"Connect failed: {}",
+				Shared::Utils::GetLastWSAErrorString(error)
+			);
+#endif
+			OnConnectFailed({ error });
+		}
+	}
+
+	bool ClientSocket::FinishAttempt(ClientContext* ctx, std::uint32_t error) noexcept {
+		auto attempt = static_cast<Attempt*>(ctx->target);
+
+		std::unique_lock<std::mutex> lock(m_raceMutex);
+		attempt->settled = true;
+
+		// From a race that already gave way to another
+		if (attempt->race != m_race) {
+			lock.unlock();
+			attempt->Close();
+			return false;
+		}
+		m_attemptsRunning--;
+
+		// Lost the race, or cancelled by the winner
+		if (m_raceSettled) {
+			lock.unlock();
+			attempt->Close();
+			return false;
+		}
+
+		if (error != 0) {
+			m_raceError = error;
+			lock.unlock();
+			attempt->Close();
+
+			// No need to wait for the timer (RFC 8305 section 5)
+			this->StartAttempt();
+			return false;
+		}
+
+		m_raceSettled = true;
+		m_raceGeneration++;
+
+		// The attempt is left with this socket's unused descriptor
+		bool adopted = this->SwapDescriptor(attempt);
+
+		std::vector<Attempt*> losers;
+		for (auto& other : m_attempts)
+			losers.push_back(other.get());
+		lock.unlock();
+
+		for (auto loser : losers)
+			loser->Close();
+
+		if (!adopted) {
+#if NSA_USE_WINDOWS
+			OnConnectFailed({ static_cast<std::uint32_t>(WSAGetLastError()) });
+#else
+			OnConnectFailed({ static_cast<std::uint32_t>(errno) });
+#endif
+			return false;
+		}
+		return true;
+	}
+
+	bool ClientSocket::Recv() noexcept {
+		if (m_socket == INVALID_SOCKET)
+			return false;
+
+		auto ctx = Track<ClientContext>(this);
+		// Multishot receives land in the ring's provided buffers
+		if (!Socket::IsMultishot())
+			ctx->buffer.resize(IOCP::DEFAULT_BUFFER_SIZE);
+		ctx->operation = IOCP::IOOperation::RECV;
+
+		return Socket::PostRecv(ctx);
+	}
+
+	bool ClientSocket::Receive(IOCP::IOContext* ctx, std::uint32_t length) noexcept {
+		if (!m_tls && !m_compression) {
+			// The view may take the buffer over, so the copy goes first
+			if (OnData)
+				OnData({ ctx->Data(), length });
+			if (OnDataView)
+				OnDataView({ ctx, length });
+			return true;
+		}
+
+		std::string plain;
+		auto open = true;
+		if (m_tls) {
+			auto secured = m_tls->IsSecured();
+			open = m_tls->Receive(ctx->Data(), length, plain);
+			// Handshake records and alerts in reply
+			this->FlushTLS();
+
+			if (!secured && m_tls->IsSecured())
+				OnSecure({ m_tls->GetProtocol(), m_tls->IsResumed() });
+		}
+
+		// Decompressed once decrypted, the server's answer may let held
+		// sends out
+		if (m_compression) {
+			auto wire = m_tls ? std::string_view(plain) : std::string_view(ctx->Data(), length);
+			std::string inflated;
+			if (!wire.empty())
+				open = m_compression->Receive(wire.data(), wire.size(), inflated) && open;
+			this->FlushCompression();
+			plain.swap(inflated);
+		}
+
+		if (!plain.empty()) {
+			IOCP::BufferRef view;
+			if (OnDataView)
+				view = std::make_shared<IOCP::Buffer>(plain.begin(), plain.end());
+			if (OnData)
+				OnData({ std::move(plain) });
+			if (view)
+				OnDataView({ std::move(view) });
+		}
+		return open;
+	}
+
+	bool ClientSocket::FlushTLS() noexcept {
+		if (!m_tls->BeginOutput())
+			return true;
+
+		bool sent = true;
+		for (;;) {
+			auto ctx = Track<ClientContext>(this);
+			IOCP::IOContext* queued;
+			if (!m_tls->TakeOutput(ctx->buffer, queued)) {
+				Socket::Release(ctx);
+				break;
+			}
+			if (queued) {
+				Socket::Release(ctx);
+				ctx = static_cast<ClientContext*>(queued);
+			}
+
+			// Records of a closed connection are dropped, the turn still
+			// has to end
+			if (m_socket == INVALID_SOCKET) {
+				Socket::Release(ctx);
+				sent = false;
+				continue;
+			}
+
+			if (!queued)
+				ctx->operation = IOCP::IOOperation::SEND;
+			if (!Socket::QueueSend(ctx))
+				sent = false;
+		}
+
+		// Sends of the turn may have completed before it ended, leaving the
+		// switch to kTLS to it
+		if (m_tls->Offload(m_socket, this->GetUnsentBytes()))
+			return this->FlushTLS() && sent;
+		return sent;
+	}
+
+	bool ClientSocket::FlushCompression() noexcept {
+		if (!m_compression->BeginOutput())
+			return true;
+
+		bool sent = true;
+		for (;;) {
+			auto ctx = Track<ClientContext>(this);
+			if (!m_compression->TakeOutput(ctx->buffer)) {
+				Socket::Release(ctx);
+				break;
+			}
+
+			// Frames of a closed connection are dropped, the turn still has
+			// to end
+			if (m_socket == INVALID_SOCKET) {
+				Socket::Release(ctx);
+				sent = false;
+				continue;
+			}
+
+			// Encrypted in the order taken, the turn keeps it
+			if (m_tls) {
+				std::string_view frames(ctx->buffer.data(), ctx->buffer.size());
+				if (!m_tls->Write(std::span<const std::string_view>(&frames, 1)) || !this->FlushTLS())
+					sent = false;
+				Socket::Release(ctx);
+				continue;
+			}
+
+			ctx->operation = IOCP::IOOperation::SEND;
+			if (!Socket::QueueSend(ctx))
+				sent = false;
+		}
+		return sent;
+	}
+
+	std::uint32_t ClientSocket::GetStageError() const noexcept {
+		if (m_compression && m_compression->GetError() != 0)
+			return m_compression->GetError();
+		return m_tls ? m_tls->GetError() : 0;
+	}
+
+	void ClientSocket::Disconnect(std::uint32_t error) noexcept {
+		this->Close();
+
+		// Every receive still out fails the same way
+		if (!std::exchange(m_disconnected, true))
+			OnDisconnect({ error });
+	}
+
+	bool ClientSocket::Send(const std::string_view& data) noexcept {
+		return this->Send(std::span<const std::string_view>(&data, 1));
+	}
+
+	bool ClientSocket::Send(std::span<const std::string_view> buffers) noexcept {
+		if (m_socket == INVALID_SOCKET)
+			return false;
+
+		// Compressed into frames, then encrypted into records, which go out
+		// as sends of their own
+		if (m_compression)
+			return m_compression->Write(buffers) && this->FlushCompression();
+		if (m_tls)
+			return m_tls->Write(buffers) && this->FlushTLS();
+
+		auto ctx = Track<ClientContext>(this);
+		ctx->operation = IOCP::IOOperation::SEND;
+		ctx->Gather(buffers);
+
+		return Socket::QueueSend(ctx);
+	}
+
+	bool ClientSocket::Send(std::span<const IOCP::BufferRef> buffers) noexcept {
+		if (m_socket == INVALID_SOCKET)
+			return false;
+
+		if (m_tls || m_compression) {
+			auto views = ToViews(buffers);
+			return this->Send(std::span<const std::string_view>(views));
+		}
+
+		auto ctx = Track<ClientContext>(this);
+		ctx->operation = IOCP::IOOperation::SEND;
+		ctx->Attach(buffers);
+
+		return Socket::QueueSend(ctx);
+	}
+
+	bool ClientSocket::CanSendFile() const noexcept {
+		// Only once the kernel encrypts, the file would go out around TLS
+		// in the clear otherwise. Never past compression
+		return this->IsOpen() && (!m_tls || m_tls->IsOffloaded()) && !m_compression;
+	}
+
+	bool ClientSocket::SendFile(
+		const std::filesystem::path& path,
+		std::uint64_t offset,
+		std::uint64_t length
+	) noexcept {
+		if (!this->CanSendFile())
+			return false;
+
+		auto ctx = Track<ClientContext>(this);
+		ctx->operation = IOCP::IOOperation::SEND_FILE;
+		if (!ctx->OpenFile(path, offset, length)) {
+			Socket::Release(ctx);
+			return false;
+		}
+
+		return this->QueueFile(ctx);
+	}
+
+	bool ClientSocket::SendFile(
+		IOCP::FileHandle file,
+		std::uint64_t offset,
+		std::uint64_t length
+	) noexcept {
+		if (!this->CanSendFile())
+			return false;
+
+		auto ctx = Track<ClientContext>(this);
+		ctx->operation = IOCP::IOOperation::SEND_FILE;
+		if (!ctx->SetFile(file, offset, length)) {
+			Socket::Release(ctx);
+			return false;
+		}
+
+		return this->QueueFile(ctx);
+	}
+
+	bool ClientSocket::QueueFile(ClientContext* ctx) noexcept {
+		if (!m_tls)
+			return Socket::QueueSend(ctx);
+
+		// Sends of another thread's turn may still be waiting in TLS
+		if (!m_tls->Queue(ctx)) {
+			Socket::Release(ctx);
+			return false;
+		}
+		return this->FlushTLS();
+	}
+
+	bool ClientSocket::UseTLS(std::shared_ptr<TLS::Context> context, std::string_view serverName) noexcept {
+		if (!context || !context->IsCreated() || context->GetRole() != TLS::Role::CLIENT)
+			return false;
+
+		m_tls = std::make_unique<TLS::Session>(std::move(context));
+		m_serverName = serverName;
+		return true;
+	}
+
+	bool ClientSocket::UseCompression(std::shared_ptr<Compression::Context> context) noexcept {
+		if (!context || !context->IsCreated())
+			return false;
+
+		m_compression = std::make_unique<Compression::Session>(std::move(context));
+		return true;
+	}
+
+	void ClientSocket::OnSendBacklog(
+		Socket* target,
+		std::size_t unsent,
+		bool congested
+	) noexcept {
+		(void)target;
+		if (congested)
+			OnBackpressure({ unsent });
+		else
+			OnWritable({ unsent });
+	}
+
+	void ClientSocket::OnIOCompleted(
+		IOCP::IOContext* rawCtx,
+		std::uint32_t bytesTransferred,
+		std::uint32_t error
+	) noexcept {
+		if (!rawCtx)
+			return;
+
+		auto ctx = static_cast<ClientContext*>(rawCtx);
+
+		switch (ctx->operation) {
+			case IOCP::IOOperation::CONNECT: {
+				// Time for the next attempt of a race, unless another one
+				// started or won in the meantime
+				if (ctx->race != 0) {
+					std::unique_lock<std::mutex> lock(m_raceMutex);
+					if (ctx->race == m_raceGeneration) {
+						lock.unlock();
+						this->StartAttempt();
+					}
+					break;
+				}
+
+				// One of the raced attempts, carries on when it won
+				if (ctx->target != this && !this->FinishAttempt(ctx, error))
+					break;
+
+				// The name is resolved, the connect itself is still to go
+				if (ctx->resolving) {
+					ctx->resolving = false;
+					m_resolveTicket = 0;
+
+					if (error == 0 && ctx->candidates.size() > 1) {
+						this->StartRace(std::move(ctx->candidates));
+						break;
+					}
+					if (error == 0 && this->ConnectTo(ctx, error))
+						return;
+				}
+
+				if (error != 0) {
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"Connect failed: {}",
+						Shared::Utils::GetLastWSAErrorString(error)
+					);
+#endif
+					OnConnectFailed({ error });
+					break;
+				}
+
+#if NSA_USE_WINDOWS
+				// CompleteConnect: update socket to be usable with getsockname etc.
+				// set SO_UPDATE_CONNECT_CONTEXT
+				if (setsockopt(
+					m_socket,
+					SOL_SOCKET,
+					SO_UPDATE_CONNECT_CONTEXT,
+					nullptr,
+					0
+				) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"OnIOCompleted error: {}",
+						Shared::Utils::GetLastWSAErrorString()
+					);
+#endif
+					break;
+				}
+#endif
+
+				// The address the handshake went to, no need to ask for it
+				this->SetAddress(ctx->address);
+
+				// The ClientHello leaves ahead of anything OnConnect sends
+				if (m_tls) {
+					const auto& name = m_serverName.empty() ? m_connectHost : m_serverName;
+					auto peer = name + ':' + std::to_string(m_port);
+					if (!m_tls->Start(name, peer)) {
+						this->Close();
+						OnConnectFailed({ m_tls->GetError() });
+						break;
+					}
+					this->FlushTLS();
+				}
+				// The offer follows, ahead of anything OnConnect sends too
+				if (m_compression) {
+					m_compression->Start(Compression::Role::CLIENT);
+					this->FlushCompression();
+				}
+
+				m_disconnected = false;
+				OnConnect({ this->GetHost(), m_port });
+
+				for (std::uint32_t i = 0; i < (Socket::IsMultishot() ? 1 : Socket::MAX_PENDING_RECVS); i++)
+					this->Recv();
+
+				break;
+			} case IOCP::IOOperation::RECV: {
+				// A zero byte receive means the peer closed the connection
+				if (error != 0 || bytesTransferred == 0) {
+					// connection closed or error
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"ClientSocket WSARecv closed or error: {}",
+						Shared::Utils::GetLastWSAErrorString(error)
+					);
+#endif
+					this->Disconnect(error);
+					break;
+				}
+
+				if (!this->Receive(ctx, bytesTransferred)) {
+					this->Disconnect(this->GetStageError());
+					break;
+				}
+
+				if (!ctx->multishot && !this->Recv()) {
+#if NSA_USE_WINDOWS
+					this->Disconnect(static_cast<std::uint32_t>(WSAGetLastError()));
+#else
+					this->Disconnect(static_cast<std::uint32_t>(errno));
+#endif
+				}
+
+				break;
+			} case IOCP::IOOperation::SEND: {
+				Socket::CompleteSend(ctx, error != 0);
+
+				if (error != 0) {
+					// connection closed or error
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"ClientSocket WSASend closed or error: {}",
+						Shared::Utils::GetLastWSAErrorString(error)
+					);
+#endif
+					this->Close();
+					break;
+				}
+
+				// The records ahead of the switch to kTLS are out
+				if (m_tls && m_tls->Offload(m_socket, this->GetUnsentBytes()))
+					this->FlushTLS();
+
+				break;
+			} case IOCP::IOOperation::SEND_FILE: {
+				Socket::CompleteSend(ctx, error != 0);
+
+				OnFileSent({ ctx->offset, error });
+
+				if (error != 0) {
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"ClientSocket TransmitFile closed or error: {}",
+						Shared::Utils::GetLastWSAErrorString(error)
+					);
+#endif
+					this->Close();
+				}
+
+				break;
+			} case IOCP::IOOperation::RECV_FROM:
+			case IOCP::IOOperation::SEND_TO: {
+				// Datagram operations, never issued on a stream
+				break;
+			} default: {
+				// Tasks are run by Socket::Run and never get here
+				break;
+			}
+		}
+
+		// Multishot operations keep their context until the final completion
+		if (!ctx->multishot)
+			Socket::Release(ctx);
 	}
 
-	void* Socket::GetWinsockFunctionPtr(SockType sock, GUID guid) noexcept {
-		void* func = nullptr;
+#pragma endregion
 
-		DWORD bytes = 0;
-		if (WSAIoctl(
-			sock,
-			SIO_GET_EXTENSION_FUNCTION_POINTER,
-			&guid,
-			sizeof(guid),
-			&func,
-			sizeof(func),
-			&bytes,
-			nullptr,
-			nullptr
-		) == SOCKET_ERROR)
-			return nullptr;
+#pragma region Server Socket
 
-		return func;
+	namespace {
+		// Errors that leave a listener unable to accept. The rest concern
+		// one connection, or a shortage of descriptors or memory that passes
+		bool IsListenerError(std::uint32_t error) noexcept {
+#if NSA_USE_WINDOWS
+			return error == ERROR_OPERATION_ABORTED
+				|| error == WSAENOTSOCK
+				|| error == WSAEINVAL
+				|| error == WSAEOPNOTSUPP
+				|| error == WSAENETDOWN;
+#else
+			return error == ECANCELED
+				|| error == EBADF
+				|| error == ENOTSOCK
+				|| error == EINVAL
+				|| error == EOPNOTSUPP;
+#endif
+		}
 	}
 
-	LPFN_CONNECTEX ClientSocket::GetConnectExPtr(SockType sock) noexcept {
-		static auto func = reinterpret_cast<LPFN_CONNECTEX>(
-			GetWinsockFunctionPtr(sock, WSAID_CONNECTEX)
-		);
-		return func;
+	ServerSocket::~ServerSocket() noexcept {
+		// Keeps accepts that back off from coming back
+		for (auto listener : m_listeners)
+			Socket::CancelDelayed(listener);
+
+		// Completions still in flight call back into this object, including
+		// the ones running on the shards and the accepted clients
+		this->Close();
+		this->WaitForPending();
+		for (auto& shard : m_shards)
+			shard->WaitForPending();
+
+		// No accept is left to add clients
+		m_clients.clear();
 	}
-	LPFN_ACCEPTEX ServerSocket::GetAcceptExPtr(SockType sock) noexcept {
-		static auto func = reinterpret_cast<LPFN_ACCEPTEX>(
-			GetWinsockFunctionPtr(sock, WSAID_ACCEPTEX)
-		);
-		return func;
+
+	bool ServerSocket::Listen(const std::string_view& host, std::uint32_t port) noexcept {
+		if (m_socket == INVALID_SOCKET || !m_listeners.empty())
+			return false;
+
+		// "::" on an IPv6 socket takes IPv4 clients as well
+		auto address = IOCP::Address::Parse(host, port);
+		if (!address.has_value() || address->Family() != std::to_underlying(m_family)) {
+#ifdef ATS_DEBUG
+			std::println(stderr, "Not a numeric address of the socket's family: {}", host);
+#endif
+			return false;
+		}
+
+#if NSA_USE_LINUX
+		if (m_acceptConfig.reusePort) {
+			// Listener N on queue N, this socket standing in for its own
+			auto queues = Socket::GetQueueCount();
+			auto own = this->GetQueue().value_or(0);
+			for (std::uint32_t queue = 0; queue < queues; queue++) {
+				if (queue == own) {
+					m_listeners.push_back(this);
+					continue;
+				}
+
+				auto& shard = m_shards.emplace_back(new Shard);
+				if (!shard->Create(m_family, SocketType::TCP, queue))
+					return false;
+				m_listeners.push_back(shard.get());
+			}
+		} else
+#endif
+		m_listeners.push_back(this);
+
+		// The order they are bound in is their index in the reuseport group
+		for (auto listener : m_listeners) {
+			if (!this->OpenListener(listener, *address))
+				return false;
+
+			// The rest of the group joins the port the first one was given
+			if (port == 0) {
+				auto bound = Socket::GetLocalAddress(listener->GetSocket());
+				if (!bound.has_value())
+					return false;
+
+				address = bound;
+				port = bound->GetPort();
+			}
+		}
+
+#if NSA_USE_LINUX
+		if (m_listeners.size() > 1 && m_acceptConfig.steering == Steering::BPF) {
+			// The listener with the index of the receiving processor, which
+			// is the one on that processor's worker while workers are pinned
+			// in processor order
+			sock_filter code[] = {
+				{ BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<std::uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+				{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<std::uint32_t>(m_listeners.size()) },
+				{ BPF_RET | BPF_A, 0, 0, 0 }
+			};
+			sock_fprog program{ static_cast<unsigned short>(std::size(code)), code };
+
+			if (setsockopt(
+				m_socket,
+				SOL_SOCKET,
+				SO_ATTACH_REUSEPORT_CBPF,
+				&program,
+				sizeof(program)
+			) == SOCKET_ERROR) {
+				// Connections still arrive, spread by the kernel's hash
+#ifdef ATS_DEBUG
+				std::println(stderr,
+					"SO_ATTACH_REUSEPORT_CBPF failed: {}",
+					Shared::Utils::GetLastErrorString()
+				);
+#endif
+			}
+		}
+#endif
+
+		this->SetAddress(*address);
+		OnListening({ host, m_port });
+
+		this->StartAccepting();
+		return true;
+	}
+
+	bool ServerSocket::Adopt(std::span<const SockType> listeners) noexcept {
+		auto closeFrom = [&](std::size_t first) {
+			for (auto i = first; i < listeners.size(); i++) {
+#if NSA_USE_WINDOWS
+				closesocket(listeners[i]);
+#else
+				close(listeners[i]);
+#endif
+			}
+		};
+
+		if (m_socket != INVALID_SOCKET || !m_listeners.empty() || listeners.empty()) {
+			closeFrom(0);
+			return false;
+		}
+
+		// The reuseport group keeps its order, and a BPF program its
+		// steering, across the handover
+		auto queues = Socket::GetQueueCount();
+		std::size_t attached = 0;
+		for (; attached < listeners.size(); attached++) {
+			Socket* listener = this;
+			if (attached != 0)
+				listener = m_shards.emplace_back(new Shard).get();
+
+			auto queue = listeners.size() > 1
+				? std::optional<std::uint32_t>(static_cast<std::uint32_t>(attached % queues))
+				: std::nullopt;
+			if (!listener->Attach(listeners[attached], queue))
+				break;
+			m_listeners.push_back(listener);
+		}
+
+		auto address = attached == listeners.size()
+			? Socket::GetLocalAddress(m_socket)
+			: std::nullopt;
+		if (!address.has_value()) {
+			// Neither accepted on nor shut down, the process they came
+			// from may still be using them
+			closeFrom(attached);
+			this->Detach();
+			m_shards.clear();
+			m_listeners.clear();
+			return false;
+		}
+
+#if NSA_USE_LINUX
+		{
+			std::lock_guard<std::mutex> lock(m_acceptMutex);
+			m_acceptConfig.reusePort = listeners.size() > 1;
+		}
+#endif
+
+		this->SetAddress(*address);
+		OnListening({ this->GetHost(), m_port });
+
+		this->StartAccepting();
+		return true;
+	}
+
+	std::vector<Socket::SockType> ServerSocket::GetListenSockets() const noexcept {
+		std::vector<SockType> sockets;
+		for (auto listener : m_listeners) {
+			if (listener->IsOpen())
+				sockets.push_back(listener->GetSocket());
+		}
+		return sockets;
+	}
+
+	std::size_t ServerSocket::GetConnectionCount() const noexcept {
+		std::lock_guard<std::mutex> lock(m_clientsMutex);
+		return static_cast<std::size_t>(std::ranges::count_if(m_clients, [](const auto& client) {
+			return client->IsOpen();
+		}));
+	}
+
+	void ServerSocket::StartAccepting() noexcept {
+		{
+			std::lock_guard<std::mutex> lock(m_acceptMutex);
+			m_listenerAccepts.assign(m_listeners.size(), 0);
+			m_listenerBackoff.assign(m_listeners.size(), false);
+
+			if (m_acceptConfig.minPending == 0)
+				m_acceptConfig.minPending = static_cast<std::uint32_t>(gs_workers.size());
+			m_acceptConfig.maxPending = std::max(m_acceptConfig.maxPending, m_acceptConfig.minPending);
+
+			m_acceptTarget = m_acceptConfig.minPending;
+			m_windowStart = std::chrono::steady_clock::now();
+		}
+
+		for (std::size_t i = 0; i < m_listeners.size(); i++)
+			this->ResumeAccepts(i);
+	}
+
+	void ServerSocket::ResumeAccepts(std::size_t listener) noexcept {
+		// One multishot accept serves every incoming connection
+		if (Socket::IsMultishot()) {
+			{
+				std::lock_guard<std::mutex> lock(m_acceptMutex);
+				if (m_listenerAccepts[listener] != 0)
+					return;
+				m_listenerAccepts[listener] = 1;
+			}
+			m_pendingAccepts++;
+			if (!this->Accept(m_listeners[listener])) {
+				std::lock_guard<std::mutex> lock(m_acceptMutex);
+				m_listenerAccepts[listener] = 0;
+				m_pendingAccepts--;
+			}
+			return;
+		}
+
+		this->ReplenishAccepts(listener, false);
+	}
+
+	void ServerSocket::BackOffAccept(std::size_t listener) noexcept {
+		{
+			std::lock_guard<std::mutex> lock(m_acceptMutex);
+			m_listenerAccepts[listener]--;
+			m_pendingAccepts--;
+
+			// The other accepts failing meanwhile wait for the same timer
+			if (m_listenerBackoff[listener])
+				return;
+			m_listenerBackoff[listener] = true;
+		}
+
+		auto timer = Track<ServerContext>(m_listeners[listener]);
+		timer->operation = IOCP::IOOperation::ACCEPT;
+		timer->backoff = true;
+		if (Socket::PostAfter(timer, 0, ACCEPT_BACKOFF))
+			return;
+
+		// Closed in the meantime
+		Socket::Release(timer);
+		std::lock_guard<std::mutex> lock(m_acceptMutex);
+		m_listenerBackoff[listener] = false;
+	}
+
+	bool ServerSocket::OpenListener(Socket* listener, const IOCP::Address& address) noexcept {
+		auto sock = listener->GetSocket();
+
+#if NSA_USE_LINUX
+		if (m_acceptConfig.reusePort) {
+			int enable = 1;
+			if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+				std::println(stderr,
+					"SO_REUSEPORT failed: {}",
+					Shared::Utils::GetLastErrorString()
+				);
+#endif
+				return false;
+			}
+
+			if (m_acceptConfig.steering == Steering::INCOMING_CPU) {
+				int cpu = Socket::GetWorkerCpu(listener->GetQueue().value_or(0));
+				if (cpu != -1)
+					setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+			}
+		}
+
+		// Closest to AcceptEx receiving data: connections are only reported
+		// once their first bytes arrived, or after the timeout regardless
+		if (m_acceptConfig.firstPayload != 0) {
+			int timeout = FIRST_PAYLOAD_TIMEOUT;
+			setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout));
+		}
+#endif
+
+		if (bind(sock, address.Get(), address.length) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+			std::println(stderr,
+				"bind failed: {}",
+				Shared::Utils::GetLastWSAErrorString()
+			);
+#endif
+			return false;
+		}
+
+		if (listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+#ifdef ATS_DEBUG
+			std::println(stderr,
+				"listen failed: {}",
+				Shared::Utils::GetLastWSAErrorString()
+			);
+#endif
+			return false;
+		}
+		return true;
+	}
+
+	bool ServerSocket::Close() noexcept {
+		for (auto& shard : m_shards)
+			shard->Close();
+
+		return Socket::Close();
+	}
+
+	bool ServerSocket::Detach() noexcept {
+		// Before the first accept comes back cancelled
+		m_detached = true;
+
+		for (auto& shard : m_shards)
+			shard->Detach();
+
+		return Socket::Detach();
+	}
+
+	bool ServerSocket::UseTLS(std::shared_ptr<TLS::Context> context) noexcept {
+		if (!context || !context->IsCreated() || context->GetRole() != TLS::Role::SERVER)
+			return false;
+		// Connections accepted already would stay in the clear
+		if (!m_listeners.empty())
+			return false;
+
+		m_tlsContext = std::move(context);
+		return true;
 	}
 
-#pragma endregion
+	bool ServerSocket::UseCompression(std::shared_ptr<Compression::Context> context) noexcept {
+		if (!context || !context->IsCreated())
+			return false;
+		// Connections accepted already would stay uncompressed
+		if (!m_listeners.empty())
+			return false;
 
-#pragma region Client Socket
+		m_compressionContext = std::move(context);
+		return true;
+	}
 
-	ClientSocket::ClientSocket() noexcept : Socket() {}
+	bool ServerSocket::SetAcceptConfig(const AcceptConfig& config) noexcept {
+		std::lock_guard<std::mutex> lock(m_acceptMutex);
+		if (m_acceptTarget != 0)
+			return false;
 
-	ClientSocket::ClientSocket(Socket::SockType&& socket) noexcept : Socket() {
-		m_socket = socket;
-		AssociateIOCP();
-	}
-	
-	bool ClientSocket::Connect(const std::string_view& host, std::uint32_t port) noexcept {
-		addrinfo hints{};
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
+		if (config.maxPending == 0)
+			return false;
+
+#if NSA_USE_WINDOWS
+		// Winsock has no load balancing SO_REUSEPORT
+		if (config.reusePort)
+			return false;
+#endif
 
-		addrinfo* result = nullptr;
-		auto portStr = std::to_string(port);
+		m_acceptConfig = config;
+		return true;
+	}
 
+	void ServerSocket::ReplenishAccepts(std::size_t listener, bool accepted) noexcept {
+		std::uint32_t count = 0;
 		{
-			auto ret = getaddrinfo(host.data(), portStr.c_str(), &hints, &result);
-			if (ret != 0) {
-#ifdef ATS_DEBUG
-				std::println(
-					stderr,
-					"getaddrinfo failed: {}",
-					Shared::Utils::GetLastErrorString(ret)
-				);
-#endif
-				return false;
-			}
-		}
+			std::lock_guard<std::mutex> lock(m_acceptMutex);
+			auto& config = m_acceptConfig;
+			auto& pending = m_listenerAccepts[listener];
+
+			if (accepted) {
+				pending--;
+				m_pendingAccepts--;
+				m_windowAccepts++;
 
-		bool success = false;
-		for (auto ai = result; ai; ai = ai->ai_next) {
-			sockaddr_storage ss;
-			ZeroMemory(&ss, sizeof(ss));
+				// Every accept posted on the listener got used up, connections
+				// come in faster than they are replaced
+				if (pending == 0)
+					m_acceptTarget = std::min(m_acceptTarget * 2, config.maxPending);
 
-			int aiSize = 0;
+				auto now = std::chrono::steady_clock::now();
+				if (now - m_windowStart >= ACCEPT_WINDOW) {
+					// Enough for a window's worth of arrivals, halving at most
+					// once per window when they calm down
+					m_acceptTarget = std::clamp(
+						std::max(m_windowAccepts, m_acceptTarget / 2),
+						config.minPending,
+						config.maxPending
+					);
+					m_windowAccepts = 0;
+					m_windowStart = now;
+				}
 
-			if (ai->ai_family == AF_INET) {
-				sockaddr_in* sin = (sockaddr_in*)&ss;
-				sin->sin_family = AF_INET;
-				aiSize = sizeof(sockaddr_in);
+				// Surplus accepts are not replaced as they complete, but every
+				// listener keeps at least one
+				if (m_acceptTarget > m_pendingAccepts)
+					count = m_acceptTarget - m_pendingAccepts;
+				else if (pending == 0)
+					count = 1;
 			} else {
-				sockaddr_in6* sin6 = (sockaddr_in6*)&ss;
-				sin6->sin6_family = AF_INET6;
-				aiSize = sizeof(sockaddr_in6);
+				// The first accepts are spread evenly over the listeners
+				auto listeners = static_cast<std::uint32_t>(m_listeners.size());
+				auto share = std::max(1u, (m_acceptTarget + listeners - 1) / listeners);
+				if (share > pending)
+					count = share - pending;
 			}
 
-			if (bind(
-				m_socket,
-				reinterpret_cast<sockaddr*>(&ss),
-				aiSize
-			) == SOCKET_ERROR) {
-#ifdef ATS_DEBUG
-				std::println(
-					stderr,
-					"bind failed: {}",
-					Shared::Utils::GetLastErrorString()
-				);
-#endif
-				continue;
-			}
+			pending += count;
+			m_pendingAccepts += count;
+		}
 
-			auto ConnectEx = ClientSocket::GetConnectExPtr(m_socket);
-			if (!ConnectEx) {
-#ifdef ATS_DEBUG
-				std::println(
-					stderr,
-					"GetConnectExPtr failed: {}",
-					Shared::Utils::GetLastErrorString()
-				);
-#endif
+		for (std::uint32_t i = 0; i < count; i++) {
+			if (this->Accept(m_listeners[listener]))
 				continue;
-			}
 
-			auto& ctx = m_postedCtx.emplace_back(new ClientContext);
-			ctx->operation = IOCP::IOOperation::CONNECT;
-			ctx->owner = this;
+			std::lock_guard<std::mutex> lock(m_acceptMutex);
+			m_listenerAccepts[listener]--;
+			m_pendingAccepts--;
+		}
+	}
 
-			// Silence the C6387 warning
-			DWORD bytesSent = 0;
-			if (!ConnectEx(
-				m_socket,
-				ai->ai_addr,
-				static_cast<int>(ai->ai_addrlen),
-				nullptr,
-				0,
-				&bytesSent,
-				&ctx->overlapped
-			)) {
-				auto err = WSAGetLastError();
-				if (err != WSA_IO_PENDING) {
+	bool ServerSocket::Accept(Socket* listener) noexcept {
+		if (listener->GetSocket() == INVALID_SOCKET)
+			return false;
+
+#if NSA_USE_WINDOWS
+		auto AcceptEx = ServerSocket::GetAcceptExPtr(m_socket);
+		if (!AcceptEx) {
 #ifdef ATS_DEBUG
-					std::println(
-						stderr,
-						"ConnectEx failed: {}",
-						Shared::Utils::GetLastErrorString(err)
-					);
+			std::println(
+				stderr,
+				"GetAcceptExPtr failed: {}",
+				Shared::Utils::GetLastErrorString()
+			);
 #endif
-					continue;
-				}
-			}
-			success = true;
-			break;
+			return false;
 		}
-		freeaddrinfo(result);
-		return success;
-	}
+#endif
 
-	bool ClientSocket::Recv() noexcept {
-		if (m_socket == INVALID_SOCKET)
+		auto ctx = Track<ServerContext>(listener);
+		ctx->operation = IOCP::IOOperation::ACCEPT;
+
+#if NSA_USE_WINDOWS
+		{
+			std::lock_guard<std::mutex> lock(m_clientsMutex);
+			ctx->client = m_clients.emplace_back(new ClientSocket).get();
+		}
+		// The client never got to accept anything
+		auto discard = [&] {
+			std::lock_guard<std::mutex> lock(m_clientsMutex);
+			std::erase_if(m_clients, [&](const auto& client) { return client.get() == ctx->client; });
+			Socket::Release(ctx);
 			return false;
+		};
 
-		std::lock_guard<std::mutex> lock(gs_bufferMutex);
+		if (!ctx->client->Create(m_family))
+			return discard();
 
-		auto& ctx = m_postedCtx.emplace_back(new ClientContext);
-		ctx->owner = this;
-		ctx->buffer.resize(IOCP::DEFAULT_BUFFER_SIZE);
-		ctx->wsabuf.buf = ctx->buffer.data();
-		ctx->wsabuf.len = static_cast<ULONG>(ctx->buffer.size());
-		ctx->operation = IOCP::IOOperation::RECV;
+		// Both addresses go after the first payload
+		ctx->buffer.resize(m_acceptConfig.firstPayload + 2 * ACCEPT_ADDRESS_LENGTH);
 
-		DWORD flags = 0;
 		DWORD bytesReceived = 0;
-		if (WSARecv(
-			m_socket,
-			&ctx->wsabuf,
-			1,
+		listener->m_inflight++;
+
+		if (!AcceptEx(
+			listener->GetSocket(),
+			ctx->client->GetSocket(),
+			ctx->buffer.data(),
+			m_acceptConfig.firstPayload,
+			ACCEPT_ADDRESS_LENGTH,
+			ACCEPT_ADDRESS_LENGTH,
 			&bytesReceived,
-			&flags,
-			&ctx->overlapped,
-			nullptr
-		) == SOCKET_ERROR) {
+			&ctx->overlapped
+		)) {
 			auto err = WSAGetLastError();
 			if (err != WSA_IO_PENDING) {
+				listener->ReleaseInflight();
 #ifdef ATS_DEBUG
 				std::println(
 					stderr,
-					"WSARecv failed: {}",
-					Shared::Utils::GetLastWSAErrorString(err)
+					"AcceptEx failed: {}",
+					Shared::Utils::GetLastErrorString(err)
 				);
 #endif
-				return false;
+				return discard();
 			}
 		} else {
+			listener->ReleaseInflight();
+
 			auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
 			ctx->buffer.resize(bytesTransferred);
 
-			this->OnIOCompleted(
-				ctx.get(),
+			Socket::Complete(
+				ctx,
 				bytesTransferred,
 				Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal))
 			);
 		}
 		return true;
+#else
+		// The accepted descriptor arrives with the completion
+		return Socket::Submit(listener, ctx);
+#endif
 	}
 
-	bool ClientSocket::Send(const std::string_view& data) noexcept {
-		if (m_socket == INVALID_SOCKET)
+	bool ServerSocket::Send(const std::string_view& data, ClientSocket* sock) noexcept {
+		return this->Send(std::span<const std::string_view>(&data, 1), sock);
+	}
+
+	bool ServerSocket::Send(std::span<const std::string_view> buffers, ClientSocket* sock) noexcept {
+		if (!sock || !sock->IsOpen())
 			return false;
 
-		std::lock_guard<std::mutex> lock(gs_bufferMutex);
+		// Compressed into frames, then encrypted into records, which go out
+		// as sends of their own
+		if (sock->m_compression)
+			return sock->m_compression->Write(buffers) && this->FlushCompression(sock);
+		if (sock->m_tls)
+			return sock->m_tls->Write(buffers) && this->FlushTLS(sock);
 
-		auto& ctx = m_postedCtx.emplace_back(new ClientContext);
-		ctx->owner = this;
-		ctx->buffer.assign(data.begin(), data.end());
-		ctx->wsabuf.buf = ctx->buffer.data();
-		ctx->wsabuf.len = static_cast<ULONG>(ctx->buffer.size());
+		auto ctx = Track<ServerContext>(sock);
+		ctx->client = sock;
 		ctx->operation = IOCP::IOOperation::SEND;
+		ctx->Gather(buffers);
 
-		DWORD bytesSent = 0;
-		if (WSASend(
-			m_socket,
-			&ctx->wsabuf,
-			1,
-			&bytesSent,
-			0,
-			&ctx->overlapped,
-			nullptr
-		) == SOCKET_ERROR) {
-			auto err = WSAGetLastError();
-			if (err != WSA_IO_PENDING) {
-#ifdef ATS_DEBUG
-				std::println(
-					stderr,
-					"WSASend failed: {}",
-					Shared::Utils::GetLastWSAErrorString(err)
-				);
-#endif
-				return false;
+		return Socket::QueueSend(ctx);
+	}
+
+	bool ServerSocket::Send(std::span<const IOCP::BufferRef> buffers, ClientSocket* sock) noexcept {
+		if (!sock || !sock->IsOpen())
+			return false;
+
+		if (sock->m_tls || sock->m_compression) {
+			auto views = ToViews(buffers);
+			return this->Send(std::span<const std::string_view>(views), sock);
+		}
+
+		auto ctx = Track<ServerContext>(sock);
+		ctx->client = sock;
+		ctx->operation = IOCP::IOOperation::SEND;
+		ctx->Attach(buffers);
+
+		return Socket::QueueSend(ctx);
+	}
+
+	bool ServerSocket::SendFile(
+		const std::filesystem::path& path,
+		ClientSocket* sock,
+		std::uint64_t offset,
+		std::uint64_t length
+	) noexcept {
+		if (!sock || !sock->CanSendFile())
+			return false;
+
+		auto ctx = Track<ServerContext>(sock);
+		ctx->client = sock;
+		ctx->operation = IOCP::IOOperation::SEND_FILE;
+		if (!ctx->OpenFile(path, offset, length)) {
+			Socket::Release(ctx);
+			return false;
+		}
+
+		return this->QueueFile(ctx, sock);
+	}
+
+	bool ServerSocket::SendFile(
+		IOCP::FileHandle file,
+		ClientSocket* sock,
+		std::uint64_t offset,
+		std::uint64_t length
+	) noexcept {
+		if (!sock || !sock->CanSendFile())
+			return false;
+
+		auto ctx = Track<ServerContext>(sock);
+		ctx->client = sock;
+		ctx->operation = IOCP::IOOperation::SEND_FILE;
+		if (!ctx->SetFile(file, offset, length)) {
+			Socket::Release(ctx);
+			return false;
+		}
+
+		return this->QueueFile(ctx, sock);
+	}
+
+	bool ServerSocket::QueueFile(ServerContext* ctx, ClientSocket* client) noexcept {
+		if (!client->m_tls)
+			return Socket::QueueSend(ctx);
+
+		// Sends of another thread's turn may still be waiting in TLS
+		if (!client->m_tls->Queue(ctx)) {
+			Socket::Release(ctx);
+			return false;
+		}
+		return this->FlushTLS(client);
+	}
+
+	bool ServerSocket::Recv(ClientSocket* sock) noexcept {
+		// Clients are served on after the listeners closed, until they drain
+		if (!sock->IsOpen())
+			return false;
+
+		auto ctx = Track<ServerContext>(sock);
+		ctx->client = sock;
+		// Multishot receives land in the ring's provided buffers
+		if (!Socket::IsMultishot())
+			ctx->buffer.resize(IOCP::DEFAULT_BUFFER_SIZE);
+		ctx->operation = IOCP::IOOperation::RECV;
+
+		return Socket::PostRecv(ctx);
+	}
+
+	bool ServerSocket::Receive(ServerContext* ctx, std::uint32_t length) noexcept {
+		auto client = ctx->client;
+		auto& tls = client->m_tls;
+		auto& compression = client->m_compression;
+		if (!tls && !compression) {
+			// The view may take the buffer over, so the copy goes first
+			if (OnData)
+				OnData({ ctx->Data(), length, client });
+			if (OnDataView)
+				OnDataView({ ctx, length, client });
+			return true;
+		}
+
+		std::string plain;
+		auto open = true;
+		if (tls) {
+			auto secured = tls->IsSecured();
+			open = tls->Receive(ctx->Data(), length, plain);
+			// Handshake records, session tickets and alerts in reply
+			this->FlushTLS(client);
+
+			if (!secured && tls->IsSecured())
+				OnSecure({ tls->GetProtocol(), tls->IsResumed(), client });
+		}
+
+		// Decompressed once decrypted, the client's offer answered
+		if (compression) {
+			auto wire = tls ? std::string_view(plain) : std::string_view(ctx->Data(), length);
+			std::string inflated;
+			if (!wire.empty())
+				open = compression->Receive(wire.data(), wire.size(), inflated) && open;
+			this->FlushCompression(client);
+			plain.swap(inflated);
+		}
+
+		if (!plain.empty()) {
+			IOCP::BufferRef view;
+			if (OnDataView)
+				view = std::make_shared<IOCP::Buffer>(plain.begin(), plain.end());
+			if (OnData)
+				OnData({ std::move(plain), client });
+			if (view)
+				OnDataView({ std::move(view), client });
+		}
+		return open;
+	}
+
+	bool ServerSocket::FlushTLS(ClientSocket* client) noexcept {
+		auto& tls = client->m_tls;
+		if (!tls->BeginOutput())
+			return true;
+
+		bool sent = true;
+		for (;;) {
+			auto ctx = Track<ServerContext>(client);
+			IOCP::IOContext* queued;
+			if (!tls->TakeOutput(ctx->buffer, queued)) {
+				Socket::Release(ctx);
+				break;
+			}
+			if (queued) {
+				Socket::Release(ctx);
+				ctx = static_cast<ServerContext*>(queued);
 			}
-		} else {
-			auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
-			ctx->buffer.resize(bytesTransferred);
 
-			this->OnIOCompleted(
-				ctx.get(),
-				bytesTransferred,
-				Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal))
-			);
+			// Records of a closed connection are dropped, the turn still
+			// has to end
+			if (!client->IsOpen()) {
+				Socket::Release(ctx);
+				sent = false;
+				continue;
+			}
+
+			ctx->client = client;
+			if (!queued)
+				ctx->operation = IOCP::IOOperation::SEND;
+			if (!Socket::QueueSend(ctx))
+				sent = false;
 		}
-		return true;
+
+		// Sends of the turn may have completed before it ended, leaving the
+		// switch to kTLS to it
+		if (tls->Offload(client->GetSocket(), client->GetUnsentBytes()))
+			return this->FlushTLS(client) && sent;
+		return sent;
 	}
 
-	void ClientSocket::OnIOCompleted(
+	bool ServerSocket::FlushCompression(ClientSocket* client) noexcept {
+		auto& compression = client->m_compression;
+		if (!compression->BeginOutput())
+			return true;
+
+		bool sent = true;
+		for (;;) {
+			auto ctx = Track<ServerContext>(client);
+			if (!compression->TakeOutput(ctx->buffer)) {
+				Socket::Release(ctx);
+				break;
+			}
+
+			// Frames of a closed connection are dropped, the turn still has
+			// to end
+			if (!client->IsOpen()) {
+				Socket::Release(ctx);
+				sent = false;
+				continue;
+			}
+
+			// Encrypted in the order taken, the turn keeps it
+			if (client->m_tls) {
+				std::string_view frames(ctx->buffer.data(), ctx->buffer.size());
+				if (!client->m_tls->Write(std::span<const std::string_view>(&frames, 1)) || !this->FlushTLS(client))
+					sent = false;
+				Socket::Release(ctx);
+				continue;
+			}
+
+			ctx->client = client;
+			ctx->operation = IOCP::IOOperation::SEND;
+			if (!Socket::QueueSend(ctx))
+				sent = false;
+		}
+		return sent;
+	}
+
+	void ServerSocket::Disconnect(ClientSocket* client, std::uint32_t error) noexcept {
+		client->Close();
+
+		// Every receive still out fails the same way
+		if (!std::exchange(client->m_disconnected, true))
+			OnDisconnect({ error, client });
+	}
+
+	void ServerSocket::OnSendBacklog(
+		Socket* target,
+		std::size_t unsent,
+		bool congested
+	) noexcept {
+		auto client = static_cast<ClientSocket*>(target);
+		if (congested)
+			OnBackpressure({ unsent, client });
+		else
+			OnWritable({ unsent, client });
+	}
+
+	void ServerSocket::OnIOCompleted(
 		IOCP::IOContext* rawCtx,
 		std::uint32_t bytesTransferred,
 		std::uint32_t error
@@ -584,378 +4623,555 @@ namespace NSA::Core::Socket {
 		if (!rawCtx)
 			return;
 
-		auto ctx = static_cast<ClientContext*>(rawCtx);
+		auto ctx = static_cast<ServerContext*>(rawCtx);
 
 		switch (ctx->operation) {
-			case IOCP::IOOperation::CONNECT: {
+			case IOCP::IOOperation::ACCEPT: {
+				auto listener = static_cast<std::size_t>(
+					std::ranges::find(m_listeners, ctx->target) - m_listeners.begin()
+				);
+
+				if (ctx->backoff) {
+					{
+						std::lock_guard<std::mutex> lock(m_acceptMutex);
+						m_listenerBackoff[listener] = false;
+					}
+					if (ctx->target->IsOpen())
+						this->ResumeAccepts(listener);
+					break;
+				}
+
 				if (error != 0) {
+					// connection closed or error
 #ifdef ATS_DEBUG
 					std::println(
 						stderr,
-						"Connect failed: {}",
+						"ServerSocket AcceptEx closed or error: {}",
 						Shared::Utils::GetLastWSAErrorString(error)
 					);
-#endif
-					break;
+#endif
+#if NSA_USE_WINDOWS
+					// The socket AcceptEx was handed for the connection
+					if (ctx->client) {
+						std::lock_guard<std::mutex> lock(m_clientsMutex);
+						std::erase_if(m_clients, [&](const auto& client) { return client.get() == ctx->client; });
+					}
+#endif
+					if (IsListenerError(error) || !ctx->target->IsOpen()) {
+						// Detached listeners live on in another process, closing
+						// them here would shut them down there too
+						if (!m_detached)
+							this->Close();
+						break;
+					}
+
+					// A multishot accept still armed carries on by itself
+					if (!ctx->multishot)
+						this->BackOffAccept(listener);
+					break;
+				}
+
+#if NSA_USE_LINUX
+				{
+					std::lock_guard<std::mutex> lock(m_clientsMutex);
+					// Sharded connections stay on the queue that accepted them
+					ctx->client = m_clients.emplace_back(new ClientSocket(
+						std::move(ctx->socket),
+						m_shards.empty() ? std::nullopt : ctx->target->GetQueue()
+					)).get();
+				}
+
+				// The listener held the connection back until data arrived,
+				// so the first bytes are normally there already
+				if (m_acceptConfig.firstPayload != 0) {
+					ctx->buffer.resize(m_acceptConfig.firstPayload);
+
+					auto received = recv(
+						ctx->client->GetSocket(),
+						ctx->buffer.data(),
+						ctx->buffer.size(),
+						0
+					);
+					bytesTransferred = received > 0 ? static_cast<std::uint32_t>(received) : 0;
 				}
+#endif
 
-				// CompleteConnect: update socket to be usable with getsockname etc.
-				// set SO_UPDATE_CONNECT_CONTEXT
-				if (setsockopt(
-					m_socket,
+#if NSA_USE_WINDOWS
+				// Lets getsockname, shutdown and the like work on the connection
+				auto listenerSocket = ctx->target->GetSocket();
+				setsockopt(
+					ctx->client->GetSocket(),
 					SOL_SOCKET,
-					SO_UPDATE_CONNECT_CONTEXT,
-					nullptr,
-					0
-				) == SOCKET_ERROR) {
-#ifdef ATS_DEBUG
-					std::println(
-						stderr,
-						"OnIOCompleted error: {}",
-						Shared::Utils::GetLastWSAErrorString()
+					SO_UPDATE_ACCEPT_CONTEXT,
+					reinterpret_cast<const char*>(&listenerSocket),
+					sizeof(listenerSocket)
+				);
+
+				// AcceptEx left the peer address in the buffer, after the payload
+				if (auto GetAcceptExSockaddrs = ServerSocket::GetAcceptExSockaddrsPtr(m_socket)) {
+					sockaddr* local = nullptr;
+					sockaddr* remote = nullptr;
+					int localLength = 0;
+					int remoteLength = 0;
+
+					GetAcceptExSockaddrs(
+						ctx->buffer.data(),
+						m_acceptConfig.firstPayload,
+						ACCEPT_ADDRESS_LENGTH,
+						ACCEPT_ADDRESS_LENGTH,
+						&local,
+						&localLength,
+						&remote,
+						&remoteLength
 					);
+					if (remote && remoteLength <= static_cast<int>(sizeof(ctx->address.storage))) {
+						memcpy(&ctx->address.storage, remote, remoteLength);
+						ctx->address.length = remoteLength;
+					}
+				}
 #endif
-					break;
+				ctx->client->SetAddress(ctx->address);
+				ctx->client->UseStrand(m_acceptConfig.strand);
+
+				// Waits for the ClientHello, which may be the first payload,
+				// and for the codecs the client offers
+				auto open = true;
+				if (m_tlsContext) {
+					auto& tls = ctx->client->m_tls;
+					tls = std::make_unique<TLS::Session>(m_tlsContext);
+					open = tls->Start({}, {});
+				}
+				if (open && m_compressionContext) {
+					auto& compression = ctx->client->m_compression;
+					compression = std::make_unique<Compression::Session>(m_compressionContext);
+					open = compression->Start(Compression::Role::SERVER);
 				}
 
-				auto addr = Socket::GetSocketAddress(m_socket);
-				if (!addr.has_value())
-					break;
+				OnConnect({ ctx->client });
 
-				m_host = addr.value().first;
-				m_port = addr.value().second;
+				// The first payload goes out ahead of anything a receive gets
+				if (open && bytesTransferred != 0)
+					open = this->Receive(ctx, bytesTransferred);
 
-				OnConnect({ m_host, m_port });
+				if (open) {
+					for (std::uint32_t i = 0; i < (Socket::IsMultishot() ? 1 : Socket::MAX_PENDING_RECVS); i++)
+						this->Recv(ctx->client);
+				} else {
+					this->Disconnect(ctx->client, ctx->client->GetStageError());
+				}
 
-				for (auto i = 0; i < Socket::MAX_PENDING_RECVS; i++)
-					this->Recv();
+				// Replace the accept that was just consumed
+				if (!ctx->multishot)
+					this->ReplenishAccepts(listener, true);
 
 				break;
 			} case IOCP::IOOperation::RECV: {
-				if (error != 0) {
+				// A zero byte receive means the peer closed the connection
+				if (error != 0 || bytesTransferred == 0) {
 					// connection closed or error
 #ifdef ATS_DEBUG
 					std::println(
 						stderr,
-						"ClientSocket WSARecv closed or error: {}",
+						"ServerSocket WSARecv closed or error: {}",
 						Shared::Utils::GetLastWSAErrorString(error)
 					);
 #endif
-					this->Close();
+					this->Disconnect(ctx->client, error);
 					break;
 				}
 
-				if (bytesTransferred > 0) {
-					OnData({ ctx->buffer.data(), bytesTransferred });
+				if (!this->Receive(ctx, bytesTransferred)) {
+					this->Disconnect(ctx->client, ctx->client->GetStageError());
+					break;
+				}
+
+				if (!ctx->multishot && !this->Recv(ctx->client)) {
+#if NSA_USE_WINDOWS
+					this->Disconnect(ctx->client, static_cast<std::uint32_t>(WSAGetLastError()));
+#else
+					this->Disconnect(ctx->client, static_cast<std::uint32_t>(errno));
+#endif
 				}
-				
-				this->Recv();
 
 				break;
 			} case IOCP::IOOperation::SEND: {
+				Socket::CompleteSend(ctx, error != 0);
+
 				if (error != 0) {
 					// connection closed or error
 #ifdef ATS_DEBUG
 					std::println(
 						stderr,
-						"ClientSocket WSASend closed or error: {}",
+						"ServerSocket WSASend closed or error: {}",
 						Shared::Utils::GetLastWSAErrorString(error)
 					);
 #endif
-					this->Close();
+					ctx->client->Close();
 					break;
 				}
 
+				// The records ahead of the switch to kTLS are out
+				auto client = ctx->client;
+				if (client->m_tls && client->m_tls->Offload(client->GetSocket(), client->GetUnsentBytes()))
+					this->FlushTLS(client);
+
+				break;
+			} case IOCP::IOOperation::SEND_FILE: {
+				Socket::CompleteSend(ctx, error != 0);
+
+				OnFileSent({ ctx->offset, error, ctx->client });
+
+				if (error != 0) {
+#ifdef ATS_DEBUG
+					std::println(
+						stderr,
+						"ServerSocket TransmitFile closed or error: {}",
+						Shared::Utils::GetLastWSAErrorString(error)
+					);
+#endif
+					ctx->client->Close();
+				}
+
+				break;
+			} case IOCP::IOOperation::RECV_FROM:
+			case IOCP::IOOperation::SEND_TO: {
+				// Datagram operations, never issued on a stream
+				break;
+			} default: {
+				// Tasks are run by Socket::Run and never get here
 				break;
 			}
 		}
 
-		std::erase_if(m_postedCtx, [&](auto& p) { return p.get() == ctx; });
+		// Multishot operations keep their context until the final completion
+		if (!ctx->multishot)
+			Socket::Release(ctx);
 	}
 
 #pragma endregion
 
-#pragma region Server Socket
+#pragma region Datagram Socket
 
-	bool ServerSocket::Listen(const std::string_view& host, std::uint32_t port) noexcept {
-		if (m_socket == INVALID_SOCKET)
+	namespace {
+		// Errors that concern a single datagram, receiving goes on after them
+		bool IsDatagramError(std::uint32_t error) noexcept {
+#if NSA_USE_WINDOWS
+			return error == WSAEMSGSIZE
+				|| error == WSAECONNRESET
+				|| error == WSAENETRESET;
+#else
+			return error == ECONNREFUSED
+				|| error == EHOSTUNREACH
+				|| error == ENETUNREACH;
+#endif
+		}
+	}
+
+	DatagramSocket::~DatagramSocket() noexcept {
+		// Completions still in flight call back into this object
+		this->Close();
+		this->WaitForPending();
+	}
+
+	bool DatagramSocket::Create(
+		AddressFamily family,
+		std::optional<std::uint32_t> queue
+	) noexcept {
+		return Socket::Create(family, SocketType::UDP, queue);
+	}
+
+	bool DatagramSocket::SetDatagramConfig(const DatagramConfig& config) noexcept {
+		if (m_bound)
+			return false;
+
+		if (config.recvBatch == 0 || config.maxDatagramSize == 0)
+			return false;
+
+		m_config = config;
+		return true;
+	}
+
+	bool DatagramSocket::Bind(const std::string_view& host, std::uint32_t port) noexcept {
+		if (m_socket == INVALID_SOCKET || m_bound)
 			return false;
 
-		sockaddr_in addr;
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(port);
-		if (inet_pton(addr.sin_family, host.data(), &addr.sin_addr) != 1) {
+		auto address = IOCP::Address::Parse(host, port);
+		if (!address.has_value() || address->Family() != std::to_underlying(m_family)) {
 #ifdef ATS_DEBUG
-			std::println(stderr,
-				"inet_pton failed: {}",
-				Shared::Utils::GetLastWSAErrorString()
-			);
+			std::println(stderr, "Not a numeric address of the socket's family: {}", host);
 #endif
 			return false;
 		}
-		if (bind(m_socket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+
+#if NSA_USE_WINDOWS
+		// An ICMP port unreachable caused by a send would fail the next receive
+		BOOL reportReset = FALSE;
+		DWORD bytes = 0;
+		WSAIoctl(
+			m_socket,
+			SIO_UDP_CONNRESET,
+			&reportReset,
+			sizeof(reportReset),
+			nullptr,
+			0,
+			&bytes,
+			nullptr,
+			nullptr
+		);
+
+		// Lets a completed receive take in what else is queued without waiting
+		u_long nonBlocking = 1;
+		if (ioctlsocket(m_socket, FIONBIO, &nonBlocking) == SOCKET_ERROR) {
 #ifdef ATS_DEBUG
-			std::println(stderr,
-				"bind failed: {}",
+			std::println(
+				stderr,
+				"ioctlsocket failed: {}",
 				Shared::Utils::GetLastWSAErrorString()
 			);
 #endif
 			return false;
 		}
+#else
+		// Older kernels hand every datagram over on its own
+		if (m_config.offload) {
+			int enable = 1;
+			setsockopt(m_socket, SOL_UDP, UDP_GRO, &enable, sizeof(enable));
+		}
+#endif
 
-		if (listen(m_socket, SOMAXCONN) == SOCKET_ERROR) {
+		if (bind(m_socket, address->Get(), address->length) == SOCKET_ERROR) {
 #ifdef ATS_DEBUG
 			std::println(stderr,
-				"listen failed: {}",
+				"bind failed: {}",
 				Shared::Utils::GetLastWSAErrorString()
 			);
 #endif
 			return false;
 		}
 
-		m_host = host;
-		m_port = port;
-		OnListening({ host, port });
+		// Along with the port the system picked when asked for 0
+		if (auto local = Socket::GetLocalAddress(m_socket))
+			this->SetAddress(*local);
+		else
+			this->SetAddress(*address);
+		m_bound = true;
+
+#if NSA_USE_WINDOWS
+		auto pending = Socket::MAX_PENDING_RECVS;
+#else
+		// A single batch at a time drains the queue
+		std::uint32_t pending = 1;
+#endif
+		for (std::uint32_t i = 0; i < pending; i++)
+			this->Recv();
 
-		for (auto i = 0; i < gs_workers.size(); i++) {
-			this->Accept();
-		}
 		return true;
 	}
 
-	bool ServerSocket::Accept() noexcept {
+	bool DatagramSocket::Recv(DatagramContext* ctx) noexcept {
 		if (m_socket == INVALID_SOCKET)
 			return false;
 
-		auto AcceptEx = ServerSocket::GetAcceptExPtr(m_socket);
-		if (!AcceptEx) {
-#ifdef ATS_DEBUG
-			std::println(
-				stderr,
-				"GetAcceptExPtr failed: {}",
-				Shared::Utils::GetLastErrorString()
-			);
-#endif
-			return false;
-		}
-
-		std::lock_guard<std::mutex> lock(gs_bufferMutex);
+		if (!ctx) {
+			ctx = Track<DatagramContext>(this);
+			ctx->operation = IOCP::IOOperation::RECV_FROM;
 
-		auto& ctx = m_postedCtx.emplace_back(new ServerContext);
-		ctx->owner = this;
+			std::size_t slotSize = m_config.maxDatagramSize;
+#if NSA_USE_LINUX
+			if (m_config.offload)
+				slotSize = std::max<std::size_t>(slotSize, OFFLOAD_SLOT_SIZE);
 
-		auto& sock = m_clients.emplace_back(new ClientSocket);
-		if (!sock->Create())
-			return false;
-
-		ctx->client = sock.get();
-		ctx->operation = IOCP::IOOperation::ACCEPT;
-		DWORD bytesReceived = 0;
-
-		if (!AcceptEx(
-			m_socket,
-			ctx->client->GetSocket(),
-			ctx->buffer.data(),
-			0,
-			sizeof(sockaddr_storage) + 16,
-			sizeof(sockaddr_storage) + 16,
-			&bytesReceived,
-			&ctx->overlapped
-		)) {
-			auto err = WSAGetLastError();
-			if (err != WSA_IO_PENDING) {
-#ifdef ATS_DEBUG
-				std::println(
-					stderr,
-					"ConnectEx failed: {}",
-					Shared::Utils::GetLastErrorString(err)
-				);
+			// One message per slot
+			ctx->messages.resize(m_config.recvBatch);
 #endif
-				return false;
-			}
-		} else {
-			auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
-			ctx->buffer.resize(bytesTransferred);
-
-			this->OnIOCompleted(
-				ctx.get(),
-				bytesTransferred,
-				Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal))
-			);
+			ctx->buffer.resize(m_config.recvBatch * slotSize);
 		}
-		return true;
-	}
-
-	bool ServerSocket::Send(const std::string_view& data, ClientSocket* sock) noexcept {
-		if (m_socket == INVALID_SOCKET)
-			return false;
 
-		std::lock_guard<std::mutex> lock(gs_bufferMutex);
+#if NSA_USE_WINDOWS
+		// The completion fills the first slot
+		ctx->datagrams.resize(m_config.recvBatch);
+		auto& first = ctx->datagrams.front();
+		first.peer.length = sizeof(first.peer.storage);
 
-		auto& ctx = m_postedCtx.emplace_back(new ServerContext);
-		ctx->owner = this;
-		ctx->client = sock;
-		ctx->buffer.assign(data.begin(), data.end());
+		memset(&ctx->overlapped, 0, sizeof(ctx->overlapped));
 		ctx->wsabuf.buf = ctx->buffer.data();
-		ctx->wsabuf.len = static_cast<ULONG>(ctx->buffer.size());
-		ctx->operation = IOCP::IOOperation::SEND;
+		ctx->wsabuf.len = static_cast<ULONG>(m_config.maxDatagramSize);
 
-		DWORD bytesSent = 0;
-		if (WSASend(
-			ctx->client->GetSocket(),
+		m_inflight++;
+
+		DWORD flags = 0;
+		DWORD bytesReceived = 0;
+		if (WSARecvFrom(
+			m_socket,
 			&ctx->wsabuf,
 			1,
-			&bytesSent,
-			0,
+			&bytesReceived,
+			&flags,
+			first.peer.Get(),
+			&first.peer.length,
 			&ctx->overlapped,
 			nullptr
 		) == SOCKET_ERROR) {
 			auto err = WSAGetLastError();
 			if (err != WSA_IO_PENDING) {
+				ReleaseInflight();
 #ifdef ATS_DEBUG
 				std::println(
 					stderr,
-					"WSASend failed: {}",
+					"WSARecvFrom failed: {}",
 					Shared::Utils::GetLastWSAErrorString(err)
 				);
 #endif
 				return false;
 			}
 		} else {
+			ReleaseInflight();
+
 			auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
-			ctx->buffer.resize(bytesTransferred);
 
-			this->OnIOCompleted(
-				ctx.get(),
+			Socket::Complete(
+				ctx,
 				bytesTransferred,
 				Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal))
 			);
 		}
 		return true;
+#else
+		return Socket::Submit(this, ctx);
+#endif
 	}
 
-	bool ServerSocket::Recv(ClientSocket* sock) noexcept {
-		if (m_socket == INVALID_SOCKET)
+	bool DatagramSocket::Send(const std::string_view& data, const IOCP::Address& peer) noexcept {
+		IOCP::Datagram datagram{ data, peer };
+		return this->Send(std::span<const IOCP::Datagram>(&datagram, 1));
+	}
+
+	bool DatagramSocket::Send(std::span<const IOCP::Datagram> datagrams) noexcept {
+		if (m_socket == INVALID_SOCKET || datagrams.empty())
 			return false;
 
-		std::lock_guard<std::mutex> lock(gs_bufferMutex);
+		auto ctx = Track<DatagramContext>(this);
+		ctx->operation = IOCP::IOOperation::SEND_TO;
 
-		auto& ctx = m_postedCtx.emplace_back(new ServerContext);
-		ctx->owner = this;
-		ctx->client = sock;
-		ctx->buffer.resize(IOCP::DEFAULT_BUFFER_SIZE);
-		ctx->wsabuf.buf = ctx->buffer.data();
-		ctx->wsabuf.len = static_cast<ULONG>(ctx->buffer.size());
-		ctx->operation = IOCP::IOOperation::RECV;
+		std::size_t size = 0;
+		for (auto& datagram : datagrams)
+			size += datagram.data.size();
 
-		DWORD flags = 0;
-		DWORD bytesReceived = 0;
-		if (WSARecv(
-			ctx->client->GetSocket(),
-			&ctx->wsabuf,
-			1,
-			&bytesReceived,
-			&flags,
-			&ctx->overlapped,
-			nullptr
-		) == SOCKET_ERROR) {
-			auto err = WSAGetLastError();
-			if (err != WSA_IO_PENDING) {
-#ifdef ATS_DEBUG
-				std::println(
-					stderr,
-					"WSARecv failed: {}",
-					Shared::Utils::GetLastWSAErrorString(err)
-				);
+		// Back to back, so a run to one peer can go out as a single send
+		ctx->buffer.resize(size);
+		auto out = ctx->buffer.data();
+		for (auto& datagram : datagrams) {
+			ctx->datagrams.push_back({ { out, datagram.data.size() }, datagram.peer });
+			out = std::ranges::copy(datagram.data, out).out;
+		}
+#if NSA_USE_LINUX
+		ctx->segment = m_config.offload;
 #endif
-				return false;
-			}
-		} else {
-			auto bytesTransferred = static_cast<std::uint32_t>(ctx->overlapped.InternalHigh);
-			ctx->buffer.resize(bytesTransferred);
 
-			this->OnIOCompleted(
-				ctx.get(),
-				bytesTransferred,
-				Shared::Utils::GetLastErrorInternal(static_cast<NTSTATUS>(ctx->overlapped.Internal))
-			);
-		}
-		return true;
+		return Socket::QueueSend(ctx);
 	}
 
-	void ServerSocket::OnIOCompleted(
+	void DatagramSocket::OnSendBacklog(
+		Socket* target,
+		std::size_t unsent,
+		bool congested
+	) noexcept {
+		(void)target;
+		if (congested)
+			OnBackpressure({ unsent });
+		else
+			OnWritable({ unsent });
+	}
+
+	void DatagramSocket::OnIOCompleted(
 		IOCP::IOContext* rawCtx,
-		std::uint32_t bytesTransferred,
+		[[maybe_unused]] std::uint32_t bytesTransferred,
 		std::uint32_t error
 	) noexcept {
 		if (!rawCtx)
 			return;
 
-		auto ctx = static_cast<ServerContext*>(rawCtx);
+		auto ctx = static_cast<DatagramContext*>(rawCtx);
 
 		switch (ctx->operation) {
-			case IOCP::IOOperation::ACCEPT: {
-				if (error != 0) {
-					// connection closed or error
+			case IOCP::IOOperation::RECV_FROM: {
+				if (error != 0 && !IsDatagramError(error)) {
 #ifdef ATS_DEBUG
 					std::println(
 						stderr,
-						"ServerSocket AcceptEx closed or error: {}",
+						"DatagramSocket WSARecvFrom closed or error: {}",
 						Shared::Utils::GetLastWSAErrorString(error)
 					);
 #endif
-					this->Close();
 					break;
 				}
 
-				OnConnect({ ctx->client });
+#if NSA_USE_WINDOWS
+				// The completion filled the first slot, take in what else is
+				// queued without waiting. A cut off datagram still arrived
+				std::size_t count = 0;
+				if (error == 0 || error == WSAEMSGSIZE) {
+					ctx->datagrams.front().data = { ctx->buffer.data(), bytesTransferred };
+					count = 1;
+				}
 
-				for (auto i = 0; i < Socket::MAX_PENDING_RECVS; i++)
-					this->Recv(ctx->client);
+				auto slotSize = static_cast<std::size_t>(m_config.maxDatagramSize);
+				for (; count != 0 && count < ctx->datagrams.size(); count++) {
+					auto& datagram = ctx->datagrams[count];
+					auto slot = ctx->buffer.data() + count * slotSize;
+					datagram.peer.length = sizeof(datagram.peer.storage);
 
-				break;
-			} case IOCP::IOOperation::RECV: {
-				if (error != 0) {
-					// connection closed or error
-#ifdef ATS_DEBUG
-					std::println(
-						stderr,
-						"ServerSocket WSARecv closed or error: {}",
-						Shared::Utils::GetLastWSAErrorString(error)
+					auto received = recvfrom(
+						m_socket,
+						slot,
+						static_cast<int>(slotSize),
+						0,
+						datagram.peer.Get(),
+						&datagram.peer.length
 					);
-#endif
-					this->Close();
-					break;
+					if (received == SOCKET_ERROR) {
+						// Cut off at the slot size
+						if (WSAGetLastError() != WSAEMSGSIZE)
+							break;
+						received = static_cast<int>(slotSize);
+					}
+					datagram.data = { slot, static_cast<std::size_t>(received) };
 				}
+				ctx->datagrams.resize(count);
+#else
+				if (error != 0)
+					ctx->datagrams.clear();
+#endif
 
-				if (bytesTransferred > 0) {
-					OnData({ ctx->buffer.data(), bytesTransferred, ctx->client });
-				}
+				if (!ctx->datagrams.empty())
+					OnDatagrams({ ctx->datagrams });
 
-				if (!this->Recv(ctx->client)) {
-					ctx->client->Close();
-				}
+				// Same context for the next batch, it keeps its slots
+				if (this->Recv(ctx))
+					return;
 
 				break;
-			} case IOCP::IOOperation::SEND: {
-				if (error != 0) {
-					// connection closed or error
+			} case IOCP::IOOperation::SEND_TO: {
+				// Refused datagrams were skipped, the socket still works
+				Socket::CompleteSend(ctx, false);
+
 #ifdef ATS_DEBUG
+				if (error != 0) {
 					std::println(
 						stderr,
-						"ServerSocket WSASend closed or error: {}",
+						"DatagramSocket WSASendTo error: {}",
 						Shared::Utils::GetLastWSAErrorString(error)
 					);
-#endif
-					this->Close();
-					break;
 				}
-
+#endif
+				break;
+			} default: {
+				// Stream operations, never issued on a datagram socket
 				break;
 			}
 		}
 
-		std::erase_if(m_postedCtx, [&](auto& p) { return p.get() == ctx; });
+		Socket::Release(ctx);
 	}
 
 #pragma endregion
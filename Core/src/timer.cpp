@@ -0,0 +1,140 @@
+#include <timer.hpp>
+
+#include <algorithm>
+#include <bit>
+
+namespace NSA::Core::Socket::Timer {
+	Wheel::Wheel() noexcept : m_epoch(Clock::now()) {}
+
+	bool Wheel::Insert(IOCP::IOContext* ctx, Clock::duration delay) noexcept {
+		// Rounded up, a timer never fires early
+		auto ticks = std::chrono::ceil<std::chrono::milliseconds>(
+			Clock::now() - m_epoch + std::max(delay, Clock::duration::zero())
+		).count() / TICK.count();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (ctx->timerWheel)
+			Unlink(ctx);
+		else
+			m_count++;
+
+		// Catching up is the worker's job, until then m_now may lag behind
+		ctx->timerDue = std::max<std::uint64_t>(ticks, m_now + 1);
+		ctx->timerWheel = this;
+		Link(ctx);
+
+		return ctx->timerDue < m_sleepUntil;
+	}
+
+	bool Wheel::Remove(IOCP::IOContext* ctx) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (ctx->timerWheel != this)
+			return false;
+
+		Unlink(ctx);
+		ctx->timerWheel = nullptr;
+		m_count--;
+		return true;
+	}
+
+	int Wheel::Sleep() noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_sleepUntil = m_count == 0 ? NEVER : NextEvent();
+		if (m_sleepUntil == NEVER)
+			return -1;
+
+		auto now = Now();
+		if (m_sleepUntil <= now)
+			return 0;
+
+		auto ticks = m_sleepUntil - now;
+		return static_cast<int>(std::min<std::uint64_t>(
+			ticks * TICK.count(),
+			std::numeric_limits<int>::max()
+		));
+	}
+
+	std::size_t Wheel::Size() const noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_count;
+	}
+
+	std::uint64_t Wheel::Now() const noexcept {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			Clock::now() - m_epoch
+		).count() / TICK.count();
+	}
+
+	void Wheel::Link(IOCP::IOContext* ctx) noexcept {
+		auto due = ctx->timerDue;
+
+		auto slot = OVERFLOW_SLOT;
+		for (std::uint32_t level = 0; level < LEVELS; level++) {
+			// The lowest level whose span m_now and `due` share
+			auto span = SLOT_BITS * (level + 1);
+			if ((due >> span) != (m_now >> span))
+				continue;
+
+			auto index = (due >> (SLOT_BITS * level)) & (SLOTS - 1);
+			slot = level * SLOTS + static_cast<std::uint32_t>(index);
+			m_occupied[level] |= std::uint64_t(1) << index;
+			break;
+		}
+
+		ctx->timerSlot = static_cast<std::uint16_t>(slot);
+		ctx->timerPrev = nullptr;
+		ctx->timerNext = m_slots[slot];
+		if (ctx->timerNext)
+			ctx->timerNext->timerPrev = ctx;
+		m_slots[slot] = ctx;
+	}
+
+	void Wheel::Unlink(IOCP::IOContext* ctx) noexcept {
+		auto slot = ctx->timerSlot;
+		if (ctx->timerPrev)
+			ctx->timerPrev->timerNext = ctx->timerNext;
+		else
+			m_slots[slot] = ctx->timerNext;
+
+		if (ctx->timerNext)
+			ctx->timerNext->timerPrev = ctx->timerPrev;
+
+		ctx->timerPrev = nullptr;
+		ctx->timerNext = nullptr;
+
+		if (!m_slots[slot] && slot != OVERFLOW_SLOT)
+			m_occupied[slot / SLOTS] &= ~(std::uint64_t(1) << (slot % SLOTS));
+	}
+
+	IOCP::IOContext* Wheel::Take(std::uint32_t slot) noexcept {
+		auto head = std::exchange(m_slots[slot], nullptr);
+		if (slot != OVERFLOW_SLOT)
+			m_occupied[slot / SLOTS] &= ~(std::uint64_t(1) << (slot % SLOTS));
+		return head;
+	}
+
+	std::uint64_t Wheel::NextEvent() const noexcept {
+		// Everything on a level lies ahead of its current slot, and comes
+		// before anything on the levels above
+		for (std::uint32_t level = 0; level < LEVELS; level++) {
+			auto shift = SLOT_BITS * level;
+			auto current = (m_now >> shift) & (SLOTS - 1);
+
+			auto ahead = current == SLOTS - 1
+				? 0
+				: m_occupied[level] & ~((std::uint64_t(2) << current) - 1);
+			if (ahead == 0)
+				continue;
+
+			auto span = shift + SLOT_BITS;
+			auto start = (m_now >> span) << span;
+			return start + (static_cast<std::uint64_t>(std::countr_zero(ahead)) << shift);
+		}
+
+		if (m_slots[OVERFLOW_SLOT]) {
+			constexpr auto SPAN_BITS = SLOT_BITS * LEVELS;
+			return ((m_now >> SPAN_BITS) + 1) << SPAN_BITS;
+		}
+		return NEVER;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,785 @@
+#include <tls.hpp>
+
+#include <openssl/bio.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include <algorithm>
+#include <cstring>
+#include <print>
+#include <utility>
+
+#if NSA_USE_LINUX
+#	include <sys/socket.h>
+#	include <netinet/tcp.h>
+#	include <linux/tls.h>
+#	include <cerrno>
+
+#	ifndef SOL_TLS
+#		define SOL_TLS 282
+#	endif
+#	ifndef TCP_ULP
+#		define TCP_ULP 31
+#	endif
+#endif
+
+namespace NSA::Core::Socket::TLS {
+	namespace {
+#if NSA_USE_WINDOWS
+		constexpr std::uint32_t SESSION_FAILED = WSAECONNABORTED;
+#else
+		constexpr std::uint32_t SESSION_FAILED = ECONNABORTED;
+#endif
+
+		void PrintErrors([[maybe_unused]] std::string_view what) noexcept {
+#ifdef ATS_DEBUG
+			while (auto error = ERR_get_error()) {
+				char text[256];
+				ERR_error_string_n(error, text, sizeof(text));
+				std::println(stderr, "TLS {}: {}", what, text);
+			}
+#endif
+			ERR_clear_error();
+		}
+
+		bool Derive(
+			const char* name,
+			OSSL_PARAM* params,
+			unsigned char* out,
+			std::size_t length
+		) noexcept {
+			auto kdf = EVP_KDF_fetch(nullptr, name, nullptr);
+			auto ctx = kdf ? EVP_KDF_CTX_new(kdf) : nullptr;
+			auto ok = ctx && EVP_KDF_derive(ctx, out, length, params) == 1;
+
+			EVP_KDF_CTX_free(ctx);
+			EVP_KDF_free(kdf);
+			return ok;
+		}
+
+		// HKDF-Expand-Label with an empty context (RFC 8446 section 7.1)
+		bool ExpandLabel(
+			const EVP_MD* md,
+			std::span<const unsigned char> secret,
+			std::string_view label,
+			unsigned char* out,
+			std::size_t length
+		) noexcept {
+			std::string info;
+			info += static_cast<char>(length >> 8);
+			info += static_cast<char>(length & 0xFF);
+			info += static_cast<char>(6 + label.size());
+			info += "tls13 ";
+			info += label;
+			info += '\0';
+
+			int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+			OSSL_PARAM params[] = {
+				OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, const_cast<char*>(EVP_MD_get0_name(md)), 0),
+				OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+				OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, const_cast<unsigned char*>(secret.data()), secret.size()),
+				OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info.data(), info.size()),
+				OSSL_PARAM_construct_end()
+			};
+			return Derive(OSSL_KDF_NAME_HKDF, params, out, length);
+		}
+
+		// The TLS 1.2 key block (RFC 5246 section 6.3)
+		bool ExpandKeyBlock(
+			const EVP_MD* md,
+			std::span<const unsigned char> master,
+			std::string seed,
+			unsigned char* out,
+			std::size_t length
+		) noexcept {
+			OSSL_PARAM params[] = {
+				OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, const_cast<char*>(EVP_MD_get0_name(md)), 0),
+				OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, const_cast<unsigned char*>(master.data()), master.size()),
+				OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, seed.data(), seed.size()),
+				OSSL_PARAM_construct_end()
+			};
+			return Derive(OSSL_KDF_NAME_TLS1_PRF, params, out, length);
+		}
+	}
+
+#pragma region Context
+
+	Context::~Context() noexcept {
+		for (auto& [peer, session] : m_sessions)
+			SSL_SESSION_free(session);
+
+		if (m_ctx)
+			SSL_CTX_free(m_ctx);
+	}
+
+	bool Context::Create(const Config& config, Role role) noexcept {
+		if (m_ctx)
+			return false;
+
+		auto ctx = SSL_CTX_new(role == Role::SERVER ? TLS_server_method() : TLS_client_method());
+		if (!ctx) {
+			PrintErrors("context");
+			return false;
+		}
+
+		bool ok = SSL_CTX_set_min_proto_version(
+			ctx,
+			config.minVersion == Version::TLS1_3 ? TLS1_3_VERSION : TLS1_2_VERSION
+		) == 1;
+		if (ok && !config.ciphers.empty())
+			ok = SSL_CTX_set_cipher_list(ctx, config.ciphers.c_str()) == 1;
+		if (ok && !config.ciphersuites.empty())
+			ok = SSL_CTX_set_ciphersuites(ctx, config.ciphersuites.c_str()) == 1;
+
+		if (ok && !config.certificateFile.empty()) {
+			ok = SSL_CTX_use_certificate_chain_file(ctx, config.certificateFile.c_str()) == 1
+				&& SSL_CTX_use_PrivateKey_file(ctx, config.privateKeyFile.c_str(), SSL_FILETYPE_PEM) == 1
+				&& SSL_CTX_check_private_key(ctx) == 1;
+		}
+		// Servers cannot do without a certificate
+		if (ok && role == Role::SERVER && config.certificateFile.empty())
+			ok = false;
+
+		bool verify = role == Role::SERVER ? config.requireClientCertificate : config.verifyPeer;
+		if (ok && verify) {
+			ok = config.caFile.empty()
+				? SSL_CTX_set_default_verify_paths(ctx) == 1
+				: SSL_CTX_load_verify_locations(ctx, config.caFile.c_str(), nullptr) == 1;
+			SSL_CTX_set_verify(
+				ctx,
+				role == Role::SERVER
+					? SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT
+					: SSL_VERIFY_PEER,
+				nullptr
+			);
+		}
+		// The system store is too large to name to clients
+		if (ok && verify && role == Role::SERVER && !config.caFile.empty()) {
+			auto names = SSL_load_client_CA_file(config.caFile.c_str());
+			ok = names != nullptr;
+			// Takes ownership of the list
+			if (ok)
+				SSL_CTX_set_client_CA_list(ctx, names);
+		}
+
+		// Wire format: each name behind its length
+		std::string protocols;
+		for (auto& protocol : config.alpn) {
+			if (protocol.empty() || protocol.size() > 255) {
+				ok = false;
+				break;
+			}
+			protocols += static_cast<char>(protocol.size());
+			protocols += protocol;
+		}
+
+		if (!ok) {
+			PrintErrors("configuration");
+			SSL_CTX_free(ctx);
+			return false;
+		}
+
+		if (!config.tickets)
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+#if NSA_USE_LINUX
+		// TLS 1.3 traffic secrets are only to be had from the key log
+		if (config.kernelOffload)
+			SSL_CTX_set_keylog_callback(ctx, &Context::OnKeyLog);
+#endif
+
+		if (role == Role::SERVER) {
+			// One cache behind the context, shared by the sessions of every
+			// worker. Tickets are sealed with keys of the context as well
+			static const unsigned char SESSION_ID_CONTEXT[] = "NSA";
+			SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(ctx, static_cast<long>(config.sessionCacheSize));
+
+			if (!protocols.empty())
+				SSL_CTX_set_alpn_select_cb(ctx, &Context::OnSelectProtocol, this);
+		} else {
+			// Kept per peer here rather than in OpenSSL's cache, which clients
+			// do not look up by themselves
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(ctx, &Context::OnNewSession);
+
+			if (!protocols.empty()) {
+				SSL_CTX_set_alpn_protos(
+					ctx,
+					reinterpret_cast<const unsigned char*>(protocols.data()),
+					static_cast<unsigned int>(protocols.size())
+				);
+			}
+		}
+
+		m_ctx = ctx;
+		m_role = role;
+		m_config = config;
+		m_protocols = std::move(protocols);
+		return true;
+	}
+
+	Stats Context::GetStats() const noexcept {
+		Stats stats;
+		stats.handshakes = m_handshakes.load(std::memory_order_relaxed);
+		stats.resumed = m_resumed.load(std::memory_order_relaxed);
+		stats.failed = m_failed.load(std::memory_order_relaxed);
+		stats.offloaded = m_offloaded.load(std::memory_order_relaxed);
+
+		if (m_role == Role::SERVER && m_ctx) {
+			stats.cached = static_cast<std::uint64_t>(SSL_CTX_sess_number(m_ctx));
+		} else {
+			std::lock_guard<std::mutex> lock(m_sessionMutex);
+			stats.cached = m_sessions.size();
+		}
+		return stats;
+	}
+
+	void Context::StoreSession(const std::string& peer, ssl_session_st* session) noexcept {
+		ssl_session_st* replaced = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_sessionMutex);
+			auto it = m_sessions.find(peer);
+			if (it != m_sessions.end()) {
+				replaced = std::exchange(it->second, session);
+			} else {
+				// Any peer makes room, the cache only bounds memory
+				if (m_sessions.size() >= std::max<std::size_t>(m_config.sessionCacheSize, 1)) {
+					auto victim = m_sessions.begin();
+					replaced = victim->second;
+					m_sessions.erase(victim);
+				}
+				m_sessions.emplace(peer, session);
+			}
+		}
+
+		if (replaced)
+			SSL_SESSION_free(replaced);
+	}
+
+	int Context::OnNewSession(ssl_st* ssl, ssl_session_st* session) noexcept {
+		auto owner = static_cast<Session*>(SSL_get_app_data(ssl));
+		if (!owner || owner->m_peer.empty())
+			return 0;
+
+		// Returning 1 keeps the reference OpenSSL hands over
+		owner->m_context->StoreSession(owner->m_peer, session);
+		return 1;
+	}
+
+	void Context::OnKeyLog(const ssl_st* ssl, const char* line) noexcept {
+		auto owner = static_cast<Session*>(SSL_get_app_data(ssl));
+		if (!owner)
+			return;
+
+		// "<label> <client random> <secret>", both in hex
+		std::string_view entry(line);
+		auto label = owner->m_context->GetRole() == Role::SERVER
+			? "SERVER_TRAFFIC_SECRET_0 "
+			: "CLIENT_TRAFFIC_SECRET_0 ";
+		if (!entry.starts_with(label))
+			return;
+
+		auto hex = entry.substr(entry.rfind(' ') + 1);
+		auto digit = [](char c) {
+			return static_cast<unsigned char>(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+		};
+
+		auto& secret = owner->m_secret;
+		secret.clear();
+		for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+			secret.push_back(static_cast<unsigned char>(digit(hex[i]) << 4 | digit(hex[i + 1])));
+	}
+
+	int Context::OnSelectProtocol(
+		ssl_st* ssl,
+		const unsigned char** out,
+		unsigned char* outLength,
+		const unsigned char* in,
+		unsigned int inLength,
+		void* arg
+	) noexcept {
+		(void)ssl;
+		auto context = static_cast<Context*>(arg);
+		auto& protocols = context->m_protocols;
+
+		// The server's preference decides
+		unsigned char* selected = nullptr;
+		if (SSL_select_next_proto(
+			&selected,
+			outLength,
+			reinterpret_cast<const unsigned char*>(protocols.data()),
+			static_cast<unsigned int>(protocols.size()),
+			in,
+			inLength
+		) != OPENSSL_NPN_NEGOTIATED)
+			return SSL_TLSEXT_ERR_ALERT_FATAL;
+
+		*out = selected;
+		return SSL_TLSEXT_ERR_OK;
+	}
+
+#pragma endregion
+
+#pragma region Session
+
+	Session::Session(std::shared_ptr<Context> context) noexcept
+		: m_context(std::move(context)) {}
+
+	Session::~Session() noexcept {
+		this->Reset();
+	}
+
+	void Session::Reset() noexcept {
+		if (m_ssl) {
+			// Connections are closed without a close_notify, which OpenSSL
+			// takes as a broken session and drops from the caches. Only
+			// failed ones are kept from being resumed
+			if (m_error == 0)
+				SSL_set_shutdown(m_ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+			// Frees both BIOs along with it
+			SSL_free(m_ssl);
+		}
+
+		m_ssl = nullptr;
+		m_input = nullptr;
+		m_output = nullptr;
+		m_pending.clear();
+		m_peer.clear();
+		m_outputBusy = false;
+		m_ended = false;
+
+		m_offload = OffloadState::NONE;
+		OPENSSL_cleanse(m_secret.data(), m_secret.size());
+		OPENSSL_cleanse(m_kernelInfo.data(), m_kernelInfo.size());
+		m_secret.clear();
+		m_kernelInfo.clear();
+		m_plain.clear();
+		// Still tracked by their socket, which frees them
+		m_queued.clear();
+		m_offloaded = false;
+
+		m_secured = false;
+		m_protocol.clear();
+		m_resumed = false;
+		m_error = 0;
+	}
+
+	bool Session::Start(std::string_view serverName, std::string_view peer) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		this->Reset();
+
+		if (!m_context || !m_context->IsCreated())
+			return this->Fail();
+
+		m_ssl = SSL_new(m_context->m_ctx);
+		m_input = BIO_new(BIO_s_mem());
+		m_output = BIO_new(BIO_s_mem());
+		if (!m_ssl || !m_input || !m_output) {
+			if (m_input)
+				BIO_free(m_input);
+			if (m_output)
+				BIO_free(m_output);
+			m_input = m_output = nullptr;
+			this->Reset();
+			return this->Fail();
+		}
+
+		// Reading an empty input BIO is a want-read, not the end of it
+		BIO_set_mem_eof_return(m_input, -1);
+		SSL_set_bio(m_ssl, m_input, m_output);
+		SSL_set_app_data(m_ssl, this);
+		m_peer = peer;
+
+		if (m_context->GetRole() == Role::SERVER) {
+			SSL_set_accept_state(m_ssl);
+			return true;
+		}
+
+		SSL_set_connect_state(m_ssl);
+		bool verify = m_context->GetConfig().verifyPeer;
+		// A certificate fits any name when none is checked
+		if (serverName.empty() && verify) {
+#ifdef ATS_DEBUG
+			std::println(stderr, "TLS session failed: no name to verify the peer against");
+#endif
+			this->Reset();
+			return this->Fail();
+		}
+
+		if (!serverName.empty()) {
+			std::string name(serverName);
+			// Addresses are checked against the IP SANs and get no SNI
+			// (RFC 6066 section 3)
+			if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(m_ssl), name.c_str()) != 1) {
+				SSL_set_tlsext_host_name(m_ssl, name.c_str());
+				if (verify)
+					SSL_set1_host(m_ssl, name.c_str());
+			}
+		}
+
+		if (!m_peer.empty()) {
+			// The cache keeps its reference, SSL_set_session takes one of its own
+			std::lock_guard<std::mutex> sessionLock(m_context->m_sessionMutex);
+			auto it = m_context->m_sessions.find(m_peer);
+			if (it != m_context->m_sessions.end())
+				SSL_set_session(m_ssl, it->second);
+		}
+
+		// The ClientHello, ready to be taken out
+		return this->Handshake();
+	}
+
+	bool Session::Handshake() noexcept {
+		ERR_clear_error();
+		auto result = SSL_do_handshake(m_ssl);
+		if (result != 1) {
+			auto error = SSL_get_error(m_ssl, result);
+			if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+				return true;
+
+			m_context->m_failed.fetch_add(1, std::memory_order_relaxed);
+			return this->Fail();
+		}
+
+		const unsigned char* protocol = nullptr;
+		unsigned int protocolLength = 0;
+		SSL_get0_alpn_selected(m_ssl, &protocol, &protocolLength);
+		if (protocol)
+			m_protocol.assign(reinterpret_cast<const char*>(protocol), protocolLength);
+		m_resumed = SSL_session_reused(m_ssl) == 1;
+
+		m_context->m_handshakes.fetch_add(1, std::memory_order_relaxed);
+		if (m_resumed)
+			m_context->m_resumed.fetch_add(1, std::memory_order_relaxed);
+		m_secured.store(true, std::memory_order_release);
+
+		// The kernel takes the sends over once what OpenSSL made is out
+		if (m_context->GetConfig().kernelOffload && this->PrepareOffload()) {
+			m_offload = OffloadState::PENDING;
+			return true;
+		}
+		if (m_ended)
+			return false;
+
+		// What was written in the meantime goes out behind the handshake
+		if (!m_pending.empty()) {
+			auto pending = std::exchange(m_pending, {});
+			if (SSL_write(m_ssl, pending.data(), static_cast<int>(pending.size())) <= 0)
+				return this->Fail();
+		}
+		return true;
+	}
+
+	bool Session::PrepareOffload() noexcept {
+#if NSA_USE_LINUX
+		auto cipher = SSL_get_current_cipher(m_ssl);
+		auto md = cipher ? SSL_CIPHER_get_handshake_digest(cipher) : nullptr;
+		if (!md)
+			return false;
+
+		std::uint16_t type = 0;
+		std::size_t keyLength = 0;
+		switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+			case NID_aes_128_gcm:
+				type = TLS_CIPHER_AES_GCM_128;
+				keyLength = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+				break;
+			case NID_aes_256_gcm:
+				type = TLS_CIPHER_AES_GCM_256;
+				keyLength = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+				break;
+			case NID_chacha20_poly1305:
+				type = TLS_CIPHER_CHACHA20_POLY1305;
+				keyLength = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+				break;
+			default:
+				return false;
+		}
+		auto chacha = type == TLS_CIPHER_CHACHA20_POLY1305;
+
+		auto server = m_context->GetRole() == Role::SERVER;
+		auto version = SSL_version(m_ssl);
+		// Implicit IV, the 4 byte salt of GCM followed by the nonce bytes
+		// TLS 1.3 and ChaCha20 add to it
+		unsigned char key[32] = {};
+		unsigned char iv[12] = {};
+		std::uint64_t sequence = 0;
+
+		if (version == TLS1_3_VERSION) {
+			if (m_secret.empty())
+				return false;
+			if (SSL_key_update(m_ssl, SSL_KEY_UPDATE_NOT_REQUESTED) != 1)
+				return false;
+			// Sent right away with the keys it retires
+			ERR_clear_error();
+			if (SSL_do_handshake(m_ssl) != 1) {
+				this->Fail();
+				return false;
+			}
+
+			std::vector<unsigned char> next(EVP_MD_get_size(md));
+			auto ok = ExpandLabel(md, m_secret, "traffic upd", next.data(), next.size())
+				&& ExpandLabel(md, next, "key", key, keyLength)
+				&& ExpandLabel(md, next, "iv", iv, sizeof(iv));
+			OPENSSL_cleanse(next.data(), next.size());
+			if (!ok) {
+				// OpenSSL moved on already, without the kernel it carries on
+				PrintErrors("key update");
+				return false;
+			}
+		} else if (version == TLS1_2_VERSION) {
+			unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+			auto masterLength = SSL_SESSION_get_master_key(SSL_get_session(m_ssl), master, sizeof(master));
+
+			unsigned char random[SSL3_RANDOM_SIZE];
+			std::string seed = "key expansion";
+			SSL_get_server_random(m_ssl, random, sizeof(random));
+			seed.append(reinterpret_cast<const char*>(random), sizeof(random));
+			SSL_get_client_random(m_ssl, random, sizeof(random));
+			seed.append(reinterpret_cast<const char*>(random), sizeof(random));
+
+			// Client key, server key, client IV, server IV; AEADs take no MAC keys
+			auto ivLength = chacha ? std::size_t(12) : std::size_t(4);
+			unsigned char block[2 * 32 + 2 * 12];
+			auto ok = ExpandKeyBlock(md, { master, masterLength }, std::move(seed), block, 2 * (keyLength + ivLength));
+			if (ok) {
+				std::memcpy(key, block + (server ? keyLength : 0), keyLength);
+				std::memcpy(iv, block + 2 * keyLength + (server ? ivLength : 0), ivLength);
+			}
+			OPENSSL_cleanse(master, sizeof(master));
+			OPENSSL_cleanse(block, sizeof(block));
+			if (!ok) {
+				PrintErrors("key block");
+				return false;
+			}
+
+			// The Finished message went out as record 0
+			sequence = 1;
+		} else {
+			return false;
+		}
+
+		unsigned char recordSequence[8];
+		for (auto i = 0; i < 8; i++)
+			recordSequence[i] = static_cast<unsigned char>(sequence >> (56 - 8 * i));
+
+		auto fill = [&]<typename T>(T& info) {
+			info.info.version = version == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+			info.info.cipher_type = type;
+			std::memcpy(info.key, key, sizeof(info.key));
+			std::memcpy(info.rec_seq, recordSequence, sizeof(info.rec_seq));
+			if constexpr (sizeof(info.salt) != 0) {
+				std::memcpy(info.salt, iv, sizeof(info.salt));
+				// TLS 1.2 sends the rest of the nonce along, the kernel counts
+				// it up from here with the sequence
+				std::memcpy(info.iv, version == TLS1_3_VERSION ? iv + sizeof(info.salt) : recordSequence, sizeof(info.iv));
+			} else {
+				std::memcpy(info.iv, iv, sizeof(info.iv));
+			}
+
+			auto bytes = reinterpret_cast<const unsigned char*>(&info);
+			m_kernelInfo.assign(bytes, bytes + sizeof(info));
+			OPENSSL_cleanse(&info, sizeof(info));
+		};
+		if (type == TLS_CIPHER_AES_GCM_128) {
+			tls12_crypto_info_aes_gcm_128 crypto{};
+			fill(crypto);
+		} else if (type == TLS_CIPHER_AES_GCM_256) {
+			tls12_crypto_info_aes_gcm_256 crypto{};
+			fill(crypto);
+		} else {
+			tls12_crypto_info_chacha20_poly1305 crypto{};
+			fill(crypto);
+		}
+
+		OPENSSL_cleanse(key, sizeof(key));
+		OPENSSL_cleanse(iv, sizeof(iv));
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	bool Session::Fail() noexcept {
+		PrintErrors("session failed");
+		m_ended = true;
+		m_error = SESSION_FAILED;
+		return false;
+	}
+
+	bool Session::Receive(const char* data, std::size_t length, std::string& plain) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_ssl || m_ended)
+			return false;
+
+		if (BIO_write(m_input, data, static_cast<int>(length)) != static_cast<int>(length))
+			return this->Fail();
+
+		if (!m_secured && !this->Handshake())
+			return false;
+
+		// Application data may come right behind the last handshake record
+		while (m_secured) {
+			char buffer[16 * 1024];
+			ERR_clear_error();
+			auto read = SSL_read(m_ssl, buffer, sizeof(buffer));
+			if (read > 0) {
+				plain.append(buffer, static_cast<std::size_t>(read));
+				continue;
+			}
+
+			auto error = SSL_get_error(m_ssl, read);
+			if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+				break;
+			if (error == SSL_ERROR_ZERO_RETURN) {
+				// close_notify, answered with one of ours
+				SSL_shutdown(m_ssl);
+				m_ended = true;
+				return false;
+			}
+			return this->Fail();
+		}
+
+		// OpenSSL answered with keys the kernel moved past, a KeyUpdate the
+		// peer asked for most likely
+		if (m_offload == OffloadState::ACTIVE && BIO_ctrl_pending(m_output) != 0)
+			return this->Fail();
+		return true;
+	}
+
+	bool Session::Write(std::span<const std::string_view> buffers) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_ssl || m_ended)
+			return false;
+
+		for (auto& buffer : buffers) {
+			if (buffer.empty())
+				continue;
+
+			if (!m_secured || m_offload == OffloadState::PENDING) {
+				m_pending += buffer;
+				continue;
+			}
+			// Encrypted by the kernel on the way out
+			if (m_offload == OffloadState::ACTIVE) {
+				m_plain.insert(m_plain.end(), buffer.begin(), buffer.end());
+				continue;
+			}
+
+			// The memory BIO takes all of it, writes never come back short
+			ERR_clear_error();
+			if (SSL_write(m_ssl, buffer.data(), static_cast<int>(buffer.size())) <= 0)
+				return this->Fail();
+		}
+		return true;
+	}
+
+	bool Session::BeginOutput() noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return !std::exchange(m_outputBusy, true);
+	}
+
+	bool Session::TakeOutput(IOCP::Buffer& out, IOCP::IOContext*& queued) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		queued = nullptr;
+		if (m_offload == OffloadState::ACTIVE) {
+			if (!m_queued.empty() && m_queued.front().first == 0) {
+				queued = m_queued.front().second;
+				m_queued.pop_front();
+				out.clear();
+				return true;
+			}
+			if (m_plain.empty()) {
+				m_outputBusy = false;
+				return false;
+			}
+
+			// Up to the next queued send
+			auto length = m_queued.empty() ? m_plain.size() : m_queued.front().first;
+			if (length == m_plain.size()) {
+				out.swap(m_plain);
+				m_plain.clear();
+			} else {
+				auto end = m_plain.begin() + static_cast<std::ptrdiff_t>(length);
+				out.assign(m_plain.begin(), end);
+				m_plain.erase(m_plain.begin(), end);
+			}
+			for (auto& entry : m_queued)
+				entry.first -= length;
+			return true;
+		}
+
+		auto pending = m_output ? BIO_ctrl_pending(m_output) : 0;
+		if (pending == 0) {
+			m_outputBusy = false;
+			return false;
+		}
+
+		out.resize(pending);
+		auto read = BIO_read(m_output, out.data(), static_cast<int>(pending));
+		if (read <= 0) {
+			m_outputBusy = false;
+			return false;
+		}
+
+		out.resize(static_cast<std::size_t>(read));
+		return true;
+	}
+
+	bool Session::Queue(IOCP::IOContext* ctx) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_ssl || m_ended || m_offload != OffloadState::ACTIVE)
+			return false;
+
+		m_queued.emplace_back(m_plain.size(), ctx);
+		return true;
+	}
+
+	bool Session::Offload(Socket::SockType socket, std::size_t unsent) noexcept {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_offload != OffloadState::PENDING || m_ended)
+			return false;
+		// Records OpenSSL made have to reach the descriptor ahead of the switch
+		if (m_outputBusy || unsent != 0 || BIO_ctrl_pending(m_output) != 0)
+			return false;
+
+		auto pending = std::exchange(m_pending, {});
+#if NSA_USE_LINUX
+		auto installed = setsockopt(socket, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0
+			&& setsockopt(socket, SOL_TLS, TLS_TX, m_kernelInfo.data(), m_kernelInfo.size()) == 0;
+#ifdef ATS_DEBUG
+		if (!installed)
+			std::println(stderr, "kTLS not available: {}", std::strerror(errno));
+#endif
+#else
+		(void)socket;
+		auto installed = false;
+#endif
+		OPENSSL_cleanse(m_kernelInfo.data(), m_kernelInfo.size());
+		m_kernelInfo.clear();
+
+		if (installed) {
+			m_offload = OffloadState::ACTIVE;
+			m_offloaded.store(true, std::memory_order_release);
+			m_context->m_offloaded.fetch_add(1, std::memory_order_relaxed);
+
+			m_plain.insert(m_plain.end(), pending.begin(), pending.end());
+			return !m_plain.empty();
+		}
+
+		// OpenSSL carries on, it moved on to the same keys
+		m_offload = OffloadState::NONE;
+		ERR_clear_error();
+		if (!pending.empty() && SSL_write(m_ssl, pending.data(), static_cast<int>(pending.size())) <= 0)
+			this->Fail();
+		return BIO_ctrl_pending(m_output) != 0;
+	}
+
+#pragma endregion
+}
\ No newline at end of file
@@ -0,0 +1,293 @@
+#include <uring.hpp>
+
+#if NSA_USE_LINUX
+#include <Shared/utils.hpp>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <print>
+#include <csignal>
+#include <cassert>
+
+namespace NSA::Core::Socket::IOUring {
+	thread_local Ring* Ring::t_reaping = nullptr;
+
+	namespace {
+		int Setup(std::uint32_t entries, io_uring_params* params) noexcept {
+			return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+		}
+		int Register(int fd, std::uint32_t opcode, void* arg, std::uint32_t count) noexcept {
+			return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+		}
+	}
+
+	Ring::~Ring() noexcept {
+		Destroy();
+	}
+
+	bool Ring::Create(
+		std::uint32_t entries,
+		std::uint32_t bufferCount,
+		std::uint32_t bufferSize
+	) noexcept {
+		if (m_fd != -1)
+			return false;
+
+		io_uring_params params{};
+		params.flags = IORING_SETUP_SUBMIT_ALL;
+
+		m_fd = Setup(entries, &params);
+		if (m_fd == -1) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"io_uring_setup failed: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			return false;
+		}
+
+		// Waits are bounded by the worker's next timer (5.11)
+		if (!(params.features & IORING_FEAT_EXT_ARG)) {
+#ifdef ATS_DEBUG
+			std::println(stderr, "io_uring_enter lacks IORING_ENTER_EXT_ARG");
+#endif
+			Destroy();
+			return false;
+		}
+
+		m_ringSize = params.sq_off.array + params.sq_entries * sizeof(std::uint32_t);
+		m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		// Both rings share one mapping on every kernel we can run on, but
+		// keep the split layout working as well
+		bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (singleMap)
+			m_ringSize = m_cqRingSize = std::max(m_ringSize, m_cqRingSize);
+
+		m_ringPtr = mmap(
+			nullptr,
+			m_ringSize,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,
+			m_fd,
+			IORING_OFF_SQ_RING
+		);
+		if (m_ringPtr == MAP_FAILED) {
+			m_ringPtr = nullptr;
+			Destroy();
+			return false;
+		}
+
+		if (singleMap) {
+			m_cqRingPtr = m_ringPtr;
+		} else {
+			m_cqRingPtr = mmap(
+				nullptr,
+				m_cqRingSize,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE,
+				m_fd,
+				IORING_OFF_CQ_RING
+			);
+			if (m_cqRingPtr == MAP_FAILED) {
+				m_cqRingPtr = nullptr;
+				Destroy();
+				return false;
+			}
+		}
+
+		m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		auto sqes = mmap(
+			nullptr,
+			m_sqesSize,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,
+			m_fd,
+			IORING_OFF_SQES
+		);
+		if (sqes == MAP_FAILED) {
+			Destroy();
+			return false;
+		}
+		m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+		auto sq = static_cast<char*>(m_ringPtr);
+		m_sqHead = reinterpret_cast<std::uint32_t*>(sq + params.sq_off.head);
+		m_sqTail = reinterpret_cast<std::uint32_t*>(sq + params.sq_off.tail);
+		m_sqArray = reinterpret_cast<std::uint32_t*>(sq + params.sq_off.array);
+		m_sqMask = *reinterpret_cast<std::uint32_t*>(sq + params.sq_off.ring_mask);
+		m_sqEntries = params.sq_entries;
+
+		auto cq = static_cast<char*>(m_cqRingPtr);
+		m_cqHead = reinterpret_cast<std::uint32_t*>(cq + params.cq_off.head);
+		m_cqTail = reinterpret_cast<std::uint32_t*>(cq + params.cq_off.tail);
+		m_cqMask = *reinterpret_cast<std::uint32_t*>(cq + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		// Provided buffer ring, the count has to be a power of two
+		assert((bufferCount & (bufferCount - 1)) == 0 && "bufferCount must be a power of two");
+
+		m_bufferRingSize = bufferCount * sizeof(io_uring_buf);
+		auto bufferRing = mmap(
+			nullptr,
+			m_bufferRingSize,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS,
+			-1,
+			0
+		);
+		if (bufferRing == MAP_FAILED) {
+			Destroy();
+			return false;
+		}
+		m_bufferRing = static_cast<io_uring_buf_ring*>(bufferRing);
+
+		io_uring_buf_reg reg{};
+		reg.ring_addr = reinterpret_cast<std::uint64_t>(m_bufferRing);
+		reg.ring_entries = bufferCount;
+		reg.bgid = BUFFER_GROUP;
+
+		if (Register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"IORING_REGISTER_PBUF_RING failed: {}",
+				Shared::Utils::GetLastErrorString()
+			);
+#endif
+			Destroy();
+			return false;
+		}
+
+		m_buffers.reset(new char[static_cast<std::size_t>(bufferCount) * bufferSize]);
+		m_bufferSize = bufferSize;
+		m_bufferMask = static_cast<std::uint16_t>(bufferCount - 1);
+		m_bufferTail = 0;
+
+		for (std::uint32_t i = 0; i < bufferCount; i++)
+			ReturnBuffer(static_cast<std::uint16_t>(i));
+
+		return true;
+	}
+
+	void Ring::Destroy() noexcept {
+		if (m_bufferRing) {
+			munmap(m_bufferRing, m_bufferRingSize);
+			m_bufferRing = nullptr;
+		}
+		m_buffers.reset();
+
+		if (m_sqes) {
+			munmap(m_sqes, m_sqesSize);
+			m_sqes = nullptr;
+		}
+		if (m_cqRingPtr && m_cqRingPtr != m_ringPtr)
+			munmap(m_cqRingPtr, m_cqRingSize);
+		m_cqRingPtr = nullptr;
+
+		if (m_ringPtr) {
+			munmap(m_ringPtr, m_ringSize);
+			m_ringPtr = nullptr;
+		}
+
+		if (m_fd != -1) {
+			close(m_fd);
+			m_fd = -1;
+		}
+	}
+
+	char* Ring::GetBuffer(std::uint16_t id) noexcept {
+		return m_buffers.get() + static_cast<std::size_t>(id) * m_bufferSize;
+	}
+
+	void Ring::ReturnBuffer(std::uint16_t id) noexcept {
+		// Not through `bufs`: in C++ the kernel's flexible array macro shifts
+		// it past an empty member, away from where the kernel looks
+		auto& buf = reinterpret_cast<io_uring_buf*>(m_bufferRing)[m_bufferTail & m_bufferMask];
+		buf.addr = reinterpret_cast<std::uint64_t>(GetBuffer(id));
+		buf.len = m_bufferSize;
+		buf.bid = id;
+
+		m_bufferTail++;
+		std::atomic_ref(m_bufferRing->tail).store(m_bufferTail, std::memory_order_release);
+	}
+
+	io_uring_sqe* Ring::NextSqe() noexcept {
+		auto tail = std::atomic_ref(*m_sqTail).load(std::memory_order_relaxed);
+		if (tail - std::atomic_ref(*m_sqHead).load(std::memory_order_acquire) >= m_sqEntries) {
+			// Full of entries the reaping thread has not flushed yet
+			if (!m_unsubmitted || !Flush())
+				return nullptr;
+
+			if (tail - std::atomic_ref(*m_sqHead).load(std::memory_order_acquire) >= m_sqEntries)
+				return nullptr;
+		}
+		return &m_sqes[tail & m_sqMask];
+	}
+
+	bool Ring::Flush() noexcept {
+		auto submitted = Enter(m_unsubmitted, 0, 0);
+		if (submitted < 0) {
+			// Left in the ring, the next Enter picks them up
+			if (submitted == -EAGAIN || submitted == -EBUSY)
+				return true;
+
+#ifdef ATS_DEBUG
+			std::println(
+				stderr,
+				"io_uring_enter failed: {}",
+				Shared::Utils::GetLastErrorString(-submitted)
+			);
+#endif
+			return false;
+		}
+		m_unsubmitted -= std::min<std::uint32_t>(m_unsubmitted, submitted);
+		return true;
+	}
+
+	int Ring::Enter(
+		std::uint32_t toSubmit,
+		std::uint32_t minComplete,
+		std::uint32_t flags,
+		int timeout
+	) noexcept {
+		if (timeout < 0 || !(flags & IORING_ENTER_GETEVENTS)) {
+			auto ret = static_cast<int>(syscall(
+				__NR_io_uring_enter,
+				m_fd,
+				toSubmit,
+				minComplete,
+				flags,
+				nullptr,
+				_NSIG / 8
+			));
+			return ret == -1 ? -errno : ret;
+		}
+
+		// The wait times out on its own, no timeout SQE to reap afterwards
+		__kernel_timespec ts{};
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = static_cast<long long>(timeout % 1000) * 1000000;
+
+		io_uring_getevents_arg arg{};
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+
+		auto ret = static_cast<int>(syscall(
+			__NR_io_uring_enter,
+			m_fd,
+			toSubmit,
+			minComplete,
+			flags | IORING_ENTER_EXT_ARG,
+			&arg,
+			sizeof(arg)
+		));
+		return ret == -1 ? -errno : ret;
+	}
+}
+#endif
\ No newline at end of file
@@ -3,10 +3,18 @@
 #include <Shared/os.hpp>
 #include <string>
 #include <random>
-#include <WinSock2.h>
-#include <winternl.h>
+#include <optional>
+
+#if NSA_USE_WINDOWS
+#   include <WinSock2.h>
+#   include <winternl.h>
+#else
+#   include <cerrno>
+#   include <cstring>
+#endif
 
 namespace NSA::Shared::Utils {
+#if NSA_USE_WINDOWS
     inline std::string GetLastErrorString(DWORD error) noexcept {
         if (error == 0)
             return {}; // No error message has been recorded
@@ -47,6 +55,21 @@ namespace NSA::Shared::Utils {
     inline std::string GetLastWSAErrorString(int error = ::WSAGetLastError()) noexcept {
         return GetLastErrorString(error);
     }
+#else
+    inline std::string GetLastErrorString(int error) noexcept {
+        if (error == 0)
+            return {}; // No error message has been recorded
+
+        return std::strerror(error);
+    }
+    inline std::string GetLastErrorString() noexcept {
+        return GetLastErrorString(errno);
+    }
+    inline std::string GetLastWSAErrorString(int error = errno) noexcept {
+        // Sockets report through errno like everything else
+        return GetLastErrorString(error);
+    }
+#endif
 
     template <std::integral T>
     inline T RandomInRange(T min, T max) noexcept {
@@ -13,19 +13,6 @@ workspace "NSA"
 
     includedirs { '.', 'Shared', 'Modules', 'Shared/include' }
     libdirs { 'Shared/lib' }
-    links {
-        'ws2_32.lib',
-        'bcrypt.lib',
-        'secur32.lib',
-        'ole32.lib',
-        'shell32.lib',
-
-        'avcodec.lib',
-        'avformat.lib',
-        'avutil.lib',
-        'swresample.lib',
-        'swscale.lib',
-    }
 
     filter "configurations:Debug"
         defines { "DEBUG" }
@@ -43,6 +30,48 @@ workspace "NSA"
 
     filter "system:windows"
         defines { "_WIN32", "WIN32_LEAN_AND_MEAN", "NOMINMAX" }
+        links {
+            'ws2_32.lib',
+            'bcrypt.lib',
+            'secur32.lib',
+            'ole32.lib',
+            'shell32.lib',
+
+            'avcodec.lib',
+            'avformat.lib',
+            'avutil.lib',
+            'swresample.lib',
+            'swscale.lib',
+
+            'libssl.lib',
+            'libcrypto.lib',
+
+            'snappy.lib',
+            'zlib.lib',
+            'brotlienc.lib',
+            'brotlidec.lib',
+            'brotlicommon.lib',
+        }
+
+    filter "system:linux"
+        links {
+            'pthread',
+
+            'avcodec',
+            'avformat',
+            'avutil',
+            'swresample',
+            'swscale',
+
+            'ssl',
+            'crypto',
+
+            'snappy',
+            'z',
+            'brotlienc',
+            'brotlidec',
+            'brotlicommon',
+        }
 
     filter {}
 
@@ -52,6 +81,7 @@ workspace "NSA"
 
     include 'Loader'
     include 'Core'
+    include 'Bench'
     include 'Shared'
     group 'Modules'
         include 'Modules/OS'